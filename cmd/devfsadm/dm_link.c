@@ -37,6 +37,9 @@
 
 #define	DM_CONTROL_NODE		"dmctl"
 #define	DM_CONTROL_LINUX	"mapper/control"
+#define	DM_BLOCK_DIR		"dm/dsk"
+#define	DM_CHAR_DIR		"dm/rdsk"
+#define	DM_LINUX_DIR		"mapper"
 
 /*
  * For the master device:
@@ -49,77 +52,96 @@
  * Linux familiarity links
  *	/dev/mapper/control -> /dev/dmctl
  *	/dev/mapper/name -> /dev/dm/dsk/name
+ *
+ * devfsadmd calls in here for each minor node it learns about from the
+ * minor create event the driver generates when a mapping is attached, so
+ * only the links of that mapping are made.  Removal is driven the same way
+ * by the minor remove event: the remove rules below are hot-plug only and
+ * drop the links of the one mapping that went away, never the whole tree.
  */
 
 /* Check that the string 's' ends with the string 'e' */
 static int
 endswith(const char *s, const char *e)
 {
-	char	*ptr;
+	size_t	slen = strlen(s);
+	size_t	elen = strlen(e);
 
-	ptr = s + strlen(s) - strlen(e);
-	return (strcmp(ptr, e));
+	if (slen < elen)
+		return (0);
+	return (strcmp(s + slen - elen, e) == 0);
 }
 
 static int
-dm(di_minor_t minor, di_node_t node)
+dm_ctl(di_minor_t minor, di_node_t node)
 {
-	dev_t	dev;
-	minor_t	minorno;
-	char	minorname[MAXNAMELEN + 1];
-	char	dmname[MAXNAMELEN + 1];
-	char	blkname[MAXNAMELEN + 1];
-	char	rawname[MAXNAMELEN + 1];
-	char	path[PATH_MAX + 1];
-
-	(void) strcpy(minorname, di_minor_name(minor));
-	dev = di_minor_devt(minor);
-	minorno = minor(dev);
-
 	/* Is it a control node ? */
-	if ((minorno == 0) && (strcmp(minorname, "ctl") == 0)) {
+	if ((minor(di_minor_devt(minor)) == 0) &&
+	    (strcmp(di_minor_name(minor), "ctl") == 0)) {
 		(void) devfsadm_mklink(DM_CONTROL_NODE, node, minor, 0);
 		(void) devfsadm_secondary_link(DM_CONTROL_LINUX,
 		    DM_CONTROL_NODE, 0);
+	}
+	return (DEVFSADM_CONTINUE);
+}
+
+static int
+dm(di_minor_t minor, di_node_t node)
+{
+	char		*minorname = di_minor_name(minor);
+	char		dmname[MAXNAMELEN + 1];
+	char		path[PATH_MAX + 1];
+	char		compat[PATH_MAX + 1];
+	const char	*dir;
+	size_t		len;
+
+	if (endswith(minorname, ",blk")) {
+		dir = DM_BLOCK_DIR;
+	} else if (endswith(minorname, ",raw")) {
+		dir = DM_CHAR_DIR;
+	} else {
 		return (DEVFSADM_CONTINUE);
 	}
 
-	/* If we got here that is not a control node */
-	(void) strlcpy(dmname, sizeof (dmname), minorname);
-	
-	(void) snprintf(blkname, sizeof (blkname), "%s,blk", minorname);
-	(void) snprintf(rawname, sizeof (rawname), "%s,raw", minorname);
+	/* Strip the ",blk" / ",raw" suffix to get the mapping name */
+	len = strlen(minorname) - 4;
+	if (len == 0 || len >= sizeof (dmname))
+		return (DEVFSADM_CONTINUE);
+	(void) memcpy(dmname, minorname, len);
+	dmname[len] = '\0';
 
-		if (strcmp(mn, blkname) == 0) {
-			(void) snprintf(path, sizeof (path), "%s/%s",
-			    DM_BLOCK_NAME, blkname);
-		} else if (strcmp(mn, rawname) == 0) {
-			(void) snprintf(path, sizeof (path), "%s/%s",
-			    DM_CHAR_NAME, blkname);
-		} else {
-			return (DEVFSADM_CONTINUE);
-		}
+	(void) snprintf(path, sizeof (path), "%s/%s", dir, dmname);
+	if (devfsadm_mklink(path, node, minor, 0) != DEVFSADM_SUCCESS)
+		return (DEVFSADM_CONTINUE);
 
-		(void) devfsadm_mklink(path, node, minor, 0);
+	if (dir == DM_BLOCK_DIR) {
+		(void) snprintf(compat, sizeof (compat), "%s/%s",
+		    DM_LINUX_DIR, dmname);
+		(void) devfsadm_secondary_link(compat, path, 0);
+	}
 
 	return (DEVFSADM_CONTINUE);
 }
 
 /*
- * Wrapper around devfsadm_rm_all() that allows termination of remove
- * process
+ * Remove the links of one mapping (devfsadm_rm_all() takes the secondary
+ * /dev/mapper link along with the primary one)
  */
 static int
-dm_rm_all(char *link)
+dm_rm_link(char *link)
 {
 	devfsadm_rm_all(link);
-	return (DEVFSADM_TERMINATE);
+	return (DEVFSADM_CONTINUE);
 }
+
 /*
  * devfs create callback register
  */
 static devfsadm_create_t dm_create_cbt[] = {
 	{ "pseudo", "ddi_pseudo", DM_DRIVER_NAME,
+	    TYPE_EXACT | DRV_EXACT, ILEVEL_0, dm_ctl,
+	},
+	{ "pseudo", "ddi_block", DM_DRIVER_NAME,
 	    TYPE_EXACT | DRV_EXACT, ILEVEL_0, dm,
 	},
 };
@@ -129,7 +151,7 @@ DEVFSADM_CREATE_INIT_V0(dm_create_cbt);
  * devfs cleanup register
  */
 static devfsadm_remove_V1_t dm_remove_cbt[] = {
-	{"pseudo", "^mapper/r?dsk/[0-9]+$", RM_ALWAYS | RM_PRE | RM_HOT,
-	    ILEVEL_0, dm_rm_all},
+	{"pseudo", "^dm/r?dsk/[^/]+$", RM_PRE | RM_HOT,
+	    ILEVEL_0, dm_rm_link},
 };
 DEVFSADM_REMOVE_INIT_V1(dm_remove_cbt);
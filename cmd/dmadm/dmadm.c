@@ -26,10 +26,16 @@
 
 
 #include <sys/types.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <libdevinfo.h>
+#include <libnvpair.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/dm.h>
@@ -63,8 +69,12 @@ dm_list(int dmctl, int argc, char **argv, const char *usage)
 
 	for (int i = 0; i < DM_MINOR_MAX; i++) {
 		if ((names[i].name) && (strlen(names[i].name) > 0)) {
-			printf("%d - %s\t(%s)\n", i,
+			printf("%d - %s\t(%s)", i,
 			    names[i].name, names[i].dev);
+			if (names[i].target[0] != '\0')
+				printf("\t%s %s", names[i].target,
+				    names[i].args);
+			printf("\n");
 		}
 	}
 	free(names);
@@ -82,6 +92,23 @@ dm_version(int dmctl, int argc, char **argv, const char *usage)
 	return (EXIT_SUCCESS);
 }
 
+/*
+ * devfsadmd makes the links of a new mapping off the minor create event,
+ * in its own time.  Have it done now, so they are there once we return.
+ */
+static void
+dm_links(void)
+{
+	di_devlink_handle_t	hdl;
+
+	if ((hdl = di_devlink_init(DM_DRIVER_NAME, DI_MAKE_LINK)) == NULL) {
+		(void) fprintf(stderr, "failed to create device links: %s\n",
+		    strerror(errno));
+		return;
+	}
+	(void) di_devlink_fini(&hdl);
+}
+
 static int
 dm_create(int dmctl, int argc, char **argv, const char *usage)
 {
@@ -93,11 +120,46 @@ dm_create(int dmctl, int argc, char **argv, const char *usage)
 		return (EXIT_FAILURE);
 	}
 
+	(void) memset(&map, 0, sizeof (map));
 	(void) strncpy(map.name, argv[0], MAXNAMELEN);
 	(void) strncpy(map.dev, argv[1], MAXPATHLEN);
+
+	for (int i = 2; i < argc; i++) {
+		if (strncmp(argv[i], "target=", 7) == 0) {
+			/* Everything past the target goes to the plugin */
+			(void) strlcpy(map.target, argv[i] + 7,
+			    sizeof (map.target));
+			while (++i < argc) {
+				if (map.args[0] != '\0')
+					(void) strlcat(map.args, " ",
+					    sizeof (map.args));
+				if (strlcat(map.args, argv[i],
+				    sizeof (map.args)) >= sizeof (map.args)) {
+					(void) fprintf(stderr,
+					    "target arguments too long\n");
+					return (EXIT_FAILURE);
+				}
+			}
+			break;
+		} else if (strcmp(argv[i], "discard=zero") == 0) {
+			map.flags |= DM_FLAG_DISCARD_ZERO;
+		} else if (strcmp(argv[i], "discard=ignore") == 0) {
+			map.flags |= DM_FLAG_DISCARD_IGNORE;
+		} else if (strcmp(argv[i], "readahead") == 0) {
+			map.flags |= DM_FLAG_READAHEAD;
+		} else {
+			(void) fprintf(stderr, usage);
+			return (EXIT_FAILURE);
+		}
+	}
+
 	rc = ioctl(dmctl, DM_ATTACH_MAPPING, &map);
+	if (rc == -1)
+		return (EXIT_FAILURE);
 
-	return ((rc == -1) ? EXIT_FAILURE : EXIT_SUCCESS);
+	dm_links();
+
+	return (EXIT_SUCCESS);
 }
 
 static int
@@ -117,6 +179,255 @@ dm_remove(int dmctl, int argc, char **argv, const char *usage)
 	return ((rc == -1) ? EXIT_FAILURE : EXIT_SUCCESS);
 }
 
+/* Suspend and resume share the argument handling */
+static int
+dm_mapping_op(int dmctl, int argc, char **argv, const char *usage, int cmd)
+{
+	dm_entry_t		map;
+	int		rc;
+
+	if (argc < 1) {
+		(void) fprintf(stderr, usage);
+		return (EXIT_FAILURE);
+	}
+
+	(void) memset(&map, 0, sizeof (map));
+	(void) strncpy(map.name, argv[0], MAXNAMELEN);
+	rc = ioctl(dmctl, cmd, &map);
+
+	return ((rc == -1) ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+static int
+dm_suspend(int dmctl, int argc, char **argv, const char *usage)
+{
+	return (dm_mapping_op(dmctl, argc, argv, usage, DM_SUSPEND_MAPPING));
+}
+
+static int
+dm_resume(int dmctl, int argc, char **argv, const char *usage)
+{
+	return (dm_mapping_op(dmctl, argc, argv, usage, DM_RESUME_MAPPING));
+}
+
+/* Print the counters the mapping's target plugin keeps */
+static int
+dm_stats(int dmctl, int argc, char **argv, const char *usage)
+{
+	dm_stats_t	*st;
+	nvlist_t	*nvl;
+	int		rc = EXIT_FAILURE;
+
+	if (argc < 1) {
+		(void) fprintf(stderr, usage);
+		return (EXIT_FAILURE);
+	}
+
+	if ((st = calloc(1, sizeof (*st))) == NULL)
+		return (EXIT_FAILURE);
+
+	(void) strlcpy(st->name, argv[0], sizeof (st->name));
+	if (ioctl(dmctl, DM_GET_STATS, st) == -1) {
+		perror("DM_GET_STATS");
+	} else if (nvlist_unpack(st->data, st->size, &nvl, 0) != 0) {
+		(void) fprintf(stderr, "malformed statistics\n");
+	} else {
+		nvlist_print(stdout, nvl);
+		nvlist_free(nvl);
+		rc = EXIT_SUCCESS;
+	}
+
+	free(st);
+	return (rc);
+}
+
+static volatile sig_atomic_t	dm_capture_done;
+
+/*ARGSUSED*/
+static void
+dm_capture_sig(int sig)
+{
+	dm_capture_done = 1;
+}
+
+/* Write the records of a capture batch out */
+static int
+dm_capture_write(FILE *fp, const dm_trace_ctl_t *tc)
+{
+	if (tc->count != 0 &&
+	    fwrite(tc->recs, sizeof (dm_trace_rec_t), tc->count, fp) !=
+	    tc->count) {
+		perror("write");
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Record the I/O of a mapping to a file for dmreplay, until interrupted
+ * or for the given time.
+ */
+static int
+dm_capture(int dmctl, int argc, char **argv, const char *usage)
+{
+	dm_trace_ctl_t	*tc;
+	dm_trace_hdr_t	th;
+	FILE		*fp;
+	uint32_t	nrecs = 0;
+	long		seconds = 0;
+	time_t		end;
+	uint64_t	total = 0;
+	int		rc = EXIT_FAILURE;
+
+	if (argc < 2) {
+		(void) fprintf(stderr, usage);
+		return (EXIT_FAILURE);
+	}
+	for (int i = 2; i < argc; i++) {
+		if (strncmp(argv[i], "records=", 8) == 0) {
+			nrecs = (uint32_t)strtoul(argv[i] + 8, NULL, 0);
+		} else if (strncmp(argv[i], "seconds=", 8) == 0) {
+			seconds = strtol(argv[i] + 8, NULL, 0);
+		} else {
+			(void) fprintf(stderr, usage);
+			return (EXIT_FAILURE);
+		}
+	}
+
+	if ((tc = calloc(1, sizeof (*tc))) == NULL)
+		return (EXIT_FAILURE);
+	if ((fp = fopen(argv[1], "w")) == NULL) {
+		perror(argv[1]);
+		free(tc);
+		return (EXIT_FAILURE);
+	}
+
+	(void) strlcpy(tc->name, argv[0], sizeof (tc->name));
+	tc->nrecs = nrecs;
+	if (ioctl(dmctl, DM_TRACE_START, tc) == -1) {
+		perror("DM_TRACE_START");
+		goto out;
+	}
+
+	(void) memset(&th, 0, sizeof (th));
+	th.th_magic = DM_TRACE_MAGIC;
+	th.th_version = DM_TRACE_VERSION;
+	th.th_recsize = sizeof (dm_trace_rec_t);
+	th.th_size = tc->size;
+	th.th_start = (int64_t)time(NULL);
+	(void) strlcpy(th.th_name, argv[0], sizeof (th.th_name));
+	if (fwrite(&th, sizeof (th), 1, fp) != 1) {
+		perror("write");
+		goto stop;
+	}
+
+	(void) signal(SIGINT, dm_capture_sig);
+	(void) signal(SIGTERM, dm_capture_sig);
+	end = time(NULL) + seconds;
+
+	/* Drain the ring until told to stop, then once more */
+	for (;;) {
+		boolean_t	last = dm_capture_done ||
+		    (seconds != 0 && time(NULL) >= end);
+
+		do {
+			if (ioctl(dmctl, DM_GET_TRACE, tc) == -1) {
+				perror("DM_GET_TRACE");
+				goto stop;
+			}
+			if (dm_capture_write(fp, tc) != 0)
+				goto stop;
+			total += tc->count;
+		} while (tc->count == DM_TRACE_BATCH);
+
+		if (last)
+			break;
+		(void) usleep(100000);
+	}
+	rc = EXIT_SUCCESS;
+
+	(void) fprintf(stderr, "%llu records, %llu lost\n",
+	    (u_longlong_t)total, (u_longlong_t)tc->lost);
+stop:
+	if (ioctl(dmctl, DM_TRACE_STOP, tc) == -1)
+		perror("DM_TRACE_STOP");
+out:
+	if (fclose(fp) != 0 && rc == EXIT_SUCCESS) {
+		perror(argv[1]);
+		rc = EXIT_FAILURE;
+	}
+	free(tc);
+	return (rc);
+}
+
+static const char *
+dm_event_name(uint32_t type)
+{
+	switch (type) {
+	case DM_EVENT_ATTACH:
+		return ("attach");
+	case DM_EVENT_DETACH:
+		return ("detach");
+	case DM_EVENT_SUSPEND:
+		return ("suspend");
+	case DM_EVENT_RESUME:
+		return ("resume");
+	case DM_EVENT_IOERR:
+		return ("ioerr");
+	case DM_EVENT_PLUGIN_LOAD:
+		return ("plugin-load");
+	case DM_EVENT_MIGRATED:
+		return ("migrated");
+	case DM_EVENT_CORRUPT:
+		return ("corrupt");
+	default:
+		return ("unknown");
+	}
+}
+
+/* Print mapping events as they happen */
+static int
+dm_events(int dmctl, int argc, char **argv, const char *usage)
+{
+	dm_events_t	evs;
+	struct pollfd	pfd;
+
+	pfd.fd = dmctl;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		if (poll(&pfd, 1, -1) == -1) {
+			perror("poll");
+			return (EXIT_FAILURE);
+		}
+
+		do {
+			if (ioctl(dmctl, DM_GET_EVENTS, &evs) == -1) {
+				perror("DM_GET_EVENTS");
+				return (EXIT_FAILURE);
+			}
+			if (evs.lost != 0) {
+				(void) printf("%u events lost\n", evs.lost);
+			}
+			for (uint32_t i = 0; i < evs.count; i++) {
+				dm_event_t	*ev = &evs.events[i];
+
+				(void) printf("%llu\t%s\t%s",
+				    (u_longlong_t)ev->seq,
+				    dm_event_name(ev->type), ev->name);
+				if (ev->type == DM_EVENT_IOERR)
+					(void) printf("\t%s",
+					    strerror(ev->error));
+				(void) printf("\n");
+			}
+			(void) fflush(stdout);
+		} while (evs.count == DM_EVENT_BATCH);
+	}
+
+	/* NOTREACHED */
+	return (EXIT_SUCCESS);
+}
+
 static int
 dm_failure(int dmctl, int argc, char **argv, const char *usage)
 {
@@ -137,8 +448,16 @@ static cmd_t commands[] = {
 	{"version", dm_version, "version"},
 	{"list", dm_list, "list [mapping]"},
 	{"show", dm_list, "show <mapping>"},
-	{"create", dm_create, "create <mapping>"},
+	{"create", dm_create,
+	    "create <mapping> <device> [discard=zero|discard=ignore] "
+	    "[readahead] [target=<plugin> [args ...]]"},
 	{"remove", dm_remove, "remove <mapping>"},
+	{"suspend", dm_suspend, "suspend <mapping>"},
+	{"resume", dm_resume, "resume <mapping>"},
+	{"stats", dm_stats, "stats <mapping>"},
+	{"events", dm_events, "events"},
+	{"capture", dm_capture,
+	    "capture <mapping> <file> [records=<n>] [seconds=<n>]"},
 	{NULL, NULL, NULL}
 };
 
@@ -0,0 +1,625 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright 2011 Grigale Ltd. All rights reserved.
+ * Use is subject to license terms.
+ */
+
+/*
+ * dmreplay - play an I/O trace from "dmadm capture" back
+ *
+ * The trace is replayed against a mapping, a device or a plain file,
+ * with its timing, sped up or slowed down, or as fast as it goes.  A
+ * dispatcher hands each I/O, at its time, to a pool of worker threads
+ * doing the I/O synchronously, so that as many are in flight as the pool
+ * is large; by default it is as large as the deepest queue in the trace.
+ * Latencies, from an I/O being started to it completing, are kept in a
+ * log-linear histogram per thread and I/O type and reported at the end.
+ *
+ * Offsets past the end of the target wrap round, so a trace can be
+ * replayed against something smaller; a regular file is created or grown
+ * to the size of the traced mapping first, unless writes are left out.
+ */
+
+#ifdef __linux__
+#define	_GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/falloc.h>
+#endif
+
+#include <sys/dm_trace.h>
+
+#define	NOPS		(DM_TRACE_DISCARD + 1)	/* Histograms by dt_op */
+#define	HBITS		4		/* Sub-buckets per power of two, log2 */
+#define	HSUB		(1 << HBITS)
+#define	HBUCKETS	((64 - HBITS + 1) << HBITS)
+#define	QLEN		4096		/* Dispatch queue, power of two */
+#define	MAXTHREADS	1024
+#define	LATE_NS		1000000		/* Started this much late: delayed */
+#define	NSEC		1000000000LL
+
+#ifndef MIN
+#define	MIN(a, b)	((a) < (b) ? (a) : (b))
+#endif
+
+typedef struct {
+	uint64_t	h_count;
+	uint64_t	h_bytes;
+	uint64_t	h_sum;		/* ns */
+	uint64_t	h_max;
+	uint64_t	h_errors;
+	uint64_t	h_buckets[HBUCKETS];
+} hist_t;
+
+typedef struct {
+	pthread_t	w_tid;
+	char		*w_buf;
+	hist_t		w_hist[NOPS];
+	uint64_t	w_delayed;
+} worker_t;
+
+static dm_trace_rec_t	*recs;
+static size_t		nrecs;
+static int		fd;
+static uint64_t		tsize;		/* Target size, 0 if not known */
+static double		speed = 1.0;	/* 0: as fast as possible */
+static int		readonly;
+static uint32_t		maxlen;
+static struct timespec	t0;		/* Replay start */
+
+/* The dispatch queue, of indexes into recs[] */
+static pthread_mutex_t	qlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	qwork = PTHREAD_COND_INITIALIZER;	/* Queued */
+static pthread_cond_t	qroom = PTHREAD_COND_INITIALIZER;	/* Taken */
+static size_t		queue[QLEN];
+static uint64_t		qhead;		/* Queued */
+static uint64_t		qtail;		/* Taken */
+static int		qdone;		/* Nothing more is coming */
+
+static const char	*opnames[NOPS] = {
+	NULL, "read", "write", "flush", "discard"
+};
+
+static void
+usage(const char *prog)
+{
+	(void) fprintf(stderr, "usage: %s [-f | -s <speed>] [-t <threads>] "
+	    "[-n] [-d] <trace> <target>\n"
+	    "\t-f\treplay as fast as possible\n"
+	    "\t-s\tspeed up (or slow down, below 1) the timing by this much\n"
+	    "\t-t\tworker threads, the deepest queue in the trace by "
+	    "default\n"
+	    "\t-n\tleave writes, flushes and discards out\n"
+	    "\t-d\tbypass the file system cache\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+static uint32_t
+swap32(uint32_t x)
+{
+	return ((x >> 24) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000) |
+	    (x << 24));
+}
+
+static uint64_t
+swap64(uint64_t x)
+{
+	return (((uint64_t)swap32((uint32_t)x) << 32) |
+	    swap32((uint32_t)(x >> 32)));
+}
+
+static uint16_t
+swap16(uint16_t x)
+{
+	return ((uint16_t)((x >> 8) | (x << 8)));
+}
+
+static int64_t
+ts2ns(const struct timespec *ts)
+{
+	return ((int64_t)ts->tv_sec * NSEC + ts->tv_nsec);
+}
+
+static int64_t
+now(void)
+{
+	struct timespec	ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts2ns(&ts) - ts2ns(&t0));
+}
+
+/* Read the trace into recs[], in our byte order */
+static dm_trace_hdr_t *
+load(const char *path)
+{
+	static dm_trace_hdr_t	th;
+	FILE			*fp;
+	char			*rec;
+	size_t			cap = 0;
+	int			swap;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		perror(path);
+		return (NULL);
+	}
+	if (fread(&th, sizeof (th), 1, fp) != 1) {
+		(void) fprintf(stderr, "%s: not a trace\n", path);
+		(void) fclose(fp);
+		return (NULL);
+	}
+	swap = (th.th_magic == swap32(DM_TRACE_MAGIC));
+	if (swap) {
+		th.th_magic = swap32(th.th_magic);
+		th.th_version = swap32(th.th_version);
+		th.th_recsize = swap32(th.th_recsize);
+		th.th_size = swap64(th.th_size);
+		th.th_start = (int64_t)swap64((uint64_t)th.th_start);
+	}
+	if (th.th_magic != DM_TRACE_MAGIC ||
+	    th.th_recsize < sizeof (dm_trace_rec_t)) {
+		(void) fprintf(stderr, "%s: not a trace\n", path);
+		(void) fclose(fp);
+		return (NULL);
+	}
+	th.th_name[DM_TRACE_NAMELEN - 1] = '\0';
+
+	/* Later versions may have longer records, starting the same */
+	if ((rec = malloc(th.th_recsize)) == NULL) {
+		(void) fclose(fp);
+		return (NULL);
+	}
+	while (fread(rec, th.th_recsize, 1, fp) == 1) {
+		dm_trace_rec_t	*dt;
+
+		if (nrecs == cap) {
+			dm_trace_rec_t	*n;
+
+			cap = (cap == 0) ? 65536 : cap * 2;
+			if ((n = realloc(recs, cap * sizeof (*recs))) == NULL) {
+				(void) fprintf(stderr, "out of memory\n");
+				free(rec);
+				(void) fclose(fp);
+				return (NULL);
+			}
+			recs = n;
+		}
+		dt = &recs[nrecs++];
+		(void) memcpy(dt, rec, sizeof (*dt));
+		if (swap) {
+			dt->dt_time = swap64(dt->dt_time);
+			dt->dt_off = swap64(dt->dt_off);
+			dt->dt_len = swap32(dt->dt_len);
+			dt->dt_op = swap16(dt->dt_op);
+			dt->dt_qdepth = swap16(dt->dt_qdepth);
+		}
+	}
+	free(rec);
+	(void) fclose(fp);
+
+	return (&th);
+}
+
+static int
+hist_index(uint64_t v)
+{
+	int	msb = 0;
+
+	if (v < HSUB)
+		return ((int)v);
+	while ((v >> msb) > 1)
+		msb++;
+	return (((msb - HBITS + 1) << HBITS) +
+	    (int)((v >> (msb - HBITS)) & (HSUB - 1)));
+}
+
+/* The middle of a bucket */
+static uint64_t
+hist_value(int i)
+{
+	int		shift;
+	uint64_t	lo;
+
+	if (i < HSUB)
+		return ((uint64_t)i);
+	shift = (i >> HBITS) - 1;
+	lo = (uint64_t)(HSUB + (i & (HSUB - 1))) << shift;
+	return (lo + ((1ULL << shift) >> 1));
+}
+
+static void
+hist_add(hist_t *h, uint64_t ns, uint64_t bytes, int error)
+{
+	if (error) {
+		h->h_errors++;
+		return;
+	}
+	h->h_count++;
+	h->h_bytes += bytes;
+	h->h_sum += ns;
+	if (ns > h->h_max)
+		h->h_max = ns;
+	h->h_buckets[hist_index(ns)]++;
+}
+
+static void
+hist_merge(hist_t *to, const hist_t *from)
+{
+	to->h_count += from->h_count;
+	to->h_bytes += from->h_bytes;
+	to->h_sum += from->h_sum;
+	to->h_errors += from->h_errors;
+	if (from->h_max > to->h_max)
+		to->h_max = from->h_max;
+	for (int i = 0; i < HBUCKETS; i++)
+		to->h_buckets[i] += from->h_buckets[i];
+}
+
+/* Latency at or below which 'pct' percent of the I/O completed, in ns */
+static uint64_t
+hist_pct(const hist_t *h, double pct)
+{
+	uint64_t	want = (uint64_t)(h->h_count * pct / 100.0 + 0.5);
+	uint64_t	seen = 0;
+
+	if (want == 0)
+		want = 1;
+	for (int i = 0; i < HBUCKETS; i++) {
+		if ((seen += h->h_buckets[i]) >= want)
+			return (MIN(hist_value(i), h->h_max));
+	}
+	return (h->h_max);
+}
+
+static void
+hist_print(const char *name, const hist_t *h, double secs)
+{
+	uint64_t	dist[64] = { 0 };
+	int		lo = 64, hi = -1;
+
+	if (h->h_count == 0 && h->h_errors == 0)
+		return;
+
+	(void) printf("%s: %llu ops, %llu errors, %.0f ops/s, %.2f MB/s\n",
+	    name, (unsigned long long)h->h_count,
+	    (unsigned long long)h->h_errors, h->h_count / secs,
+	    h->h_bytes / secs / (1024 * 1024));
+	if (h->h_count == 0)
+		return;
+	(void) printf("\tlatency us: avg %.1f  p50 %.1f  p90 %.1f  "
+	    "p99 %.1f  p99.9 %.1f  max %.1f\n",
+	    (double)h->h_sum / h->h_count / 1000,
+	    hist_pct(h, 50) / 1000.0, hist_pct(h, 90) / 1000.0,
+	    hist_pct(h, 99) / 1000.0, hist_pct(h, 99.9) / 1000.0,
+	    h->h_max / 1000.0);
+
+	/* And in powers of two of microseconds */
+	for (int i = 0; i < HBUCKETS; i++) {
+		uint64_t	us = hist_value(i) / 1000;
+		int		b = 0;
+
+		if (h->h_buckets[i] == 0)
+			continue;
+		while ((us >> b) > 1)
+			b++;
+		if (us == 0)
+			b = 0;
+		dist[b] += h->h_buckets[i];
+		if (b < lo)
+			lo = b;
+		if (b > hi)
+			hi = b;
+	}
+	(void) printf("\t%12s  %-40s %s\n", "us", "distribution", "count");
+	for (int b = lo; b <= hi; b++) {
+		int	n = (int)(dist[b] * 40 / h->h_count);
+		char	bar[41];
+
+		(void) memset(bar, '@', n);
+		bar[n] = '\0';
+		(void) printf("\t%12llu |%-40s %llu\n",
+		    (unsigned long long)(b == 0 ? 0 : 1ULL << b), bar,
+		    (unsigned long long)dist[b]);
+	}
+}
+
+/* Where an I/O of the trace goes on the target */
+static uint64_t
+place(uint64_t off, uint32_t len)
+{
+	if (tsize == 0 || off + len <= tsize)
+		return (off);
+	if (len >= tsize)
+		return (0);
+	/* Wrap round, keeping the alignment */
+	return ((off % (tsize - len)) & ~(uint64_t)4095);
+}
+
+static int
+do_discard(uint64_t off, uint32_t len)
+{
+#ifdef __linux__
+	return (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+	    (off_t)off, (off_t)len));
+#else
+	errno = ENOTSUP;
+	return (-1);
+#endif
+}
+
+static void *
+worker(void *arg)
+{
+	worker_t	*w = arg;
+
+	for (;;) {
+		dm_trace_rec_t	*dt;
+		int64_t		start, sched;
+		ssize_t		n;
+		uint64_t	off;
+		int		error = 0;
+
+		(void) pthread_mutex_lock(&qlock);
+		while (qtail == qhead && !qdone)
+			(void) pthread_cond_wait(&qwork, &qlock);
+		if (qtail == qhead) {
+			(void) pthread_mutex_unlock(&qlock);
+			break;
+		}
+		if (qhead - qtail == QLEN)
+			(void) pthread_cond_signal(&qroom);
+		dt = &recs[queue[qtail++ % QLEN]];
+		(void) pthread_mutex_unlock(&qlock);
+
+		off = place(dt->dt_off, dt->dt_len);
+		start = now();
+		sched = (speed == 0) ? start : (int64_t)(dt->dt_time / speed);
+		if (start - sched > LATE_NS)
+			w->w_delayed++;
+
+		switch (dt->dt_op) {
+		case DM_TRACE_READ:
+			n = pread(fd, w->w_buf, dt->dt_len, (off_t)off);
+			error = (n != (ssize_t)dt->dt_len);
+			break;
+		case DM_TRACE_WRITE:
+			n = pwrite(fd, w->w_buf, dt->dt_len, (off_t)off);
+			error = (n != (ssize_t)dt->dt_len);
+			break;
+		case DM_TRACE_FLUSH:
+			error = (fsync(fd) != 0);
+			break;
+		case DM_TRACE_DISCARD:
+			error = (do_discard(off, dt->dt_len) != 0);
+			break;
+		}
+
+		hist_add(&w->w_hist[dt->dt_op], (uint64_t)(now() - start),
+		    dt->dt_len, error);
+	}
+
+	return (NULL);
+}
+
+/* Queue the I/O for the workers at their time */
+static void
+dispatch(uint64_t *lost, uint64_t *skipped)
+{
+	for (size_t i = 0; i < nrecs; i++) {
+		dm_trace_rec_t	*dt = &recs[i];
+
+		if (dt->dt_op == DM_TRACE_LOST) {
+			*lost += dt->dt_len;
+			continue;
+		}
+		if (dt->dt_op < DM_TRACE_READ || dt->dt_op > DM_TRACE_DISCARD ||
+		    (readonly && dt->dt_op != DM_TRACE_READ)) {
+			(*skipped)++;
+			continue;
+		}
+
+		if (speed != 0) {
+			int64_t		t = (int64_t)(dt->dt_time / speed);
+			struct timespec	ts;
+
+			t += ts2ns(&t0);
+			ts.tv_sec = t / NSEC;
+			ts.tv_nsec = t % NSEC;
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+			    &ts, NULL) == EINTR)
+				;
+		}
+
+		(void) pthread_mutex_lock(&qlock);
+		while (qhead - qtail == QLEN)
+			(void) pthread_cond_wait(&qroom, &qlock);
+		queue[qhead++ % QLEN] = i;
+		(void) pthread_cond_signal(&qwork);
+		(void) pthread_mutex_unlock(&qlock);
+	}
+
+	(void) pthread_mutex_lock(&qlock);
+	qdone = 1;
+	(void) pthread_cond_broadcast(&qwork);
+	(void) pthread_mutex_unlock(&qlock);
+}
+
+/* Open the target and learn its size */
+static int
+open_target(const char *path, uint64_t size, int direct)
+{
+	struct stat	st;
+	int		flags = readonly ? O_RDONLY : (O_RDWR | O_CREAT);
+
+#ifdef O_DIRECT
+	if (direct)
+		flags |= O_DIRECT;
+#endif
+	if ((fd = open(path, flags, 0644)) == -1) {
+		perror(path);
+		return (-1);
+	}
+#ifndef O_DIRECT
+	if (direct)
+		(void) directio(fd, DIRECTIO_ON);
+#endif
+
+	if (fstat(fd, &st) == -1) {
+		perror(path);
+		return (-1);
+	}
+	if (S_ISREG(st.st_mode)) {
+		if ((uint64_t)st.st_size < size && !readonly &&
+		    ftruncate(fd, (off_t)size) == 0)
+			st.st_size = (off_t)size;
+		tsize = (uint64_t)st.st_size;
+	} else {
+		off_t	end = lseek(fd, 0, SEEK_END);
+
+		tsize = (end > 0) ? (uint64_t)end : 0;
+	}
+	if (S_ISREG(st.st_mode) && tsize == 0) {
+		(void) fprintf(stderr, "%s: empty\n", path);
+		return (-1);
+	}
+
+	return (0);
+}
+
+int
+main(int argc, char **argv)
+{
+	dm_trace_hdr_t	*th;
+	worker_t	*workers;
+	hist_t		total[NOPS];
+	uint64_t	lost = 0, skipped = 0, delayed = 0;
+	int		nthreads = 0, qmax = 0, direct = 0, c;
+	double		secs;
+	char		*end;
+
+	while ((c = getopt(argc, argv, "fs:t:nd")) != -1) {
+		switch (c) {
+		case 'f':
+			speed = 0;
+			break;
+		case 's':
+			speed = strtod(optarg, &end);
+			if (*end != '\0' || speed <= 0)
+				usage(argv[0]);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			if (nthreads < 1 || nthreads > MAXTHREADS)
+				usage(argv[0]);
+			break;
+		case 'n':
+			readonly = 1;
+			break;
+		case 'd':
+			direct = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2)
+		usage(argv[0]);
+
+	if ((th = load(argv[optind])) == NULL)
+		return (EXIT_FAILURE);
+	for (size_t i = 0; i < nrecs; i++) {
+		if ((recs[i].dt_op == DM_TRACE_READ ||
+		    recs[i].dt_op == DM_TRACE_WRITE) && recs[i].dt_len > maxlen)
+			maxlen = recs[i].dt_len;
+		if (recs[i].dt_op != DM_TRACE_LOST && recs[i].dt_qdepth > qmax)
+			qmax = recs[i].dt_qdepth;
+	}
+	if (nthreads == 0)
+		nthreads = (qmax == 0) ? 1 : MIN(qmax, MAXTHREADS);
+
+	if (open_target(argv[optind + 1], th->th_size, direct) != 0)
+		return (EXIT_FAILURE);
+
+	(void) printf("%s: %zu records of %s, %.3f s, %d threads\n",
+	    argv[optind], nrecs, th->th_name,
+	    nrecs == 0 ? 0.0 : recs[nrecs - 1].dt_time / 1e9, nthreads);
+
+	if ((workers = calloc(nthreads, sizeof (*workers))) == NULL) {
+		(void) fprintf(stderr, "out of memory\n");
+		return (EXIT_FAILURE);
+	}
+	(void) clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0; i < nthreads; i++) {
+		worker_t	*w = &workers[i];
+
+		if (posix_memalign((void **)&w->w_buf, 4096,
+		    maxlen == 0 ? 4096 : maxlen) != 0) {
+			(void) fprintf(stderr, "out of memory\n");
+			return (EXIT_FAILURE);
+		}
+		(void) memset(w->w_buf, 0xd5, maxlen == 0 ? 4096 : maxlen);
+		if ((errno = pthread_create(&w->w_tid, NULL, worker, w)) != 0) {
+			perror("pthread_create");
+			return (EXIT_FAILURE);
+		}
+	}
+
+	dispatch(&lost, &skipped);
+
+	(void) memset(total, 0, sizeof (total));
+	for (int i = 0; i < nthreads; i++) {
+		(void) pthread_join(workers[i].w_tid, NULL);
+		for (int op = 0; op < NOPS; op++)
+			hist_merge(&total[op], &workers[i].w_hist[op]);
+		delayed += workers[i].w_delayed;
+		free(workers[i].w_buf);
+	}
+	secs = now() / 1e9;
+	if (secs <= 0)
+		secs = 1e-9;
+
+	(void) printf("replayed in %.3f s, %llu started over 1 ms late, "
+	    "%llu left out, %llu lost in capture\n", secs,
+	    (unsigned long long)delayed, (unsigned long long)skipped,
+	    (unsigned long long)lost);
+	for (int op = DM_TRACE_READ; op < NOPS; op++)
+		hist_print(opnames[op], &total[op], secs);
+
+	free(workers);
+	free(recs);
+	(void) close(fd);
+
+	return (EXIT_SUCCESS);
+}
@@ -29,10 +29,14 @@
 
 /*
  * Device Mapper control ABI definitions
+ *
+ * The target plugin interface is in <sys/dm_ops.h>; mind that dpo_mapio()
+ * runs in strategy context and must not block.
  */
 
 #include <sys/types.h>
 #include <sys/param.h>
+#include <sys/dm_trace.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -57,13 +61,168 @@ extern "C" {
 #define	DM_LIST_MAPPINGS	2048
 #define	DM_ATTACH_MAPPING	2049
 #define	DM_DETACH_MAPPING	2050
+#define	DM_SUSPEND_MAPPING	2051
+#define	DM_RESUME_MAPPING	2052
+#define	DM_GET_STATS		2053
+#define	DM_TRACE_START		2054
+#define	DM_TRACE_STOP		2055
+#define	DM_GET_TRACE		2056
+
+/* Event queue */
+#define	DM_GET_EVENTS		3072
+
+/* Mapping flags */
+#define	DM_FLAG_DISCARD_ZERO	0x0001	/* Emulate discard by writing zeroes */
+#define	DM_FLAG_DISCARD_IGNORE	0x0002	/* Drop discards the device rejects */
+#define	DM_FLAG_READAHEAD	0x0004	/* Detect streams and prefetch */
+
+/*
+ * sysevents posted when mappings come and go, for whoever wants to know.
+ * The /dev links do not depend on them, devfsadmd makes those off the
+ * devfs minor node events.
+ */
+#define	DM_SYSEVENT_VENDOR	"GRIGALE"
+#define	EC_DM			"EC_dm"
+#define	ESC_DM_MAPPING_ATTACH	"ESC_dm_mapping_attach"
+#define	ESC_DM_MAPPING_DETACH	"ESC_dm_mapping_detach"
+
+/* sysevent attributes */
+#define	DM_EV_NAME		"name"		/* string: mapping name */
+#define	DM_EV_MINOR		"minor"		/* uint32: minor number */
+
+#define	DM_TARGETLEN		32	/* Plugin (target type) name */
+#define	DM_ARGSLEN		256	/* Plugin arguments */
 
 typedef struct {
 	char		name[MAXNAMELEN];
 	char		dev[MAXPATHLEN];
 	uint64_t	flags;
+	char		target[DM_TARGETLEN];	/* Empty: plain passthrough */
+	char		args[DM_ARGSLEN];	/* Handed to the plugin as is */
 } dm_entry_t;
 
+/*
+ * Target statistics: DM_GET_STATS fills 'data' with the packed (native
+ * encoding) nvlist of counters the mapping's plugin reports.
+ */
+#define	DM_STATSLEN		4096
+
+typedef struct {
+	char		name[MAXNAMELEN];	/* In: mapping name */
+	uint32_t	size;			/* Out: packed nvlist size */
+	char		data[DM_STATSLEN];
+} dm_stats_t;
+
+/*
+ * I/O capture
+ *
+ * DM_TRACE_START has the kernel record every I/O given to the mapping,
+ * and flushes and discards, in a ring of 'nrecs' records (0: the
+ * default); DM_GET_TRACE takes up to DM_TRACE_BATCH of them off it, in
+ * order.  Records that did not fit are marked by DM_TRACE_LOST ones and
+ * counted in 'lost'.  DM_TRACE_STOP drops the ring.  A mapping has one
+ * capture at a time.
+ */
+#define	DM_TRACE_BATCH		256
+
+typedef struct {
+	char		name[MAXNAMELEN];	/* In: mapping name */
+	uint32_t	nrecs;		/* In: ring size, START */
+	uint32_t	count;		/* Out: records returned, GET */
+	uint64_t	lost;		/* Out: records dropped so far, GET */
+	uint64_t	size;		/* Out: mapping size, START */
+	dm_trace_rec_t	recs[DM_TRACE_BATCH];
+} dm_trace_ctl_t;
+
+/*
+ * Statistics page
+ *
+ * The control node can be mmap()ed, read-only, for the I/O counters of
+ * every mapping without a system call per sample.  The region starts with
+ * a dm_stat_hdr_t and holds sh_nslots slots of sh_slotsize bytes from
+ * sh_hdrsize on, so map the first page, then all of it.  A mapping owns a
+ * slot from attach to detach, with a ds_gen of its own (0 on a free slot);
+ * sh_gen goes up whenever a slot changes hands.  Mappings attached while
+ * all the slots are taken have none.
+ *
+ * Slots are updated in place under a sequence count, odd while an update
+ * is in progress.  To read one consistently:
+ *
+ *	do {
+ *		seq = slot->ds_seq;
+ *		membar_consumer();
+ *		copy = *slot;
+ *		membar_consumer();
+ *	} while ((seq & 1) != 0 || seq != slot->ds_seq);
+ *
+ * Times are the nanoseconds from the target taking an I/O to it
+ * completing, summed; I/O served from readahead adds none.
+ */
+#define	DM_STAT_MAGIC		0x444d5354	/* "DMST" */
+#define	DM_STAT_VERSION		1
+
+typedef struct {
+	uint32_t	sh_magic;	/* DM_STAT_MAGIC */
+	uint32_t	sh_version;	/* DM_STAT_VERSION */
+	uint32_t	sh_hdrsize;	/* Offset of the first slot */
+	uint32_t	sh_slotsize;	/* sizeof (dm_stat_slot_t) */
+	uint32_t	sh_nslots;
+	uint32_t	sh_pad;
+	volatile uint64_t sh_gen;	/* Slot ownership changes */
+	uint64_t	sh_reserved[4];
+} dm_stat_hdr_t;
+
+typedef struct {
+	volatile uint64_t ds_seq;	/* Odd while being updated */
+	uint64_t	ds_gen;		/* Owner, 0: free */
+	uint64_t	ds_rops;	/* Reads completed */
+	uint64_t	ds_wops;	/* Writes completed */
+	uint64_t	ds_rbytes;	/* Bytes transferred by them */
+	uint64_t	ds_wbytes;
+	uint64_t	ds_rtime;	/* Latency sums, ns */
+	uint64_t	ds_wtime;
+	uint64_t	ds_errors;	/* I/O that failed */
+	uint64_t	ds_inflight;	/* I/O in progress */
+	uint32_t	ds_minor;	/* Mapping minor number */
+	uint32_t	ds_pad;
+	uint64_t	ds_reserved[5];
+	char		ds_name[MAXNAMELEN];	/* Mapping name */
+} dm_stat_slot_t;
+
+/*
+ * Mapping change events
+ *
+ * Every open of the control node has its own position in the (bounded)
+ * kernel event queue and polls readable while events past that position
+ * are queued.  DM_GET_EVENTS returns up to DM_EVENT_BATCH of them and
+ * advances the position; if the reader fell behind and events were
+ * overwritten, the gap shows in the sequence numbers and in 'lost'.
+ */
+#define	DM_EVENT_ATTACH		1	/* Mapping attached */
+#define	DM_EVENT_DETACH		2	/* Mapping detached */
+#define	DM_EVENT_SUSPEND	3	/* Mapping I/O suspended */
+#define	DM_EVENT_RESUME		4	/* Mapping I/O resumed */
+#define	DM_EVENT_IOERR		5	/* I/O error on the mapping */
+#define	DM_EVENT_PLUGIN_LOAD	6	/* Plugin loaded, name is the plugin */
+#define	DM_EVENT_MIGRATED	7	/* Migration switched devices */
+#define	DM_EVENT_CORRUPT	8	/* Data failed verification */
+
+typedef struct {
+	uint64_t	seq;		/* Event sequence number */
+	hrtime_t	time;		/* gethrtime() of the event */
+	uint32_t	type;		/* DM_EVENT_* */
+	int32_t		error;		/* errno for DM_EVENT_IOERR */
+	char		name[MAXNAMELEN];
+} dm_event_t;
+
+#define	DM_EVENT_BATCH		16
+
+typedef struct {
+	uint32_t	count;		/* Out: events returned */
+	uint32_t	lost;		/* Out: events overwritten unread */
+	dm_event_t	events[DM_EVENT_BATCH];
+} dm_events_t;
+
 #ifdef __cplusplus
 }
 #endif
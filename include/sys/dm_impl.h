@@ -32,29 +32,244 @@
  */
 
 #include <sys/types.h>
+#include <sys/buf.h>
+#include <sys/ddidevmap.h>
+#include <sys/id_space.h>
+#include <sys/ksynch.h>
 #include <sys/map.h>
+#include <sys/nvpair.h>
+#include <sys/poll.h>
 #include <sys/refstr.h>
 #include <sys/sunldi.h>
 
+#include <sys/dm.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/*
+ * Opens of the control node are cloned onto minors past the mapping range
+ * so that every opener keeps its own event queue position.
+ */
+#define	DM_CTL_MINOR_BASE	(DM_MINOR_MAX + 1)
+#define	DM_CTL_MINOR_MAX	1024
+#define	DM_MINOR_IS_CTL(m)	((m) == 0 || (m) >= DM_CTL_MINOR_BASE)
+
+#define	DM_EVENT_QLEN		256	/* Event queue length, power of 2 */
+
+typedef struct {
+	uint64_t	seq;	/* Next event sequence number to read */
+} dm_ctl_t;
+
 typedef struct {
 	dev_info_t	*dip;
 	ldi_ident_t	li;	/* LDI identifier */
 	struct map	*dm_minor_map;
 	void		*dm_infop;
 	uint64_t	state;	/* State bit-field */
+	kmutex_t	lock;	/* Protects mapping create/remove */
+	uint32_t	nmappings;	/* Number of live mappings */
+	id_space_t	*ctl_ids;	/* Control node clone minors */
+	void		*dm_ctlp;	/* Per-open control node state */
+	kmutex_t	evlock;	/* Protects the event queue */
+	dm_event_t	*evq;	/* Event ring, DM_EVENT_QLEN entries */
+	uint64_t	evseq;	/* Sequence number of the next event */
+	struct pollhead	evph;	/* Event queue pollers */
+	major_t		major;	/* Ours, to tell stacked mappings by */
+	uint_t		stkey;	/* TSD key, set while passing I/O down */
 } dm_state_t;
 
+/* What a backing device takes, learnt when it is opened */
+typedef struct {
+	size_t		dl_maxxfer;	/* Largest transfer, bytes */
+	uint32_t	dl_lbsize;	/* Logical block size, I/O alignment */
+	uint32_t	dl_pbsize;	/* Physical block size */
+} dm_limits_t;
+
+struct dm_child;
+
+/* A buf being split, complete when the last piece is */
 typedef struct {
+	struct buf	*ds_bp;		/* Parent */
+	uint32_t	ds_pending;	/* Pieces plus the splitter's hold */
+	int		ds_error;	/* First error reported */
+	uint64_t	ds_resid;	/* Sum of the pieces' b_resid */
+	void		(*ds_done)(struct dm_child *, void *);	/* Per piece */
+	void		*ds_arg;
+} dm_split_t;
+
+/* One piece of it */
+typedef struct dm_child {
+	struct buf	dc_buf;		/* Clone, has to be first */
+	dm_split_t	*dc_split;
+	ldi_handle_t	dc_lh;		/* Device, for the splitter's use */
+	struct dm_child	*dc_next;	/* likewise */
+	uint64_t	dc_tag;		/* likewise */
+} dm_child_t;
+
+/* A backing device, open once for all the mappings using it */
+typedef struct dm_bdev {
+	struct dm_bdev	*bd_nnext;	/* Hash chains, by path */
+	struct dm_bdev	*bd_dnext;	/* and by dev_t */
+	refstr_t	*bd_path;	/* Opened as */
+	dev_t		bd_dev;
+	ldi_handle_t	bd_lh;
+	uint32_t	bd_ref;		/* Holds */
+	uint64_t	bd_size;	/* Bytes, 0 if not known */
+	dm_limits_t	bd_limits;
+} dm_bdev_t;
+
+/* A device opened by a target plugin besides the mapping device */
+typedef struct dm_dev {
+	struct dm_dev	*dd_next;
+	dm_bdev_t	*dd_bdev;
+	ldi_handle_t	dd_lh;		/* dd_bdev's */
+	struct dm_info	*dd_lower;	/* The mapping it is, if one */
+} dm_dev_t;
+
+typedef struct dm_info {
 	refstr_t	*name;	/* Mapping name */
 	refstr_t	*dev;	/* Target device name */
-	ldi_handle_t	lh;	/* LDI handle */
+	dm_bdev_t	*bdev;	/* Target device */
+	ldi_handle_t	lh;	/* Its LDI handle */
+	dev_t		tdev;	/* and device number */
 	uint64_t	target;	/* Target / Index in table */
+	uint64_t	flags;	/* DM_FLAG_* from the mapping entry */
+	uint64_t	size;	/* Mapping size in bytes */
+	kmutex_t	lock;	/* Protects suspend state */
+	kcondvar_t	cv;	/* Signalled when I/O drains */
+	boolean_t	suspended;	/* I/O is being held */
+	boolean_t	detaching;	/* Going away, I/O is refused */
+	uint32_t	inflight;	/* I/O passed to the target */
+	uint32_t	holds;	/* Control operations waiting on it */
+	uint32_t	otyps;	/* Open types, bit per OTYP_* */
+	uint32_t	lyropens;	/* and layered opens */
+	struct buf	*held;	/* I/O held while suspended */
+	struct buf	*held_tail;
+	struct dm_ra	*ra;	/* Readahead state, if enabled */
+	struct dm_plugin_entry *plugin;	/* Target plugin, if any */
+	refstr_t	*args;	/* Target plugin arguments */
+	void		*tpriv;	/* Target plugin private state */
+	kmutex_t	rlock;	/* Protects rfree */
+	struct dm_remap_slot *rfree;	/* Free in-place remap slots */
+	struct dm_remap_slot *rslots;	/* All of them */
+	int		nrslots;	/* and how many */
+	kmutex_t	flock;	/* Protects devs and the flush state */
+	kcondvar_t	fcv;	/* Signalled when a flush completes */
+	dm_dev_t	*devs;	/* Devices the target opened */
+	boolean_t	fbusy;	/* Flush in flight */
+	uint64_t	fstarted;	/* Flush generations started */
+	uint64_t	fdone;	/* and completed */
+	uint64_t	ferrgen;	/* Last generation that failed */
+	int		ferror;	/* and how */
+	dm_limits_t	limits;	/* Mapping device limits */
+	size_t		maxxfer;	/* Smallest dl_maxxfer of all devices */
+	struct dm_info	*lower;	/* The mapping the device is, if one */
+	uint32_t	stacked;	/* Mappings stacked on this one */
+	kmutex_t	slock;	/* Protects stat and trace */
+	dm_stat_slot_t	*stat;	/* Statistics page slot, if one */
+	struct dm_trace	*trace;	/* I/O capture ring, if one */
 } dm_info_t;
 
+/* dm.c */
+extern void	dm_io_start(dm_info_t *, struct buf *);
+extern void	dm_io_exit(dm_info_t *);
+extern void	dm_io_complete(struct buf *);
+extern int	dm_target_open(dm_info_t *, cred_t *, const char *,
+		    ldi_handle_t *, dev_t *);
+extern void	dm_target_close(dm_info_t *, ldi_handle_t);
+extern const dm_limits_t *dm_target_limits(dm_info_t *, ldi_handle_t);
+extern void	dm_target_event(dm_info_t *, uint32_t, int);
+extern int	dm_target_flush(dm_info_t *);
+extern int	dm_target_flush_dev(dm_info_t *, ldi_handle_t);
+extern uint32_t	dm_cksum(const void *, size_t);
+/* Does not block, for dpo_mapio() (see dm_ops.h) and interrupt context */
+extern void	dm_issue(ldi_handle_t, struct buf *);
+
+/* dm_wib.c */
+typedef struct dm_wib dm_wib_t;
+
+extern uint64_t	dm_wib_size(uint64_t, uint32_t);
+extern int	dm_wib_open(dm_info_t *, ldi_handle_t, dev_t, diskaddr_t,
+		    uint64_t, uint32_t, boolean_t,
+		    void (*)(struct buf *, void *), void *, dm_wib_t **);
+extern void	dm_wib_close(dm_wib_t *);
+extern boolean_t dm_wib_write(dm_wib_t *, struct buf *);
+extern void	dm_wib_done(dm_wib_t *, diskaddr_t, size_t);
+extern void	dm_wib_mark(dm_wib_t *, diskaddr_t, size_t);
+extern int	dm_wib_commit(dm_wib_t *, diskaddr_t, size_t);
+extern uint64_t	dm_wib_resync_next(dm_wib_t *, uint64_t);
+extern boolean_t dm_wib_stale(dm_wib_t *, uint64_t);
+extern void	dm_wib_resynced(dm_wib_t *, uint64_t);
+extern uint32_t	dm_wib_rgshift(dm_wib_t *);
+extern uint64_t	dm_wib_nregions(dm_wib_t *);
+extern uint64_t	dm_wib_flags(dm_wib_t *);
+extern int	dm_wib_set_flags(dm_wib_t *, uint64_t);
+extern void	dm_wib_stats(dm_wib_t *, nvlist_t *);
+
+/* dm_bdev.c */
+extern void	dm_bdev_init(void);
+extern void	dm_bdev_fini(void);
+extern int	dm_bdev_open(const char *, cred_t *, ldi_ident_t,
+		    dm_bdev_t **);
+extern void	dm_bdev_rele(dm_bdev_t *);
+
+/* dm_cq.c */
+extern int	dm_cq_init(void);
+extern void	dm_cq_fini(void);
+extern void	dm_cq_complete(struct buf *, processorid_t);
+
+/* dm_split.c */
+extern void	dm_split_init(void);
+extern void	dm_split_fini(void);
+extern void	dm_limits_get(ldi_handle_t, dm_limits_t *);
+extern dm_split_t *dm_split_alloc(struct buf *,
+		    void (*)(dm_child_t *, void *), void *, int);
+extern void	dm_split_error(dm_split_t *, int);
+extern void	dm_split_hold(dm_split_t *);
+extern void	dm_split_rele(dm_split_t *);
+extern dm_child_t *dm_split_child(dm_split_t *, size_t, size_t, dev_t,
+		    diskaddr_t, int);
+extern void	dm_split_submit(dm_split_t *, size_t, size_t, ldi_handle_t,
+		    dev_t, diskaddr_t, const dm_limits_t *);
+extern void	dm_split_issue(struct buf *, ldi_handle_t,
+		    const dm_limits_t *);
+extern int	dm_target_bio(dm_info_t *, ldi_handle_t, dev_t, caddr_t,
+		    size_t, diskaddr_t, int);
+
+/* dm_ra.c */
+extern int	dm_ra_init(dev_info_t *);
+extern void	dm_ra_fini(void);
+extern int	dm_ra_create(dm_info_t *);
+extern void	dm_ra_destroy(dm_info_t *);
+extern boolean_t dm_ra_read(dm_info_t *, struct buf *);
+extern void	dm_ra_write(dm_info_t *, struct buf *);
+
+/* dm_cache.c */
+extern int	dm_cache_init(dev_info_t *);
+extern void	dm_cache_fini(void);
+extern boolean_t dm_cache_io(ldi_handle_t, struct buf *);
+extern void	dm_cache_invalidate(dev_t, uint64_t, uint64_t);
+extern void	dm_cache_purge(dev_t);
+extern void	dm_cache_stats(nvlist_t *);
+
+/* dm_stat.c */
+extern int	dm_stat_init(dev_info_t *);
+extern void	dm_stat_fini(void);
+extern void	dm_stat_attach(dm_info_t *, minor_t);
+extern void	dm_stat_detach(dm_info_t *);
+extern void	dm_stat_start(dm_info_t *);
+extern void	dm_stat_done(dm_info_t *, struct buf *, hrtime_t);
+extern int	dm_stat_devmap(devmap_cookie_t, offset_t, size_t, size_t *);
+
+/* dm_trace.c */
+extern void	dm_trace_io(dm_info_t *, uint16_t, uint64_t, uint64_t);
+extern void	dm_trace_buf(dm_info_t *, struct buf *);
+extern int	dm_trace_start(dm_info_t *, uint32_t);
+extern int	dm_trace_stop(dm_info_t *);
+extern int	dm_trace_get(dm_info_t *, dm_trace_ctl_t *);
+
 #ifdef __cplusplus
 }
 #endif
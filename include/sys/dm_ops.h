@@ -32,14 +32,69 @@
  */
 
 #include <sys/types.h>
+#include <sys/buf.h>
+#include <sys/cred.h>
+#include <sys/nvpair.h>
+#include <sys/sunldi.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #define	DM_PLUGIN_OPS_REV_0	0
-#define	DPO_REV			DM_PLUGIN_OPS_REV_0
+#define	DM_PLUGIN_OPS_REV_1	1
+#define	DM_PLUGIN_OPS_REV_2	2	/* dpo_create() takes a cred_t */
+#define	DPO_REV			DM_PLUGIN_OPS_REV_2
 
+struct dm_info;
+
+/* What dpo_mapio() did with the buf */
+typedef enum {
+	DM_MAPIO_SUBMITTED,	/* Plugin owns bp and will biodone() it */
+	DM_MAPIO_REMAPPED,	/* Core is to issue bp as described by rp */
+	DM_MAPIO_KILL		/* Core is to fail bp, with its error or EIO */
+} dm_mapio_t;
+
+/* Where an I/O goes when the plugin only redirects it */
+typedef struct {
+	ldi_handle_t	dr_lh;		/* Device to issue it to */
+	dev_t		dr_dev;		/* and its device number */
+	diskaddr_t	dr_blkno;	/* Start, in DEV_BSIZE blocks */
+} dm_remap_t;
+
+/*
+ * Revision 2 hooks
+ *
+ * dpo_create() gets the target arguments split at white space and returns
+ * the mapping's private state in *privp, which every other hook gets
+ * back.  dmip->lh is the mapping device, dmip->size may be changed to the
+ * size the target presents.  crp is the credential of whoever creates the
+ * mapping, for dm_target_open() of any further devices the target uses.
+ *
+ * dpo_mapio() gets a clone of the caller's buf, b_private belongs to the
+ * core.  It is called from strategy context, possibly on the thread
+ * passing I/O down a stack of mappings for others, so it must not block:
+ * no cv_wait(), no KM_SLEEP, no bp_mapin().  Work that has to wait goes
+ * to a taskq or thread of the target's own.  Returning DM_MAPIO_REMAPPED
+ * hands it back to the core to be sent to the device in *rp.  Whatever
+ * the answer, dpo_end_io() (if set) sees the clone complete before the
+ * caller's buf does and may change the error reported.
+ *
+ * dpo_remap() is the fast path for targets that only redirect I/O.  It is
+ * offered the caller's own buf first, before anything is allocated; if
+ * the whole transfer maps onto one device it fills *rp in and returns
+ * B_TRUE, and the core redirects the buf in place without a clone.
+ * B_FALSE sends the I/O down the dpo_mapio() path.  It must not block
+ * and, as dpo_end_io() is not called for remapped bufs, not rely on
+ * seeing the completion.
+ *
+ * dpo_stats() adds the target's counters to an nvlist for DM_GET_STATS.
+ *
+ * Targets that cut I/O up do so with the core's dm_split_*() routines;
+ * dmip->maxxfer is the largest piece all of the mapping's devices take.
+ * I/O a target issues itself goes through dm_issue() rather than
+ * ldi_strategy(), so that it does not recurse into mappings stacked below.
+ */
 typedef struct {
 	int		dpo_rev;
 
@@ -47,22 +102,31 @@ typedef struct {
 	char		*dpo_name;
 
 	/* plugin initialization */
-	void		(*dpo_init)();
+	int		(*dpo_init)(void);
 
 	/* plugin de-initialization */
-	void		(*dpo_fini)();
+	void		(*dpo_fini)(void);
 
 	/* create mapping */
-	void		(*dpo_create)();
+	int		(*dpo_create)(struct dm_info *, int, char **, cred_t *,
+			    void **);
 
 	/* destroy mapping */
-	void		(*dpo_destroy)();
+	void		(*dpo_destroy)(struct dm_info *, void *);
 
 	/* map io */
-	void		(*dpo_mapio)();
+	dm_mapio_t	(*dpo_mapio)(struct dm_info *, void *, struct buf *,
+			    dm_remap_t *);
+
+	/* io completion, optional */
+	int		(*dpo_end_io)(struct dm_info *, void *, struct buf *,
+			    int);
+
+	/* remap-only fast path, optional */
+	boolean_t	(*dpo_remap)(void *, const struct buf *, dm_remap_t *);
 
-	/* update statistics */
-	void		(*dpo_stats)();
+	/* update statistics, optional */
+	int		(*dpo_stats)(struct dm_info *, void *, nvlist_t *);
 
 } dm_plugin_ops_t;
 
@@ -0,0 +1,83 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright 2011 Grigale Ltd. All rights reserved.
+ * Use is subject to license terms.
+ */
+
+#ifndef	SYS_DM_TRACE_H
+#define	SYS_DM_TRACE_H
+
+/*
+ * Device Mapper I/O trace format
+ *
+ * "dmadm capture" records the I/O a mapping is given and dmreplay plays it
+ * back.  A trace file is a dm_trace_hdr_t followed by records up to the
+ * end of the file, in the byte order of the machine that captured it
+ * (th_magic tells which).  This header is shared with dmreplay, which
+ * also builds on other systems, so it stays self-contained.
+ */
+
+#ifdef	_KERNEL
+#include <sys/types.h>
+#else
+#include <stdint.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define	DM_TRACE_MAGIC		0x444d5452	/* "DMTR" */
+#define	DM_TRACE_VERSION	1
+#define	DM_TRACE_NAMELEN	256
+
+/* Record types */
+#define	DM_TRACE_READ		1
+#define	DM_TRACE_WRITE		2
+#define	DM_TRACE_FLUSH		3	/* Cache flush, no range */
+#define	DM_TRACE_DISCARD	4
+#define	DM_TRACE_LOST		5	/* dt_len records were dropped here */
+
+typedef struct {
+	uint64_t	dt_time;	/* ns since the capture started */
+	uint64_t	dt_off;		/* Byte offset */
+	uint32_t	dt_len;		/* Bytes */
+	uint16_t	dt_op;		/* DM_TRACE_* */
+	uint16_t	dt_qdepth;	/* I/O in flight, this one included */
+} dm_trace_rec_t;
+
+typedef struct {
+	uint32_t	th_magic;	/* DM_TRACE_MAGIC */
+	uint32_t	th_version;	/* DM_TRACE_VERSION */
+	uint32_t	th_recsize;	/* sizeof (dm_trace_rec_t) */
+	uint32_t	th_pad;
+	uint64_t	th_size;	/* Mapping size, bytes */
+	int64_t		th_start;	/* Capture start, seconds since 1970 */
+	char		th_name[DM_TRACE_NAMELEN];	/* Mapping name */
+} dm_trace_hdr_t;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* SYS_DM_TRACE_H */
@@ -25,15 +25,28 @@
  */
 
 
+#include <sys/aio_req.h>
+#include <sys/atomic.h>
+#include <sys/buf.h>
 #include <sys/conf.h>
+#include <sys/cpuvar.h>
 #include <sys/cred.h>
 #include <sys/devops.h>
+#include <sys/dkio.h>
+#include <sys/dkioc_free_util.h>
 #include <sys/errno.h>
 #include <sys/file.h>
+#include <sys/kmem.h>
 #include <sys/map.h>
 #include <sys/modctl.h>
+#include <sys/poll.h>
+#include <sys/nvpair.h>
 #include <sys/stat.h>
+#include <sys/sysevent.h>
+#include <sys/sysmacros.h>
+#include <sys/taskq_impl.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/ddi.h>
 #include <sys/sunddi.h>
 
@@ -46,6 +59,79 @@ static dm_state_t	dm_state = {
 };
 
 
+/*
+ * Event queue
+ *
+ * A fixed size ring holding the latest DM_EVENT_QLEN events.  Posting
+ * never waits for readers, a reader that falls behind loses the oldest
+ * events.  dm_event_post() is called from I/O completion context too.
+ */
+static void
+dm_event_init(dm_state_t *sp)
+{
+	mutex_init(&sp->evlock, NULL, MUTEX_DRIVER, NULL);
+	sp->evq = kmem_zalloc(sizeof (dm_event_t) * DM_EVENT_QLEN, KM_SLEEP);
+	sp->evseq = 1;
+}
+
+static void
+dm_event_fini(dm_state_t *sp)
+{
+	kmem_free(sp->evq, sizeof (dm_event_t) * DM_EVENT_QLEN);
+	sp->evq = NULL;
+	mutex_destroy(&sp->evlock);
+}
+
+static void
+dm_event_post(dm_state_t *sp, uint32_t type, const char *name, int error)
+{
+	dm_event_t	*ev;
+
+	if (sp->evq == NULL)
+		return;
+
+	mutex_enter(&sp->evlock);
+	ev = &sp->evq[sp->evseq & (DM_EVENT_QLEN - 1)];
+	ev->seq = sp->evseq++;
+	ev->time = gethrtime();
+	ev->type = type;
+	ev->error = error;
+	(void) strlcpy(ev->name, name, sizeof (ev->name));
+	mutex_exit(&sp->evlock);
+
+	pollwakeup(&sp->evph, POLLIN | POLLRDNORM);
+}
+
+/* Hand the next batch of events past the opener's position out */
+static int
+dm_get_events(dm_state_t *sp, dm_ctl_t *ctl, intptr_t arg, int mode)
+{
+	dm_events_t	*evs;
+	int		rc;
+
+	evs = kmem_zalloc(sizeof (*evs), KM_SLEEP);
+
+	mutex_enter(&sp->evlock);
+	if (sp->evseq - ctl->seq > DM_EVENT_QLEN) {
+		uint64_t	first = sp->evseq - DM_EVENT_QLEN;
+
+		evs->lost = (uint32_t)MIN(first - ctl->seq, UINT32_MAX);
+		ctl->seq = first;
+	}
+	while (ctl->seq < sp->evseq && evs->count < DM_EVENT_BATCH) {
+		evs->events[evs->count++] =
+		    sp->evq[ctl->seq & (DM_EVENT_QLEN - 1)];
+		ctl->seq++;
+	}
+	mutex_exit(&sp->evlock);
+
+	rc = ddi_copyout(evs, (void *)arg, sizeof (*evs), mode);
+	kmem_free(evs, sizeof (*evs));
+
+	return ((rc == -1) ? (EFAULT) : (0));
+}
+
+
 /*
  * Device mapping plugin management
  *
@@ -53,10 +139,10 @@ static dm_state_t	dm_state = {
  * explain here more
  */
 
-typedef struct {
+typedef struct dm_plugin_entry {
 	ddi_modhandle_t		pmod;
 	dm_plugin_ops_t		*dmp_ops;
-	int			refcnt;
+	int			refcnt;	/* Mappings using the plugin */
 } dm_plugin_entry_t;
 
 typedef struct {
@@ -84,20 +170,62 @@ dm_plugin_table_fini(void)
 static void
 dm_plugin_add(dm_plugin_entry_t *plugin)
 {
+	dm_plugin_entry_t	**table;
+	uint32_t		count;
+
 	ASSERT(plugin);
 
 	mutex_enter(&dm_plugin_table.lock);
-	
+
+	count = dm_plugin_table.count;
+	table = kmem_alloc(sizeof (*table) * (count + 1), KM_SLEEP);
+	if (count != 0) {
+		bcopy(dm_plugin_table.table, table, sizeof (*table) * count);
+		kmem_free(dm_plugin_table.table, sizeof (*table) * count);
+	}
+	table[count] = plugin;
+	dm_plugin_table.table = table;
+	dm_plugin_table.count = count + 1;
+
 	mutex_exit(&dm_plugin_table.lock);
 }
 
 static void
 dm_plugin_rem(dm_plugin_entry_t *plugin)
 {
+	dm_plugin_entry_t	**table = NULL;
+	uint32_t		count;
+	int			idx = -1;
+
 	ASSERT(plugin);
 
 	mutex_enter(&dm_plugin_table.lock);
 
+	count = dm_plugin_table.count;
+	for (int i = 0; i < count; i++) {
+		if (dm_plugin_table.table[i] == plugin) {
+			idx = i;
+			break;
+		}
+	}
+
+	if (idx == -1) {
+		mutex_exit(&dm_plugin_table.lock);
+		return;
+	}
+
+	if (count > 1) {
+		table = kmem_alloc(sizeof (*table) * (count - 1), KM_SLEEP);
+		for (int i = 0, j = 0; i < count; i++) {
+			if (i != idx)
+				table[j++] = dm_plugin_table.table[i];
+		}
+	}
+
+	kmem_free(dm_plugin_table.table, sizeof (*table) * count);
+	dm_plugin_table.table = table;
+	dm_plugin_table.count = count - 1;
+
 	mutex_exit(&dm_plugin_table.lock);
 }
 
@@ -146,6 +274,9 @@ dm_plugin_load(const char *name)
 
 	plugin->dmp_ops = ddi_modsym(plugin->pmod, "dm_ops", &error);
 	if (plugin->dmp_ops == NULL) {
+		/* Built wrong, most likely dm_ops left static */
+		cmn_err(CE_WARN, "Plugin module %s does not export dm_ops (%d)",
+		    modname, error);
 		ddi_modclose(plugin->pmod);
 		kmem_free(plugin, sizeof (*plugin));
 		return (NULL);
@@ -172,9 +303,31 @@ dm_plugin_resgister(const char *name)
 {
 	dm_plugin_entry_t	*plugin;
 
+	if (dm_plugin_lookup(name) != NULL)
+		return (DDI_SUCCESS);
+
 	plugin = dm_plugin_load(name);
+	if (plugin == NULL) {
+		cmn_err(CE_WARN, "Failed to load plugin %s", name);
+		return (DDI_FAILURE);
+	}
+
+	if (plugin->dmp_ops->dpo_rev != DPO_REV) {
+		cmn_err(CE_WARN, "Plugin %s has revision %d, %d expected",
+		    name, plugin->dmp_ops->dpo_rev, DPO_REV);
+		(void) dm_plugin_unload(plugin);
+		return (DDI_FAILURE);
+	}
+
+	if (plugin->dmp_ops->dpo_init() != 0) {
+		cmn_err(CE_WARN, "Failed to initialize plugin %s", name);
+		(void) dm_plugin_unload(plugin);
+		return (DDI_FAILURE);
+	}
 	dm_plugin_add(plugin);
 
+	dm_event_post(&dm_state, DM_EVENT_PLUGIN_LOAD, name, 0);
+
 	return (DDI_SUCCESS);
 }
 
@@ -185,12 +338,49 @@ dm_plugin_unresgister(const char *name)
 	dm_plugin_entry_t	*plugin;
 
 	plugin = dm_plugin_lookup(name);
+	if (plugin == NULL || plugin->refcnt != 0)
+		return (DDI_FAILURE);
+
 	dm_plugin_rem(plugin);
+	plugin->dmp_ops->dpo_fini();
 	dm_plugin_unload(plugin);
 
 	return (DDI_SUCCESS);
 }
 
+/* Load all the plugins listed in the "plugin-list" driver property */
+static void
+dm_plugin_load_list(dm_state_t *sp)
+{
+	char	**list;
+	uint_t	count;
+
+	if (ddi_prop_lookup_string_array(DDI_DEV_T_ANY, sp->dip,
+	    DDI_PROP_DONTPASS, "plugin-list", &list, &count) !=
+	    DDI_PROP_SUCCESS) {
+		return;
+	}
+
+	for (uint_t i = 0; i < count; i++) {
+		(void) dm_plugin_resgister(list[i]);
+	}
+
+	ddi_prop_free(list);
+}
+
+/* Unload every registered plugin */
+static void
+dm_plugin_unload_all(void)
+{
+	while (dm_plugin_table.count != 0) {
+		dm_plugin_entry_t	*plugin = dm_plugin_table.table[0];
+
+		dm_plugin_rem(plugin);
+		plugin->dmp_ops->dpo_fini();
+		(void) dm_plugin_unload(plugin);
+	}
+}
+
 /*
  * minor number management routines
  */
@@ -251,6 +441,13 @@ dm_info_alloc(dm_state_t *sp, minor_t minor, const char *name, const char *dev)
 	rsdev = refstr_alloc(dev);
 	dmp->name = rsname;
 	dmp->dev = rsdev;
+	mutex_init(&dmp->lock, NULL, MUTEX_DRIVER, NULL);
+	mutex_init(&dmp->rlock, NULL, MUTEX_DRIVER, NULL);
+	mutex_init(&dmp->flock, NULL, MUTEX_DRIVER, NULL);
+	cv_init(&dmp->cv, NULL, CV_DRIVER, NULL);
+	cv_init(&dmp->fcv, NULL, CV_DRIVER, NULL);
+	mutex_init(&dmp->slock, NULL, MUTEX_DRIVER, NULL);
+	dm_stat_attach(dmp, minor);
 
 	return (dmp);
 }
@@ -262,8 +459,16 @@ dm_info_free(dm_state_t *sp, minor_t minor)
 
 	dmp = ddi_get_soft_state(sp->dm_infop, (int)minor);
 
+	dm_stat_detach(dmp);
+	(void) dm_trace_stop(dmp);
+	mutex_destroy(&dmp->slock);
 	refstr_rele(dmp->name);
 	refstr_rele(dmp->dev);
+	cv_destroy(&dmp->fcv);
+	cv_destroy(&dmp->cv);
+	mutex_destroy(&dmp->flock);
+	mutex_destroy(&dmp->rlock);
+	mutex_destroy(&dmp->lock);
 
 	ddi_soft_state_free(sp->dm_infop, (int)minor);
 }
@@ -274,7 +479,10 @@ dm_info_get(dm_state_t *sp, minor_t minor)
 	return (ddi_get_soft_state(sp->dm_infop, (int)minor));
 }
 
-/* Loop through all the item in the dm_info state till the match found */
+/*
+ * Loop through all the item in the dm_info state till the match found,
+ * mappings on their way out do not count
+ */
 static minor_t
 dm_name2minor(dm_state_t *sp, const char *name)
 {
@@ -283,7 +491,7 @@ dm_name2minor(dm_state_t *sp, const char *name)
 	for (int i = 1; i < DM_MINOR_MAX; i++) {
 		dm_info_t *dmp = ddi_get_soft_state(sp->dm_infop, i);
 
-		if (dmp == NULL)
+		if (dmp == NULL || dmp->detaching)
 			continue;
 		if (strncmp(refstr_value(dmp->name), name, MAXNAMELEN) == 0) {
 			minor = (minor_t)i;
@@ -293,6 +501,64 @@ dm_name2minor(dm_state_t *sp, const char *name)
 	return (minor);
 }
 
+/*
+ * Control node clones
+ */
+static int
+dm_ctl_init(dm_state_t *sp)
+{
+	sp->ctl_ids = id_space_create("dm_ctl", DM_CTL_MINOR_BASE,
+	    DM_CTL_MINOR_BASE + DM_CTL_MINOR_MAX);
+	return (ddi_soft_state_init(&sp->dm_ctlp, sizeof (dm_ctl_t), 0));
+}
+
+static void
+dm_ctl_fini(dm_state_t *sp)
+{
+	ddi_soft_state_fini(&sp->dm_ctlp);
+	id_space_destroy(sp->ctl_ids);
+}
+
+static int
+dm_ctl_open(dm_state_t *sp, dev_t *devp)
+{
+	dm_ctl_t	*ctl;
+	id_t		id;
+
+	if ((id = id_alloc_nosleep(sp->ctl_ids)) == -1)
+		return (EAGAIN);
+
+	if (ddi_soft_state_zalloc(sp->dm_ctlp, (int)id) != DDI_SUCCESS) {
+		id_free(sp->ctl_ids, id);
+		return (ENOMEM);
+	}
+	ctl = ddi_get_soft_state(sp->dm_ctlp, (int)id);
+
+	/* Only events from now on are of interest */
+	mutex_enter(&sp->evlock);
+	ctl->seq = sp->evseq;
+	mutex_exit(&sp->evlock);
+
+	*devp = makedevice(getmajor(*devp), (minor_t)id);
+
+	return (0);
+}
+
+static void
+dm_ctl_close(dm_state_t *sp, minor_t minor)
+{
+	ddi_soft_state_free(sp->dm_ctlp, (int)minor);
+	id_free(sp->ctl_ids, (id_t)minor);
+}
+
+static dm_ctl_t *
+dm_ctl_get(dm_state_t *sp, minor_t minor)
+{
+	if (minor == 0)
+		return (NULL);
+	return (ddi_get_soft_state(sp->dm_ctlp, (int)minor));
+}
+
 
 static int
 dm_create_minor_nodes(dm_state_t *sp, char *name, minor_t minor)
@@ -333,214 +599,1983 @@ dm_remove_minor_nodes(dm_state_t *sp, char *name)
 }
 
 
+/*
+ * Discard (DKIOCFREE) support
+ *
+ * The caller's extent list is translated into the backing device address
+ * space, clipped to the mapping, sorted and coalesced so that adjacent and
+ * overlapping ranges reach the device as a single extent.  A mapping only
+ * has the one backing device for now, so the per-device list is the whole
+ * list.  Devices that do not implement DKIOCFREE either get the ranges
+ * overwritten with zeroes or the request is dropped, as the mapping flags
+ * say.  Under a target plugin only the target knows where the data lives,
+ * so the zeroes are written through the mapping itself.
+ */
+#define	DM_ZERO_BUFSZ	(128 * 1024)
+
 static int
-dm_ioctl_dev(dev_t dev, int cmd, intptr_t arg, int mode, cred_t *crp, int *rvp)
+dm_free_ext_cmp(const void *a, const void *b)
 {
-	minor_t		minor;
-	int		rc;
-	dm_state_t	*sp = &dm_state;
-	dm_info_t	*dmip;
-
-	minor = getminor(dev);
+	const dkioc_free_list_ext_t	*ea = a;
+	const dkioc_free_list_ext_t	*eb = b;
 
-	dmip = dm_info_get(sp, minor);
-
-	if (dmip == NULL)
-		return (ENXIO);
-
-	return (EINVAL);
+	if (ea->dfle_start < eb->dfle_start)
+		return (-1);
+	if (ea->dfle_start > eb->dfle_start)
+		return (1);
+	return (0);
 }
 
 /*
- * Mapping manipulations
+ * Rebase the extents onto the mapping, drop the empty ones, clip them to
+ * the mapping size and merge the neighbours.  Returns the number of
+ * extents left in dfl.
  */
-
 static int
-dm_list_mappings(dm_state_t *sp, intptr_t buf, int mode)
+dm_free_coalesce(dm_info_t *dmip, dkioc_free_list_t *dfl)
 {
-	dm_entry_t	*dmlist;
-	int		rc;
+	dkioc_free_list_ext_t	*ext = dfl->dfl_exts;
+	uint64_t		n = 0;
 
-	dmlist = kmem_zalloc(sizeof (dm_entry_t) * DM_MINOR_MAX, KM_SLEEP);
+	for (uint64_t i = 0; i < dfl->dfl_num_exts; i++) {
+		uint64_t	start = ext[i].dfle_start + dfl->dfl_offset;
+		uint64_t	len = ext[i].dfle_length;
 
-	for (int i = 1; i <= DM_MINOR_MAX; i++) {
-		const char	*name = "";
-		const char	*dev = "";
-		dm_info_t	*dmip = dm_info_get(sp, (minor_t)i);
+		if (len == 0 || start >= dmip->size)
+			continue;
+		if (len > dmip->size - start)
+			len = dmip->size - start;
 
-		if (dmip != NULL) {
-			name = refstr_value(dmip->name);
-			dev = refstr_value(dmip->dev);
-			cmn_err(CE_CONT, "Found mapping %s (%d)\n", name, i);
-		}
+		ext[n].dfle_start = start;
+		ext[n].dfle_length = len;
+		n++;
+	}
+	dfl->dfl_offset = 0;
 
-		(void) strncpy(dmlist[i - 1].name, name, MAXNAMELEN);
-		(void) strncpy(dmlist[i - 1].dev, dev, MAXPATHLEN);
+	if (n > 1) {
+		uint64_t	j = 0;
+
+		qsort(ext, n, sizeof (*ext), dm_free_ext_cmp);
+
+		for (uint64_t i = 1; i < n; i++) {
+			uint64_t	end = ext[j].dfle_start + ext[j].dfle_length;
+
+			if (ext[i].dfle_start <= end) {
+				uint64_t iend = ext[i].dfle_start +
+				    ext[i].dfle_length;
+
+				if (iend > end)
+					ext[j].dfle_length = iend -
+					    ext[j].dfle_start;
+			} else {
+				ext[++j] = ext[i];
+			}
+		}
+		n = j + 1;
 	}
 
-	rc = ddi_copyout(dmlist, (void *)buf,
-	    sizeof (dm_entry_t) * DM_MINOR_MAX, mode);
-	kmem_free(dmlist, sizeof (dm_entry_t) * DM_MINOR_MAX);
+	dfl->dfl_num_exts = n;
 
-	return ((rc == -1) ? (EFAULT) : (0));
+	return ((int)n);
 }
 
 /*
- * Allocate new mapping and attach it
- */ 
+ * Write len bytes of zeroes at off through the mapping dev, in pieces of
+ * no more than the devices under it take.
+ */
 static int
-dm_attach_mapping(dm_state_t *sp, char *name, char *dev, cred_t *crp)
+dm_free_zero_mapped(dm_info_t *dmip, dev_t dev, caddr_t zbuf, uint64_t off,
+    size_t len)
 {
-	dm_info_t	*dmp;
-	minor_t		minor;
+	dm_limits_t	dl = dmip->limits;
+	struct buf	*bp;
+	dm_split_t	*ds;
 	int		rc;
 
-	cmn_err(CE_CONT, "Attaching new map %s (%s)\n", name, dev);
+	dl.dl_maxxfer = dmip->maxxfer;
 
-	minor = dm_minor_alloc(sp);
+	bp = getrbuf(KM_SLEEP);
+	bp->b_flags = B_BUSY | B_WRITE;
+	bp->b_un.b_addr = zbuf;
+	bp->b_bcount = len;
+	bp->b_lblkno = lbtodb(off);
+	bp->b_blkno = (daddr_t)bp->b_lblkno;
+	bp->b_edev = dev;
+	bp->b_dev = cmpdev(dev);
 
-	/* Allocate new info structure */
-	dmp = dm_info_alloc(sp, minor, name, dev);
+	ds = dm_split_alloc(bp, NULL, NULL, KM_SLEEP);
+	dm_split_submit(ds, 0, len, NULL, dev, bp->b_lblkno, &dl);
+	dm_split_rele(ds);
+	rc = biowait(bp);
+	freerbuf(bp);
 
-	rc = ldi_open_by_name(dev, FREAD|FWRITE, crp, &dmp->lh, sp->li);
-	if (rc != 0) {
-		cmn_err(CE_WARN, "Failed to open device %s", dev);
-		dm_info_free(sp, minor);
-		return (rc);
+	return (rc);
+}
+
+/* Overwrite the (block aligned part of) extents with zeroes */
+static int
+dm_free_zero(dm_info_t *dmip, dev_t dev, dkioc_free_list_t *dfl)
+{
+	uint32_t	lbsize = dmip->limits.dl_lbsize;
+	caddr_t		zbuf;
+	int		rc = 0;
+
+	zbuf = kmem_zalloc(DM_ZERO_BUFSZ, KM_SLEEP);
+
+	for (uint64_t i = 0; i < dfl->dfl_num_exts && rc == 0; i++) {
+		uint64_t	off = dfl->dfl_exts[i].dfle_start;
+		uint64_t	end = off + dfl->dfl_exts[i].dfle_length;
+
+		off = P2ROUNDUP(off, (uint64_t)lbsize);
+		end = P2ALIGN(end, (uint64_t)lbsize);
+
+		while (off < end && rc == 0) {
+			struct iovec	iov;
+			struct uio	uio;
+			size_t		len = MIN(end - off, DM_ZERO_BUFSZ);
+
+			if (dmip->plugin != NULL) {
+				rc = dm_free_zero_mapped(dmip, dev, zbuf, off,
+				    len);
+				off += len;
+				continue;
+			}
+
+			iov.iov_base = zbuf;
+			iov.iov_len = len;
+			bzero(&uio, sizeof (uio));
+			uio.uio_iov = &iov;
+			uio.uio_iovcnt = 1;
+			uio.uio_loffset = (offset_t)off;
+			uio.uio_segflg = UIO_SYSSPACE;
+			uio.uio_llimit = MAXOFFSET_T;
+			uio.uio_resid = len;
+
+			rc = ldi_write(dmip->lh, &uio, kcred);
+			if (rc == 0 && uio.uio_resid != 0)
+				rc = EIO;
+			off += len;
+		}
 	}
 
-	rc = dm_create_minor_nodes(sp, name, minor);
+	kmem_free(zbuf, DM_ZERO_BUFSZ);
 
-	if (rc != DDI_SUCCESS) {
-		dm_remove_minor_nodes(sp, name);
-		ldi_close(dmp->lh, 0, NULL);
-		dm_info_free(sp, minor);
-		dm_minor_free(sp, minor);
-		return (rc);
-	}
 	return (rc);
 }
 
-/*
- * Detach the existing mapping and free its resources
- */
+static void
+dm_free_invalidate(dm_info_t *dmip, dkioc_free_list_t *dfl)
+{
+	for (uint64_t i = 0; i < dfl->dfl_num_exts; i++) {
+		dm_cache_invalidate(dmip->tdev,
+		    dfl->dfl_offset + dfl->dfl_exts[i].dfle_start,
+		    dfl->dfl_exts[i].dfle_length);
+	}
+}
+
 static int
-dm_detach_mapping(dm_state_t *sp, char *name)
+dm_free(dm_info_t *dmip, dev_t dev, intptr_t arg, int mode)
 {
-	minor_t		minor;
-	dm_info_t	*dmp = NULL;
+	dkioc_free_list_t	*dfl;
+	int			rc;
 
-	cmn_err(CE_CONT, "Detaching existing map %s\n", name);
+	if ((mode & FWRITE) == 0)
+		return (EBADF);
 
-	minor = dm_name2minor(sp, name);
+	/* The target decides where the data lives, not the device */
+	if (dmip->plugin != NULL && !(dmip->flags & DM_FLAG_DISCARD_ZERO))
+		return ((dmip->flags & DM_FLAG_DISCARD_IGNORE) ? 0 : ENOTSUP);
 
-	if (minor == 0) {
-		return (EINVAL);
-	}
+	rc = dfl_copyin((void *)arg, &dfl, mode, KM_SLEEP);
+	if (rc != 0)
+		return (rc);
 
-	dmp = dm_info_get(sp, minor);
+	if (dm_free_coalesce(dmip, dfl) == 0) {
+		dfl_free(dfl);
+		return (0);
+	}
+	if (dmip->trace != NULL) {
+		for (uint64_t i = 0; i < dfl->dfl_num_exts; i++) {
+			dm_trace_io(dmip, DM_TRACE_DISCARD,
+			    dfl->dfl_exts[i].dfle_start,
+			    dfl->dfl_exts[i].dfle_length);
+		}
+	}
 
-	cmn_err(CE_CONT, "Found %s info block\n", name);
+	/* Reads cached around the discard would see the old data */
+	dm_free_invalidate(dmip, dfl);
+	if (dmip->plugin != NULL)
+		rc = ENOTSUP;
+	else
+		rc = ldi_ioctl(dmip->lh, DKIOCFREE, (intptr_t)dfl, FKIOCTL,
+		    kcred, NULL);
+
+	if (rc == ENOTSUP || rc == ENOTTY) {
+		if (dmip->flags & DM_FLAG_DISCARD_ZERO)
+			rc = dm_free_zero(dmip, dev, dfl);
+		else if (dmip->flags & DM_FLAG_DISCARD_IGNORE)
+			rc = 0;
+	}
+	dm_free_invalidate(dmip, dfl);
 
-	dm_remove_minor_nodes(sp, name);
-	ldi_close(dmp->lh, 0, NULL);
-	dm_info_free(sp, minor);
-	dm_minor_free(sp, minor);
+	dfl_free(dfl);
 
-	return (0);
+	return (rc);
 }
 
-
 /*
- * Standard Solaris character driver entry points
+ * Cache flushes
+ *
+ * A flush of the mapping goes to every device under it at once, in the
+ * asynchronous dk_callback form, and is done when all of them are.
+ * Flushes are coalesced by generation.  A flush only covers writes that
+ * completed before it started, so a request arriving while one is in
+ * flight waits for the next one, and that one then serves every request
+ * that arrived in the meantime: however many callers there are, at most
+ * one flush is in flight and one more is pending.
  */
-static int
-dm_open(dev_t *devp, int flag, int otyp, cred_t *cp)
+typedef struct dm_flush {
+	dm_info_t		*fl_dmip;
+	uint32_t		fl_pending;	/* Devices still flushing */
+	int			fl_error;
+	int			fl_ndevs;
+	struct dk_callback	*fl_dkc;	/* One per device */
+} dm_flush_t;
+
+static void
+dm_flush_done(void *arg, int error)
 {
-	minor_t		minor = getminor(*devp);
-	dm_state_t	*sp = &dm_state;
-	dm_info_t	*dmip;
+	dm_flush_t	*fl = arg;
+	dm_info_t	*dmip = fl->fl_dmip;
 
-	/* Control node */
-	if (minor == 0) {
-		/* Are we attached ? */
-		if (sp->dip == NULL) {
-			return (ENXIO);
-		} else {
-			return (0);
-		}
-	}
+	/* No write cache to flush is as good as a flushed one */
+	if (error != 0 && error != ENOTSUP && error != ENOTTY)
+		fl->fl_error = error;
 
-	dmip = dm_info_get(sp, minor);
-	if (dmip == NULL)
-		return (ENXIO);
+	if (atomic_dec_32_nv(&fl->fl_pending) != 0)
+		return;
 
-	return (0);
+	mutex_enter(&dmip->flock);
+	dmip->fdone++;
+	if (fl->fl_error != 0) {
+		dmip->ferrgen = dmip->fdone;
+		dmip->ferror = fl->fl_error;
+	}
+	dmip->fbusy = B_FALSE;
+	cv_broadcast(&dmip->fcv);
+	mutex_exit(&dmip->flock);
+
+	kmem_free(fl->fl_dkc, sizeof (struct dk_callback) * fl->fl_ndevs);
+	kmem_free(fl, sizeof (*fl));
 }
 
-static int
-dm_close(dev_t dev, int flag, int otyp, cred_t *crp)
+/* Start the next flush generation, called and returns with flock held */
+static void
+dm_flush_start(dm_info_t *dmip)
 {
-	minor_t		minor = getminor(dev);
-	dm_state_t	*sp = &dm_state;
-	dm_info_t	*dmip;
-
-	/* Control node */
-	if (minor == 0) {
-		/* Are we attached ? */
-		if (sp->dip == NULL) {
-			return (ENXIO);
-		} else {
-			return (0);
-		}
+	dm_flush_t	*fl;
+	ldi_handle_t	*lhs;
+	dm_dev_t	*dd;
+	int		n = 1;
+
+	ASSERT(MUTEX_HELD(&dmip->flock));
+
+	dmip->fbusy = B_TRUE;
+	dmip->fstarted++;
+
+	for (dd = dmip->devs; dd != NULL; dd = dd->dd_next)
+		n++;
+	lhs = kmem_alloc(sizeof (ldi_handle_t) * n, KM_SLEEP);
+	lhs[0] = dmip->lh;
+	n = 1;
+	for (dd = dmip->devs; dd != NULL; dd = dd->dd_next)
+		lhs[n++] = dd->dd_lh;
+
+	fl = kmem_zalloc(sizeof (*fl), KM_SLEEP);
+	fl->fl_dmip = dmip;
+	fl->fl_ndevs = n;
+	fl->fl_dkc = kmem_zalloc(sizeof (struct dk_callback) * n, KM_SLEEP);
+	fl->fl_pending = n + 1;		/* Held until all are issued */
+
+	mutex_exit(&dmip->flock);
+
+	for (int i = 0; i < n; i++) {
+		struct dk_callback	*dkc = &fl->fl_dkc[i];
+		int			rc;
+
+		dkc->dkc_callback = dm_flush_done;
+		dkc->dkc_cookie = fl;
+		dkc->dkc_flag = FLUSH_VOLATILE;
+
+		/* A device that takes the callback calls it, even on error */
+		rc = ldi_ioctl(lhs[i], DKIOCFLUSHWRITECACHE, (intptr_t)dkc,
+		    FKIOCTL, kcred, NULL);
+		if (rc != 0)
+			dm_flush_done(fl, rc);
 	}
+	kmem_free(lhs, sizeof (ldi_handle_t) * n);
+	dm_flush_done(fl, 0);
 
-	dmip = dm_info_get(sp, minor);
-	if (dmip == NULL)
-		return (ENXIO);
-
-	return (0);
+	mutex_enter(&dmip->flock);
 }
 
 static int
-dm_read(dev_t dev, struct uio *uiop, cred_t *crp)
+dm_flush(dm_info_t *dmip, intptr_t arg, int mode)
 {
-	minor_t		minor = getminor(dev);
-	dm_state_t	*sp = &dm_state;
-	dm_info_t	*dmip;
-
-	/* Control node doesn't support IO */
-	if (minor == 0) {
-		return (EIO);
+	struct dk_callback	*dkc = NULL;
+	uint64_t		gen;
+	int			rc;
+
+	if ((mode & FKIOCTL) && arg != (intptr_t)NULL)
+		dkc = (struct dk_callback *)arg;
+
+	mutex_enter(&dmip->flock);
+
+	/* The first generation to start from now on covers this caller */
+	gen = dmip->fstarted + 1;
+	while (dmip->fdone < gen) {
+		if (!dmip->fbusy)
+			dm_flush_start(dmip);
+		else
+			cv_wait(&dmip->fcv, &dmip->flock);
 	}
+	rc = (dmip->ferrgen >= gen) ? dmip->ferror : 0;
 
-	dmip = dm_info_get(sp, minor);
+	mutex_exit(&dmip->flock);
 
-	if (dmip == NULL) {
-		return (ENXIO);
+	/*
+	 * In-kernel callers asking for a callback get it, the flush having
+	 * been done synchronously all the same.
+	 */
+	if (dkc != NULL && dkc->dkc_callback != NULL) {
+		dkc->dkc_callback(dkc->dkc_cookie, rc);
+		return (0);
 	}
 
-	return (ldi_read(dmip->lh, uiop, crp));
+	return (rc);
 }
 
 static int
-dm_write(dev_t dev, struct uio *uiop, cred_t *crp)
+dm_ioctl_dev(dev_t dev, int cmd, intptr_t arg, int mode, cred_t *crp, int *rvp)
+{
+	minor_t		minor;
+	int		rc;
+	dm_state_t	*sp = &dm_state;
+	dm_info_t	*dmip;
+
+	minor = getminor(dev);
+
+	dmip = dm_info_get(sp, minor);
+
+	if (dmip == NULL)
+		return (ENXIO);
+
+	switch (cmd) {
+	case DKIOCFREE:
+		rc = dm_free(dmip, dev, arg, mode);
+		break;
+	case DKIOCFLUSHWRITECACHE:
+		if (dmip->trace != NULL)
+			dm_trace_io(dmip, DM_TRACE_FLUSH, 0, 0);
+		rc = dm_flush(dmip, arg, mode);
+		break;
+	default:
+		rc = EINVAL;
+	}
+
+	return (rc);
+}
+
+/*
+ * Mapping manipulations
+ */
+
+/*
+ * Tell the world about a mapping coming or going.  The event carries the
+ * mapping name so consumers don't have to rescan the mapping list.  The
+ * link module does not use it, the minor node events drive that.
+ */
+static void
+dm_sysevent(dm_state_t *sp, char *subclass, const char *name, minor_t minor)
+{
+	nvlist_t	*attr;
+
+	if (nvlist_alloc(&attr, NV_UNIQUE_NAME_TYPE, KM_SLEEP) != 0)
+		return;
+
+	if (nvlist_add_string(attr, DM_EV_NAME, (char *)name) == 0 &&
+	    nvlist_add_uint32(attr, DM_EV_MINOR, minor) == 0) {
+		(void) ddi_log_sysevent(sp->dip, DM_SYSEVENT_VENDOR, EC_DM,
+		    subclass, attr, NULL, DDI_SLEEP);
+	}
+
+	nvlist_free(attr);
+}
+
+static int
+dm_list_mappings(dm_state_t *sp, intptr_t buf, int mode)
+{
+	dm_entry_t	*dmlist;
+	int		rc;
+
+	dmlist = kmem_zalloc(sizeof (dm_entry_t) * DM_MINOR_MAX, KM_SLEEP);
+
+	for (int i = 1; i <= DM_MINOR_MAX; i++) {
+		const char	*name = "";
+		const char	*dev = "";
+		dm_info_t	*dmip;
+
+		/* The mapping may be removed or reconfigured meanwhile */
+		mutex_enter(&sp->lock);
+		if ((dmip = dm_info_get(sp, (minor_t)i)) != NULL) {
+			name = refstr_value(dmip->name);
+			dev = refstr_value(dmip->dev);
+			cmn_err(CE_CONT, "Found mapping %s (%d)\n", name, i);
+			dmlist[i - 1].flags = dmip->flags;
+			if (dmip->plugin != NULL) {
+				(void) strlcpy(dmlist[i - 1].target,
+				    dmip->plugin->dmp_ops->dpo_name,
+				    DM_TARGETLEN);
+				(void) strlcpy(dmlist[i - 1].args,
+				    refstr_value(dmip->args), DM_ARGSLEN);
+			}
+		}
+
+		(void) strncpy(dmlist[i - 1].name, name, MAXNAMELEN);
+		(void) strncpy(dmlist[i - 1].dev, dev, MAXPATHLEN);
+		mutex_exit(&sp->lock);
+	}
+
+	rc = ddi_copyout(dmlist, (void *)buf,
+	    sizeof (dm_entry_t) * DM_MINOR_MAX, mode);
+	kmem_free(dmlist, sizeof (dm_entry_t) * DM_MINOR_MAX);
+
+	return ((rc == -1) ? (EFAULT) : (0));
+}
+
+/*
+ * In-place remap slots
+ *
+ * A buf redirected by the dpo_remap() fast path travels on to the device
+ * as it is, with the caller's completion routine, block number and device
+ * saved in a slot from a small per-mapping pool and b_iodone pointed at
+ * dm_remap_done().  The pool is preallocated so that the fast path never
+ * allocates; when it runs dry I/O simply takes the cloning path.
+ *
+ * Mappings without a target plugin are the whole device under another
+ * name, so all of their I/O that needs no splitting goes this way too.
+ */
+typedef struct dm_remap_slot {
+	struct dm_remap_slot	*rs_next;	/* Free list link */
+	dm_info_t		*rs_dmip;
+	int			(*rs_iodone)(struct buf *);
+	void			*rs_private;
+	dev_t			rs_edev;
+	diskaddr_t		rs_lblkno;
+	daddr_t			rs_blkno;
+	processorid_t		rs_cpu;		/* Submitting CPU */
+	hrtime_t		rs_start;	/* When it was issued */
+} dm_remap_slot_t;
+
+int	dm_remap_slots = 256;	/* In-place remaps in flight per mapping */
+
+static void
+dm_remap_pool_create(dm_info_t *dmp)
+{
+	int	n = dm_remap_slots;
+
+	if (n <= 0)
+		return;
+
+	dmp->rslots = kmem_zalloc(sizeof (dm_remap_slot_t) * n, KM_SLEEP);
+	dmp->nrslots = n;
+	for (int i = 0; i < n; i++) {
+		dmp->rslots[i].rs_dmip = dmp;
+		dmp->rslots[i].rs_next = dmp->rfree;
+		dmp->rfree = &dmp->rslots[i];
+	}
+}
+
+static void
+dm_remap_pool_destroy(dm_info_t *dmp)
+{
+	if (dmp->rslots == NULL)
+		return;
+
+	kmem_free(dmp->rslots, sizeof (dm_remap_slot_t) * dmp->nrslots);
+	dmp->rslots = NULL;
+	dmp->rfree = NULL;
+}
+
+static int dm_strategy(struct buf *);
+
+/*
+ * Stacked mappings
+ *
+ * A mapping device, or a device a target opens, that is itself a mapping
+ * is resolved to its dm_info_t when opened, and the lower mapping cannot
+ * be detached while something is stacked on it.  I/O the core and the
+ * plugins send down goes through dm_issue(), which hands I/O for a
+ * mapping straight to dm_strategy() instead of through LDI and cb_ops.
+ * Rather than recursing a level at a time, the first dm_issue() on a
+ * thread keeps a list in TSD, and I/O issued further down while it is
+ * running is appended to it and passed down by that first caller in a
+ * loop once the level above returns.  A stack of any depth so takes the
+ * kernel stack of one, on the thread that issued it.
+ *
+ * Only I/O issued from interrupt context, where the mappings below are
+ * not to be run, is handed over: to a queue of the CPU it arrives on, each
+ * with a preallocated taskq entry that is only dispatched while the queue
+ * is not being drained, so that handing I/O over cannot fail.  The taskq
+ * has a thread per CPU.
+ */
+typedef struct dm_stack {
+	struct buf	*st_head;	/* Issued for the next level down */
+	struct buf	*st_tail;
+} dm_stack_t;
+
+typedef struct dm_stack_cpu {
+	kmutex_t	sc_lock;
+	struct buf	*sc_head;	/* Issued from interrupt context */
+	struct buf	*sc_tail;
+	boolean_t	sc_run;		/* sc_ent is dispatched */
+	taskq_ent_t	sc_ent;
+} dm_stack_cpu_t;
+
+static dm_stack_cpu_t	*dm_stack_cpus;	/* Indexed by CPU id */
+static taskq_t		*dm_stack_tq;
+
+/* The mapping a device is, if it is one */
+static dm_info_t *
+dm_stack_lower(dev_t dev)
+{
+	dm_state_t	*sp = &dm_state;
+
+	if (dev == NODEV || getmajor(dev) != sp->major ||
+	    DM_MINOR_IS_CTL(getminor(dev)))
+		return (NULL);
+
+	return (dm_info_get(sp, getminor(dev)));
+}
+
+static dm_info_t *
+dm_stack_hold(dev_t dev)
+{
+	dm_info_t	*lower;
+
+	if ((lower = dm_stack_lower(dev)) != NULL)
+		atomic_inc_32(&lower->stacked);
+
+	return (lower);
+}
+
+static void
+dm_stack_rele(dm_info_t *lower)
+{
+	if (lower != NULL)
+		atomic_dec_32(&lower->stacked);
+}
+
+/* Pass bp down, and whatever the levels below issue, a level at a time */
+static void
+dm_stack_run(struct buf *bp)
+{
+	dm_state_t	*sp = &dm_state;
+	dm_stack_t	st;
+
+	st.st_head = st.st_tail = NULL;
+	(void) tsd_set(sp->stkey, &st);
+	for (;;) {
+		(void) dm_strategy(bp);
+		if ((bp = st.st_head) == NULL)
+			break;
+		if ((st.st_head = bp->av_forw) == NULL)
+			st.st_tail = NULL;
+		bp->av_forw = NULL;
+	}
+	(void) tsd_set(sp->stkey, NULL);
+}
+
+/* Pass down what interrupts on a CPU issued */
+static void
+dm_stack_task(void *arg)
+{
+	dm_stack_cpu_t	*sc = arg;
+	struct buf	*bp;
+
+	mutex_enter(&sc->sc_lock);
+	while ((bp = sc->sc_head) != NULL) {
+		if ((sc->sc_head = bp->av_forw) == NULL)
+			sc->sc_tail = NULL;
+		mutex_exit(&sc->sc_lock);
+		bp->av_forw = NULL;
+		dm_stack_run(bp);
+		mutex_enter(&sc->sc_lock);
+	}
+	sc->sc_run = B_FALSE;
+	mutex_exit(&sc->sc_lock);
+}
+
+static void
+dm_stack_init(void)
+{
+	dm_stack_cpus = kmem_zalloc(sizeof (dm_stack_cpu_t) * max_ncpus,
+	    KM_SLEEP);
+	for (processorid_t id = 0; id < max_ncpus; id++) {
+		mutex_init(&dm_stack_cpus[id].sc_lock, NULL, MUTEX_DRIVER,
+		    NULL);
+	}
+	dm_stack_tq = taskq_create("dm_stack", ncpus, minclsyspri, 1, 1,
+	    TASKQ_PREPOPULATE);
+}
+
+static void
+dm_stack_fini(void)
+{
+	taskq_wait(dm_stack_tq);
+	taskq_destroy(dm_stack_tq);
+	for (processorid_t id = 0; id < max_ncpus; id++)
+		mutex_destroy(&dm_stack_cpus[id].sc_lock);
+	kmem_free(dm_stack_cpus, sizeof (dm_stack_cpu_t) * max_ncpus);
+}
+
+/*
+ * Send bp to lh, directly if lh is another mapping.  Only a thread not
+ * already passing I/O down calls into the mapping below itself, others
+ * leave it to that one.
+ */
+void
+dm_issue(ldi_handle_t lh, struct buf *bp)
+{
+	dm_state_t	*sp = &dm_state;
+	dm_stack_t	*st;
+	dm_stack_cpu_t	*sc;
+
+	if (dm_stack_lower(bp->b_edev) == NULL) {
+		if (!dm_cache_io(lh, bp))
+			(void) ldi_strategy(lh, bp);
+		return;
+	}
+
+	bp->av_forw = NULL;
+	if (!servicing_interrupt()) {
+		if ((st = tsd_get(sp->stkey)) == NULL) {
+			dm_stack_run(bp);
+		} else {
+			if (st->st_tail != NULL)
+				st->st_tail->av_forw = bp;
+			else
+				st->st_head = bp;
+			st->st_tail = bp;
+		}
+		return;
+	}
+
+	sc = &dm_stack_cpus[CPU->cpu_id];
+	mutex_enter(&sc->sc_lock);
+	if (sc->sc_tail != NULL)
+		sc->sc_tail->av_forw = bp;
+	else
+		sc->sc_head = bp;
+	sc->sc_tail = bp;
+	if (!sc->sc_run) {
+		sc->sc_run = B_TRUE;
+		taskq_dispatch_ent(dm_stack_tq, dm_stack_task, sc, 0,
+		    &sc->sc_ent);
+	}
+	mutex_exit(&sc->sc_lock);
+}
+
+/*
+ * Open a further device for the mapping's target plugin, with the access
+ * rights of whoever creates the mapping.  The core keeps
+ * track of it so that flushes reach it too and it is closed with the
+ * mapping if the plugin does not close it first.
+ */
+int
+dm_target_open(dm_info_t *dmip, cred_t *crp, const char *path,
+    ldi_handle_t *lhp, dev_t *devp)
+{
+	dm_dev_t	*dd;
+	dm_bdev_t	*bd;
+	int		rc;
+
+	if ((rc = dm_bdev_open(path, crp, dm_state.li, &bd)) != 0)
+		return (rc);
+
+	dd = kmem_zalloc(sizeof (*dd), KM_SLEEP);
+	dd->dd_bdev = bd;
+	dd->dd_lh = bd->bd_lh;
+	dd->dd_lower = dm_stack_hold(bd->bd_dev);
+
+	mutex_enter(&dmip->flock);
+	dd->dd_next = dmip->devs;
+	dmip->devs = dd;
+	dmip->maxxfer = MIN(dmip->maxxfer, bd->bd_limits.dl_maxxfer);
+	mutex_exit(&dmip->flock);
+
+	*lhp = bd->bd_lh;
+	if (devp != NULL)
+		*devp = bd->bd_dev;
+
+	return (0);
+}
+
+void
+dm_target_close(dm_info_t *dmip, ldi_handle_t lh)
+{
+	dm_dev_t	**ddp, *dd;
+
+	mutex_enter(&dmip->flock);
+	/* Not while a flush may be using it */
+	while (dmip->fbusy)
+		cv_wait(&dmip->fcv, &dmip->flock);
+	for (ddp = &dmip->devs; (dd = *ddp) != NULL; ddp = &dd->dd_next) {
+		if (dd->dd_lh == lh) {
+			*ddp = dd->dd_next;
+			break;
+		}
+	}
+	dmip->maxxfer = dmip->limits.dl_maxxfer;
+	for (dm_dev_t *d = dmip->devs; d != NULL; d = d->dd_next) {
+		dmip->maxxfer = MIN(dmip->maxxfer,
+		    d->dd_bdev->bd_limits.dl_maxxfer);
+	}
+	mutex_exit(&dmip->flock);
+
+	if (dd == NULL)
+		return;
+
+	dm_stack_rele(dd->dd_lower);
+	dm_bdev_rele(dd->dd_bdev);
+	kmem_free(dd, sizeof (*dd));
+}
+
+/* Let event readers know of a change in the target's state */
+void
+dm_target_event(dm_info_t *dmip, uint32_t type, int error)
+{
+	dm_event_post(&dm_state, type, refstr_value(dmip->name), error);
+}
+
+/* Limits of one of the mapping's devices, NULL if lh is none of them */
+const dm_limits_t *
+dm_target_limits(dm_info_t *dmip, ldi_handle_t lh)
+{
+	const dm_limits_t	*dl = NULL;
+	dm_dev_t		*dd;
+
+	if (lh == dmip->lh)
+		return (&dmip->limits);
+
+	mutex_enter(&dmip->flock);
+	for (dd = dmip->devs; dd != NULL; dd = dd->dd_next) {
+		if (dd->dd_lh == lh) {
+			dl = &dd->dd_bdev->bd_limits;
+			break;
+		}
+	}
+	mutex_exit(&dmip->flock);
+
+	return (dl);
+}
+
+/* Flush the write caches of all of the mapping's devices, synchronously */
+int
+dm_target_flush(dm_info_t *dmip)
+{
+	return (dm_flush(dmip, (intptr_t)NULL, FKIOCTL));
+}
+
+/*
+ * Flush the write cache of just one of the mapping's devices, for targets
+ * ordering their own metadata.  No cache is as good as a flushed one.
+ */
+/*ARGSUSED*/
+int
+dm_target_flush_dev(dm_info_t *dmip, ldi_handle_t lh)
+{
+	int	rc;
+
+	rc = ldi_ioctl(lh, DKIOCFLUSHWRITECACHE, (intptr_t)NULL, FKIOCTL,
+	    kcred, NULL);
+
+	return ((rc == ENOTSUP || rc == ENOTTY) ? 0 : rc);
+}
+
+/* Checksum of target metadata, 'len' a multiple of 4 */
+uint32_t
+dm_cksum(const void *buf, size_t len)
+{
+	const uint32_t	*p = buf;
+	uint32_t	a = 0, b = 0;
+
+	for (size_t i = 0; i < len / sizeof (uint32_t); i++) {
+		a += p[i];
+		b += a;
+	}
+	return (a ^ (b << 1) ^ 0x5a5a5a5a);
+}
+
+#define	DM_TARGET_MAXARGS	32
+
+/*
+ * Bind the mapping to its target plugin, loading the plugin if needed
+ */
+static int
+dm_target_create(dm_info_t *dmp, const char *target, const char *args,
+    cred_t *crp)
+{
+	dm_plugin_entry_t	*plugin;
+	char			*argv[DM_TARGET_MAXARGS];
+	char			*buf, *p;
+	int			argc = 0;
+	void			*priv = NULL;
+	int			rc;
+
+	if ((plugin = dm_plugin_lookup(target)) == NULL) {
+		if (dm_plugin_resgister(target) != DDI_SUCCESS)
+			return (ENOENT);
+		if ((plugin = dm_plugin_lookup(target)) == NULL)
+			return (ENOENT);
+	}
+
+	/* Split the arguments at white space */
+	buf = ddi_strdup(args, KM_SLEEP);
+	for (p = buf; *p != '\0'; ) {
+		while (*p == ' ' || *p == '\t')
+			*p++ = '\0';
+		if (*p == '\0')
+			break;
+		if (argc == DM_TARGET_MAXARGS) {
+			strfree(buf);
+			return (E2BIG);
+		}
+		argv[argc++] = p;
+		while (*p != '\0' && *p != ' ' && *p != '\t')
+			p++;
+	}
+
+	dmp->args = refstr_alloc(args);
+	rc = plugin->dmp_ops->dpo_create(dmp, argc, argv, crp, &priv);
+	strfree(buf);
+	if (rc != 0) {
+		refstr_rele(dmp->args);
+		dmp->args = NULL;
+		return (rc);
+	}
+	dmp->tpriv = priv;
+
+	if (plugin->dmp_ops->dpo_remap != NULL)
+		dm_remap_pool_create(dmp);
+
+	mutex_enter(&dm_plugin_table.lock);
+	plugin->refcnt++;
+	mutex_exit(&dm_plugin_table.lock);
+	dmp->plugin = plugin;
+
+	return (0);
+}
+
+static void
+dm_target_destroy(dm_info_t *dmp)
+{
+	dm_plugin_entry_t	*plugin = dmp->plugin;
+
+	if (plugin == NULL)
+		return;
+
+	plugin->dmp_ops->dpo_destroy(dmp, dmp->tpriv);
+	dm_remap_pool_destroy(dmp);
+	while (dmp->devs != NULL)
+		dm_target_close(dmp, dmp->devs->dd_lh);
+	dmp->tpriv = NULL;
+	dmp->plugin = NULL;
+	refstr_rele(dmp->args);
+	dmp->args = NULL;
+
+	mutex_enter(&dm_plugin_table.lock);
+	plugin->refcnt--;
+	mutex_exit(&dm_plugin_table.lock);
+}
+
+/*
+ * Publish a mapping over an already opened backing device: allocate the
+ * minor number and info structure, bind the target and create the minor
+ * nodes.  On failure the caller still owns (and has to close) the LDI
+ * handle.  The target opens its devices with crp.
+ */
+static int
+dm_publish_mapping(dm_state_t *sp, const dm_entry_t *ent, dm_bdev_t *bd,
+    cred_t *crp)
+{
+	const char	*name = ent->name;
+	dm_info_t	*dmp;
+	minor_t		minor;
+	int		rc;
+
+	mutex_enter(&sp->lock);
+
+	if (dm_name2minor(sp, name) != 0) {
+		mutex_exit(&sp->lock);
+		return (EEXIST);
+	}
+
+	minor = dm_minor_alloc(sp);
+
+	/* Allocate new info structure */
+	dmp = dm_info_alloc(sp, minor, name, ent->dev);
+	if (dmp == NULL) {
+		dm_minor_free(sp, minor);
+		mutex_exit(&sp->lock);
+		return (ENOMEM);
+	}
+
+	dmp->bdev = bd;
+	dmp->lh = bd->bd_lh;
+	dmp->tdev = bd->bd_dev;
+	dmp->flags = ent->flags;
+	dmp->size = bd->bd_size;
+	dmp->limits = bd->bd_limits;
+	dmp->maxxfer = dmp->limits.dl_maxxfer;
+
+	if (ent->target[0] != '\0') {
+		rc = dm_target_create(dmp, ent->target, ent->args, crp);
+		if (rc != 0) {
+			dm_info_free(sp, minor);
+			dm_minor_free(sp, minor);
+			mutex_exit(&sp->lock);
+			return (rc);
+		}
+	} else {
+		/* Prefetch reads the mapping device directly */
+		if (dmp->flags & DM_FLAG_READAHEAD)
+			(void) dm_ra_create(dmp);
+		dm_remap_pool_create(dmp);
+	}
+
+	rc = dm_create_minor_nodes(sp, (char *)name, minor);
+
+	if (rc != DDI_SUCCESS) {
+		dm_remove_minor_nodes(sp, (char *)name);
+		dm_ra_destroy(dmp);
+		dm_target_destroy(dmp);
+		dm_remap_pool_destroy(dmp);
+		dm_info_free(sp, minor);
+		dm_minor_free(sp, minor);
+		mutex_exit(&sp->lock);
+		return (EIO);
+	}
+
+	dmp->lower = dm_stack_hold(dmp->tdev);
+	sp->nmappings++;
+	mutex_exit(&sp->lock);
+
+	dm_sysevent(sp, ESC_DM_MAPPING_ATTACH, name, minor);
+	dm_event_post(sp, DM_EVENT_ATTACH, name, 0);
+
+	return (0);
+}
+
+/*
+ * Allocate new mapping and attach it
+ */
+static int
+dm_attach_mapping(dm_state_t *sp, dm_entry_t *ent, cred_t *crp)
+{
+	dm_bdev_t	*bd;
+	int		rc;
+
+	ent->name[MAXNAMELEN - 1] = '\0';
+	ent->dev[MAXPATHLEN - 1] = '\0';
+	ent->target[DM_TARGETLEN - 1] = '\0';
+	ent->args[DM_ARGSLEN - 1] = '\0';
+
+	cmn_err(CE_CONT, "Attaching new map %s (%s)\n", ent->name, ent->dev);
+
+	if ((rc = dm_bdev_open(ent->dev, crp, sp->li, &bd)) != 0)
+		return (rc);
+
+	rc = dm_publish_mapping(sp, ent, bd, crp);
+	if (rc != 0) {
+		dm_bdev_rele(bd);
+	}
+
+	return (rc);
+}
+
+/* Wait, with the mapping lock held, for the I/O passed on to finish */
+static void
+dm_io_drain(dm_info_t *dmip)
+{
+	ASSERT(MUTEX_HELD(&dmip->lock));
+
+	/* dm_io_exit() may miss the flag going up, look again now and then */
+	while (dmip->inflight != 0) {
+		(void) cv_reltimedwait(&dmip->cv, &dmip->lock,
+		    drv_usectohz(10000), TR_CLOCK_TICK);
+	}
+}
+
+/*
+ * Detach the existing mapping and free its resources.  It has to be
+ * closed; once it is marked as going away I/O still in flight is waited
+ * for, and control operations holding it, without the global lock.
+ */
+static int
+dm_detach_mapping(dm_state_t *sp, char *name)
+{
+	minor_t		minor;
+	dm_info_t	*dmp = NULL;
+
+	cmn_err(CE_CONT, "Detaching existing map %s\n", name);
+
+	mutex_enter(&sp->lock);
+
+	minor = dm_name2minor(sp, name);
+
+	if (minor == 0) {
+		mutex_exit(&sp->lock);
+		return (EINVAL);
+	}
+
+	dmp = dm_info_get(sp, minor);
+
+	cmn_err(CE_CONT, "Found %s info block\n", name);
+
+	/*
+	 * Held I/O would be lost, stacked mappings left dangling, openers
+	 * left with a handle on freed state
+	 */
+	mutex_enter(&dmp->lock);
+	if (dmp->suspended || dmp->stacked != 0 || dmp->otyps != 0 ||
+	    dmp->lyropens != 0) {
+		mutex_exit(&dmp->lock);
+		mutex_exit(&sp->lock);
+		return (EBUSY);
+	}
+	dmp->detaching = B_TRUE;
+	mutex_exit(&sp->lock);
+
+	dm_io_drain(dmp);
+	while (dmp->holds != 0)
+		cv_wait(&dmp->cv, &dmp->lock);
+	mutex_exit(&dmp->lock);
+
+	mutex_enter(&sp->lock);
+	dm_remove_minor_nodes(sp, name);
+	dm_ra_destroy(dmp);
+	dm_target_destroy(dmp);
+	dm_remap_pool_destroy(dmp);
+	dm_stack_rele(dmp->lower);
+	dm_bdev_rele(dmp->bdev);
+	dm_info_free(sp, minor);
+	dm_minor_free(sp, minor);
+	sp->nmappings--;
+
+	mutex_exit(&sp->lock);
+
+	dm_sysevent(sp, ESC_DM_MAPPING_DETACH, name, minor);
+	dm_event_post(sp, DM_EVENT_DETACH, name, 0);
+
+	return (0);
+}
+
+/*
+ * I/O quiescing
+ *
+ * dm_io_enter()/dm_io_exit() bracket every I/O handed to the target.
+ * While a mapping is suspended new I/O is parked on the held list, in
+ * arrival order, and resubmitted when the mapping is resumed.
+ */
+static boolean_t
+dm_io_enter(dm_info_t *dmip, struct buf *bp)
+{
+	atomic_inc_32(&dmip->inflight);
+	membar_enter();
+
+	if (!dmip->suspended && !dmip->detaching)
+		return (B_TRUE);
+
+	mutex_enter(&dmip->lock);
+	if (dmip->detaching) {
+		if (atomic_dec_32_nv(&dmip->inflight) == 0)
+			cv_broadcast(&dmip->cv);
+		mutex_exit(&dmip->lock);
+		bioerror(bp, ENXIO);
+		biodone(bp);
+		return (B_FALSE);
+	}
+	if (!dmip->suspended) {
+		mutex_exit(&dmip->lock);
+		return (B_TRUE);
+	}
+	bp->av_forw = NULL;
+	if (dmip->held == NULL)
+		dmip->held = bp;
+	else
+		dmip->held_tail->av_forw = bp;
+	dmip->held_tail = bp;
+	if (atomic_dec_32_nv(&dmip->inflight) == 0)
+		cv_broadcast(&dmip->cv);
+	mutex_exit(&dmip->lock);
+
+	return (B_FALSE);
+}
+
+/*
+ * Someone draining the mapping waits on it: the last I/O out drops its
+ * count under the lock, so that the mapping is not freed under it.
+ * Otherwise nothing is touched past the count going down.
+ */
+void
+dm_io_exit(dm_info_t *dmip)
+{
+	membar_exit();
+	if (!dmip->suspended && !dmip->detaching) {
+		atomic_dec_32(&dmip->inflight);
+		return;
+	}
+
+	mutex_enter(&dmip->lock);
+	if (atomic_dec_32_nv(&dmip->inflight) == 0)
+		cv_broadcast(&dmip->cv);
+	mutex_exit(&dmip->lock);
+}
+
+/*
+ * Stop passing I/O to the target and wait for what is in flight.  The
+ * mapping is held meanwhile, not the global lock.
+ */
+static int
+dm_suspend_mapping(dm_state_t *sp, char *name)
+{
+	dm_info_t	*dmip;
+	minor_t		minor;
+
+	mutex_enter(&sp->lock);
+
+	if ((minor = dm_name2minor(sp, name)) == 0) {
+		mutex_exit(&sp->lock);
+		return (EINVAL);
+	}
+	dmip = dm_info_get(sp, minor);
+
+	mutex_enter(&dmip->lock);
+	if (dmip->suspended) {
+		mutex_exit(&dmip->lock);
+		mutex_exit(&sp->lock);
+		return (EALREADY);
+	}
+	dmip->suspended = B_TRUE;
+	dmip->holds++;
+	membar_enter();
+	mutex_exit(&sp->lock);
+
+	dm_io_drain(dmip);
+	if (--dmip->holds == 0)
+		cv_broadcast(&dmip->cv);
+	mutex_exit(&dmip->lock);
+
+	dm_event_post(sp, DM_EVENT_SUSPEND, name, 0);
+
+	return (0);
+}
+
+/* DM_TRACE_START, DM_TRACE_STOP and DM_GET_TRACE */
+static int
+dm_trace_ctl(dm_state_t *sp, int cmd, intptr_t arg, int mode)
+{
+	dm_trace_ctl_t	*tc;
+	dm_info_t	*dmip;
+	minor_t		minor;
+	int		rc;
+
+	tc = kmem_zalloc(sizeof (*tc), KM_SLEEP);
+	if (ddi_copyin((const void *)arg, tc, offsetof(dm_trace_ctl_t, count),
+	    mode) != 0) {
+		kmem_free(tc, sizeof (*tc));
+		return (EFAULT);
+	}
+	tc->name[MAXNAMELEN - 1] = '\0';
+
+	mutex_enter(&sp->lock);
+	if ((minor = dm_name2minor(sp, tc->name)) == 0) {
+		mutex_exit(&sp->lock);
+		kmem_free(tc, sizeof (*tc));
+		return (EINVAL);
+	}
+	dmip = dm_info_get(sp, minor);
+
+	switch (cmd) {
+	case DM_TRACE_START:
+		rc = dm_trace_start(dmip, tc->nrecs);
+		tc->size = dmip->size;
+		break;
+	case DM_TRACE_STOP:
+		rc = dm_trace_stop(dmip);
+		break;
+	default:
+		rc = dm_trace_get(dmip, tc);
+		break;
+	}
+	mutex_exit(&sp->lock);
+
+	if (rc == 0 && ddi_copyout(tc, (void *)arg, sizeof (*tc), mode) != 0)
+		rc = EFAULT;
+	kmem_free(tc, sizeof (*tc));
+
+	return (rc);
+}
+
+/* Collect the plugin counters of a mapping for DM_GET_STATS */
+static int
+dm_get_stats(dm_state_t *sp, intptr_t arg, int mode)
+{
+	dm_stats_t	*st;
+	dm_info_t	*dmip;
+	minor_t		minor;
+	nvlist_t	*nvl = NULL;
+	char		*buf;
+	size_t		len;
+	int		rc;
+
+	st = kmem_zalloc(sizeof (*st), KM_SLEEP);
+	if (ddi_copyin((const void *)arg, st->name, sizeof (st->name),
+	    mode) != 0) {
+		kmem_free(st, sizeof (*st));
+		return (EFAULT);
+	}
+	st->name[MAXNAMELEN - 1] = '\0';
+
+	mutex_enter(&sp->lock);
+	if ((minor = dm_name2minor(sp, st->name)) == 0) {
+		rc = EINVAL;
+		goto out;
+	}
+	dmip = dm_info_get(sp, minor);
+
+	if ((rc = nvlist_alloc(&nvl, NV_UNIQUE_NAME, KM_SLEEP)) != 0)
+		goto out;
+	if (dmip->plugin != NULL &&
+	    dmip->plugin->dmp_ops->dpo_stats != NULL &&
+	    (rc = dmip->plugin->dmp_ops->dpo_stats(dmip, dmip->tpriv,
+	    nvl)) != 0)
+		goto out;
+	dm_cache_stats(nvl);
+
+	buf = st->data;
+	len = sizeof (st->data);
+	if ((rc = nvlist_pack(nvl, &buf, &len, NV_ENCODE_NATIVE,
+	    KM_SLEEP)) != 0)
+		goto out;
+	st->size = (uint32_t)len;
+
+	if (ddi_copyout(st, (void *)arg, sizeof (*st), mode) != 0)
+		rc = EFAULT;
+out:
+	mutex_exit(&sp->lock);
+	nvlist_free(nvl);
+	kmem_free(st, sizeof (*st));
+
+	return (rc);
+}
+
+/* Let I/O through again, held I/O first */
+static int
+dm_resume_mapping(dm_state_t *sp, char *name)
+{
+	dm_info_t	*dmip;
+	minor_t		minor;
+	struct buf	*bp;
+
+	mutex_enter(&sp->lock);
+
+	if ((minor = dm_name2minor(sp, name)) == 0) {
+		mutex_exit(&sp->lock);
+		return (EINVAL);
+	}
+	dmip = dm_info_get(sp, minor);
+
+	mutex_enter(&dmip->lock);
+	if (!dmip->suspended) {
+		mutex_exit(&dmip->lock);
+		mutex_exit(&sp->lock);
+		return (EALREADY);
+	}
+	dmip->suspended = B_FALSE;
+	bp = dmip->held;
+	dmip->held = dmip->held_tail = NULL;
+	mutex_exit(&dmip->lock);
+
+	mutex_exit(&sp->lock);
+
+	while (bp != NULL) {
+		struct buf	*next = bp->av_forw;
+
+		bp->av_forw = NULL;
+		(void) dm_strategy(bp);
+		bp = next;
+	}
+
+	dm_event_post(sp, DM_EVENT_RESUME, name, 0);
+
+	return (0);
+}
+
+/*
+ * Persistent mappings
+ *
+ * The "mapping-list" driver property lists the mappings to recreate when
+ * the driver attaches, one "name device [option ...]" string per mapping
+ * with the same options dmadm create accepts.  Opening the backing devices
+ * is what takes time, so the opens are spread over a taskq and only the
+ * (cheap) publishing of the minor nodes is done serially afterwards.
+ */
+int	dm_restore_nthreads = 32;
+
+typedef struct {
+	dm_state_t	*sp;
+	dm_entry_t	ent;
+	boolean_t	valid;	/* Entry parsed fine */
+	dm_bdev_t	*bd;
+	int		rc;
+} dm_restore_t;
+
+/*
+ * Split "name device [option ...] [target=plugin [argument ...]]" into
+ * the restore entry
+ */
+static int
+dm_restore_parse(const char *str, dm_restore_t *rp)
+{
+	dm_entry_t	*ent = &rp->ent;
+	char		*buf, *tok, *next;
+	int		field = 0;
+	int		rc = 0;
+
+	buf = ddi_strdup(str, KM_SLEEP);
+
+	for (tok = buf; tok != NULL && rc == 0; tok = next) {
+		while (*tok == ' ' || *tok == '\t')
+			tok++;
+		if (*tok == '\0')
+			break;
+		if (field >= 2 && strncmp(tok, "target=", 7) == 0) {
+			/* The rest of the line belongs to the plugin */
+			next = tok + 7;
+			while (*next != '\0' && *next != ' ' && *next != '\t')
+				next++;
+			if (*next != '\0')
+				*next++ = '\0';
+			(void) strlcpy(ent->target, tok + 7,
+			    sizeof (ent->target));
+			(void) strlcpy(ent->args, next, sizeof (ent->args));
+			break;
+		}
+		next = tok;
+		while (*next != '\0' && *next != ' ' && *next != '\t')
+			next++;
+		if (*next != '\0')
+			*next++ = '\0';
+		else
+			next = NULL;
+
+		switch (field++) {
+		case 0:
+			(void) strlcpy(ent->name, tok, sizeof (ent->name));
+			break;
+		case 1:
+			(void) strlcpy(ent->dev, tok, sizeof (ent->dev));
+			break;
+		default:
+			if (strcmp(tok, "discard=zero") == 0)
+				ent->flags |= DM_FLAG_DISCARD_ZERO;
+			else if (strcmp(tok, "discard=ignore") == 0)
+				ent->flags |= DM_FLAG_DISCARD_IGNORE;
+			else if (strcmp(tok, "readahead") == 0)
+				ent->flags |= DM_FLAG_READAHEAD;
+			else
+				rc = EINVAL;
+		}
+	}
+
+	strfree(buf);
+
+	return ((rc == 0 && field >= 2) ? 0 : EINVAL);
+}
+
+static void
+dm_restore_open(void *arg)
+{
+	dm_restore_t	*rp = arg;
+
+	rp->rc = dm_bdev_open(rp->ent.dev, kcred, rp->sp->li, &rp->bd);
+}
+
+static void
+dm_restore_mappings(dm_state_t *sp)
+{
+	char		**list;
+	uint_t		count;
+	dm_restore_t	*rtab;
+	ddi_taskq_t	*tq;
+
+	if (ddi_prop_lookup_string_array(DDI_DEV_T_ANY, sp->dip,
+	    DDI_PROP_DONTPASS, "mapping-list", &list, &count) !=
+	    DDI_PROP_SUCCESS) {
+		return;
+	}
+
+	rtab = kmem_zalloc(sizeof (*rtab) * count, KM_SLEEP);
+	tq = ddi_taskq_create(sp->dip, "dm_restore",
+	    MAX(1, MIN(count, dm_restore_nthreads)), TASKQ_DEFAULTPRI, 0);
+
+	for (uint_t i = 0; i < count; i++) {
+		dm_restore_t	*rp = &rtab[i];
+
+		rp->sp = sp;
+		if (dm_restore_parse(list[i], rp) != 0) {
+			cmn_err(CE_WARN, "dm: bad mapping-list entry '%s'",
+			    list[i]);
+			continue;
+		}
+		rp->valid = B_TRUE;
+		if (tq == NULL || ddi_taskq_dispatch(tq, dm_restore_open, rp,
+		    DDI_SLEEP) != DDI_SUCCESS) {
+			dm_restore_open(rp);
+		}
+	}
+
+	if (tq != NULL) {
+		ddi_taskq_wait(tq);
+		ddi_taskq_destroy(tq);
+	}
+
+	for (uint_t i = 0; i < count; i++) {
+		dm_restore_t	*rp = &rtab[i];
+
+		if (!rp->valid)
+			continue;
+		if (rp->rc != 0) {
+			cmn_err(CE_WARN, "dm: failed to restore mapping %s "
+			    "(%s): %d", rp->ent.name, rp->ent.dev, rp->rc);
+			continue;
+		}
+		if (dm_publish_mapping(sp, &rp->ent, rp->bd, kcred) != 0) {
+			cmn_err(CE_WARN, "dm: failed to publish mapping %s",
+			    rp->ent.name);
+			dm_bdev_rele(rp->bd);
+		}
+	}
+
+	kmem_free(rtab, sizeof (*rtab) * count);
+	ddi_prop_free(list);
+}
+
+
+/*
+ * Standard Solaris character driver entry points
+ */
+static int
+dm_open(dev_t *devp, int flag, int otyp, cred_t *cp)
+{
+	minor_t		minor = getminor(*devp);
+	dm_state_t	*sp = &dm_state;
+	dm_info_t	*dmip;
+
+	/* Control node */
+	if (DM_MINOR_IS_CTL(minor)) {
+		/* Are we attached ? */
+		if (sp->dip == NULL || minor != 0 || otyp != OTYP_CHR) {
+			return (ENXIO);
+		} else {
+			return (dm_ctl_open(sp, devp));
+		}
+	}
+
+	mutex_enter(&sp->lock);
+	if ((dmip = dm_info_get(sp, minor)) == NULL || dmip->detaching) {
+		mutex_exit(&sp->lock);
+		return (ENXIO);
+	}
+	mutex_enter(&dmip->lock);
+	if (otyp == OTYP_LYR)
+		dmip->lyropens++;
+	else
+		dmip->otyps |= 1U << otyp;
+	mutex_exit(&dmip->lock);
+	mutex_exit(&sp->lock);
+
+	return (0);
+}
+
+static int
+dm_close(dev_t dev, int flag, int otyp, cred_t *crp)
 {
 	minor_t		minor = getminor(dev);
 	dm_state_t	*sp = &dm_state;
 	dm_info_t	*dmip;
 
+	/* Control node */
+	if (DM_MINOR_IS_CTL(minor)) {
+		/* Are we attached ? */
+		if (sp->dip == NULL) {
+			return (ENXIO);
+		}
+		if (dm_ctl_get(sp, minor) != NULL) {
+			dm_ctl_close(sp, minor);
+		}
+		return (0);
+	}
+
+	dmip = dm_info_get(sp, minor);
+	if (dmip == NULL)
+		return (ENXIO);
+
+	/* Only the last close of a type comes here, bar layered ones */
+	mutex_enter(&dmip->lock);
+	if (otyp == OTYP_LYR) {
+		ASSERT(dmip->lyropens != 0);
+		dmip->lyropens--;
+	} else {
+		dmip->otyps &= ~(1U << otyp);
+	}
+	mutex_exit(&dmip->lock);
+
+	return (0);
+}
+
+/*
+ * I/O path
+ *
+ * Both the block and the raw nodes end up in dm_strategy().  The raw
+ * read/write entry points go through physio()/aphysio(), which lock the
+ * caller's pages down, so the buf handed to the target is a clone sharing
+ * those pages and no data is ever copied by the mapper.  Where nothing
+ * needs to change but the device and block, the caller's buf itself goes
+ * on instead (see the in-place remap slots).
+ *
+ * Clones come from a kmem cache and carry the submitting CPU, the caller's
+ * buf is completed through dm_cq_complete() so that it finishes near where
+ * it was started.
+ */
+typedef struct dm_io {
+	struct buf	di_buf;		/* The clone, has to be first */
+	processorid_t	di_cpu;		/* Submitting CPU */
+	hrtime_t	di_start;	/* When it was cloned */
+} dm_io_t;
+
+static kmem_cache_t	*dm_io_cache;
+
+/*ARGSUSED*/
+static int
+dm_io_ctor(void *buf, void *arg, int kmflags)
+{
+	bioinit(&((dm_io_t *)buf)->di_buf);
+	return (0);
+}
+
+/*ARGSUSED*/
+static void
+dm_io_dtor(void *buf, void *arg)
+{
+	biofini(&((dm_io_t *)buf)->di_buf);
+}
+
+static void
+dm_io_cache_init(void)
+{
+	dm_io_cache = kmem_cache_create("dm_io_cache", sizeof (dm_io_t), 0,
+	    dm_io_ctor, dm_io_dtor, NULL, NULL, NULL, 0);
+}
+
+static void
+dm_io_cache_fini(void)
+{
+	kmem_cache_destroy(dm_io_cache);
+}
+
+static int dm_done(struct buf *);
+
+/* Clone bp for the target, completing in dm_done() */
+static struct buf *
+dm_clone(struct buf *bp, dev_t dev, diskaddr_t blkno)
+{
+	dm_io_t		*dio;
+	struct buf	*cbp;
+
+	if ((dio = kmem_cache_alloc(dm_io_cache, KM_NOSLEEP)) == NULL)
+		return (NULL);
+
+	cbp = bioclone(bp, 0, bp->b_bcount, dev, (daddr_t)blkno, dm_done,
+	    &dio->di_buf, KM_NOSLEEP);
+	cbp->b_lblkno = blkno;
+	cbp->b_edev = dev;
+	cbp->b_dev = cmpdev(dev);
+	cbp->b_private = bp;
+	dio->di_cpu = CPU->cpu_id;
+	dio->di_start = gethrtime();
+
+	return (cbp);
+}
+
+/* Finish the caller's buf, from wherever dm_cq_complete() decided */
+void
+dm_io_complete(struct buf *bp)
+{
+	dm_info_t	*dmip = dm_info_get(&dm_state, getminor(bp->b_edev));
+
+	biodone(bp);
+	dm_io_exit(dmip);
+}
+
+static int
+dm_done(struct buf *cbp)
+{
+	dm_io_t		*dio = (dm_io_t *)cbp;
+	struct buf	*bp = cbp->b_private;
+	dm_state_t	*sp = &dm_state;
+	dm_info_t	*dmip = dm_info_get(sp, getminor(bp->b_edev));
+	int		error = geterror(cbp);
+	processorid_t	cpu = dio->di_cpu;
+
+	if (dmip->plugin != NULL &&
+	    dmip->plugin->dmp_ops->dpo_end_io != NULL) {
+		error = dmip->plugin->dmp_ops->dpo_end_io(dmip, dmip->tpriv,
+		    cbp, error);
+	}
+
+	if (error != 0) {
+		bioerror(bp, error);
+		dm_event_post(sp, DM_EVENT_IOERR, refstr_value(dmip->name),
+		    error);
+	}
+	bp->b_resid = cbp->b_resid;
+
+	dm_stat_done(dmip, bp, dio->di_start);
+	kmem_cache_free(dm_io_cache, dio);
+	dm_cq_complete(bp, cpu);
+
+	return (0);
+}
+
+/*
+ * Pass an I/O that has been through dm_io_enter() to the target.  Safe to
+ * call from completion context.
+ */
+void
+dm_io_start(dm_info_t *dmip, struct buf *bp)
+{
+	struct buf	*cbp;
+
+	if ((cbp = dm_clone(bp, dmip->tdev, bp->b_lblkno)) == NULL) {
+		bioerror(bp, ENOMEM);
+		dm_stat_done(dmip, bp, 0);
+		biodone(bp);
+		dm_io_exit(dmip);
+		return;
+	}
+
+	dm_split_issue(cbp, dmip->lh, &dmip->limits);
+}
+
+/* Completion of a buf redirected in place: put the caller's view back */
+static int
+dm_remap_done(struct buf *bp)
+{
+	dm_remap_slot_t	*rs = bp->b_private;
+	dm_info_t	*dmip = rs->rs_dmip;
+	int		error = geterror(bp);
+	processorid_t	cpu = rs->rs_cpu;
+	hrtime_t	start = rs->rs_start;
+
+	bp->b_iodone = rs->rs_iodone;
+	bp->b_private = rs->rs_private;
+	bp->b_edev = rs->rs_edev;
+	bp->b_dev = cmpdev(rs->rs_edev);
+	bp->b_lblkno = rs->rs_lblkno;
+	bp->b_blkno = rs->rs_blkno;
+
+	mutex_enter(&dmip->rlock);
+	rs->rs_next = dmip->rfree;
+	dmip->rfree = rs;
+	mutex_exit(&dmip->rlock);
+
+	if (error != 0) {
+		dm_event_post(&dm_state, DM_EVENT_IOERR,
+		    refstr_value(dmip->name), error);
+	}
+
+	dm_stat_done(dmip, bp, start);
+	dm_cq_complete(bp, cpu);
+
+	return (0);
+}
+
+/*
+ * dpo_remap() fast path: send the caller's buf itself to the device the
+ * plugin named.  Returns B_FALSE if no remap slot was free.
+ */
+static boolean_t
+dm_remap_start(dm_info_t *dmip, struct buf *bp, const dm_remap_t *rp)
+{
+	dm_remap_slot_t	*rs;
+
+	mutex_enter(&dmip->rlock);
+	if ((rs = dmip->rfree) != NULL)
+		dmip->rfree = rs->rs_next;
+	mutex_exit(&dmip->rlock);
+	if (rs == NULL)
+		return (B_FALSE);
+
+	rs->rs_iodone = bp->b_iodone;
+	rs->rs_private = bp->b_private;
+	rs->rs_edev = bp->b_edev;
+	rs->rs_lblkno = bp->b_lblkno;
+	rs->rs_blkno = bp->b_blkno;
+	rs->rs_cpu = CPU->cpu_id;
+	rs->rs_start = gethrtime();
+
+	bp->b_iodone = dm_remap_done;
+	bp->b_private = rs;
+	bp->b_edev = rp->dr_dev;
+	bp->b_dev = cmpdev(rp->dr_dev);
+	bp->b_lblkno = rp->dr_blkno;
+	bp->b_blkno = (daddr_t)rp->dr_blkno;
+
+	dm_issue(rp->dr_lh, bp);
+
+	return (B_TRUE);
+}
+
+/*
+ * Hand the I/O to the target plugin.  Plain redirections are done in
+ * place, everything else goes to dpo_mapio() on a clone that completes in
+ * dm_done().
+ */
+static void
+dm_target_io(dm_info_t *dmip, struct buf *bp)
+{
+	dm_plugin_ops_t	*ops = dmip->plugin->dmp_ops;
+	dm_remap_t	remap;
+	struct buf	*cbp;
+
+	/* In place only what needs no splitting */
+	if (ops->dpo_remap != NULL && dmip->rfree != NULL &&
+	    bp->b_bcount <= dmip->maxxfer &&
+	    ops->dpo_remap(dmip->tpriv, bp, &remap) &&
+	    dm_remap_start(dmip, bp, &remap))
+		return;
+
+	if ((cbp = dm_clone(bp, dmip->tdev, bp->b_lblkno)) == NULL) {
+		bioerror(bp, ENOMEM);
+		dm_stat_done(dmip, bp, 0);
+		biodone(bp);
+		dm_io_exit(dmip);
+		return;
+	}
+
+	switch (ops->dpo_mapio(dmip, dmip->tpriv, cbp, &remap)) {
+	case DM_MAPIO_SUBMITTED:
+		break;
+	case DM_MAPIO_REMAPPED:
+		cbp->b_edev = remap.dr_dev;
+		cbp->b_dev = cmpdev(remap.dr_dev);
+		cbp->b_lblkno = remap.dr_blkno;
+		cbp->b_blkno = (daddr_t)remap.dr_blkno;
+		if (cbp->b_bcount <= dmip->maxxfer)
+			dm_issue(remap.dr_lh, cbp);
+		else
+			dm_split_issue(cbp, remap.dr_lh,
+			    dm_target_limits(dmip, remap.dr_lh));
+		break;
+	case DM_MAPIO_KILL:
+	default:
+		if (geterror(cbp) == 0)
+			bioerror(cbp, EIO);
+		biodone(cbp);
+		break;
+	}
+}
+
+static int
+dm_eof_done(struct buf *cbp)
+{
+	struct buf	*bp = cbp->b_private;
+	int		error = geterror(cbp);
+
+	if (error != 0)
+		bioerror(bp, error);
+	bp->b_resid = cbp->b_resid + (bp->b_bcount - cbp->b_bcount);
+	freerbuf(cbp);
+	biodone(bp);
+
+	return (0);
+}
+
+/*
+ * A transfer running past the end of the mapping: the part up to the end
+ * goes ahead as a clone and the rest is reported back in b_resid.
+ */
+static void
+dm_eof_clone(struct buf *bp, size_t len)
+{
+	struct buf	*cbp;
+
+	cbp = bioclone(bp, 0, len, bp->b_edev, bp->b_blkno, dm_eof_done,
+	    NULL, KM_NOSLEEP);
+	if (cbp == NULL) {
+		bioerror(bp, ENOMEM);
+		biodone(bp);
+		return;
+	}
+	cbp->b_lblkno = bp->b_lblkno;
+	cbp->b_private = bp;
+
+	(void) dm_strategy(cbp);
+}
+
+static int
+dm_strategy(struct buf *bp)
+{
+	minor_t		minor = getminor(bp->b_edev);
+	dm_state_t	*sp = &dm_state;
+	dm_info_t	*dmip;
+	offset_t	off;
+
+	/* Control node doesn't support IO */
+	if (minor == 0 || (dmip = dm_info_get(sp, minor)) == NULL) {
+		bioerror(bp, ENXIO);
+		biodone(bp);
+		return (0);
+	}
+
+	/* A size of 0 means it could not be learnt, nothing to check */
+	off = ldbtob(bp->b_lblkno);
+	if (off < 0 || (off > dmip->size && dmip->size != 0)) {
+		bioerror(bp, ENXIO);
+		biodone(bp);
+		return (0);
+	}
+	if (dmip->size != 0 && off + bp->b_bcount > dmip->size) {
+		if (off == dmip->size) {
+			/* EOF */
+			bp->b_resid = bp->b_bcount;
+			biodone(bp);
+		} else {
+			dm_eof_clone(bp, (size_t)(dmip->size - off));
+		}
+		return (0);
+	}
+
+	if (!dm_io_enter(dmip, bp))
+		return (0);
+	dm_stat_start(dmip);
+	if (dmip->trace != NULL)
+		dm_trace_buf(dmip, bp);
+
+	if (dmip->plugin != NULL) {
+		dm_target_io(dmip, bp);
+		return (0);
+	}
+
+	if (dmip->ra != NULL) {
+		if (bp->b_flags & B_READ) {
+			if (dm_ra_read(dmip, bp))
+				return (0);
+		} else {
+			dm_ra_write(dmip, bp);
+		}
+	}
+
+	/* The same blocks of the device, in place if no split is needed */
+	if (dmip->rfree != NULL && bp->b_bcount <= dmip->maxxfer) {
+		dm_remap_t	remap;
+
+		remap.dr_lh = dmip->lh;
+		remap.dr_dev = dmip->tdev;
+		remap.dr_blkno = bp->b_lblkno;
+		if (dm_remap_start(dmip, bp, &remap))
+			return (0);
+	}
+
+	dm_io_start(dmip, bp);
+
+	return (0);
+}
+
+/* Validate a raw transfer before it is handed to physio */
+static int
+dm_rw_check(dev_t dev, offset_t off, ssize_t resid)
+{
+	minor_t		minor = getminor(dev);
+	dm_state_t	*sp = &dm_state;
+
 	/* Control node doesn't support IO */
 	if (minor == 0) {
 		return (EIO);
 	}
-	dmip = dm_info_get(sp, minor);
 
-	if (dmip == NULL) {
+	if (dm_info_get(sp, minor) == NULL) {
 		return (ENXIO);
 	}
 
-	return (ldi_write(dmip->lh, uiop, crp));
+	if ((off & (DEV_BSIZE - 1)) != 0 || (resid & (DEV_BSIZE - 1)) != 0) {
+		return (EINVAL);
+	}
+
+	return (0);
+}
+
+static int
+dm_read(dev_t dev, struct uio *uiop, cred_t *crp)
+{
+	int	rc;
+
+	rc = dm_rw_check(dev, uiop->uio_loffset, uiop->uio_resid);
+	if (rc != 0)
+		return (rc);
+
+	return (physio(dm_strategy, NULL, dev, B_READ, minphys, uiop));
+}
+
+static int
+dm_write(dev_t dev, struct uio *uiop, cred_t *crp)
+{
+	int	rc;
+
+	rc = dm_rw_check(dev, uiop->uio_loffset, uiop->uio_resid);
+	if (rc != 0)
+		return (rc);
+
+	return (physio(dm_strategy, NULL, dev, B_WRITE, minphys, uiop));
+}
+
+static int
+dm_aread(dev_t dev, struct aio_req *aio, cred_t *crp)
+{
+	struct uio	*uiop = aio->aio_uio;
+	int		rc;
+
+	rc = dm_rw_check(dev, uiop->uio_loffset, uiop->uio_resid);
+	if (rc != 0)
+		return (rc);
+
+	return (aphysio(dm_strategy, anocancel, dev, B_READ, minphys, aio));
+}
+
+static int
+dm_awrite(dev_t dev, struct aio_req *aio, cred_t *crp)
+{
+	struct uio	*uiop = aio->aio_uio;
+	int		rc;
+
+	rc = dm_rw_check(dev, uiop->uio_loffset, uiop->uio_resid);
+	if (rc != 0)
+		return (rc);
+
+	return (aphysio(dm_strategy, anocancel, dev, B_WRITE, minphys, aio));
 }
 
 static int
@@ -550,13 +2585,15 @@ dm_ioctl(dev_t dev, int cmd, intptr_t arg, int mode, cred_t *crp, int *rvp)
 	int		rc;
 	dm_state_t	*sp = &dm_state;
 	dm_entry_t	dm_entry;
+	dm_ctl_t	*ctl;
 
 	/* If this is not a control node handle it elsewhere */
-	if (minor != 0) {
+	if (!DM_MINOR_IS_CTL(minor)) {
 		return (dm_ioctl_dev(dev, cmd, arg, mode, crp, rvp));
 	}
 
-	if ((cmd == DM_ATTACH_MAPPING) || (cmd == DM_DETACH_MAPPING)) {
+	if ((cmd == DM_ATTACH_MAPPING) || (cmd == DM_DETACH_MAPPING) ||
+	    (cmd == DM_SUSPEND_MAPPING) || (cmd == DM_RESUME_MAPPING)) {
 		rc = ddi_copyin((const void *)arg, &dm_entry,
 		    sizeof (dm_entry_t), mode);
 		if (rc == -1) {
@@ -569,12 +2606,32 @@ dm_ioctl(dev_t dev, int cmd, intptr_t arg, int mode, cred_t *crp, int *rvp)
 		rc = dm_list_mappings(sp, arg, mode);
 		break;
 	case DM_ATTACH_MAPPING:
-		rc = dm_attach_mapping(sp, dm_entry.name, dm_entry.dev, crp);
-		rc = (rc == DDI_SUCCESS) ? 0 : EIO;
+		rc = dm_attach_mapping(sp, &dm_entry, crp);
 		break;
 	case DM_DETACH_MAPPING:
 		rc = dm_detach_mapping(sp, dm_entry.name);
 
+		break;
+	case DM_SUSPEND_MAPPING:
+		rc = dm_suspend_mapping(sp, dm_entry.name);
+		break;
+	case DM_RESUME_MAPPING:
+		rc = dm_resume_mapping(sp, dm_entry.name);
+		break;
+	case DM_GET_STATS:
+		rc = dm_get_stats(sp, arg, mode);
+		break;
+	case DM_TRACE_START:
+	case DM_TRACE_STOP:
+	case DM_GET_TRACE:
+		rc = dm_trace_ctl(sp, cmd, arg, mode);
+		break;
+	case DM_GET_EVENTS:
+		if ((ctl = dm_ctl_get(sp, minor)) == NULL) {
+			rc = EINVAL;
+			break;
+		}
+		rc = dm_get_events(sp, ctl, arg, mode);
 		break;
 	default:
 		rc = EINVAL;
@@ -583,25 +2640,81 @@ dm_ioctl(dev_t dev, int cmd, intptr_t arg, int mode, cred_t *crp, int *rvp)
 	return (rc);
 }
 
+/* The control node polls readable while there are unread events */
+static int
+dm_chpoll(dev_t dev, short events, int anyyet, short *reventsp,
+    struct pollhead **phpp)
+{
+	minor_t		minor = getminor(dev);
+	dm_state_t	*sp = &dm_state;
+	dm_ctl_t	*ctl;
+	short		revents = 0;
+
+	if (!DM_MINOR_IS_CTL(minor) || (ctl = dm_ctl_get(sp, minor)) == NULL)
+		return (ENXIO);
+
+	mutex_enter(&sp->evlock);
+	if (ctl->seq < sp->evseq)
+		revents = events & (POLLIN | POLLRDNORM);
+	mutex_exit(&sp->evlock);
+
+	*reventsp = revents;
+	if (revents == 0 && !anyyet)
+		*phpp = &sp->evph;
+
+	return (0);
+}
+
+/* The statistics page, read-only and on the control node only */
+/*ARGSUSED*/
+static int
+dm_devmap(dev_t dev, devmap_cookie_t dhp, offset_t off, size_t len,
+    size_t *maplen, uint_t model)
+{
+	if (!DM_MINOR_IS_CTL(getminor(dev)))
+		return (ENXIO);
+
+	return (dm_stat_devmap(dhp, off, len, maplen));
+}
+
+/* Export the mapping size so that specfs can use the block node */
+static int
+dm_prop_op(dev_t dev, dev_info_t *dip, ddi_prop_op_t prop_op, int mod_flags,
+    char *name, caddr_t valuep, int *lengthp)
+{
+	minor_t		minor = getminor(dev);
+	dm_state_t	*sp = &dm_state;
+	dm_info_t	*dmip;
+
+	if (dev == DDI_DEV_T_ANY || minor == 0 ||
+	    (dmip = dm_info_get(sp, minor)) == NULL) {
+		return (ddi_prop_op(dev, dip, prop_op, mod_flags, name,
+		    valuep, lengthp));
+	}
+
+	return (ddi_prop_op_size(dev, dip, prop_op, mod_flags, name,
+	    valuep, lengthp, dmip->size));
+}
+
 static struct cb_ops dm_cb_ops = {
 	.cb_open	= dm_open,
 	.cb_close	= dm_close,
-	.cb_strategy	= nodev,
+	.cb_strategy	= dm_strategy,
 	.cb_print	= nodev,
 	.cb_dump	= nodev,
 	.cb_read	= dm_read,
 	.cb_write	= dm_write,
 	.cb_ioctl	= dm_ioctl,
-	.cb_devmap	= nodev,
+	.cb_devmap	= dm_devmap,
 	.cb_mmap	= nodev,
-	.cb_segmap	= nodev,
-	.cb_chpoll	= nochpoll,
-	.cb_prop_op	= ddi_prop_op,
+	.cb_segmap	= ddi_devmap_segmap,
+	.cb_chpoll	= dm_chpoll,
+	.cb_prop_op	= dm_prop_op,
 	.cb_str		= NULL,
 	.cb_flag	= D_NEW | D_MP | D_64BIT,
 	.cb_rev		= CB_REV,
-	.cb_aread	= nodev,
-	.cb_awrite	= nodev
+	.cb_aread	= dm_aread,
+	.cb_awrite	= dm_awrite
 };
 
 static int
@@ -645,23 +2758,54 @@ dm_attach(dev_info_t *dip, ddi_attach_cmd_t cmd)
 	}
 
 	sp->dip = dip;
+	sp->major = ddi_driver_major(dip);
 
 	if (ldi_ident_from_dip(sp->dip, &sp->li) != 0) {
 		cmn_err(CE_WARN, "dm_attach: failed to get LDI identification");
 		return (DDI_FAILURE);
 	}
 
+	mutex_init(&sp->lock, NULL, MUTEX_DRIVER, NULL);
+	tsd_create(&sp->stkey, NULL);
+	dm_stack_init();
+	dm_event_init(sp);
+	dm_plugin_table_init();
 	dm_minor_init(sp);
 	dm_info_init(sp);
+	(void) dm_ctl_init(sp);
+	(void) dm_ra_init(dip);
+	(void) dm_cache_init(dip);
+	(void) dm_stat_init(dip);
+	dm_io_cache_init();
+	dm_bdev_init();
+	dm_split_init();
+	(void) dm_cq_init();
 
 	if (ddi_create_minor_node(dip, "ctl", S_IFCHR,
 	    instance, DDI_PSEUDO, 0) != DDI_SUCCESS) {
 		cmn_err(CE_WARN, "dm_attach: failed to create minor node");
+		dm_cq_fini();
+		dm_split_fini();
+		dm_bdev_fini();
+		dm_io_cache_fini();
+		dm_stat_fini();
+		dm_cache_fini();
+		dm_ra_fini();
+		dm_ctl_fini(sp);
+		dm_info_fini(sp);
 		dm_minor_fini(sp);
+		dm_plugin_table_fini();
+		dm_event_fini(sp);
+		dm_stack_fini();
+		tsd_destroy(&sp->stkey);
+		mutex_destroy(&sp->lock);
 		ldi_ident_release(sp->li);
 		return (DDI_FAILURE);
 	}
 
+	dm_plugin_load_list(sp);
+	dm_restore_mappings(sp);
+
 	ddi_report_dev(dip);
 
 	return (DDI_SUCCESS);
@@ -685,10 +2829,29 @@ dm_detach(dev_info_t *dip, ddi_detach_cmd_t cmd)
 		return (DDI_FAILURE);
 	}
 
+	/* Mappings are still there, do not let them go with us */
+	if (sp->nmappings != 0) {
+		return (DDI_FAILURE);
+	}
+
 	ddi_remove_minor_node(dip, 0);
 
+	dm_plugin_unload_all();
+	dm_cq_fini();
+	dm_split_fini();
+	dm_bdev_fini();
+	dm_io_cache_fini();
+	dm_stat_fini();
+	dm_cache_fini();
+	dm_ra_fini();
+	dm_ctl_fini(sp);
 	dm_info_fini(sp);
 	dm_minor_fini(sp);
+	dm_plugin_table_fini();
+	dm_event_fini(sp);
+	dm_stack_fini();
+	tsd_destroy(&sp->stkey);
+	mutex_destroy(&sp->lock);
 
 	ldi_ident_release(sp->li);
 
@@ -0,0 +1,245 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright 2011 Grigale Ltd. All rights reserved.
+ * Use is subject to license terms.
+ */
+
+/*
+ * Device Mapper backing devices
+ *
+ * Every device under a mapping, be it the mapping device or one a target
+ * plugin opened, is opened once however many mappings use it.  The table
+ * here holds an LDI handle per device, counts the mappings and plugins
+ * holding it, and keeps what the core wants to know of the device (its
+ * size and dm_limits_t), learnt when it is opened.  When hundreds of
+ * mappings carve up one LUN, all but the first find it by path in a hash
+ * and take a hold, once the vnode at that path says the caller may read
+ * and write it.
+ *
+ * A device opened under another path is found by its dev_t once opened,
+ * and the second handle closed.  The table lock is not held across opens
+ * and closes, so two racing opens of a device may both go through; the
+ * one to find the other in the table gives way.  Whoever opened a device
+ * first, the handle is shared: FREAD|FWRITE opens all the same.
+ */
+
+#include <sys/file.h>
+#include <sys/kmem.h>
+#include <sys/refstr.h>
+#include <sys/sunldi.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/vnode.h>
+#include <sys/ddi.h>
+#include <sys/sunddi.h>
+
+#include <sys/dm.h>
+#include <sys/dm_impl.h>
+
+#define	DM_BDEV_HASH	256		/* Buckets, power of two */
+
+static kmutex_t		dm_bdev_lock;	/* Protects both hashes */
+static dm_bdev_t	*dm_bdev_byname[DM_BDEV_HASH];
+static dm_bdev_t	*dm_bdev_bydev[DM_BDEV_HASH];
+static uint32_t		dm_bdev_count;	/* Devices open */
+
+static uint_t
+dm_bdev_hname(const char *path)
+{
+	uint32_t	h = 2166136261U;
+
+	while (*path != '\0')
+		h = (h ^ (uchar_t)*path++) * 16777619U;
+
+	return (h & (DM_BDEV_HASH - 1));
+}
+
+static uint_t
+dm_bdev_hdev(dev_t dev)
+{
+	return ((uint_t)(((uint64_t)dev * 0x9e3779b97f4a7c15ULL) >> 56) &
+	    (DM_BDEV_HASH - 1));
+}
+
+static dm_bdev_t *
+dm_bdev_find_name(const char *path)
+{
+	dm_bdev_t	*bd;
+
+	ASSERT(MUTEX_HELD(&dm_bdev_lock));
+
+	for (bd = dm_bdev_byname[dm_bdev_hname(path)]; bd != NULL;
+	    bd = bd->bd_nnext) {
+		if (strcmp(refstr_value(bd->bd_path), path) == 0)
+			return (bd);
+	}
+	return (NULL);
+}
+
+static dm_bdev_t *
+dm_bdev_find_dev(dev_t dev)
+{
+	dm_bdev_t	*bd;
+
+	ASSERT(MUTEX_HELD(&dm_bdev_lock));
+
+	for (bd = dm_bdev_bydev[dm_bdev_hdev(dev)]; bd != NULL;
+	    bd = bd->bd_dnext) {
+		if (bd->bd_dev == dev)
+			return (bd);
+	}
+	return (NULL);
+}
+
+static void
+dm_bdev_close(dm_bdev_t *bd)
+{
+	(void) ldi_close(bd->bd_lh, FREAD|FWRITE, kcred);
+	refstr_rele(bd->bd_path);
+	kmem_free(bd, sizeof (*bd));
+}
+
+/* May crp open the device at path for reading and writing? */
+static int
+dm_bdev_access(const char *path, cred_t *crp)
+{
+	vnode_t	*vp;
+	int	rc;
+
+	if ((rc = lookupname((char *)path, UIO_SYSSPACE, FOLLOW, NULLVPP,
+	    &vp)) != 0)
+		return (rc);
+	rc = VOP_ACCESS(vp, VREAD | VWRITE, 0, crp, NULL);
+	VN_RELE(vp);
+
+	return (rc);
+}
+
+/*
+ * Take a hold on the device at path, opening it with 'crp' unless it is
+ * open already.  If it is, the caller still has to be allowed to open it,
+ * so that nobody gets at a device through someone else's handle.
+ */
+int
+dm_bdev_open(const char *path, cred_t *crp, ldi_ident_t li, dm_bdev_t **bdp)
+{
+	dm_bdev_t	*bd, *other;
+	ldi_handle_t	lh;
+	uint_t		h;
+	int		rc;
+
+	mutex_enter(&dm_bdev_lock);
+	if ((bd = dm_bdev_find_name(path)) != NULL) {
+		bd->bd_ref++;
+		mutex_exit(&dm_bdev_lock);
+		if ((rc = dm_bdev_access(path, crp)) != 0) {
+			dm_bdev_rele(bd);
+			return (rc);
+		}
+		*bdp = bd;
+		return (0);
+	}
+	mutex_exit(&dm_bdev_lock);
+
+	rc = ldi_open_by_name((char *)path, FREAD|FWRITE, crp, &lh, li);
+	if (rc != 0) {
+		cmn_err(CE_WARN, "Failed to open device %s", path);
+		return (rc);
+	}
+
+	bd = kmem_zalloc(sizeof (*bd), KM_SLEEP);
+	bd->bd_lh = lh;
+	bd->bd_path = refstr_alloc(path);
+	bd->bd_ref = 1;
+	if (ldi_get_dev(lh, &bd->bd_dev) != 0)
+		bd->bd_dev = NODEV;
+	if (ldi_get_size(lh, &bd->bd_size) != DDI_SUCCESS)
+		bd->bd_size = 0;
+	dm_limits_get(lh, &bd->bd_limits);
+
+	mutex_enter(&dm_bdev_lock);
+	if ((other = dm_bdev_find_name(path)) != NULL ||
+	    (bd->bd_dev != NODEV &&
+	    (other = dm_bdev_find_dev(bd->bd_dev)) != NULL)) {
+		/* Opened meanwhile, or under another name */
+		other->bd_ref++;
+		mutex_exit(&dm_bdev_lock);
+		dm_bdev_close(bd);
+		*bdp = other;
+		return (0);
+	}
+	h = dm_bdev_hname(path);
+	bd->bd_nnext = dm_bdev_byname[h];
+	dm_bdev_byname[h] = bd;
+	h = dm_bdev_hdev(bd->bd_dev);
+	bd->bd_dnext = dm_bdev_bydev[h];
+	dm_bdev_bydev[h] = bd;
+	dm_bdev_count++;
+	mutex_exit(&dm_bdev_lock);
+
+	*bdp = bd;
+	return (0);
+}
+
+/* Let go of a hold, the last one closes the device */
+void
+dm_bdev_rele(dm_bdev_t *bd)
+{
+	dm_bdev_t	**bdpp;
+
+	mutex_enter(&dm_bdev_lock);
+	ASSERT(bd->bd_ref > 0);
+	if (--bd->bd_ref != 0) {
+		mutex_exit(&dm_bdev_lock);
+		return;
+	}
+	for (bdpp = &dm_bdev_byname[dm_bdev_hname(refstr_value(bd->bd_path))];
+	    *bdpp != bd; bdpp = &(*bdpp)->bd_nnext)
+		;
+	*bdpp = bd->bd_nnext;
+	for (bdpp = &dm_bdev_bydev[dm_bdev_hdev(bd->bd_dev)]; *bdpp != bd;
+	    bdpp = &(*bdpp)->bd_dnext)
+		;
+	*bdpp = bd->bd_dnext;
+	dm_bdev_count--;
+	mutex_exit(&dm_bdev_lock);
+
+	/* Nothing goes through the mapper to it any more */
+	dm_cache_purge(bd->bd_dev);
+	dm_bdev_close(bd);
+}
+
+void
+dm_bdev_init(void)
+{
+	mutex_init(&dm_bdev_lock, NULL, MUTEX_DRIVER, NULL);
+}
+
+/* Only once all the mappings are gone */
+void
+dm_bdev_fini(void)
+{
+	ASSERT(dm_bdev_count == 0);
+	mutex_destroy(&dm_bdev_lock);
+}
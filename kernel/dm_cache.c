@@ -0,0 +1,754 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright 2011 Grigale Ltd. All rights reserved.
+ * Use is subject to license terms.
+ */
+
+/*
+ * Device Mapper block cache
+ *
+ * An optional cache of 4K blocks in memory, shared by all the mappings.
+ * It sits right above the backing devices and is keyed by device and
+ * block, so whichever mappings are on top a block read twice comes from
+ * memory the second time.  It is meant for the small hot regions that get
+ * read over and over through the raw nodes, bypassing the page cache:
+ * only 4K aligned reads of up to dm_cache_maxio are cached, larger ones go
+ * by.
+ *
+ * Replacement is 2Q, which keeps a scan from pushing out the blocks that
+ * matter.  A block read the first time goes on a short FIFO (A1in); only
+ * a block read again after dropping off it, while its key is still on a
+ * ghost FIFO (A1out), makes it onto the main LRU (Am).
+ *
+ * The cache is cut into DM_CACHE_STRIPES stripes by device and 64K region,
+ * each with its own lock, hash table and queues and an even share of the
+ * memory.  That goes up to dm_cache_size (the block-cache property in
+ * dm.conf, in MB; 0, the default, turns the cache off), comes down by an
+ * eighth whenever the kmem reaper asks for memory back and grows back
+ * once it has not for a while.
+ *
+ * Reads hitting the cache are copied into in the issuing thread if the buf
+ * is mapped in.  Those that are not, the usual case through the raw nodes,
+ * are served on the taskq that fills the cache after misses, as mapping
+ * them in may sleep; should the blocks be gone by then they go on to the
+ * device from there.
+ *
+ * Writes and discards drop the blocks they cover, both when they are
+ * issued and when they complete.  Every stripe also counts the writes over
+ * it, and a read that missed only fills the cache if none went over its
+ * blocks while it was in flight, so a read racing a write does not leave
+ * stale data behind.  Only I/O through the mapper is seen: devices written
+ * to behind its back should not be mapped with the cache on.
+ */
+
+#include <sys/atomic.h>
+#include <sys/buf.h>
+#include <sys/cpuvar.h>
+#include <sys/errno.h>
+#include <sys/kmem.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/ddi.h>
+#include <sys/sunddi.h>
+
+#include <sys/dm.h>
+#include <sys/dm_impl.h>
+
+#define	DM_CACHE_BSIZE		4096
+#define	DM_CACHE_BSHIFT		12
+#define	DM_CACHE_STRIPES	64		/* Power of two */
+#define	DM_CACHE_HASH		1024		/* Buckets per stripe, ditto */
+#define	DM_CACHE_RSHIFT		4		/* log2 of blocks per region */
+#define	DM_CACHE_MAXBLKS	(1 << DM_CACHE_RSHIFT)	/* Largest read */
+#define	DM_CACHE_REGROW		10		/* Seconds before regrowing */
+
+/* Queues */
+#define	DM_CACHE_A1IN		0		/* Read once, FIFO */
+#define	DM_CACHE_AM		1		/* Read again, LRU */
+#define	DM_CACHE_A1OUT		2		/* Keys off A1in, FIFO */
+#define	DM_CACHE_NQ		3
+
+size_t	dm_cache_size = 0;			/* Memory for blocks, 0: off */
+size_t	dm_cache_maxio = 64 * 1024;		/* Largest read cached */
+
+typedef struct dm_cblk {
+	struct dm_cblk	*cb_hnext;	/* Hash chain */
+	struct dm_cblk	*cb_prev;	/* Queue, towards the head */
+	struct dm_cblk	*cb_next;
+	dev_t		cb_dev;
+	uint64_t	cb_blk;
+	int		cb_q;		/* DM_CACHE_A1IN etc. */
+	caddr_t		cb_data;	/* NULL on A1out */
+} dm_cblk_t;
+
+typedef struct {
+	dm_cblk_t	*cl_head;	/* Most recent */
+	dm_cblk_t	*cl_tail;
+	uint64_t	cl_len;
+} dm_clist_t;
+
+typedef struct {
+	kmutex_t	cs_lock;
+	uint64_t	cs_gen;		/* Writes gone over the stripe */
+	dm_clist_t	cs_q[DM_CACHE_NQ];
+	dm_cblk_t	*cs_hash[DM_CACHE_HASH];
+	uint64_t	cs_hits;	/* Reads served */
+	uint64_t	cs_misses;
+	uint64_t	cs_ghosthits;	/* Blocks promoted to Am */
+	uint64_t	cs_inserts;
+	uint64_t	cs_evicts;
+	uint64_t	cs_invals;	/* Blocks dropped by writes */
+} dm_cstripe_t;
+
+/* I/O hooked for its completion: a read that missed, or a write */
+typedef struct {
+	int		(*ci_iodone)(struct buf *);
+	void		*ci_private;
+	dev_t		ci_dev;
+	uint64_t	ci_blk;
+	uint64_t	ci_nblks;
+	uint64_t	ci_gens[2];	/* Of the regions the read spans */
+	ldi_handle_t	ci_lh;		/* Where a read goes on a late miss */
+} dm_cio_t;
+
+static dm_cstripe_t	*dm_cache_stripes;	/* NULL with the cache off */
+static kmem_cache_t	*dm_cblk_cache;
+static kmem_cache_t	*dm_cdata_cache;
+static kmem_cache_t	*dm_cio_cache;
+static ddi_taskq_t	*dm_cache_tq;		/* Read miss fills */
+static volatile size_t	dm_cache_target;	/* Memory to use now */
+static volatile uint64_t dm_cache_nblks;	/* Blocks with data */
+static clock_t		dm_cache_reclaimed;	/* Last kmem reclaim */
+static clock_t		dm_cache_grown;
+
+
+static uint64_t
+dm_cache_hash(dev_t dev, uint64_t x)
+{
+	return ((((uint64_t)dev * 0x9e3779b97f4a7c15ULL) ^ x) *
+	    0xc2b2ae3d27d4eb4fULL);
+}
+
+/* The stripe of a region */
+static dm_cstripe_t *
+dm_cache_stripe(dev_t dev, uint64_t region)
+{
+	return (&dm_cache_stripes[(dm_cache_hash(dev, region) >> 32) &
+	    (DM_CACHE_STRIPES - 1)]);
+}
+
+static dm_cblk_t **
+dm_cache_bucket(dm_cstripe_t *cs, dev_t dev, uint64_t blk)
+{
+	return (&cs->cs_hash[(dm_cache_hash(dev, blk) >> 32) &
+	    (DM_CACHE_HASH - 1)]);
+}
+
+/* Blocks a stripe may hold */
+static uint64_t
+dm_cache_limit(void)
+{
+	return (MAX(dm_cache_target / DM_CACHE_BSIZE / DM_CACHE_STRIPES, 1));
+}
+
+static void
+dm_clist_remove(dm_clist_t *cl, dm_cblk_t *cb)
+{
+	if (cb->cb_prev != NULL)
+		cb->cb_prev->cb_next = cb->cb_next;
+	else
+		cl->cl_head = cb->cb_next;
+	if (cb->cb_next != NULL)
+		cb->cb_next->cb_prev = cb->cb_prev;
+	else
+		cl->cl_tail = cb->cb_prev;
+	cb->cb_prev = cb->cb_next = NULL;
+	cl->cl_len--;
+}
+
+static void
+dm_clist_push(dm_clist_t *cl, dm_cblk_t *cb)
+{
+	cb->cb_prev = NULL;
+	cb->cb_next = cl->cl_head;
+	if (cl->cl_head != NULL)
+		cl->cl_head->cb_prev = cb;
+	else
+		cl->cl_tail = cb;
+	cl->cl_head = cb;
+	cl->cl_len++;
+}
+
+static dm_cblk_t *
+dm_cache_lookup(dm_cstripe_t *cs, dev_t dev, uint64_t blk)
+{
+	dm_cblk_t	*cb;
+
+	ASSERT(MUTEX_HELD(&cs->cs_lock));
+
+	for (cb = *dm_cache_bucket(cs, dev, blk); cb != NULL;
+	    cb = cb->cb_hnext) {
+		if (cb->cb_blk == blk && cb->cb_dev == dev)
+			return (cb);
+	}
+	return (NULL);
+}
+
+static void
+dm_cache_unlink(dm_cstripe_t *cs, dm_cblk_t *cb)
+{
+	dm_cblk_t	**cbp;
+
+	ASSERT(MUTEX_HELD(&cs->cs_lock));
+
+	for (cbp = dm_cache_bucket(cs, cb->cb_dev, cb->cb_blk); *cbp != cb;
+	    cbp = &(*cbp)->cb_hnext)
+		;
+	*cbp = cb->cb_hnext;
+	dm_clist_remove(&cs->cs_q[cb->cb_q], cb);
+	if (cb->cb_data != NULL) {
+		kmem_cache_free(dm_cdata_cache, cb->cb_data);
+		atomic_dec_64(&dm_cache_nblks);
+	}
+	kmem_cache_free(dm_cblk_cache, cb);
+}
+
+/* Bring the stripe within its share: A1in down to a quarter, then Am */
+static void
+dm_cache_trim(dm_cstripe_t *cs)
+{
+	dm_clist_t	*a1in = &cs->cs_q[DM_CACHE_A1IN];
+	dm_clist_t	*am = &cs->cs_q[DM_CACHE_AM];
+	dm_clist_t	*a1out = &cs->cs_q[DM_CACHE_A1OUT];
+	uint64_t	cap = dm_cache_limit();
+	uint64_t	kin = MAX(cap / 4, 1);
+	uint64_t	kout = MAX(cap / 2, 1);
+
+	ASSERT(MUTEX_HELD(&cs->cs_lock));
+
+	while (a1in->cl_len + am->cl_len > cap) {
+		dm_cblk_t	*cb;
+
+		if (a1in->cl_len > kin || am->cl_len == 0) {
+			/* Off the FIFO, only the key is kept */
+			cb = a1in->cl_tail;
+			dm_clist_remove(a1in, cb);
+			kmem_cache_free(dm_cdata_cache, cb->cb_data);
+			atomic_dec_64(&dm_cache_nblks);
+			cb->cb_data = NULL;
+			cb->cb_q = DM_CACHE_A1OUT;
+			dm_clist_push(a1out, cb);
+		} else {
+			dm_cache_unlink(cs, am->cl_tail);
+		}
+		cs->cs_evicts++;
+	}
+	while (a1out->cl_len > kout)
+		dm_cache_unlink(cs, a1out->cl_tail);
+}
+
+/* Take 'data' as the contents of the block, or free it */
+static void
+dm_cache_insert(dm_cstripe_t *cs, dev_t dev, uint64_t blk, caddr_t data)
+{
+	dm_cblk_t	*cb, **cbp;
+
+	ASSERT(MUTEX_HELD(&cs->cs_lock));
+
+	if ((cb = dm_cache_lookup(cs, dev, blk)) != NULL) {
+		if (cb->cb_data != NULL) {
+			/* Someone got there first */
+			kmem_cache_free(dm_cdata_cache, data);
+			return;
+		}
+		/* Read again since it dropped off A1in: hot */
+		dm_clist_remove(&cs->cs_q[DM_CACHE_A1OUT], cb);
+		cb->cb_q = DM_CACHE_AM;
+		cs->cs_ghosthits++;
+	} else {
+		if ((cb = kmem_cache_alloc(dm_cblk_cache, KM_NOSLEEP)) ==
+		    NULL) {
+			kmem_cache_free(dm_cdata_cache, data);
+			return;
+		}
+		cb->cb_dev = dev;
+		cb->cb_blk = blk;
+		cb->cb_q = DM_CACHE_A1IN;
+		cbp = dm_cache_bucket(cs, dev, blk);
+		cb->cb_hnext = *cbp;
+		*cbp = cb;
+	}
+
+	cb->cb_data = data;
+	atomic_inc_64(&dm_cache_nblks);
+	dm_clist_push(&cs->cs_q[cb->cb_q], cb);
+	cs->cs_inserts++;
+	dm_cache_trim(cs);
+}
+
+/* Drop blocks [blk, blk + n) of dev, n may be huge */
+static void
+dm_cache_drop(dev_t dev, uint64_t blk, uint64_t n)
+{
+	uint64_t	r0 = blk >> DM_CACHE_RSHIFT;
+	uint64_t	r1 = (blk + n - 1) >> DM_CACHE_RSHIFT;
+
+	if (dm_cache_stripes == NULL || n == 0)
+		return;
+
+	/* Too many regions to go through, go through the blocks instead */
+	if (r1 - r0 >= DM_CACHE_STRIPES * DM_CACHE_HASH) {
+		for (int i = 0; i < DM_CACHE_STRIPES; i++) {
+			dm_cstripe_t	*cs = &dm_cache_stripes[i];
+
+			mutex_enter(&cs->cs_lock);
+			cs->cs_gen++;
+			for (int q = 0; q < DM_CACHE_NQ; q++) {
+				dm_cblk_t	*cb, *next;
+
+				for (cb = cs->cs_q[q].cl_head; cb != NULL;
+				    cb = next) {
+					next = cb->cb_next;
+					if (cb->cb_dev != dev ||
+					    cb->cb_blk < blk ||
+					    cb->cb_blk - blk >= n)
+						continue;
+					dm_cache_unlink(cs, cb);
+					cs->cs_invals++;
+				}
+			}
+			mutex_exit(&cs->cs_lock);
+		}
+		return;
+	}
+
+	for (uint64_t r = r0; r <= r1; r++) {
+		dm_cstripe_t	*cs = dm_cache_stripe(dev, r);
+		uint64_t	s = MAX(blk, r << DM_CACHE_RSHIFT);
+		uint64_t	e = MIN(blk + n, (r + 1) << DM_CACHE_RSHIFT);
+
+		mutex_enter(&cs->cs_lock);
+		cs->cs_gen++;
+		for (uint64_t b = s; b < e; b++) {
+			dm_cblk_t	*cb;
+
+			if ((cb = dm_cache_lookup(cs, dev, b)) != NULL) {
+				dm_cache_unlink(cs, cb);
+				cs->cs_invals++;
+			}
+		}
+		mutex_exit(&cs->cs_lock);
+	}
+}
+
+static boolean_t
+dm_cache_mapped(struct buf *bp)
+{
+	return ((bp->b_flags & (B_PAGEIO | B_PHYS)) == 0 ||
+	    (bp->b_flags & B_REMAPPED) != 0);
+}
+
+/*
+ * Are all of the blocks there?  Only a miss is counted, dm_cache_hit()
+ * counts the rest once the buf is mapped in.
+ */
+static boolean_t
+dm_cache_present(dev_t dev, uint64_t blk, uint64_t n)
+{
+	dm_cstripe_t	*cs;
+	uint64_t	i;
+
+	for (i = 0; i < n; i++) {
+		dm_cblk_t	*cb;
+
+		cs = dm_cache_stripe(dev, (blk + i) >> DM_CACHE_RSHIFT);
+		mutex_enter(&cs->cs_lock);
+		cb = dm_cache_lookup(cs, dev, blk + i);
+		mutex_exit(&cs->cs_lock);
+		if (cb == NULL || cb->cb_data == NULL)
+			break;
+	}
+	if (i == n)
+		return (B_TRUE);
+
+	cs = dm_cache_stripe(dev, blk >> DM_CACHE_RSHIFT);
+	mutex_enter(&cs->cs_lock);
+	cs->cs_misses++;
+	mutex_exit(&cs->cs_lock);
+
+	return (B_FALSE);
+}
+
+/* Serve a mapped in read from the cache, B_TRUE if all of it was there */
+static boolean_t
+dm_cache_hit(struct buf *bp, dev_t dev, uint64_t blk, uint64_t n)
+{
+	dm_cstripe_t	*cs;
+	uint64_t	i;
+
+	for (i = 0; i < n; i++) {
+		dm_cblk_t	*cb;
+
+		cs = dm_cache_stripe(dev, (blk + i) >> DM_CACHE_RSHIFT);
+		mutex_enter(&cs->cs_lock);
+		if ((cb = dm_cache_lookup(cs, dev, blk + i)) == NULL ||
+		    cb->cb_data == NULL) {
+			mutex_exit(&cs->cs_lock);
+			break;
+		}
+		bcopy(cb->cb_data, bp->b_un.b_addr + (i << DM_CACHE_BSHIFT),
+		    DM_CACHE_BSIZE);
+		if (cb->cb_q == DM_CACHE_AM) {
+			dm_clist_remove(&cs->cs_q[DM_CACHE_AM], cb);
+			dm_clist_push(&cs->cs_q[DM_CACHE_AM], cb);
+		}
+		mutex_exit(&cs->cs_lock);
+	}
+
+	cs = dm_cache_stripe(dev, blk >> DM_CACHE_RSHIFT);
+	mutex_enter(&cs->cs_lock);
+	if (i == n)
+		cs->cs_hits++;
+	else
+		cs->cs_misses++;
+	mutex_exit(&cs->cs_lock);
+
+	return (i == n);
+}
+
+/* Give the memory taken back a while after the last reclaim */
+static void
+dm_cache_regrow(void)
+{
+	clock_t	now = ddi_get_lbolt();
+
+	if (dm_cache_target >= dm_cache_size ||
+	    now - dm_cache_reclaimed <
+	    drv_usectohz(DM_CACHE_REGROW * MICROSEC) ||
+	    now - dm_cache_grown < drv_usectohz(MICROSEC))
+		return;
+
+	dm_cache_grown = now;
+	dm_cache_target = MIN(dm_cache_target + dm_cache_size / 16,
+	    dm_cache_size);
+}
+
+static void
+dm_cache_finish(struct buf *bp)
+{
+	dm_cio_t	*ci = bp->b_private;
+
+	bp->b_iodone = ci->ci_iodone;
+	bp->b_private = ci->ci_private;
+	kmem_cache_free(dm_cio_cache, ci);
+	biodone(bp);
+}
+
+/* Taskq: copy what a read that missed brought in, it needs mapping in */
+static void
+dm_cache_fill(void *arg)
+{
+	struct buf	*bp = arg;
+	dm_cio_t	*ci = bp->b_private;
+	boolean_t	mapped = dm_cache_mapped(bp);
+	uint64_t	r0 = ci->ci_blk >> DM_CACHE_RSHIFT;
+
+	dm_cache_regrow();
+
+	bp_mapin(bp);
+	for (uint64_t i = 0; i < ci->ci_nblks; i++) {
+		uint64_t	blk = ci->ci_blk + i;
+		uint64_t	r = blk >> DM_CACHE_RSHIFT;
+		dm_cstripe_t	*cs = dm_cache_stripe(ci->ci_dev, r);
+		caddr_t		data;
+
+		if ((data = kmem_cache_alloc(dm_cdata_cache, KM_NOSLEEP)) ==
+		    NULL)
+			break;
+		bcopy(bp->b_un.b_addr + (i << DM_CACHE_BSHIFT), data,
+		    DM_CACHE_BSIZE);
+
+		mutex_enter(&cs->cs_lock);
+		if (cs->cs_gen == ci->ci_gens[r - r0])
+			dm_cache_insert(cs, ci->ci_dev, blk, data);
+		else
+			kmem_cache_free(dm_cdata_cache, data);
+		mutex_exit(&cs->cs_lock);
+	}
+	if (!mapped)
+		bp_mapout(bp);
+
+	dm_cache_finish(bp);
+}
+
+/*
+ * Taskq: serve a read that was not mapped in, hooked as for a miss.  If
+ * the blocks went meanwhile it goes to the device and fills the cache.
+ */
+static void
+dm_cache_serve(void *arg)
+{
+	struct buf	*bp = arg;
+	dm_cio_t	*ci = bp->b_private;
+
+	bp_mapin(bp);
+	if (dm_cache_hit(bp, ci->ci_dev, ci->ci_blk, ci->ci_nblks)) {
+		bp_mapout(bp);
+		bp->b_resid = 0;
+		dm_cache_finish(bp);
+		return;
+	}
+	bp_mapout(bp);
+	(void) ldi_strategy(ci->ci_lh, bp);
+}
+
+static int
+dm_cache_iodone(struct buf *bp)
+{
+	dm_cio_t	*ci = bp->b_private;
+
+	if (bp->b_flags & B_READ) {
+		if (geterror(bp) == 0 && bp->b_resid == 0 &&
+		    ddi_taskq_dispatch(dm_cache_tq, dm_cache_fill, bp,
+		    DDI_NOSLEEP) == DDI_SUCCESS)
+			return (0);
+	} else {
+		dm_cache_drop(ci->ci_dev, ci->ci_blk, ci->ci_nblks);
+	}
+
+	dm_cache_finish(bp);
+
+	return (0);
+}
+
+/*
+ * I/O on its way to backing device lh.  Returns B_TRUE if the cache has
+ * taken it, completed or to be completed, otherwise it is the caller's to
+ * issue, with its completion hooked if the cache wants to see it.  Never
+ * maps the buf in or blocks, it may be called from dpo_mapio() or an
+ * interrupt.
+ */
+boolean_t
+dm_cache_io(ldi_handle_t lh, struct buf *bp)
+{
+	uint64_t	off = ldbtob(bp->b_lblkno);
+	uint64_t	blk = off >> DM_CACHE_BSHIFT;
+	dev_t		dev = bp->b_edev;
+	dm_cio_t	*ci;
+	uint64_t	n;
+	boolean_t	mapped = B_TRUE;
+
+	if (dm_cache_stripes == NULL || bp->b_bcount == 0)
+		return (B_FALSE);
+
+	if (bp->b_flags & B_READ) {
+		if (((off | bp->b_bcount) & (DM_CACHE_BSIZE - 1)) != 0 ||
+		    bp->b_bcount > MIN(dm_cache_maxio,
+		    DM_CACHE_MAXBLKS * DM_CACHE_BSIZE))
+			return (B_FALSE);
+		n = bp->b_bcount >> DM_CACHE_BSHIFT;
+		mapped = dm_cache_mapped(bp);
+		if (mapped && dm_cache_hit(bp, dev, blk, n)) {
+			bp->b_resid = 0;
+			biodone(bp);
+			return (B_TRUE);
+		}
+
+		if ((ci = kmem_cache_alloc(dm_cio_cache, KM_NOSLEEP)) == NULL)
+			return (B_FALSE);
+		for (uint64_t r = blk >> DM_CACHE_RSHIFT;
+		    r <= (blk + n - 1) >> DM_CACHE_RSHIFT; r++) {
+			dm_cstripe_t	*cs = dm_cache_stripe(dev, r);
+
+			mutex_enter(&cs->cs_lock);
+			ci->ci_gens[r - (blk >> DM_CACHE_RSHIFT)] = cs->cs_gen;
+			mutex_exit(&cs->cs_lock);
+		}
+	} else {
+		/*
+		 * Without seeing it complete the cache could go stale; if
+		 * that cannot be arranged, drop what it overlaps and let it
+		 * through rather than fail it.
+		 */
+		n = howmany(off + bp->b_bcount, DM_CACHE_BSIZE) - blk;
+		if ((ci = kmem_cache_alloc(dm_cio_cache, KM_NOSLEEP)) == NULL) {
+			dm_cache_invalidate(dev, off, bp->b_bcount);
+			return (B_FALSE);
+		}
+		dm_cache_drop(dev, blk, n);
+	}
+
+	ci->ci_iodone = bp->b_iodone;
+	ci->ci_private = bp->b_private;
+	ci->ci_dev = dev;
+	ci->ci_blk = blk;
+	ci->ci_nblks = n;
+	ci->ci_lh = lh;
+	bp->b_iodone = dm_cache_iodone;
+	bp->b_private = ci;
+
+	/* Mapping the buf in may sleep, a hit is copied in on the taskq */
+	if (!mapped && dm_cache_present(dev, blk, n) &&
+	    ddi_taskq_dispatch(dm_cache_tq, dm_cache_serve, bp,
+	    DDI_NOSLEEP) == DDI_SUCCESS)
+		return (B_TRUE);
+
+	return (B_FALSE);
+}
+
+/* Bytes [off, off + len) of dev changed other than by a write */
+void
+dm_cache_invalidate(dev_t dev, uint64_t off, uint64_t len)
+{
+	uint64_t	blk = off >> DM_CACHE_BSHIFT;
+
+	if (len != 0)
+		dm_cache_drop(dev, blk, howmany(off + len, DM_CACHE_BSIZE) -
+		    blk);
+}
+
+/* The device is being let go of */
+void
+dm_cache_purge(dev_t dev)
+{
+	dm_cache_drop(dev, 0, UINT64_MAX);
+}
+
+/* kmem is short of memory: use an eighth less and give it back */
+/*ARGSUSED*/
+static void
+dm_cache_reclaim(void *arg)
+{
+	dm_cache_target = MAX(dm_cache_target - dm_cache_target / 8,
+	    dm_cache_size / 16);
+	dm_cache_reclaimed = ddi_get_lbolt();
+
+	for (int i = 0; i < DM_CACHE_STRIPES; i++) {
+		dm_cstripe_t	*cs = &dm_cache_stripes[i];
+
+		mutex_enter(&cs->cs_lock);
+		dm_cache_trim(cs);
+		mutex_exit(&cs->cs_lock);
+	}
+}
+
+/* Cache counters, added to every mapping's DM_GET_STATS */
+void
+dm_cache_stats(nvlist_t *nvl)
+{
+	uint64_t	c[6] = { 0 };
+
+	if (dm_cache_stripes == NULL)
+		return;
+
+	for (int i = 0; i < DM_CACHE_STRIPES; i++) {
+		dm_cstripe_t	*cs = &dm_cache_stripes[i];
+
+		mutex_enter(&cs->cs_lock);
+		c[0] += cs->cs_hits;
+		c[1] += cs->cs_misses;
+		c[2] += cs->cs_ghosthits;
+		c[3] += cs->cs_inserts;
+		c[4] += cs->cs_evicts;
+		c[5] += cs->cs_invals;
+		mutex_exit(&cs->cs_lock);
+	}
+
+	(void) nvlist_add_uint64(nvl, "cache_size", dm_cache_size);
+	(void) nvlist_add_uint64(nvl, "cache_target", dm_cache_target);
+	(void) nvlist_add_uint64(nvl, "cache_used",
+	    dm_cache_nblks * DM_CACHE_BSIZE);
+	(void) nvlist_add_uint64(nvl, "cache_hits", c[0]);
+	(void) nvlist_add_uint64(nvl, "cache_misses", c[1]);
+	(void) nvlist_add_uint64(nvl, "cache_promoted", c[2]);
+	(void) nvlist_add_uint64(nvl, "cache_inserts", c[3]);
+	(void) nvlist_add_uint64(nvl, "cache_evictions", c[4]);
+	(void) nvlist_add_uint64(nvl, "cache_invalidations", c[5]);
+}
+
+int
+dm_cache_init(dev_info_t *dip)
+{
+	int	mb;
+
+	mb = ddi_prop_get_int(DDI_DEV_T_ANY, dip, DDI_PROP_DONTPASS,
+	    "block-cache", 0);
+	if (mb > 0)
+		dm_cache_size = (size_t)mb << 20;
+	if (dm_cache_size == 0)
+		return (DDI_SUCCESS);
+
+	dm_cache_tq = ddi_taskq_create(dip, "dm_cache", 4, TASKQ_DEFAULTPRI,
+	    0);
+	if (dm_cache_tq == NULL)
+		return (DDI_FAILURE);
+
+	dm_cblk_cache = kmem_cache_create("dm_cblk_cache", sizeof (dm_cblk_t),
+	    0, NULL, NULL, NULL, NULL, NULL, 0);
+	dm_cdata_cache = kmem_cache_create("dm_cdata_cache", DM_CACHE_BSIZE,
+	    DM_CACHE_BSIZE, NULL, NULL, dm_cache_reclaim, NULL, NULL, 0);
+	dm_cio_cache = kmem_cache_create("dm_cio_cache", sizeof (dm_cio_t),
+	    0, NULL, NULL, NULL, NULL, NULL, 0);
+
+	dm_cache_target = dm_cache_size;
+	dm_cache_stripes = kmem_zalloc(DM_CACHE_STRIPES *
+	    sizeof (dm_cstripe_t), KM_SLEEP);
+	for (int i = 0; i < DM_CACHE_STRIPES; i++) {
+		mutex_init(&dm_cache_stripes[i].cs_lock, NULL, MUTEX_DRIVER,
+		    NULL);
+	}
+
+	return (DDI_SUCCESS);
+}
+
+void
+dm_cache_fini(void)
+{
+	dm_cstripe_t	*stripes = dm_cache_stripes;
+
+	if (stripes == NULL)
+		return;
+
+	/* No mappings, so no I/O: only fills may be left */
+	ddi_taskq_wait(dm_cache_tq);
+	ddi_taskq_destroy(dm_cache_tq);
+	dm_cache_tq = NULL;
+
+	for (int i = 0; i < DM_CACHE_STRIPES; i++) {
+		dm_cstripe_t	*cs = &stripes[i];
+
+		mutex_enter(&cs->cs_lock);
+		for (int q = 0; q < DM_CACHE_NQ; q++) {
+			while (cs->cs_q[q].cl_head != NULL)
+				dm_cache_unlink(cs, cs->cs_q[q].cl_head);
+		}
+		mutex_exit(&cs->cs_lock);
+		mutex_destroy(&cs->cs_lock);
+	}
+	dm_cache_stripes = NULL;
+	kmem_free(stripes, DM_CACHE_STRIPES * sizeof (dm_cstripe_t));
+
+	kmem_cache_destroy(dm_cio_cache);
+	kmem_cache_destroy(dm_cdata_cache);
+	kmem_cache_destroy(dm_cblk_cache);
+}
@@ -0,0 +1,258 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright 2011 Grigale Ltd. All rights reserved.
+ * Use is subject to license terms.
+ */
+
+/*
+ * Device Mapper completion queues
+ *
+ * The backing device completes mapped I/O on whichever CPU took its
+ * interrupt.  Completing the caller's buf there drags the caller's cache
+ * lines (the buf, whatever its iodone routine touches, the thread it
+ * wakes) across to that CPU, and across sockets that is expensive.  So the
+ * submitting CPU is recorded with the I/O, and a completion arriving on a
+ * CPU in another locality group is queued to the submitter instead.  Each
+ * CPU has a completion thread, bound to it, that takes the whole queue at
+ * once and completes it in one go; a single wakeup covers however many
+ * completions piled up in the meantime.  Completions arriving in the
+ * submitter's own locality group are done in place, queueing would only
+ * add latency there.
+ *
+ * Threads follow their CPU through offline and online (like squeue
+ * workers do); while a CPU is offline its queue still works, just unbound.
+ * CPUs configured after attach complete in place.
+ */
+
+#include <sys/buf.h>
+#include <sys/cpuvar.h>
+#include <sys/disp.h>
+#include <sys/kmem.h>
+#include <sys/proc.h>
+#include <sys/thread.h>
+#include <sys/types.h>
+#include <sys/ddi.h>
+#include <sys/sunddi.h>
+
+#include <sys/dm.h>
+#include <sys/dm_impl.h>
+
+int	dm_cq_enable = 1;	/* Queue cross-node completions */
+
+typedef struct dm_cq {
+	kmutex_t	cq_lock;
+	kcondvar_t	cq_cv;
+	struct buf	*cq_head;	/* Completions, linked on av_forw */
+	struct buf	*cq_tail;
+	processorid_t	cq_cpu;
+	kthread_t	*cq_thread;
+	boolean_t	cq_bound;
+	boolean_t	cq_exiting;
+	uint64_t	cq_batches;	/* Queue drains */
+	uint64_t	cq_queued;	/* Completions queued */
+} dm_cq_t;
+
+static dm_cq_t	**dm_cqs;	/* Indexed by CPU id, max_ncpus entries */
+
+static void
+dm_cq_thread(void *arg)
+{
+	dm_cq_t		*cq = arg;
+	struct buf	*bp;
+
+	mutex_enter(&cq->cq_lock);
+
+	for (;;) {
+		while (cq->cq_head == NULL && !cq->cq_exiting)
+			cv_wait(&cq->cq_cv, &cq->cq_lock);
+		if (cq->cq_head == NULL)
+			break;
+
+		bp = cq->cq_head;
+		cq->cq_head = cq->cq_tail = NULL;
+		cq->cq_batches++;
+		mutex_exit(&cq->cq_lock);
+
+		while (bp != NULL) {
+			struct buf	*next = bp->av_forw;
+
+			bp->av_forw = NULL;
+			dm_io_complete(bp);
+			bp = next;
+		}
+
+		mutex_enter(&cq->cq_lock);
+	}
+
+	mutex_exit(&cq->cq_lock);
+	thread_exit();
+}
+
+/* Bind or unbind a queue's thread, called with cpu_lock held */
+static void
+dm_cq_bind(dm_cq_t *cq, boolean_t bind)
+{
+	cpu_t	*cp;
+
+	ASSERT(MUTEX_HELD(&cpu_lock));
+
+	if (bind == cq->cq_bound)
+		return;
+
+	if (bind) {
+		if ((cp = cpu_get(cq->cq_cpu)) == NULL || !cpu_is_online(cp))
+			return;
+		thread_affinity_set(cq->cq_thread, cq->cq_cpu);
+	} else {
+		thread_affinity_clear(cq->cq_thread);
+	}
+	cq->cq_bound = bind;
+}
+
+/*ARGSUSED*/
+static int
+dm_cq_cpu_setup(cpu_setup_t what, int id, void *arg)
+{
+	dm_cq_t	*cq;
+
+	ASSERT(MUTEX_HELD(&cpu_lock));
+
+	if (id >= max_ncpus || (cq = dm_cqs[id]) == NULL)
+		return (0);
+
+	switch (what) {
+	case CPU_ON:
+	case CPU_INIT:
+	case CPU_CPUPART_IN:
+		dm_cq_bind(cq, B_TRUE);
+		break;
+	case CPU_UNCONFIG:
+	case CPU_OFF:
+	case CPU_CPUPART_OUT:
+		dm_cq_bind(cq, B_FALSE);
+		break;
+	default:
+		break;
+	}
+
+	return (0);
+}
+
+int
+dm_cq_init(void)
+{
+	dm_cqs = kmem_zalloc(sizeof (dm_cq_t *) * max_ncpus, KM_SLEEP);
+
+	mutex_enter(&cpu_lock);
+	for (processorid_t id = 0; id < max_ncpus; id++) {
+		dm_cq_t	*cq;
+
+		if (cpu_get(id) == NULL)
+			continue;
+
+		cq = kmem_zalloc(sizeof (*cq), KM_SLEEP);
+		mutex_init(&cq->cq_lock, NULL, MUTEX_DRIVER, NULL);
+		cv_init(&cq->cq_cv, NULL, CV_DRIVER, NULL);
+		cq->cq_cpu = id;
+		cq->cq_thread = thread_create(NULL, 0, dm_cq_thread, cq, 0,
+		    &p0, TS_RUN, maxclsyspri);
+		dm_cq_bind(cq, B_TRUE);
+		dm_cqs[id] = cq;
+	}
+	register_cpu_setup_func(dm_cq_cpu_setup, NULL);
+	mutex_exit(&cpu_lock);
+
+	return (DDI_SUCCESS);
+}
+
+void
+dm_cq_fini(void)
+{
+	mutex_enter(&cpu_lock);
+	unregister_cpu_setup_func(dm_cq_cpu_setup, NULL);
+	for (processorid_t id = 0; id < max_ncpus; id++) {
+		if (dm_cqs[id] != NULL)
+			dm_cq_bind(dm_cqs[id], B_FALSE);
+	}
+	mutex_exit(&cpu_lock);
+
+	for (processorid_t id = 0; id < max_ncpus; id++) {
+		dm_cq_t		*cq = dm_cqs[id];
+		kt_did_t	tid;
+
+		if (cq == NULL)
+			continue;
+
+		tid = cq->cq_thread->t_did;
+		mutex_enter(&cq->cq_lock);
+		cq->cq_exiting = B_TRUE;
+		cv_signal(&cq->cq_cv);
+		mutex_exit(&cq->cq_lock);
+		thread_join(tid);
+
+		cv_destroy(&cq->cq_cv);
+		mutex_destroy(&cq->cq_lock);
+		kmem_free(cq, sizeof (*cq));
+	}
+
+	kmem_free(dm_cqs, sizeof (dm_cq_t *) * max_ncpus);
+	dm_cqs = NULL;
+}
+
+/*
+ * Complete a mapped I/O submitted on CPU 'id': here if this CPU is in the
+ * submitter's locality group, on the submitter otherwise.
+ */
+void
+dm_cq_complete(struct buf *bp, processorid_t id)
+{
+	dm_cq_t		*cq;
+	cpu_t		*cp;
+	boolean_t	wake;
+
+	kpreempt_disable();
+	cp = cpu[id];
+	if (!dm_cq_enable || id == CPU->cpu_id || cp == NULL ||
+	    (cq = dm_cqs[id]) == NULL ||
+	    cp->cpu_lpl->lpl_lgrpid == CPU->cpu_lpl->lpl_lgrpid) {
+		kpreempt_enable();
+		dm_io_complete(bp);
+		return;
+	}
+	kpreempt_enable();
+
+	bp->av_forw = NULL;
+	mutex_enter(&cq->cq_lock);
+	wake = (cq->cq_head == NULL);
+	if (wake)
+		cq->cq_head = bp;
+	else
+		cq->cq_tail->av_forw = bp;
+	cq->cq_tail = bp;
+	cq->cq_queued++;
+	mutex_exit(&cq->cq_lock);
+
+	/* Already non-empty: the thread is awake or about to be */
+	if (wake)
+		cv_signal(&cq->cq_cv);
+}
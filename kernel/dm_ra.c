@@ -0,0 +1,531 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright 2011 Grigale Ltd. All rights reserved.
+ * Use is subject to license terms.
+ */
+
+/*
+ * Device Mapper readahead engine
+ *
+ * Every mapping created with readahead enabled keeps a small table of the
+ * read streams it has seen recently.  A stream is a run of reads that are
+ * either back to back or a fixed stride apart.  Once a stream has been
+ * confirmed, reads further along it are prefetched from the backing device
+ * into a kernel buffer with a single large read; the prefetch size starts
+ * small and doubles with every prefetch the stream consumes, up to
+ * dm_ra_max.  Reads that fall into a prefetched buffer are copied out of it
+ * and never reach the backing device, reads that fall into a prefetch that
+ * is still in flight wait for it.
+ *
+ * Writes invalidate any buffered or in-flight data they overlap.
+ *
+ * Memory used for buffers across all the mappings is bounded by
+ * dm_ra_budget, prefetching simply stops while the budget is used up.
+ */
+
+#include <sys/atomic.h>
+#include <sys/buf.h>
+#include <sys/errno.h>
+#include <sys/kmem.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/ddi.h>
+#include <sys/sunddi.h>
+
+#include <sys/dm.h>
+#include <sys/dm_impl.h>
+
+#define	DM_RA_STREAMS	8		/* Streams tracked per mapping */
+#define	DM_RA_TRIGGER	2		/* Pattern hits before prefetching */
+#define	DM_RA_STRIDE	4		/* Max stride, in units of read size */
+
+size_t	dm_ra_min = 128 * 1024;		/* First prefetch size */
+size_t	dm_ra_max = 4 * 1024 * 1024;	/* Largest prefetch size */
+size_t	dm_ra_budget = 64 * 1024 * 1024;	/* All buffers together */
+
+static volatile size_t	dm_ra_used;	/* Memory held by buffers */
+static ddi_taskq_t	*dm_ra_tq;	/* Prefetch completion processing */
+
+typedef struct dm_ra_stream {
+	struct dm_ra	*rs_ra;		/* Owning mapping */
+	uint64_t	rs_last;	/* Offset of the last read */
+	uint64_t	rs_next;	/* Where a sequential read goes */
+	int64_t		rs_stride;	/* Distance between reads, 0: none */
+	uint32_t	rs_hits;	/* Consecutive reads on the pattern */
+	size_t		rs_window;	/* Next prefetch size */
+	hrtime_t	rs_atime;	/* Last use, for replacement */
+
+	caddr_t		rs_buf;		/* Prefetched data */
+	size_t		rs_bufsz;	/* rs_buf allocation size */
+	uint64_t	rs_boff;	/* Device offset of rs_buf */
+	size_t		rs_blen;	/* Valid bytes in rs_buf */
+
+	struct buf	*rs_pbp;	/* Prefetch in flight */
+	caddr_t		rs_pbuf;	/* and its buffer */
+	size_t		rs_pbufsz;
+	uint64_t	rs_poff;
+	size_t		rs_plen;
+	boolean_t	rs_stale;	/* Overwritten while in flight */
+	struct buf	*rs_waiters;	/* Reads waiting for the prefetch */
+} dm_ra_stream_t;
+
+typedef struct dm_ra {
+	dm_info_t	*ra_dmip;
+	kmutex_t	ra_lock;
+	kcondvar_t	ra_cv;		/* Signalled when a prefetch is done */
+	uint32_t	ra_busy;	/* Prefetches not completed yet */
+	dm_ra_stream_t	ra_streams[DM_RA_STREAMS];
+} dm_ra_t;
+
+
+static caddr_t
+dm_ra_buf_alloc(size_t size)
+{
+	caddr_t	buf;
+
+	if (atomic_add_long_nv((ulong_t *)&dm_ra_used, size) > dm_ra_budget) {
+		atomic_add_long((ulong_t *)&dm_ra_used, -(long)size);
+		return (NULL);
+	}
+
+	if ((buf = kmem_alloc(size, KM_NOSLEEP)) == NULL)
+		atomic_add_long((ulong_t *)&dm_ra_used, -(long)size);
+
+	return (buf);
+}
+
+static void
+dm_ra_buf_free(caddr_t buf, size_t size)
+{
+	if (buf == NULL)
+		return;
+
+	kmem_free(buf, size);
+	atomic_add_long((ulong_t *)&dm_ra_used, -(long)size);
+}
+
+/* Drop the prefetched data of the stream */
+static void
+dm_ra_stream_drop(dm_ra_stream_t *rs)
+{
+	dm_ra_buf_free(rs->rs_buf, rs->rs_bufsz);
+	rs->rs_buf = NULL;
+	rs->rs_bufsz = 0;
+	rs->rs_blen = 0;
+}
+
+/*
+ * Copy the part of the prefetch buffer the read asked for.  The read has
+ * been mapped in by dm_ra_read(), before the lock was taken.
+ */
+static void
+dm_ra_copy(dm_ra_stream_t *rs, struct buf *bp)
+{
+	uint64_t	off = ldbtob(bp->b_lblkno);
+
+	bcopy(rs->rs_buf + (off - rs->rs_boff), bp->b_un.b_addr,
+	    bp->b_bcount);
+	bp_mapout(bp);
+	bp->b_resid = 0;
+}
+
+static boolean_t
+dm_ra_covers(uint64_t boff, size_t blen, uint64_t off, size_t len)
+{
+	return (off >= boff && off + len <= boff + blen);
+}
+
+static int dm_ra_iodone(struct buf *);
+
+/*
+ * Set up a prefetch of the stream's window at 'off'.  Called with the
+ * readahead lock held, returns the buf for the caller to issue once it
+ * has dropped the lock, as the completion may run in the same thread.
+ * NULL when out of memory or budget.
+ */
+static struct buf *
+dm_ra_prefetch(dm_ra_t *ra, dm_ra_stream_t *rs, uint64_t off)
+{
+	dm_info_t	*dmip = ra->ra_dmip;
+	struct buf	*pbp;
+	size_t		len;
+
+	ASSERT(MUTEX_HELD(&ra->ra_lock));
+
+	if (rs->rs_pbp != NULL || dmip->suspended || off >= dmip->size)
+		return (NULL);
+
+	len = MIN(rs->rs_window, dmip->size - off);
+	len = P2ALIGN(len, DEV_BSIZE);
+	if (len == 0)
+		return (NULL);
+
+	if ((rs->rs_pbuf = dm_ra_buf_alloc(len)) == NULL)
+		return (NULL);
+	if ((pbp = getrbuf(KM_NOSLEEP)) == NULL) {
+		dm_ra_buf_free(rs->rs_pbuf, len);
+		rs->rs_pbuf = NULL;
+		return (NULL);
+	}
+
+	rs->rs_pbp = pbp;
+	rs->rs_pbufsz = len;
+	rs->rs_poff = off;
+	rs->rs_plen = len;
+	rs->rs_stale = B_FALSE;
+	rs->rs_window = MIN(rs->rs_window * 2, dm_ra_max);
+	ra->ra_busy++;
+
+	pbp->b_flags = B_BUSY | B_READ;
+	pbp->b_un.b_addr = rs->rs_pbuf;
+	pbp->b_bcount = len;
+	pbp->b_lblkno = btodb(off);
+	pbp->b_blkno = btodb(off);
+	pbp->b_edev = dmip->tdev;
+	pbp->b_dev = cmpdev(dmip->tdev);
+	pbp->b_iodone = dm_ra_iodone;
+	pbp->b_private = rs;
+
+	atomic_inc_32(&dmip->inflight);
+
+	return (pbp);
+}
+
+/*
+ * Prefetch completion.  Copying into the waiting reads takes a while, so
+ * the work is passed to the taskq; if the taskq can't take it the waiters
+ * are sent to the device instead.  The prefetch stops counting as busy
+ * only once nothing here touches the stream, dm_ra_destroy() waits for
+ * that.
+ */
+static void
+dm_ra_complete(dm_ra_stream_t *rs, boolean_t usable)
+{
+	dm_ra_t		*ra = rs->rs_ra;
+	dm_info_t	*dmip = ra->ra_dmip;
+	struct buf	*pbp;
+	struct buf	*bp;
+	boolean_t	valid;
+
+	mutex_enter(&ra->ra_lock);
+
+	pbp = rs->rs_pbp;
+	valid = usable && !rs->rs_stale && geterror(pbp) == 0 &&
+	    pbp->b_resid == 0;
+
+	if (valid) {
+		dm_ra_stream_drop(rs);
+		rs->rs_buf = rs->rs_pbuf;
+		rs->rs_bufsz = rs->rs_pbufsz;
+		rs->rs_boff = rs->rs_poff;
+		rs->rs_blen = rs->rs_plen;
+	} else {
+		dm_ra_buf_free(rs->rs_pbuf, rs->rs_pbufsz);
+	}
+	rs->rs_pbp = NULL;
+	rs->rs_pbuf = NULL;
+	rs->rs_pbufsz = 0;
+
+	bp = rs->rs_waiters;
+	rs->rs_waiters = NULL;
+
+	while (bp != NULL) {
+		struct buf	*next = bp->av_forw;
+
+		bp->av_forw = NULL;
+		if (valid && dm_ra_covers(rs->rs_boff, rs->rs_blen,
+		    ldbtob(bp->b_lblkno), bp->b_bcount)) {
+			dm_ra_copy(rs, bp);
+			dm_stat_done(dmip, bp, 0);
+			biodone(bp);
+			dm_io_exit(dmip);
+		} else {
+			bp_mapout(bp);
+			dm_io_start(dmip, bp);
+		}
+		bp = next;
+	}
+
+	mutex_exit(&ra->ra_lock);
+
+	freerbuf(pbp);
+	dm_io_exit(dmip);
+
+	mutex_enter(&ra->ra_lock);
+	if (--ra->ra_busy == 0)
+		cv_broadcast(&ra->ra_cv);
+	mutex_exit(&ra->ra_lock);
+}
+
+static void
+dm_ra_task(void *arg)
+{
+	dm_ra_complete(arg, B_TRUE);
+}
+
+static int
+dm_ra_iodone(struct buf *pbp)
+{
+	dm_ra_stream_t	*rs = pbp->b_private;
+
+	if (ddi_taskq_dispatch(dm_ra_tq, dm_ra_task, rs, DDI_NOSLEEP) !=
+	    DDI_SUCCESS) {
+		dm_ra_complete(rs, B_FALSE);
+	}
+
+	return (0);
+}
+
+/*
+ * Pick the stream the read continues, or recycle the least recently used
+ * idle one for it.  Returns NULL if every stream has a prefetch in flight.
+ */
+static dm_ra_stream_t *
+dm_ra_stream_find(dm_ra_t *ra, uint64_t off, size_t len, boolean_t *newp)
+{
+	dm_ra_stream_t	*victim = NULL;
+
+	*newp = B_FALSE;
+
+	for (int i = 0; i < DM_RA_STREAMS; i++) {
+		dm_ra_stream_t	*rs = &ra->ra_streams[i];
+
+		if (rs->rs_atime == 0)
+			continue;
+
+		/* Sequential, or on the established stride */
+		if (off == rs->rs_next ||
+		    (rs->rs_stride != 0 && off == rs->rs_last + rs->rs_stride))
+			return (rs);
+
+		/* A second read a short stride past the first one */
+		if (rs->rs_hits == 0 && off > rs->rs_next &&
+		    off - rs->rs_last <= DM_RA_STRIDE * len) {
+			rs->rs_stride = off - rs->rs_last;
+			return (rs);
+		}
+	}
+
+	for (int i = 0; i < DM_RA_STREAMS; i++) {
+		dm_ra_stream_t	*rs = &ra->ra_streams[i];
+
+		if (rs->rs_pbp != NULL)
+			continue;
+		if (victim == NULL || rs->rs_atime < victim->rs_atime)
+			victim = rs;
+	}
+
+	if (victim != NULL) {
+		dm_ra_stream_drop(victim);
+		victim->rs_stride = 0;
+		victim->rs_hits = 0;
+		victim->rs_window = dm_ra_min;
+		*newp = B_TRUE;
+	}
+
+	return (victim);
+}
+
+/*
+ * Read side hook, called for every read on a mapping with readahead.
+ * Returns B_TRUE if the read has been taken care of (completed from a
+ * buffer or queued on an in-flight prefetch), B_FALSE if it should go to
+ * the device as usual.  A read that is to be copied into is mapped in
+ * first, with the lock dropped, and the lookup done again.
+ */
+boolean_t
+dm_ra_read(dm_info_t *dmip, struct buf *bp)
+{
+	dm_ra_t		*ra = dmip->ra;
+	dm_ra_stream_t	*rs;
+	uint64_t	off = ldbtob(bp->b_lblkno);
+	size_t		len = bp->b_bcount;
+	boolean_t	mapped = B_FALSE;
+	boolean_t	isnew;
+	struct buf	*pbp = NULL;
+
+	if (len == 0 || len >= dm_ra_max)
+		return (B_FALSE);
+
+retry:
+	mutex_enter(&ra->ra_lock);
+
+	/* Already prefetched, or about to be */
+	for (int i = 0; i < DM_RA_STREAMS; i++) {
+		boolean_t	hit;
+
+		rs = &ra->ra_streams[i];
+		hit = (rs->rs_buf != NULL &&
+		    dm_ra_covers(rs->rs_boff, rs->rs_blen, off, len)) ||
+		    (rs->rs_pbp != NULL && !rs->rs_stale &&
+		    dm_ra_covers(rs->rs_poff, rs->rs_plen, off, len));
+
+		if (hit && !mapped) {
+			mutex_exit(&ra->ra_lock);
+			bp_mapin(bp);
+			mapped = B_TRUE;
+			goto retry;
+		}
+
+		if (rs->rs_buf != NULL &&
+		    dm_ra_covers(rs->rs_boff, rs->rs_blen, off, len)) {
+			dm_ra_copy(rs, bp);
+			rs->rs_last = off;
+			rs->rs_next = off + len;
+			rs->rs_atime = gethrtime();
+
+			/* Keep the pipeline full once past the middle */
+			if (off + len > rs->rs_boff + rs->rs_blen / 2)
+				pbp = dm_ra_prefetch(ra, rs,
+				    rs->rs_boff + rs->rs_blen);
+
+			mutex_exit(&ra->ra_lock);
+			if (pbp != NULL)
+				dm_split_issue(pbp, dmip->lh, &dmip->limits);
+			dm_stat_done(dmip, bp, 0);
+			biodone(bp);
+			dm_io_exit(dmip);
+			return (B_TRUE);
+		}
+
+		if (rs->rs_pbp != NULL && !rs->rs_stale &&
+		    dm_ra_covers(rs->rs_poff, rs->rs_plen, off, len)) {
+			bp->av_forw = rs->rs_waiters;
+			rs->rs_waiters = bp;
+			rs->rs_last = off;
+			rs->rs_next = off + len;
+			rs->rs_atime = gethrtime();
+			mutex_exit(&ra->ra_lock);
+			return (B_TRUE);
+		}
+	}
+
+	/* A miss, see which stream it belongs to */
+	if ((rs = dm_ra_stream_find(ra, off, len, &isnew)) != NULL) {
+		if (isnew) {
+			rs->rs_hits = 0;
+		} else if (++rs->rs_hits >= DM_RA_TRIGGER) {
+			uint64_t	poff = off + len;
+
+			if (rs->rs_stride > (int64_t)len)
+				poff = off + rs->rs_stride;
+			pbp = dm_ra_prefetch(ra, rs, poff);
+		}
+		rs->rs_last = off;
+		rs->rs_next = off + len;
+		rs->rs_atime = gethrtime();
+	}
+
+	mutex_exit(&ra->ra_lock);
+
+	if (pbp != NULL)
+		dm_split_issue(pbp, dmip->lh, &dmip->limits);
+
+	/* Gone meanwhile, the device does not need the mapping */
+	if (mapped)
+		bp_mapout(bp);
+
+	return (B_FALSE);
+}
+
+/* Write side hook, drops whatever the write makes out of date */
+void
+dm_ra_write(dm_info_t *dmip, struct buf *bp)
+{
+	dm_ra_t		*ra = dmip->ra;
+	uint64_t	off = ldbtob(bp->b_lblkno);
+	uint64_t	end = off + bp->b_bcount;
+
+	mutex_enter(&ra->ra_lock);
+
+	for (int i = 0; i < DM_RA_STREAMS; i++) {
+		dm_ra_stream_t	*rs = &ra->ra_streams[i];
+
+		if (rs->rs_buf != NULL && off < rs->rs_boff + rs->rs_blen &&
+		    end > rs->rs_boff)
+			dm_ra_stream_drop(rs);
+
+		if (rs->rs_pbp != NULL && off < rs->rs_poff + rs->rs_plen &&
+		    end > rs->rs_poff)
+			rs->rs_stale = B_TRUE;
+	}
+
+	mutex_exit(&ra->ra_lock);
+}
+
+int
+dm_ra_create(dm_info_t *dmip)
+{
+	dm_ra_t	*ra;
+
+	ra = kmem_zalloc(sizeof (*ra), KM_SLEEP);
+	ra->ra_dmip = dmip;
+	mutex_init(&ra->ra_lock, NULL, MUTEX_DRIVER, NULL);
+	cv_init(&ra->ra_cv, NULL, CV_DRIVER, NULL);
+
+	for (int i = 0; i < DM_RA_STREAMS; i++) {
+		ra->ra_streams[i].rs_ra = ra;
+		ra->ra_streams[i].rs_window = dm_ra_min;
+	}
+
+	dmip->ra = ra;
+
+	return (0);
+}
+
+void
+dm_ra_destroy(dm_info_t *dmip)
+{
+	dm_ra_t	*ra = dmip->ra;
+
+	if (ra == NULL)
+		return;
+
+	mutex_enter(&ra->ra_lock);
+	while (ra->ra_busy != 0)
+		cv_wait(&ra->ra_cv, &ra->ra_lock);
+	for (int i = 0; i < DM_RA_STREAMS; i++)
+		dm_ra_stream_drop(&ra->ra_streams[i]);
+	mutex_exit(&ra->ra_lock);
+
+	cv_destroy(&ra->ra_cv);
+	mutex_destroy(&ra->ra_lock);
+	kmem_free(ra, sizeof (*ra));
+
+	dmip->ra = NULL;
+}
+
+int
+dm_ra_init(dev_info_t *dip)
+{
+	dm_ra_tq = ddi_taskq_create(dip, "dm_ra", 4, TASKQ_DEFAULTPRI, 0);
+
+	return ((dm_ra_tq == NULL) ? (DDI_FAILURE) : (DDI_SUCCESS));
+}
+
+void
+dm_ra_fini(void)
+{
+	ddi_taskq_destroy(dm_ra_tq);
+	dm_ra_tq = NULL;
+}
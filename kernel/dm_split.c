@@ -0,0 +1,291 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright 2011 Grigale Ltd. All rights reserved.
+ * Use is subject to license terms.
+ */
+
+
+/*
+ * Device Mapper I/O splitting
+ *
+ * Targets and the core cut a buf into pieces wherever the layout or the
+ * backing device calls for it.  The pieces are clones sharing the parent's
+ * pages, nothing is copied.  One counter, dropped atomically as pieces
+ * complete (and by whoever cut them once done cutting), tells when the
+ * parent is complete; the first error any piece reports is the parent's.
+ *
+ * The limits of every backing device are learnt when it is opened:
+ * DKIOCINFO gives the largest transfer the driver takes, the media info
+ * its block sizes.  Pieces are cut to fit, on block boundaries.
+ */
+
+#include <sys/atomic.h>
+#include <sys/buf.h>
+#include <sys/conf.h>
+#include <sys/cred.h>
+#include <sys/dkio.h>
+#include <sys/file.h>
+#include <sys/kmem.h>
+#include <sys/sysmacros.h>
+#include <sys/systm.h>
+#include <sys/types.h>
+#include <sys/ddi.h>
+#include <sys/sunddi.h>
+
+#include <sys/dm.h>
+#include <sys/dm_impl.h>
+
+size_t	dm_maxxfer = 0;		/* Cap on transfers, if set */
+
+static kmem_cache_t	*dm_split_cache;
+static kmem_cache_t	*dm_child_cache;
+
+/*ARGSUSED*/
+static int
+dm_child_ctor(void *buf, void *arg, int kmflags)
+{
+	bioinit(&((dm_child_t *)buf)->dc_buf);
+	return (0);
+}
+
+/*ARGSUSED*/
+static void
+dm_child_dtor(void *buf, void *arg)
+{
+	biofini(&((dm_child_t *)buf)->dc_buf);
+}
+
+void
+dm_split_init(void)
+{
+	dm_split_cache = kmem_cache_create("dm_split_cache",
+	    sizeof (dm_split_t), 0, NULL, NULL, NULL, NULL, NULL, 0);
+	dm_child_cache = kmem_cache_create("dm_child_cache",
+	    sizeof (dm_child_t), 0, dm_child_ctor, dm_child_dtor, NULL, NULL,
+	    NULL, 0);
+}
+
+void
+dm_split_fini(void)
+{
+	kmem_cache_destroy(dm_child_cache);
+	kmem_cache_destroy(dm_split_cache);
+}
+
+/* Learn what the device behind lh takes */
+void
+dm_limits_get(ldi_handle_t lh, dm_limits_t *dl)
+{
+	struct dk_minfo_ext	mie;
+	struct dk_minfo		mi;
+	struct dk_cinfo		ci;
+	size_t			max;
+
+	max = (dm_maxxfer != 0) ? dm_maxxfer : (size_t)maxphys;
+	dl->dl_lbsize = DEV_BSIZE;
+	dl->dl_pbsize = DEV_BSIZE;
+	if (ldi_ioctl(lh, DKIOCGMEDIAINFOEXT, (intptr_t)&mie, FKIOCTL, kcred,
+	    NULL) == 0) {
+		dl->dl_lbsize = mie.dki_lbsize;
+		dl->dl_pbsize = mie.dki_pbsize;
+	} else if (ldi_ioctl(lh, DKIOCGMEDIAINFO, (intptr_t)&mi, FKIOCTL,
+	    kcred, NULL) == 0) {
+		dl->dl_lbsize = mi.dki_lbsize;
+		dl->dl_pbsize = mi.dki_lbsize;
+	}
+	if (dl->dl_lbsize < DEV_BSIZE || !ISP2(dl->dl_lbsize))
+		dl->dl_lbsize = DEV_BSIZE;
+	if (dl->dl_pbsize < dl->dl_lbsize || !ISP2(dl->dl_pbsize))
+		dl->dl_pbsize = dl->dl_lbsize;
+
+	if (ldi_ioctl(lh, DKIOCINFO, (intptr_t)&ci, FKIOCTL, kcred,
+	    NULL) == 0 && ci.dki_maxtransfer != 0)
+		max = MIN(max, (size_t)ci.dki_maxtransfer * DEV_BSIZE);
+	dl->dl_maxxfer = MAX(P2ALIGN(max, dl->dl_lbsize), dl->dl_lbsize);
+}
+
+/* Start splitting bp, the caller holds it until dm_split_rele() */
+dm_split_t *
+dm_split_alloc(struct buf *bp, void (*done)(dm_child_t *, void *), void *arg,
+    int kmflags)
+{
+	dm_split_t	*ds;
+
+	if ((ds = kmem_cache_alloc(dm_split_cache, kmflags)) == NULL)
+		return (NULL);
+	ds->ds_bp = bp;
+	ds->ds_pending = 1;
+	ds->ds_error = 0;
+	ds->ds_resid = 0;
+	ds->ds_done = done;
+	ds->ds_arg = arg;
+
+	return (ds);
+}
+
+void
+dm_split_error(dm_split_t *ds, int error)
+{
+	if (error != 0)
+		(void) atomic_cas_32((uint32_t *)&ds->ds_error, 0, error);
+}
+
+/* Keep the parent from completing until a matching dm_split_rele() */
+void
+dm_split_hold(dm_split_t *ds)
+{
+	atomic_inc_32(&ds->ds_pending);
+}
+
+void
+dm_split_rele(dm_split_t *ds)
+{
+	struct buf	*bp = ds->ds_bp;
+
+	if (atomic_dec_32_nv(&ds->ds_pending) != 0)
+		return;
+
+	if (ds->ds_error != 0) {
+		bioerror(bp, ds->ds_error);
+		bp->b_resid = bp->b_bcount;
+	} else {
+		/* Pieces can overlap, as on a mirror */
+		bp->b_resid = (size_t)MIN(ds->ds_resid, bp->b_bcount);
+	}
+	kmem_cache_free(dm_split_cache, ds);
+	biodone(bp);
+}
+
+static int
+dm_child_done(struct buf *cbp)
+{
+	dm_child_t	*dc = (dm_child_t *)cbp;
+	dm_split_t	*ds = dc->dc_split;
+
+	if (ds->ds_done != NULL)
+		ds->ds_done(dc, ds->ds_arg);
+	dm_split_error(ds, geterror(cbp));
+	if (cbp->b_resid != 0)
+		atomic_add_64(&ds->ds_resid, cbp->b_resid);
+	kmem_cache_free(dm_child_cache, dc);
+	dm_split_rele(ds);
+
+	return (0);
+}
+
+/*
+ * Cut the piece at 'off' for 'len' bytes out of the parent, bound for
+ * 'blkno' on 'dev'.  It is the caller's to issue, on dc_lh if it likes.
+ */
+dm_child_t *
+dm_split_child(dm_split_t *ds, size_t off, size_t len, dev_t dev,
+    diskaddr_t blkno, int kmflags)
+{
+	dm_child_t	*dc;
+
+	if ((dc = kmem_cache_alloc(dm_child_cache, kmflags)) == NULL) {
+		dm_split_error(ds, ENOMEM);
+		return (NULL);
+	}
+	(void) bioclone(ds->ds_bp, off, len, dev, (daddr_t)blkno,
+	    dm_child_done, &dc->dc_buf, kmflags);
+	dc->dc_buf.b_lblkno = blkno;
+	dc->dc_buf.b_resid = 0;
+	dc->dc_split = ds;
+	dc->dc_lh = NULL;
+	dc->dc_next = NULL;
+	dc->dc_tag = 0;
+	atomic_inc_32(&ds->ds_pending);
+
+	return (dc);
+}
+
+/* Issue 'len' bytes of the parent from 'off' to 'lh', in pieces it takes */
+void
+dm_split_submit(dm_split_t *ds, size_t off, size_t len, ldi_handle_t lh,
+    dev_t dev, diskaddr_t blkno, const dm_limits_t *dl)
+{
+	while (len != 0) {
+		size_t		n = MIN(len, dl->dl_maxxfer);
+		dm_child_t	*dc;
+
+		if ((dc = dm_split_child(ds, off, n, dev, blkno,
+		    KM_NOSLEEP)) == NULL)
+			return;
+		dm_issue(lh, &dc->dc_buf);
+		off += n;
+		len -= n;
+		blkno += btodb(n);
+	}
+}
+
+/*
+ * Send bp to lh as it is, in pieces if it is more than the device takes.
+ * Without limits (dl NULL) it goes whole.
+ */
+void
+dm_split_issue(struct buf *bp, ldi_handle_t lh, const dm_limits_t *dl)
+{
+	dm_split_t	*ds;
+
+	if (dl == NULL || bp->b_bcount <= dl->dl_maxxfer) {
+		dm_issue(lh, bp);
+		return;
+	}
+
+	if ((ds = dm_split_alloc(bp, NULL, NULL, KM_NOSLEEP)) == NULL) {
+		bioerror(bp, ENOMEM);
+		biodone(bp);
+		return;
+	}
+	dm_split_submit(ds, 0, bp->b_bcount, lh, bp->b_edev, bp->b_lblkno,
+	    dl);
+	dm_split_rele(ds);
+}
+
+/*
+ * Synchronous I/O of 'len' bytes at 'addr' to disk block 'blkno' of one
+ * of the mapping's devices, in pieces it takes.  For target metadata.
+ */
+int
+dm_target_bio(dm_info_t *dmip, ldi_handle_t lh, dev_t dev, caddr_t addr,
+    size_t len, diskaddr_t blkno, int rw)
+{
+	struct buf	*bp;
+	int		rc;
+
+	bp = getrbuf(KM_SLEEP);
+	bp->b_flags = B_BUSY | rw;
+	bp->b_un.b_addr = addr;
+	bp->b_bcount = len;
+	bp->b_lblkno = blkno;
+	bp->b_blkno = (daddr_t)blkno;
+	bp->b_edev = dev;
+	bp->b_dev = cmpdev(dev);
+
+	dm_split_issue(bp, lh, dm_target_limits(dmip, lh));
+	rc = biowait(bp);
+	freerbuf(bp);
+
+	return (rc);
+}
@@ -0,0 +1,244 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright 2011 Grigale Ltd. All rights reserved.
+ * Use is subject to license terms.
+ */
+
+/*
+ * Device Mapper statistics page
+ *
+ * The per-mapping I/O counters live in memory that the control node lets
+ * monitoring tools mmap() read-only (see dm_stat_hdr_t in <sys/dm.h>), so
+ * sampling every mapping costs them nothing but memory reads.  Mappings
+ * take a slot when they are attached and give it back when detached.
+ *
+ * The I/O path updates a slot in place under the mapping's slock, which
+ * serialises the writers; readers have the sequence count.
+ */
+
+#include <sys/atomic.h>
+#include <sys/buf.h>
+#include <sys/ddidevmap.h>
+#include <sys/errno.h>
+#include <sys/kmem.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/ddi.h>
+#include <sys/sunddi.h>
+
+#include <sys/dm.h>
+#include <sys/dm_impl.h>
+
+#define	DM_STAT_HDRSIZE	P2ROUNDUP(sizeof (dm_stat_hdr_t), 64)
+
+int	dm_stat_slots = 1024;		/* Mappings with a slot */
+
+static dev_info_t	*dm_stat_dip;
+static ddi_umem_cookie_t dm_stat_cookie;
+static caddr_t		dm_stat_base;	/* NULL if the page is not there */
+static size_t		dm_stat_size;
+static int		dm_stat_nslots;
+static kmutex_t		dm_stat_lock;	/* Protects slot allocation */
+static uint64_t		dm_stat_gen;
+
+#define	DM_STAT_HDR()	((dm_stat_hdr_t *)dm_stat_base)
+#define	DM_STAT_SLOT(i)	\
+	((dm_stat_slot_t *)(dm_stat_base + DM_STAT_HDRSIZE) + (i))
+
+static void
+dm_stat_begin(dm_stat_slot_t *ds)
+{
+	ds->ds_seq++;
+	membar_producer();
+}
+
+static void
+dm_stat_end(dm_stat_slot_t *ds)
+{
+	membar_producer();
+	ds->ds_seq++;
+}
+
+/* Give a new mapping a slot, if there is one left */
+void
+dm_stat_attach(dm_info_t *dmip, minor_t minor)
+{
+	dm_stat_slot_t	*ds;
+	int		i;
+
+	if (dm_stat_base == NULL)
+		return;
+
+	mutex_enter(&dm_stat_lock);
+	for (i = 0; i < dm_stat_nslots; i++) {
+		if (DM_STAT_SLOT(i)->ds_gen == 0)
+			break;
+	}
+	if (i == dm_stat_nslots) {
+		mutex_exit(&dm_stat_lock);
+		return;
+	}
+
+	ds = DM_STAT_SLOT(i);
+	dm_stat_begin(ds);
+	bzero((caddr_t)ds + sizeof (ds->ds_seq),
+	    sizeof (*ds) - sizeof (ds->ds_seq));
+	ds->ds_gen = ++dm_stat_gen;
+	ds->ds_minor = minor;
+	(void) strlcpy(ds->ds_name, refstr_value(dmip->name),
+	    sizeof (ds->ds_name));
+	dm_stat_end(ds);
+	atomic_inc_64(&DM_STAT_HDR()->sh_gen);
+	dmip->stat = ds;
+	mutex_exit(&dm_stat_lock);
+}
+
+/* The mapping is going, no I/O is left */
+void
+dm_stat_detach(dm_info_t *dmip)
+{
+	dm_stat_slot_t	*ds = dmip->stat;
+
+	if (ds == NULL)
+		return;
+
+	mutex_enter(&dm_stat_lock);
+	dm_stat_begin(ds);
+	ds->ds_gen = 0;
+	ds->ds_name[0] = '\0';
+	dm_stat_end(ds);
+	atomic_inc_64(&DM_STAT_HDR()->sh_gen);
+	dmip->stat = NULL;
+	mutex_exit(&dm_stat_lock);
+}
+
+/* The mapping has taken an I/O */
+void
+dm_stat_start(dm_info_t *dmip)
+{
+	dm_stat_slot_t	*ds = dmip->stat;
+
+	if (ds == NULL)
+		return;
+
+	mutex_enter(&dmip->slock);
+	dm_stat_begin(ds);
+	ds->ds_inflight++;
+	dm_stat_end(ds);
+	mutex_exit(&dmip->slock);
+}
+
+/*
+ * It is done with it, bp is about to be biodone()d.  'start' is when the
+ * target got it, 0 if it never did.
+ */
+void
+dm_stat_done(dm_info_t *dmip, struct buf *bp, hrtime_t start)
+{
+	dm_stat_slot_t	*ds = dmip->stat;
+	uint64_t	bytes = bp->b_bcount - bp->b_resid;
+	hrtime_t	t = (start != 0) ? gethrtime() - start : 0;
+
+	if (ds == NULL)
+		return;
+
+	mutex_enter(&dmip->slock);
+	dm_stat_begin(ds);
+	if (bp->b_flags & B_READ) {
+		ds->ds_rops++;
+		ds->ds_rbytes += bytes;
+		ds->ds_rtime += t;
+	} else {
+		ds->ds_wops++;
+		ds->ds_wbytes += bytes;
+		ds->ds_wtime += t;
+	}
+	if (geterror(bp) != 0)
+		ds->ds_errors++;
+	ds->ds_inflight--;
+	dm_stat_end(ds);
+	mutex_exit(&dmip->slock);
+}
+
+/* devmap(9E) of the control node */
+int
+dm_stat_devmap(devmap_cookie_t dhp, offset_t off, size_t len,
+    size_t *maplen)
+{
+	int	rc;
+
+	if (dm_stat_base == NULL)
+		return (ENXIO);
+	if (off < 0 || off >= dm_stat_size || len > dm_stat_size - off)
+		return (EINVAL);
+
+	len = ptob(btopr(len));
+	rc = devmap_umem_setup(dhp, dm_stat_dip, NULL, dm_stat_cookie, off,
+	    len, PROT_READ | PROT_USER, DEVMAP_DEFAULTS, NULL);
+	if (rc == 0)
+		*maplen = len;
+
+	return (rc);
+}
+
+int
+dm_stat_init(dev_info_t *dip)
+{
+	dm_stat_hdr_t	*sh;
+
+	if (dm_stat_slots <= 0)
+		return (DDI_SUCCESS);
+
+	dm_stat_nslots = dm_stat_slots;
+	dm_stat_size = ptob(btopr(DM_STAT_HDRSIZE +
+	    (size_t)dm_stat_nslots * sizeof (dm_stat_slot_t)));
+	dm_stat_base = ddi_umem_alloc(dm_stat_size, DDI_UMEM_SLEEP,
+	    &dm_stat_cookie);
+	if (dm_stat_base == NULL)
+		return (DDI_FAILURE);
+	dm_stat_dip = dip;
+	mutex_init(&dm_stat_lock, NULL, MUTEX_DRIVER, NULL);
+
+	sh = DM_STAT_HDR();
+	sh->sh_magic = DM_STAT_MAGIC;
+	sh->sh_version = DM_STAT_VERSION;
+	sh->sh_hdrsize = DM_STAT_HDRSIZE;
+	sh->sh_slotsize = sizeof (dm_stat_slot_t);
+	sh->sh_nslots = dm_stat_nslots;
+
+	return (DDI_SUCCESS);
+}
+
+/* No mappings left; nothing maps the page either, the node is closed */
+void
+dm_stat_fini(void)
+{
+	if (dm_stat_base == NULL)
+		return;
+
+	mutex_destroy(&dm_stat_lock);
+	ddi_umem_free(dm_stat_cookie);
+	dm_stat_base = NULL;
+	dm_stat_dip = NULL;
+}
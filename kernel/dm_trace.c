@@ -0,0 +1,186 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright 2011 Grigale Ltd. All rights reserved.
+ * Use is subject to license terms.
+ */
+
+/*
+ * Device Mapper I/O capture
+ *
+ * While a capture is on, every I/O the mapping takes is recorded, with
+ * the time and the I/O in flight, in a ring that "dmadm capture" drains
+ * through DM_GET_TRACE.  A full ring drops new records rather than
+ * overwrite the ones not read yet, and a DM_TRACE_LOST record goes where
+ * they would have been once there is room again, so a trace has its gaps
+ * marked.
+ *
+ * The ring hangs off the mapping and is protected by its slock, like the
+ * statistics slot; the I/O path only takes it while a capture is on.
+ */
+
+#include <sys/buf.h>
+#include <sys/errno.h>
+#include <sys/kmem.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/ddi.h>
+#include <sys/sunddi.h>
+
+#include <sys/dm.h>
+#include <sys/dm_impl.h>
+
+uint32_t	dm_trace_nrecs = 65536;		/* Default ring size */
+uint32_t	dm_trace_maxrecs = 1 << 22;	/* Largest ring allowed */
+
+typedef struct dm_trace {
+	hrtime_t	tr_start;	/* Capture start */
+	uint32_t	tr_nrecs;	/* Ring size */
+	uint64_t	tr_head;	/* Records written */
+	uint64_t	tr_tail;	/* and read */
+	uint64_t	tr_lost;	/* Dropped, not marked yet */
+	uint64_t	tr_dropped;	/* Dropped in all */
+	dm_trace_rec_t	*tr_recs;
+} dm_trace_t;
+
+static void
+dm_trace_lost(dm_trace_t *tr, dm_trace_rec_t *dt, hrtime_t now)
+{
+	dt->dt_time = (uint64_t)(now - tr->tr_start);
+	dt->dt_off = 0;
+	dt->dt_len = (uint32_t)MIN(tr->tr_lost, UINT32_MAX);
+	dt->dt_op = DM_TRACE_LOST;
+	dt->dt_qdepth = 0;
+	tr->tr_lost = 0;
+}
+
+/* Record an I/O */
+void
+dm_trace_io(dm_info_t *dmip, uint16_t op, uint64_t off, uint64_t len)
+{
+	hrtime_t	now = gethrtime();
+	dm_trace_t	*tr;
+	dm_trace_rec_t	*dt;
+
+	mutex_enter(&dmip->slock);
+	if ((tr = dmip->trace) == NULL) {
+		mutex_exit(&dmip->slock);
+		return;
+	}
+	/* Room for the record, and for the mark of a gap before it */
+	if (tr->tr_head - tr->tr_tail + (tr->tr_lost != 0) >= tr->tr_nrecs) {
+		tr->tr_lost++;
+		tr->tr_dropped++;
+		mutex_exit(&dmip->slock);
+		return;
+	}
+
+	if (tr->tr_lost != 0)
+		dm_trace_lost(tr, &tr->tr_recs[tr->tr_head++ % tr->tr_nrecs],
+		    now);
+	dt = &tr->tr_recs[tr->tr_head++ % tr->tr_nrecs];
+	dt->dt_time = (uint64_t)(now - tr->tr_start);
+	dt->dt_off = off;
+	dt->dt_len = (uint32_t)MIN(len, UINT32_MAX);
+	dt->dt_op = op;
+	dt->dt_qdepth = (uint16_t)MIN(dmip->inflight, UINT16_MAX);
+	mutex_exit(&dmip->slock);
+}
+
+/* Record a buf the mapping has taken */
+void
+dm_trace_buf(dm_info_t *dmip, struct buf *bp)
+{
+	dm_trace_io(dmip, (bp->b_flags & B_READ) ? DM_TRACE_READ :
+	    DM_TRACE_WRITE, ldbtob(bp->b_lblkno), bp->b_bcount);
+}
+
+int
+dm_trace_start(dm_info_t *dmip, uint32_t nrecs)
+{
+	dm_trace_t	*tr;
+
+	if (nrecs == 0)
+		nrecs = dm_trace_nrecs;
+	if (nrecs > dm_trace_maxrecs)
+		return (EINVAL);
+
+	tr = kmem_zalloc(sizeof (*tr), KM_SLEEP);
+	tr->tr_nrecs = nrecs;
+	tr->tr_recs = kmem_alloc(nrecs * sizeof (dm_trace_rec_t), KM_SLEEP);
+	tr->tr_start = gethrtime();
+
+	mutex_enter(&dmip->slock);
+	if (dmip->trace != NULL) {
+		mutex_exit(&dmip->slock);
+		kmem_free(tr->tr_recs, nrecs * sizeof (dm_trace_rec_t));
+		kmem_free(tr, sizeof (*tr));
+		return (EBUSY);
+	}
+	dmip->trace = tr;
+	mutex_exit(&dmip->slock);
+
+	return (0);
+}
+
+int
+dm_trace_stop(dm_info_t *dmip)
+{
+	dm_trace_t	*tr;
+
+	mutex_enter(&dmip->slock);
+	tr = dmip->trace;
+	dmip->trace = NULL;
+	mutex_exit(&dmip->slock);
+
+	if (tr == NULL)
+		return (ENXIO);
+
+	kmem_free(tr->tr_recs, tr->tr_nrecs * sizeof (dm_trace_rec_t));
+	kmem_free(tr, sizeof (*tr));
+
+	return (0);
+}
+
+/* Take the next batch of records off the ring */
+int
+dm_trace_get(dm_info_t *dmip, dm_trace_ctl_t *tc)
+{
+	dm_trace_t	*tr;
+	uint32_t	n = 0;
+
+	mutex_enter(&dmip->slock);
+	if ((tr = dmip->trace) == NULL) {
+		mutex_exit(&dmip->slock);
+		return (ENXIO);
+	}
+	while (n < DM_TRACE_BATCH && tr->tr_tail != tr->tr_head)
+		tc->recs[n++] = tr->tr_recs[tr->tr_tail++ % tr->tr_nrecs];
+	/* Drained, the gap at the end can be marked now */
+	if (n < DM_TRACE_BATCH && tr->tr_lost != 0)
+		dm_trace_lost(tr, &tc->recs[n++], gethrtime());
+	tc->count = n;
+	tc->lost = tr->tr_dropped;
+	mutex_exit(&dmip->slock);
+
+	return (0);
+}
@@ -0,0 +1,683 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright 2011 Grigale Ltd. All rights reserved.
+ * Use is subject to license terms.
+ */
+
+
+/*
+ * Device Mapper write-intent bitmaps
+ *
+ * Redundant targets keep one bit per region of the mapping on disk, set
+ * while writes to the region may be in flight, so that after a crash only
+ * the regions with their bit set need to be brought back in sync.
+ *
+ * A write may only go ahead once the bits of its regions are on disk.  Bits
+ * are set in memory as writes arrive and a bitmap thread writes them out
+ * in batches: every write waiting when it starts is covered by one write
+ * of the changed pages (as a single contiguous transfer) and a cache
+ * flush, and writes arriving meanwhile wait for the next batch.  Writes to
+ * regions whose bits are already on disk go straight ahead, which is the
+ * common case.
+ *
+ * Bits are cleared lazily.  Every w_delay the thread looks for regions
+ * that were not written to for a whole period and have nothing in flight,
+ * flushes the mapping's devices so that the data is stable, and clears
+ * them in one batch.  Regions the target still has to resync keep their
+ * bits until it says they are done.
+ *
+ * On disk, from 'start':	header block, then the bitmap pages, one bit
+ * per region, byte-wise little-endian.
+ */
+
+#include <sys/buf.h>
+#include <sys/cred.h>
+#include <sys/disp.h>
+#include <sys/errno.h>
+#include <sys/file.h>
+#include <sys/kmem.h>
+#include <sys/param.h>
+#include <sys/proc.h>
+#include <sys/sysmacros.h>
+#include <sys/systm.h>
+#include <sys/thread.h>
+#include <sys/types.h>
+#include <sys/ddi.h>
+#include <sys/sunddi.h>
+
+#include <sys/dm.h>
+#include <sys/dm_impl.h>
+
+#define	WIB_MAGIC	0x444d574942303031ULL	/* "DMWIB001" */
+#define	WIB_VERSION	1
+#define	WIB_BSIZE	4096
+#define	WIB_DBPB	(WIB_BSIZE / DEV_BSIZE)
+#define	WIB_PGBITS	(WIB_BSIZE * NBBY)	/* Regions per page */
+
+#define	WIB_TEST(map, r)	(((map)[(r) >> 3] >> ((r) & 7)) & 1)
+#define	WIB_SET(map, r)		((map)[(r) >> 3] |= 1 << ((r) & 7))
+#define	WIB_CLEAR(map, r)	((map)[(r) >> 3] &= ~(1 << ((r) & 7)))
+
+int	dm_wib_delay = 5;	/* Seconds a region is idle before clearing */
+
+typedef struct {
+	uint64_t	wh_magic;
+	uint32_t	wh_version;
+	uint32_t	wh_rgshift;	/* log2 of disk blocks per region */
+	uint64_t	wh_nregions;
+	uint64_t	wh_flags;	/* The target's own */
+	uint32_t	wh_pad;
+	uint32_t	wh_sum;		/* Checksum of the above */
+} dm_wib_hdr_t;
+
+struct dm_wib {
+	dm_info_t	*w_dmip;
+	kmutex_t	w_lock;
+	kcondvar_t	w_cv;		/* Batch written */
+	kcondvar_t	w_tcv;		/* Bitmap thread wakeup */
+	ldi_handle_t	w_lh;		/* Where the bitmap lives */
+	dev_t		w_dev;
+	diskaddr_t	w_start;	/* Header, in disk blocks */
+	dm_wib_hdr_t	w_hdr;
+	uint64_t	w_nregions;
+	size_t		w_pages;	/* Bitmap pages */
+
+	uint8_t		*w_map;		/* Bits as they are to be */
+	uint8_t		*w_disk;	/* Bits as they are on disk */
+	uint8_t		*w_stage;	/* Batch being written */
+	uint8_t		*w_recent;	/* Written to this period */
+	uint8_t		*w_snap;	/* ... the last one, while cleaning */
+	uint8_t		*w_resync;	/* Left for the target to resync */
+	ulong_t		*w_pgdirty;	/* Pages changed since written */
+	uint16_t	*w_count;	/* Writes in flight */
+
+	struct buf	*w_wait;	/* Writes waiting for their bits */
+	struct buf	*w_waittail;
+	void		(*w_go)(struct buf *, void *);
+	void		*w_arg;
+	boolean_t	w_busy;		/* Batch being written */
+
+	kthread_t	*w_thread;
+	boolean_t	w_exiting;
+	int		w_error;	/* Bitmap write failed */
+
+	uint64_t	w_batches;	/* Metadata writes */
+	uint64_t	w_waits;	/* Writes that waited for a batch */
+	uint64_t	w_cleared;	/* Bits cleared */
+};
+
+static int
+dm_wib_bio(dm_wib_t *w, caddr_t addr, size_t len, uint64_t blk, int rw)
+{
+	int	rc;
+
+	rc = dm_target_bio(w->w_dmip, w->w_lh, w->w_dev, addr, len,
+	    w->w_start + blk * WIB_DBPB, rw);
+	if (rc == 0 && rw == B_WRITE)
+		rc = dm_target_flush_dev(w->w_dmip, w->w_lh);
+
+	return (rc);
+}
+
+static int
+dm_wib_write_hdr(dm_wib_t *w)
+{
+	caddr_t	blk;
+	int	rc;
+
+	w->w_hdr.wh_sum = dm_cksum(&w->w_hdr, offsetof(dm_wib_hdr_t, wh_sum));
+	blk = kmem_zalloc(WIB_BSIZE, KM_SLEEP);
+	bcopy(&w->w_hdr, blk, sizeof (w->w_hdr));
+	rc = dm_wib_bio(w, blk, WIB_BSIZE, 0, B_WRITE);
+	kmem_free(blk, WIB_BSIZE);
+
+	return (rc);
+}
+
+/* Are all the bits of a write's regions on disk? */
+static boolean_t
+dm_wib_durable(dm_wib_t *w, struct buf *bp)
+{
+	uint32_t	shift = w->w_hdr.wh_rgshift;
+	uint64_t	first = bp->b_lblkno >> shift;
+	uint64_t	last;
+
+	last = (bp->b_lblkno + btodb(bp->b_bcount) - 1) >> shift;
+	for (uint64_t r = first; r <= last; r++) {
+		if (!WIB_TEST(w->w_disk, r))
+			return (B_FALSE);
+	}
+	return (B_TRUE);
+}
+
+/*
+ * Write the changed pages out as one batch and let go of the writes it
+ * covers.  Called and returns with the lock held.
+ */
+static void
+dm_wib_sync(dm_wib_t *w)
+{
+	struct buf	*go = NULL, **gop = &go;
+	struct buf	*bp, **bpp;
+	size_t		lo, hi;
+	int		rc;
+
+	ASSERT(MUTEX_HELD(&w->w_lock));
+
+	while (w->w_busy)
+		cv_wait(&w->w_cv, &w->w_lock);
+
+	for (lo = 0; lo < w->w_pages && !BT_TEST(w->w_pgdirty, lo); lo++)
+		;
+	if (lo < w->w_pages) {
+		for (hi = w->w_pages - 1; !BT_TEST(w->w_pgdirty, hi); hi--)
+			;
+		for (size_t pg = lo; pg <= hi; pg++)
+			BT_CLEAR(w->w_pgdirty, pg);
+		bcopy(w->w_map + lo * WIB_BSIZE, w->w_stage + lo * WIB_BSIZE,
+		    (hi - lo + 1) * WIB_BSIZE);
+		w->w_busy = B_TRUE;
+		mutex_exit(&w->w_lock);
+
+		rc = dm_wib_bio(w, (caddr_t)w->w_stage + lo * WIB_BSIZE,
+		    (hi - lo + 1) * WIB_BSIZE, 1 + lo, B_WRITE);
+
+		mutex_enter(&w->w_lock);
+		w->w_busy = B_FALSE;
+		w->w_batches++;
+		cv_broadcast(&w->w_cv);
+		if (rc == 0) {
+			bcopy(w->w_stage + lo * WIB_BSIZE,
+			    w->w_disk + lo * WIB_BSIZE,
+			    (hi - lo + 1) * WIB_BSIZE);
+		} else if (w->w_error == 0) {
+			/* Better unprotected than stuck */
+			cmn_err(CE_WARN, "dm: %s: write-intent bitmap write "
+			    "failed (%d), a full resync will be needed",
+			    refstr_value(w->w_dmip->name), rc);
+			w->w_error = rc;
+		}
+	}
+
+	/* Whatever is covered now goes */
+	for (bpp = &w->w_wait; (bp = *bpp) != NULL; ) {
+		if (w->w_error != 0 || dm_wib_durable(w, bp)) {
+			*bpp = bp->av_forw;
+			*gop = bp;
+			gop = &bp->av_forw;
+		} else {
+			w->w_waittail = bp;
+			bpp = &bp->av_forw;
+		}
+	}
+	*gop = NULL;
+	if (w->w_wait == NULL)
+		w->w_waittail = NULL;
+
+	if (go != NULL) {
+		mutex_exit(&w->w_lock);
+		while ((bp = go) != NULL) {
+			go = bp->av_forw;
+			bp->av_forw = NULL;
+			w->w_go(bp, w->w_arg);
+		}
+		mutex_enter(&w->w_lock);
+	}
+}
+
+/*
+ * Clear the bits of regions idle for a whole period.  Called and returns
+ * with the lock held.
+ *
+ * A region being cleared has its bit dropped from w_disk as well as from
+ * w_map before the lock is let go, so that a write to it arriving while
+ * the batch is in flight sees it as not on disk, sets it again and waits
+ * for the next batch rather than going ahead under a bit about to be
+ * cleared.
+ */
+static void
+dm_wib_clean(dm_wib_t *w)
+{
+	boolean_t	any = B_FALSE;
+	size_t		nbytes = howmany(w->w_nregions, NBBY);
+
+	ASSERT(MUTEX_HELD(&w->w_lock));
+
+	/* The period just over, the next one starts now */
+	bcopy(w->w_recent, w->w_snap, nbytes);
+	bzero(w->w_recent, nbytes);
+
+	for (size_t i = 0; i < nbytes && !any; i++)
+		any = (w->w_map[i] & ~w->w_snap[i] & ~w->w_resync[i]) != 0;
+	if (!any) {
+		/* Bits set by dm_wib_mark() alone still go out */
+		dm_wib_sync(w);
+		return;
+	}
+
+	/* What was written before now has to be stable first */
+	mutex_exit(&w->w_lock);
+	(void) dm_target_flush(w->w_dmip);
+	mutex_enter(&w->w_lock);
+
+	for (size_t i = 0; i < nbytes; i++) {
+		uint8_t	bits = w->w_map[i] & ~w->w_snap[i] &
+		    ~w->w_recent[i] & ~w->w_resync[i];
+
+		if (bits == 0)
+			continue;
+		for (int b = 0; b < NBBY; b++) {
+			uint64_t	r = i * NBBY + b;
+
+			if (!(bits & (1 << b)) || w->w_count[r] != 0)
+				continue;
+			WIB_CLEAR(w->w_map, r);
+			WIB_CLEAR(w->w_disk, r);
+			BT_SET(w->w_pgdirty, r / WIB_PGBITS);
+			w->w_cleared++;
+		}
+	}
+
+	dm_wib_sync(w);
+}
+
+static void
+dm_wib_thread(void *arg)
+{
+	dm_wib_t	*w = arg;
+	clock_t		last = ddi_get_lbolt();
+
+	mutex_enter(&w->w_lock);
+
+	while (!w->w_exiting) {
+		clock_t	delay = drv_usectohz(MICROSEC) * dm_wib_delay;
+
+		if (w->w_wait == NULL) {
+			(void) cv_reltimedwait(&w->w_tcv, &w->w_lock,
+			    MAX(last + delay - ddi_get_lbolt(), 1),
+			    TR_CLOCK_TICK);
+		}
+		if (w->w_wait != NULL)
+			dm_wib_sync(w);
+		if (ddi_get_lbolt() - last >= delay) {
+			dm_wib_clean(w);
+			last = ddi_get_lbolt();
+		}
+	}
+
+	mutex_exit(&w->w_lock);
+	thread_exit();
+}
+
+/* Bytes of the device a bitmap for 'size' bytes in 'rgshift' regions takes */
+uint64_t
+dm_wib_size(uint64_t size, uint32_t rgshift)
+{
+	uint64_t	nregions = howmany(lbtodb(size), 1ULL << rgshift);
+
+	return ((1 + howmany(nregions, WIB_PGBITS)) * WIB_BSIZE);
+}
+
+static void
+dm_wib_free(dm_wib_t *w)
+{
+	size_t	mapsz = w->w_pages * WIB_BSIZE;
+
+	if (w->w_map != NULL) {
+		kmem_free(w->w_map, mapsz);
+		kmem_free(w->w_disk, mapsz);
+		kmem_free(w->w_stage, mapsz);
+		kmem_free(w->w_recent, mapsz);
+		kmem_free(w->w_snap, mapsz);
+		kmem_free(w->w_resync, mapsz);
+		kmem_free(w->w_pgdirty, BT_SIZEOFMAP(w->w_pages));
+		kmem_free(w->w_count, w->w_nregions * sizeof (uint16_t));
+	}
+	cv_destroy(&w->w_tcv);
+	cv_destroy(&w->w_cv);
+	mutex_destroy(&w->w_lock);
+	kmem_free(w, sizeof (*w));
+}
+
+/*
+ * Open the bitmap for a mapping of 'size' bytes kept at 'start' on lh,
+ * writing a clean one first if 'format' is set ('rgshift' is only used
+ * then).  Writes held for their bits are handed to 'go' when they can
+ * proceed.  Regions dirty on disk are left to the target to resync, see
+ * dm_wib_resync_next().
+ */
+int
+dm_wib_open(dm_info_t *dmip, ldi_handle_t lh, dev_t dev, diskaddr_t start,
+    uint64_t size, uint32_t rgshift, boolean_t format,
+    void (*go)(struct buf *, void *), void *arg, dm_wib_t **wp)
+{
+	dm_wib_t	*w;
+	dm_wib_hdr_t	*wh;
+	caddr_t		blk;
+	size_t		mapsz;
+	int		rc;
+
+	w = kmem_zalloc(sizeof (*w), KM_SLEEP);
+	w->w_dmip = dmip;
+	w->w_lh = lh;
+	w->w_dev = dev;
+	w->w_start = start;
+	w->w_go = go;
+	w->w_arg = arg;
+	mutex_init(&w->w_lock, NULL, MUTEX_DRIVER, NULL);
+	cv_init(&w->w_cv, NULL, CV_DRIVER, NULL);
+	cv_init(&w->w_tcv, NULL, CV_DRIVER, NULL);
+
+	wh = &w->w_hdr;
+	if (format) {
+		wh->wh_magic = WIB_MAGIC;
+		wh->wh_version = WIB_VERSION;
+		wh->wh_rgshift = rgshift;
+		wh->wh_nregions = howmany(lbtodb(size), 1ULL << rgshift);
+	} else {
+		blk = kmem_zalloc(WIB_BSIZE, KM_SLEEP);
+		rc = dm_wib_bio(w, blk, WIB_BSIZE, 0, B_READ);
+		bcopy(blk, wh, sizeof (*wh));
+		kmem_free(blk, WIB_BSIZE);
+		if (rc == 0 && (wh->wh_magic != WIB_MAGIC ||
+		    wh->wh_version != WIB_VERSION || wh->wh_sum !=
+		    dm_cksum(wh, offsetof(dm_wib_hdr_t, wh_sum)) ||
+		    wh->wh_rgshift >= 48 || wh->wh_nregions !=
+		    howmany(lbtodb(size), 1ULL << wh->wh_rgshift)))
+			rc = EINVAL;
+		if (rc != 0) {
+			dm_wib_free(w);
+			return (rc);
+		}
+	}
+
+	w->w_nregions = wh->wh_nregions;
+	w->w_pages = howmany(w->w_nregions, WIB_PGBITS);
+	mapsz = w->w_pages * WIB_BSIZE;
+	w->w_map = kmem_zalloc(mapsz, KM_SLEEP);
+	w->w_disk = kmem_zalloc(mapsz, KM_SLEEP);
+	w->w_stage = kmem_zalloc(mapsz, KM_SLEEP);
+	w->w_recent = kmem_zalloc(mapsz, KM_SLEEP);
+	w->w_snap = kmem_zalloc(mapsz, KM_SLEEP);
+	w->w_resync = kmem_zalloc(mapsz, KM_SLEEP);
+	w->w_pgdirty = kmem_zalloc(BT_SIZEOFMAP(w->w_pages), KM_SLEEP);
+	w->w_count = kmem_zalloc(w->w_nregions * sizeof (uint16_t), KM_SLEEP);
+
+	if (format) {
+		if ((rc = dm_wib_bio(w, (caddr_t)w->w_map, mapsz, 1,
+		    B_WRITE)) == 0)
+			rc = dm_wib_write_hdr(w);
+	} else if ((rc = dm_wib_bio(w, (caddr_t)w->w_map, mapsz, 1,
+	    B_READ)) == 0) {
+		bcopy(w->w_map, w->w_disk, mapsz);
+		bcopy(w->w_map, w->w_resync, mapsz);
+	}
+	if (rc != 0) {
+		dm_wib_free(w);
+		return (rc);
+	}
+
+	w->w_thread = thread_create(NULL, 0, dm_wib_thread, w, 0, &p0, TS_RUN,
+	    minclsyspri);
+	*wp = w;
+
+	return (0);
+}
+
+/*
+ * Close the bitmap once the mapping is idle, leaving only the regions
+ * still to be resynced dirty.
+ */
+void
+dm_wib_close(dm_wib_t *w)
+{
+	kt_did_t	tid = w->w_thread->t_did;
+	size_t		nbytes = howmany(w->w_nregions, NBBY);
+
+	mutex_enter(&w->w_lock);
+	w->w_exiting = B_TRUE;
+	cv_signal(&w->w_tcv);
+	mutex_exit(&w->w_lock);
+	thread_join(tid);
+
+	if (w->w_error == 0 && dm_target_flush(w->w_dmip) == 0) {
+		mutex_enter(&w->w_lock);
+		for (size_t i = 0; i < nbytes; i++) {
+			if (w->w_map[i] != w->w_resync[i]) {
+				w->w_map[i] = w->w_resync[i];
+				BT_SET(w->w_pgdirty, i / WIB_BSIZE);
+			}
+		}
+		dm_wib_sync(w);
+		mutex_exit(&w->w_lock);
+	}
+
+	dm_wib_free(w);
+}
+
+/*
+ * A write to the mapping is about to start.  B_TRUE if it may go ahead,
+ * B_FALSE if it waits for its bits and is handed to the 'go' routine
+ * later.  Every write is to be followed by dm_wib_done().
+ */
+boolean_t
+dm_wib_write(dm_wib_t *w, struct buf *bp)
+{
+	uint32_t	shift = w->w_hdr.wh_rgshift;
+	uint64_t	first = bp->b_lblkno >> shift;
+	uint64_t	last;
+	boolean_t	wait = B_FALSE;
+
+	if (bp->b_bcount == 0)
+		return (B_TRUE);
+	last = (bp->b_lblkno + btodb(bp->b_bcount) - 1) >> shift;
+
+	mutex_enter(&w->w_lock);
+	for (uint64_t r = first; r <= last; r++) {
+		w->w_count[r]++;
+		WIB_SET(w->w_recent, r);
+		if (!WIB_TEST(w->w_map, r)) {
+			WIB_SET(w->w_map, r);
+			BT_SET(w->w_pgdirty, r / WIB_PGBITS);
+		}
+		if (!WIB_TEST(w->w_disk, r))
+			wait = B_TRUE;
+	}
+	if (wait && w->w_error == 0) {
+		bp->av_forw = NULL;
+		if (w->w_waittail != NULL)
+			w->w_waittail->av_forw = bp;
+		else
+			w->w_wait = bp;
+		w->w_waittail = bp;
+		w->w_waits++;
+		cv_signal(&w->w_tcv);
+		mutex_exit(&w->w_lock);
+		return (B_FALSE);
+	}
+	mutex_exit(&w->w_lock);
+
+	return (B_TRUE);
+}
+
+/* A write of 'len' bytes at 'blkno' is done, however it went */
+void
+dm_wib_done(dm_wib_t *w, diskaddr_t blkno, size_t len)
+{
+	uint32_t	shift = w->w_hdr.wh_rgshift;
+
+	if (len == 0)
+		return;
+
+	mutex_enter(&w->w_lock);
+	for (uint64_t r = blkno >> shift;
+	    r <= (blkno + btodb(len) - 1) >> shift; r++) {
+		ASSERT(w->w_count[r] != 0);
+		w->w_count[r]--;
+	}
+	mutex_exit(&w->w_lock);
+}
+
+/* Keep the regions of 'len' bytes at 'blkno' dirty until resynced */
+void
+dm_wib_mark(dm_wib_t *w, diskaddr_t blkno, size_t len)
+{
+	uint32_t	shift = w->w_hdr.wh_rgshift;
+
+	if (len == 0)
+		return;
+
+	mutex_enter(&w->w_lock);
+	for (uint64_t r = blkno >> shift;
+	    r <= (blkno + btodb(len) - 1) >> shift; r++) {
+		WIB_SET(w->w_resync, r);
+		if (!WIB_TEST(w->w_map, r)) {
+			WIB_SET(w->w_map, r);
+			BT_SET(w->w_pgdirty, r / WIB_PGBITS);
+		}
+	}
+	mutex_exit(&w->w_lock);
+}
+
+/*
+ * Wait for the bits of the regions of 'len' bytes at 'blkno' to be on
+ * disk, writing them out if need be.  0, or the error that kept them off.
+ */
+int
+dm_wib_commit(dm_wib_t *w, diskaddr_t blkno, size_t len)
+{
+	uint32_t	shift = w->w_hdr.wh_rgshift;
+	int		rc = 0;
+
+	if (len == 0)
+		return (0);
+
+	mutex_enter(&w->w_lock);
+	dm_wib_sync(w);
+	for (uint64_t r = blkno >> shift;
+	    r <= (blkno + btodb(len) - 1) >> shift; r++) {
+		if (!WIB_TEST(w->w_disk, r)) {
+			rc = (w->w_error != 0) ? w->w_error : EIO;
+			break;
+		}
+	}
+	mutex_exit(&w->w_lock);
+
+	return (rc);
+}
+
+/* The first region from 'r' on still to be resynced, or the region count */
+uint64_t
+dm_wib_resync_next(dm_wib_t *w, uint64_t r)
+{
+	mutex_enter(&w->w_lock);
+	while (r < w->w_nregions && !WIB_TEST(w->w_resync, r)) {
+		if ((r & (NBBY - 1)) == 0 && w->w_resync[r >> 3] == 0)
+			r += NBBY;
+		else
+			r++;
+	}
+	mutex_exit(&w->w_lock);
+
+	return (MIN(r, w->w_nregions));
+}
+
+/* Does a region still have to be resynced?  A hint, taken unlocked */
+boolean_t
+dm_wib_stale(dm_wib_t *w, uint64_t r)
+{
+	return (WIB_TEST(w->w_resync, r) != 0);
+}
+
+/* The region has been resynced, its bit may go once it is idle */
+void
+dm_wib_resynced(dm_wib_t *w, uint64_t r)
+{
+	mutex_enter(&w->w_lock);
+	WIB_CLEAR(w->w_resync, r);
+	mutex_exit(&w->w_lock);
+}
+
+uint32_t
+dm_wib_rgshift(dm_wib_t *w)
+{
+	return (w->w_hdr.wh_rgshift);
+}
+
+uint64_t
+dm_wib_nregions(dm_wib_t *w)
+{
+	return (w->w_nregions);
+}
+
+uint64_t
+dm_wib_flags(dm_wib_t *w)
+{
+	return (w->w_hdr.wh_flags);
+}
+
+/* Record the target's flags in the header, synchronously */
+int
+dm_wib_set_flags(dm_wib_t *w, uint64_t flags)
+{
+	int	rc;
+
+	mutex_enter(&w->w_lock);
+	while (w->w_busy)
+		cv_wait(&w->w_cv, &w->w_lock);
+	w->w_busy = B_TRUE;
+	w->w_hdr.wh_flags = flags;
+	mutex_exit(&w->w_lock);
+
+	rc = dm_wib_write_hdr(w);
+
+	mutex_enter(&w->w_lock);
+	w->w_busy = B_FALSE;
+	cv_broadcast(&w->w_cv);
+	mutex_exit(&w->w_lock);
+
+	return (rc);
+}
+
+void
+dm_wib_stats(dm_wib_t *w, nvlist_t *nvl)
+{
+	uint64_t	dirty = 0;
+	uint64_t	stale = 0;
+
+	mutex_enter(&w->w_lock);
+	for (uint64_t r = 0; r < w->w_nregions; r++) {
+		dirty += WIB_TEST(w->w_disk, r);
+		stale += WIB_TEST(w->w_resync, r);
+	}
+	(void) nvlist_add_uint64(nvl, "wib_regions", w->w_nregions);
+	(void) nvlist_add_uint64(nvl, "wib_region_size",
+	    ldbtob(1ULL << w->w_hdr.wh_rgshift));
+	(void) nvlist_add_uint64(nvl, "wib_dirty", dirty);
+	(void) nvlist_add_uint64(nvl, "wib_resync", stale);
+	(void) nvlist_add_uint64(nvl, "wib_batches", w->w_batches);
+	(void) nvlist_add_uint64(nvl, "wib_waits", w->w_waits);
+	(void) nvlist_add_uint64(nvl, "wib_cleared", w->w_cleared);
+	(void) nvlist_add_int32(nvl, "wib_error", w->w_error);
+	mutex_exit(&w->w_lock);
+}
@@ -0,0 +1,1734 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright 2011 Grigale Ltd. All rights reserved.
+ * Use is subject to license terms.
+ */
+
+/*
+ * Compressing target
+ *
+ * The mapping is cut into fixed logical chunks (64K by default) that are
+ * compressed with LZ4 and stored in as few 4K blocks as they fit in;
+ * chunks that do not shrink by a block at least are stored as they are,
+ * and chunks of zeroes take no space at all.  The device is carved into
+ * 4K blocks:
+ *
+ *	block 0			superblock
+ *	cpstart[0]		checkpoint slot 0 (header, chunk map)
+ *	cpstart[1]		checkpoint slot 1
+ *	jstart			journal
+ *	datastart		data blocks
+ *
+ * The chunk map holds the first block and the stored length of every
+ * chunk, 8 bytes per chunk, and is kept in memory whole along with a bit
+ * per data block telling whether it is in use, which is rebuilt from the
+ * map at mount.  A chunk is never rewritten in place: its new contents go
+ * to free blocks, then a record of where the chunk is now goes to a
+ * circular journal, group committed a block of records at a time as in
+ * the dedup target, and the write completes once that is on the device.
+ * The map is checkpointed to alternate slots, the pages changed since the
+ * slot was last written only, and the journal is replayed from the
+ * position recorded in the newest checkpoint at mount.  Blocks let go of
+ * are not reused before a checkpoint no longer refers to them.
+ *
+ * Chunks are compressed and decompressed on a taskq with a thread per CPU,
+ * each I/O being cut into a task per chunk, so that a large transfer keeps
+ * all of them busy.  Writes covering part of a chunk read, merge and store
+ * it all again; a small cache of decompressed chunks saves the read when
+ * a chunk is written (or read) in pieces.
+ *
+ * Arguments:	[format] [chunk=<KB>] [logical=<MB>] [journal=<KB>]
+ *		[cache=<KB>]
+ *
+ * 'format' initialises the device, chunk, logical and journal are only
+ * used then: logical is the size presented (the physical space by default,
+ * make it larger to get the space compression saves), chunk a power of two
+ * from 8 to 256.  cache is the memory the chunk cache takes.  The mapping
+ * is 4K native: I/O has to be 4K aligned.
+ */
+
+#include <sys/atomic.h>
+#include <sys/bitmap.h>
+#include <sys/buf.h>
+#include <sys/conf.h>
+#include <sys/cred.h>
+#include <sys/disp.h>
+#include <sys/errno.h>
+#include <sys/file.h>
+#include <sys/kmem.h>
+#include <sys/modctl.h>
+#include <sys/proc.h>
+#include <sys/sysmacros.h>
+#include <sys/systm.h>
+#include <sys/thread.h>
+#include <sys/types.h>
+#include <sys/ddi.h>
+#include <sys/sunddi.h>
+
+#include <sys/dm.h>
+#include <sys/dm_impl.h>
+#include <sys/dm_ops.h>
+
+#define	CZ_MAGIC	0x444d434d50523031ULL	/* "DMCMPR01" */
+#define	CZ_CPMAGIC	0x444d434d43503031ULL	/* "DMCMCP01" */
+#define	CZ_JMAGIC	0x444d434d4a4c3031ULL	/* "DMCMJL01" */
+#define	CZ_VERSION	1
+
+#define	CZ_BSIZE	4096
+#define	CZ_BSHIFT	12
+#define	CZ_DBPB		(CZ_BSIZE / DEV_BSIZE)	/* Disk blocks per block */
+#define	CZ_NOBLK	0			/* Unmapped, reads as zeroes */
+#define	CZ_MAPPG	(CZ_BSIZE / sizeof (cz_ent_t))	/* Entries/page */
+#define	CZ_IOMAX	(1024 * 1024)		/* Metadata I/O size */
+
+#define	CZ_CHUNK	64			/* Default chunk size, KB */
+#define	CZ_CHUNK_MIN	8
+#define	CZ_CHUNK_MAX	256
+#define	CZ_CACHE	1024			/* Default chunk cache, KB */
+#define	CZ_CACHE_MIN	4			/* Chunks in the cache */
+#define	CZ_JBLKS	1024			/* Default journal, 4M */
+#define	CZ_JMIN		16
+#define	CZ_RESERVE	256			/* Free blocks kept in hand */
+#define	CZ_NLOCKS	64			/* Chunk locks */
+#define	CZ_CP_SECS	30			/* Checkpoint interval, secs */
+#define	CZ_NOCHUNK	UINT64_MAX
+
+/* LZ4 block format */
+#define	CZ_MINMATCH	4
+#define	CZ_MFLIMIT	12		/* No match starts closer to the end */
+#define	CZ_LASTLIT	5		/* and the last five are literals */
+#define	CZ_MAXOFF	65535
+#define	CZ_HASHLOG	12
+#define	CZ_SKIP		6		/* Misses before stepping faster */
+
+typedef struct {
+	uint64_t	sb_magic;
+	uint32_t	sb_version;
+	uint32_t	sb_cblks;	/* Blocks per chunk */
+	uint64_t	sb_nchunks;	/* Logical chunks */
+	uint64_t	sb_npblks;	/* Data blocks */
+	uint64_t	sb_cpblks;	/* Blocks per checkpoint slot */
+	uint64_t	sb_cpstart[2];	/* First block of checkpoint slots */
+	uint64_t	sb_jstart;	/* First block of the journal */
+	uint64_t	sb_jblks;	/* and its length */
+	uint64_t	sb_datastart;	/* Data block 1 */
+	uint32_t	sb_pad;
+	uint32_t	sb_sum;		/* Checksum of the above */
+} cz_super_t;
+
+typedef struct {
+	uint64_t	cp_magic;
+	uint64_t	cp_seq;		/* Checkpoint sequence number */
+	uint64_t	cp_jseq;	/* First journal block not in it */
+	uint32_t	cp_pad;
+	uint32_t	cp_sum;		/* Checksum of the above */
+} cz_cphdr_t;
+
+/* Where a chunk is: stored raw if ce_len is the chunk size */
+typedef struct {
+	uint32_t	ce_blk;		/* First data block, CZ_NOBLK if none */
+	uint32_t	ce_len;		/* Bytes stored */
+} cz_ent_t;
+
+/* Journal block: header and records, chunk now at jr_ent */
+typedef struct {
+	uint64_t	jh_magic;
+	uint64_t	jh_seq;		/* Journal block sequence number */
+	uint32_t	jh_n;		/* Records */
+	uint32_t	jh_sum;		/* Checksum of the block */
+} cz_jhdr_t;
+
+typedef struct {
+	uint64_t	jr_chunk;
+	cz_ent_t	jr_ent;
+} cz_jrec_t;
+
+#define	CZ_JMAX		\
+	((CZ_BSIZE - sizeof (cz_jhdr_t)) / sizeof (cz_jrec_t))
+
+struct cz;
+struct cz_req;
+
+/* The part of an I/O that falls in one chunk */
+typedef struct {
+	struct cz_req	*t_req;
+	uint64_t	t_chunk;
+	size_t		t_off;		/* Offset in the chunk */
+	size_t		t_len;
+	size_t		t_boff;		/* Offset in the buf */
+	caddr_t		t_addr;		/* Data in the buf, once mapped in */
+} cz_task_t;
+
+/* A mapped I/O, completes when all its chunks are done */
+typedef struct cz_req {
+	struct buf	*q_bp;
+	struct cz	*q_cz;
+	uint32_t	q_pending;
+	int		q_error;
+	size_t		q_ntasks;
+	cz_task_t	q_tasks[1];
+} cz_req_t;
+
+#define	CZ_REQSIZE(n)	(sizeof (cz_req_t) + ((n) - 1) * sizeof (cz_task_t))
+
+typedef struct {
+	caddr_t		j_buf;		/* Header and records */
+	struct buf	*j_bp;		/* Preallocated write buf */
+	uint32_t	j_nreqs;	/* Writes completing with the block */
+	cz_req_t	*j_reqs[CZ_JMAX];
+} cz_jblk_t;
+
+/* Scratch space of a taskq thread */
+typedef struct cz_work {
+	struct cz_work	*w_next;
+	uint32_t	*w_tab;		/* LZ4 match finder */
+	caddr_t		w_ubuf;		/* A chunk uncompressed */
+	caddr_t		w_cbuf;		/* and compressed */
+} cz_work_t;
+
+/* Decompressed chunk cache entry */
+typedef struct {
+	uint64_t	e_chunk;	/* CZ_NOCHUNK if empty */
+	uint32_t	e_blk;		/* Where it was stored */
+	uint32_t	e_ref;		/* Being copied from or to */
+	uint64_t	e_used;		/* Last use, for replacement */
+	caddr_t		e_buf;
+} cz_cent_t;
+
+typedef struct cz {
+	dm_info_t	*c_dmip;
+	kmutex_t	c_lock;
+	kcondvar_t	c_cv;		/* Journal block done, blocks freed */
+	kcondvar_t	c_scv;		/* Syncer wakeup */
+	cz_super_t	c_sb;
+	size_t		c_csize;	/* Chunk size, bytes */
+	int		c_error;	/* Journal write failed, sticky */
+
+	cz_ent_t	*c_map;		/* Chunk map */
+	size_t		c_mappages;
+	ulong_t		*c_dirty[2];	/* Map pages to write to each slot */
+	ulong_t		*c_used;	/* Data blocks in use */
+	ulong_t		*c_pend;	/* Let go of since last checkpoint */
+	ulong_t		*c_freeing;	/* before the one being written */
+	uint64_t	c_nfree;	/* Data blocks not in use */
+	uint64_t	c_npend;	/* Blocks in c_pend */
+	uint64_t	c_nfreeing;	/* and in c_freeing */
+	uint64_t	c_rotor;	/* Free space search start */
+	uint32_t	c_spacewait;	/* Writers waiting for space */
+	uint64_t	c_nmapped;	/* Chunks stored */
+	uint64_t	c_stored;	/* and their bytes */
+
+	cz_jblk_t	c_jblks[2];
+	cz_jblk_t	*c_fill;	/* Collecting records */
+	cz_jblk_t	*c_flight;	/* Being written */
+	boolean_t	c_busy;		/* c_flight in flight */
+	uint64_t	c_jseq;		/* Next journal block */
+	uint64_t	c_cpjseq;	/* Journal start, last checkpoint */
+	uint64_t	c_cpseq;
+	int		c_cpslot;	/* Slot the next checkpoint goes to */
+	boolean_t	c_cpwant;	/* Checkpoint waiting for the journal */
+
+	kmutex_t	c_clocks[CZ_NLOCKS];	/* Chunk I/O, by chunk hash */
+	cz_work_t	*c_work;	/* Free scratch spaces */
+	int		c_nwork;
+	cz_cent_t	*c_cache;
+	int		c_ncache;
+	uint64_t	c_tick;		/* Cache use clock */
+
+	ddi_taskq_t	*c_tq;
+	kthread_t	*c_syncer;
+	boolean_t	c_exiting;
+
+	uint64_t	c_writes;	/* Chunks written */
+	uint64_t	c_rmw;		/* ... in part */
+	uint64_t	c_raw;		/* ... that did not compress */
+	uint64_t	c_zeroes;	/* ... of zeroes */
+	uint64_t	c_hits;		/* Chunk cache hits */
+	uint64_t	c_misses;
+	uint64_t	c_corrupt;	/* Chunks that did not decompress */
+} cz_t;
+
+#define	CZ_JUSED(c)	((c)->c_jseq - (c)->c_cpjseq)
+#define	CZ_NBLKS(len)	howmany(len, CZ_BSIZE)
+
+
+/*
+ * LZ4
+ *
+ * The block format only, the chunk map knows how long a compressed chunk
+ * is.  Greedy matching against a single-entry hash table, the way the
+ * reference implementation does it at its fastest setting.
+ */
+static uint32_t
+cz_load32(const uint8_t *p)
+{
+	return (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+static uint32_t
+cz_lz4_hash(const uint8_t *p)
+{
+	return ((cz_load32(p) * 2654435761U) >> (32 - CZ_HASHLOG));
+}
+
+/* Lengths past the 15 a token holds go on in bytes of 255 */
+static uint8_t *
+cz_lz4_len(uint8_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = (uint8_t)len;
+	return (op);
+}
+
+/* Compress 'n' bytes into at most 'cap', 0 if they do not fit */
+static size_t
+cz_lz4_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap,
+    uint32_t *tab)
+{
+	const uint8_t	*ip = src, *anchor = src;
+	const uint8_t	*iend = src + n;
+	const uint8_t	*mflimit = iend - CZ_MFLIMIT;
+	const uint8_t	*mlimit = iend - CZ_LASTLIT;
+	uint8_t		*op = dst, *oend = dst + cap;
+	uint32_t	miss = 0;
+	size_t		lit;
+
+	bzero(tab, sizeof (uint32_t) << CZ_HASHLOG);
+
+	if (n > CZ_MFLIMIT) {
+		ip++;
+	} else {
+		ip = iend;
+	}
+
+	while (ip < mflimit) {
+		uint32_t	h = cz_lz4_hash(ip);
+		const uint8_t	*ref = src + tab[h];
+		const uint8_t	*mp, *rp;
+		size_t		mlen, off;
+		uint8_t		*tok;
+
+		tab[h] = (uint32_t)(ip - src);
+		if (ref >= ip || ip - ref > CZ_MAXOFF ||
+		    cz_load32(ref) != cz_load32(ip)) {
+			ip += 1 + (miss++ >> CZ_SKIP);
+			continue;
+		}
+		miss = 0;
+
+		/* Grow the match both ways */
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+		mp = ip + CZ_MINMATCH;
+		rp = ref + CZ_MINMATCH;
+		while (mp < mlimit && *mp == *rp) {
+			mp++;
+			rp++;
+		}
+
+		lit = ip - anchor;
+		mlen = mp - ip - CZ_MINMATCH;
+		off = ip - ref;
+		if (op + lit + lit / 255 + mlen / 255 + 5 > oend)
+			return (0);
+
+		tok = op++;
+		*tok = (uint8_t)((MIN(lit, 15) << 4) | MIN(mlen, 15));
+		if (lit >= 15)
+			op = cz_lz4_len(op, lit - 15);
+		bcopy(anchor, op, lit);
+		op += lit;
+		*op++ = (uint8_t)off;
+		*op++ = (uint8_t)(off >> 8);
+		if (mlen >= 15)
+			op = cz_lz4_len(op, mlen - 15);
+
+		ip = anchor = mp;
+	}
+
+	/* Whatever is left goes as literals */
+	lit = iend - anchor;
+	if (op + lit + lit / 255 + 2 > oend)
+		return (0);
+	*op++ = (uint8_t)(MIN(lit, 15) << 4);
+	if (lit >= 15)
+		op = cz_lz4_len(op, lit - 15);
+	bcopy(anchor, op, lit);
+	op += lit;
+
+	return (op - dst);
+}
+
+/* Decompress into at most 'cap' bytes, returns how many or -1 */
+static ssize_t
+cz_lz4_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap)
+{
+	const uint8_t	*ip = src, *iend = src + n;
+	uint8_t		*op = dst, *oend = dst + cap;
+
+	for (;;) {
+		size_t		lit, mlen, off;
+		const uint8_t	*ref;
+		uint8_t		tok, b;
+
+		if (ip >= iend)
+			return (-1);
+		tok = *ip++;
+
+		if ((lit = tok >> 4) == 15) {
+			do {
+				if (ip >= iend)
+					return (-1);
+				lit += (b = *ip++);
+			} while (b == 255);
+		}
+		if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+			return (-1);
+		bcopy(ip, op, lit);
+		ip += lit;
+		op += lit;
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return (-1);
+		off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (off == 0 || off > (size_t)(op - dst))
+			return (-1);
+
+		if ((mlen = tok & 15) == 15) {
+			do {
+				if (ip >= iend)
+					return (-1);
+				mlen += (b = *ip++);
+			} while (b == 255);
+		}
+		mlen += CZ_MINMATCH;
+		if (mlen > (size_t)(oend - op))
+			return (-1);
+
+		/* Byte by byte, the match may overlap what it makes */
+		for (ref = op - off; mlen != 0; mlen--)
+			*op++ = *ref++;
+	}
+
+	return (op - dst);
+}
+
+static boolean_t
+cz_iszero(const void *buf, size_t len)
+{
+	const uint64_t	*p = buf;
+
+	for (size_t i = 0; i < len / sizeof (uint64_t); i++) {
+		if (p[i] != 0)
+			return (B_FALSE);
+	}
+	return (B_TRUE);
+}
+
+/* Synchronous I/O on the backing device, 'blk' in CZ blocks */
+static int
+cz_bio(cz_t *c, caddr_t addr, size_t len, uint64_t blk, int rw)
+{
+	dm_info_t	*dmip = c->c_dmip;
+
+	return (dm_target_bio(dmip, dmip->lh, dmip->tdev, addr, len,
+	    blk * CZ_DBPB, rw));
+}
+
+/* Large metadata transfers, in CZ_IOMAX pieces */
+static int
+cz_bio_big(cz_t *c, caddr_t addr, size_t len, uint64_t blk, int rw)
+{
+	int	rc = 0;
+
+	while (len != 0 && rc == 0) {
+		size_t	n = MIN(len, CZ_IOMAX);
+
+		rc = cz_bio(c, addr, n, blk, rw);
+		addr += n;
+		len -= n;
+		blk += n >> CZ_BSHIFT;
+	}
+
+	return (rc);
+}
+
+static uint64_t
+cz_data_blk(cz_t *c, uint32_t blk)
+{
+	return (c->c_sb.sb_datastart + blk - 1);
+}
+
+/*
+ * Space
+ */
+
+/* Point 'chunk' at 'ent', the blocks it was in wait for a checkpoint */
+static void
+cz_set(cz_t *c, uint64_t chunk, cz_ent_t ent)
+{
+	cz_ent_t	old = c->c_map[chunk];
+	size_t		pg = chunk / CZ_MAPPG;
+
+	ASSERT(MUTEX_HELD(&c->c_lock));
+
+	if (old.ce_blk != CZ_NOBLK) {
+		for (uint32_t i = 0; i < CZ_NBLKS(old.ce_len); i++)
+			BT_SET(c->c_pend, old.ce_blk + i);
+		c->c_npend += CZ_NBLKS(old.ce_len);
+		c->c_nmapped--;
+		c->c_stored -= old.ce_len;
+	}
+	if (ent.ce_blk != CZ_NOBLK) {
+		c->c_nmapped++;
+		c->c_stored += ent.ce_len;
+	}
+	c->c_map[chunk] = ent;
+	BT_SET(c->c_dirty[0], pg);
+	BT_SET(c->c_dirty[1], pg);
+}
+
+/* 'n' free blocks in a row, marked in use, CZ_NOBLK if there are none */
+static uint32_t
+cz_alloc(cz_t *c, uint32_t n)
+{
+	uint64_t	np = c->c_sb.sb_npblks;
+	uint64_t	b = c->c_rotor;
+	uint64_t	start = 0, run = 0;
+
+	ASSERT(MUTEX_HELD(&c->c_lock));
+
+	if (c->c_nfree <= CZ_RESERVE)
+		cv_signal(&c->c_scv);
+	if (c->c_nfree < n)
+		return (CZ_NOBLK);
+
+	for (uint64_t i = 0; i < np + n; i++, b++) {
+		if (b == 0 || b > np) {
+			b = 1;
+			run = 0;
+		}
+		/* Skip words in use whole */
+		if (run == 0 && (b & BT_ULMASK) == 0 && b + BT_NBIPUL <= np &&
+		    c->c_used[b >> BT_ULSHIFT] == ~0UL) {
+			b += BT_NBIPUL - 1;
+			i += BT_NBIPUL - 1;
+			continue;
+		}
+		if (BT_TEST(c->c_used, b)) {
+			run = 0;
+			continue;
+		}
+		if (run++ == 0)
+			start = b;
+		if (run == n) {
+			for (uint64_t j = start; j < start + n; j++)
+				BT_SET(c->c_used, j);
+			c->c_nfree -= n;
+			c->c_rotor = start + n;
+			return ((uint32_t)start);
+		}
+	}
+
+	return (CZ_NOBLK);
+}
+
+/* Give back blocks allocated for a write that did not make it */
+static void
+cz_unalloc(cz_t *c, uint32_t blk, uint32_t n)
+{
+	ASSERT(MUTEX_HELD(&c->c_lock));
+
+	for (uint32_t i = 0; i < n; i++)
+		BT_CLEAR(c->c_used, blk + i);
+	c->c_nfree += n;
+	cv_broadcast(&c->c_cv);
+}
+
+/*
+ * Chunk cache
+ *
+ * Entries are tagged with the chunk and the block it was stored at, so
+ * that one left behind by a rewrite never matches again.  All of them are
+ * only used under the chunk's lock.
+ */
+static cz_cent_t *
+cz_cache_get(cz_t *c, uint64_t chunk, uint32_t blk)
+{
+	cz_cent_t	*e;
+
+	mutex_enter(&c->c_lock);
+	for (int i = 0; i < c->c_ncache; i++) {
+		e = &c->c_cache[i];
+		if (e->e_chunk == chunk && e->e_blk == blk) {
+			e->e_ref++;
+			e->e_used = ++c->c_tick;
+			c->c_hits++;
+			mutex_exit(&c->c_lock);
+			return (e);
+		}
+	}
+	c->c_misses++;
+	mutex_exit(&c->c_lock);
+
+	return (NULL);
+}
+
+static void
+cz_cache_put(cz_t *c, cz_cent_t *e)
+{
+	mutex_enter(&c->c_lock);
+	e->e_ref--;
+	mutex_exit(&c->c_lock);
+}
+
+/* Remember 'chunk' stored at 'blk' is 'data', forget it if data is NULL */
+static void
+cz_cache_fill(cz_t *c, uint64_t chunk, uint32_t blk, caddr_t data)
+{
+	cz_cent_t	*e, *victim = NULL;
+
+	mutex_enter(&c->c_lock);
+	for (int i = 0; i < c->c_ncache; i++) {
+		e = &c->c_cache[i];
+		if (e->e_chunk == chunk) {
+			ASSERT(e->e_ref == 0);
+			e->e_chunk = CZ_NOCHUNK;
+		}
+		if (e->e_ref != 0)
+			continue;
+		if (victim == NULL || (victim->e_chunk != CZ_NOCHUNK &&
+		    (e->e_chunk == CZ_NOCHUNK || e->e_used < victim->e_used)))
+			victim = e;
+	}
+	if (data == NULL || victim == NULL) {
+		mutex_exit(&c->c_lock);
+		return;
+	}
+	victim->e_chunk = CZ_NOCHUNK;
+	victim->e_ref++;
+	mutex_exit(&c->c_lock);
+
+	bcopy(data, victim->e_buf, c->c_csize);
+
+	mutex_enter(&c->c_lock);
+	victim->e_chunk = chunk;
+	victim->e_blk = blk;
+	victim->e_used = ++c->c_tick;
+	victim->e_ref--;
+	mutex_exit(&c->c_lock);
+}
+
+static void
+cz_req_error(cz_req_t *q, int error)
+{
+	if (error != 0)
+		(void) atomic_cas_32((uint32_t *)&q->q_error, 0, error);
+}
+
+static void
+cz_req_rele(cz_req_t *q)
+{
+	struct buf	*bp = q->q_bp;
+
+	if (atomic_dec_32_nv(&q->q_pending) != 0)
+		return;
+
+	if (q->q_error != 0) {
+		bioerror(bp, q->q_error);
+		bp->b_resid = bp->b_bcount;
+	} else {
+		bp->b_resid = 0;
+	}
+	kmem_free(q, CZ_REQSIZE(q->q_ntasks));
+	biodone(bp);
+}
+
+/*
+ * Journal
+ */
+static int cz_journal_done(struct buf *);
+
+/*
+ * Seal the fill block and write it out.  Called with the lock held and no
+ * block in flight; the lock is dropped around issuing it since the
+ * completion may run in this very thread.
+ */
+static void
+cz_journal_issue(cz_t *c)
+{
+	cz_jblk_t	*j = c->c_fill;
+	cz_jhdr_t	*jh = (cz_jhdr_t *)j->j_buf;
+	struct buf	*bp = j->j_bp;
+
+	ASSERT(MUTEX_HELD(&c->c_lock));
+	ASSERT(!c->c_busy && jh->jh_n != 0);
+	ASSERT(CZ_JUSED(c) < c->c_sb.sb_jblks);
+
+	jh->jh_magic = CZ_JMAGIC;
+	jh->jh_seq = c->c_jseq++;
+	jh->jh_sum = 0;
+	jh->jh_sum = dm_cksum(j->j_buf, CZ_BSIZE);
+
+	bioreset(bp);
+	bp->b_flags = B_BUSY | B_WRITE;
+	bp->b_un.b_addr = j->j_buf;
+	bp->b_bcount = CZ_BSIZE;
+	bp->b_lblkno = (c->c_sb.sb_jstart + jh->jh_seq % c->c_sb.sb_jblks) *
+	    CZ_DBPB;
+	bp->b_blkno = bp->b_lblkno;
+	bp->b_edev = c->c_dmip->tdev;
+	bp->b_dev = cmpdev(c->c_dmip->tdev);
+	bp->b_iodone = cz_journal_done;
+	bp->b_private = c;
+
+	c->c_fill = c->c_flight;
+	c->c_flight = j;
+	c->c_busy = B_TRUE;
+
+	mutex_exit(&c->c_lock);
+	dm_split_issue(bp, c->c_dmip->lh, &c->c_dmip->limits);
+	mutex_enter(&c->c_lock);
+}
+
+/* Records on the device, their writes are done */
+static int
+cz_journal_done(struct buf *bp)
+{
+	cz_t		*c = bp->b_private;
+	cz_jblk_t	*j;
+	int		error = geterror(bp);
+
+	mutex_enter(&c->c_lock);
+
+	if (error != 0) {
+		cmn_err(CE_WARN, "dm_compress: %s: journal write failed (%d)",
+		    refstr_value(c->c_dmip->name), error);
+		c->c_error = error;
+	}
+
+	j = c->c_flight;
+	for (uint32_t i = 0; i < j->j_nreqs; i++) {
+		cz_req_error(j->j_reqs[i], error);
+		cz_req_rele(j->j_reqs[i]);
+	}
+	bzero(j->j_buf, CZ_BSIZE);
+	j->j_nreqs = 0;
+	c->c_busy = B_FALSE;
+
+	/* Group commit: whatever piled up meanwhile goes right away */
+	j = c->c_fill;
+	if (c->c_error != 0) {
+		for (uint32_t i = 0; i < j->j_nreqs; i++) {
+			cz_req_error(j->j_reqs[i], c->c_error);
+			cz_req_rele(j->j_reqs[i]);
+		}
+		bzero(j->j_buf, CZ_BSIZE);
+		j->j_nreqs = 0;
+	} else if (((cz_jhdr_t *)j->j_buf)->jh_n != 0) {
+		cz_journal_issue(c);
+	}
+
+	cv_broadcast(&c->c_cv);
+	mutex_exit(&c->c_lock);
+
+	return (0);
+}
+
+/*
+ * Add a record of 'chunk' now being at 'ent' for I/O 'q'.  A new journal
+ * block is not started within two of the checkpointed start, leaving room
+ * for a checkpoint to drain the journal.
+ */
+static int
+cz_journal_add(cz_t *c, uint64_t chunk, cz_ent_t ent, cz_req_t *q)
+{
+	cz_jblk_t	*j;
+	cz_jhdr_t	*jh;
+	cz_jrec_t	*jr;
+
+	ASSERT(MUTEX_HELD(&c->c_lock));
+
+	for (;;) {
+		if (c->c_error != 0)
+			return (c->c_error);
+
+		j = c->c_fill;
+		jh = (cz_jhdr_t *)j->j_buf;
+		if (jh->jh_n == CZ_JMAX) {
+			if (c->c_busy)
+				cv_wait(&c->c_cv, &c->c_lock);
+			else
+				cz_journal_issue(c);
+			continue;
+		}
+		if (jh->jh_n == 0 && CZ_JUSED(c) + 2 >= c->c_sb.sb_jblks) {
+			cv_signal(&c->c_scv);
+			cv_wait(&c->c_cv, &c->c_lock);
+			continue;
+		}
+		break;
+	}
+
+	jr = (cz_jrec_t *)(jh + 1) + jh->jh_n++;
+	jr->jr_chunk = chunk;
+	jr->jr_ent = ent;
+	if (j->j_nreqs == 0 || j->j_reqs[j->j_nreqs - 1] != q) {
+		j->j_reqs[j->j_nreqs++] = q;
+		atomic_inc_32(&q->q_pending);
+	}
+
+	return (0);
+}
+
+/*
+ * Chunk I/O, on the taskq with the chunk's lock held, which keeps the
+ * chunk where it is.
+ */
+
+/* Bytes 'off' to 'off + len' of 'chunk', stored at 'ent', into 'dst' */
+static int
+cz_get(cz_t *c, cz_work_t *w, uint64_t chunk, cz_ent_t ent, size_t off,
+    size_t len, caddr_t dst)
+{
+	cz_cent_t	*e;
+	ssize_t		n;
+	int		rc;
+
+	if (ent.ce_blk == CZ_NOBLK) {
+		bzero(dst, len);
+		return (0);
+	}
+
+	if ((e = cz_cache_get(c, chunk, ent.ce_blk)) != NULL) {
+		bcopy(e->e_buf + off, dst, len);
+		cz_cache_put(c, e);
+		return (0);
+	}
+
+	/* Raw chunks are read from where they are, only what is wanted */
+	if (ent.ce_len == c->c_csize) {
+		return (cz_bio(c, dst, len, cz_data_blk(c, ent.ce_blk) +
+		    (off >> CZ_BSHIFT), B_READ));
+	}
+
+	if ((rc = cz_bio(c, w->w_cbuf, CZ_NBLKS(ent.ce_len) << CZ_BSHIFT,
+	    cz_data_blk(c, ent.ce_blk), B_READ)) != 0)
+		return (rc);
+	n = cz_lz4_decompress((uint8_t *)w->w_cbuf, ent.ce_len,
+	    (uint8_t *)w->w_ubuf, c->c_csize);
+	if (n != (ssize_t)c->c_csize) {
+		atomic_inc_64(&c->c_corrupt);
+		cmn_err(CE_WARN, "dm_compress: %s: chunk %llu is corrupt",
+		    refstr_value(c->c_dmip->name), (u_longlong_t)chunk);
+		return (EIO);
+	}
+
+	cz_cache_fill(c, chunk, ent.ce_blk, w->w_ubuf);
+	if (dst != w->w_ubuf)
+		bcopy(w->w_ubuf + off, dst, len);
+
+	return (0);
+}
+
+static int
+cz_read_chunk(cz_t *c, cz_work_t *w, cz_task_t *t)
+{
+	cz_ent_t	ent;
+
+	mutex_enter(&c->c_lock);
+	ent = c->c_map[t->t_chunk];
+	mutex_exit(&c->c_lock);
+
+	return (cz_get(c, w, t->t_chunk, ent, t->t_off, t->t_len,
+	    t->t_addr));
+}
+
+/*
+ * Compress the chunk as it is to be and store it in free blocks, then
+ * journal where it is now.  A piece of a chunk is merged with the rest
+ * of it first.
+ */
+static int
+cz_write_chunk(cz_t *c, cz_work_t *w, cz_task_t *t)
+{
+	size_t		csize = c->c_csize;
+	caddr_t		src = t->t_addr, out;
+	cz_ent_t	ent = { CZ_NOBLK, 0 };
+	uint32_t	n = 0;
+	size_t		clen;
+	int		rc = 0;
+
+	atomic_inc_64(&c->c_writes);
+	if (t->t_len != csize) {
+		mutex_enter(&c->c_lock);
+		ent = c->c_map[t->t_chunk];
+		mutex_exit(&c->c_lock);
+
+		if ((rc = cz_get(c, w, t->t_chunk, ent, 0, csize,
+		    w->w_ubuf)) != 0)
+			return (rc);
+		bcopy(t->t_addr, w->w_ubuf + t->t_off, t->t_len);
+		src = w->w_ubuf;
+		ent.ce_blk = CZ_NOBLK;
+		ent.ce_len = 0;
+		atomic_inc_64(&c->c_rmw);
+	}
+
+	if (cz_iszero(src, csize)) {
+		atomic_inc_64(&c->c_zeroes);
+		goto commit;
+	}
+
+	/* Stored raw unless that saves a block at least */
+	clen = cz_lz4_compress((uint8_t *)src, csize, (uint8_t *)w->w_cbuf,
+	    csize - CZ_BSIZE, w->w_tab);
+	if (clen == 0) {
+		atomic_inc_64(&c->c_raw);
+		ent.ce_len = (uint32_t)csize;
+		out = src;
+	} else {
+		ent.ce_len = (uint32_t)clen;
+		bzero(w->w_cbuf + clen, P2ROUNDUP(clen, CZ_BSIZE) - clen);
+		out = w->w_cbuf;
+	}
+	n = CZ_NBLKS(ent.ce_len);
+
+	/* Blocks let go of come back with the next checkpoint */
+	mutex_enter(&c->c_lock);
+	while ((ent.ce_blk = cz_alloc(c, n)) == CZ_NOBLK) {
+		if (c->c_npend + c->c_nfreeing == 0 || c->c_error != 0) {
+			rc = ENOSPC;
+			break;
+		}
+		c->c_spacewait++;
+		cv_signal(&c->c_scv);
+		cv_wait(&c->c_cv, &c->c_lock);
+		c->c_spacewait--;
+	}
+	mutex_exit(&c->c_lock);
+	if (rc != 0)
+		return (rc);
+
+	if ((rc = cz_bio(c, out, (size_t)n << CZ_BSHIFT,
+	    cz_data_blk(c, ent.ce_blk), B_WRITE)) != 0) {
+		mutex_enter(&c->c_lock);
+		cz_unalloc(c, ent.ce_blk, n);
+		mutex_exit(&c->c_lock);
+		return (rc);
+	}
+
+commit:
+	mutex_enter(&c->c_lock);
+	while (c->c_cpwant)
+		cv_wait(&c->c_cv, &c->c_lock);
+	if ((rc = cz_journal_add(c, t->t_chunk, ent, t->t_req)) == 0) {
+		cz_set(c, t->t_chunk, ent);
+		if (!c->c_busy)
+			cz_journal_issue(c);
+	} else if (ent.ce_blk != CZ_NOBLK) {
+		cz_unalloc(c, ent.ce_blk, n);
+	}
+	mutex_exit(&c->c_lock);
+
+	/* Pieces written next to this one find the chunk in the cache */
+	cz_cache_fill(c, t->t_chunk, ent.ce_blk,
+	    (rc == 0 && ent.ce_blk != CZ_NOBLK) ? src : NULL);
+
+	return (rc);
+}
+
+static void
+cz_task(void *arg)
+{
+	cz_task_t	*t = arg;
+	cz_req_t	*q = t->t_req;
+	cz_t		*c = q->q_cz;
+	kmutex_t	*cl = &c->c_clocks[t->t_chunk % CZ_NLOCKS];
+	cz_work_t	*w;
+	int		rc;
+
+	mutex_enter(&c->c_lock);
+	while ((w = c->c_work) == NULL)
+		cv_wait(&c->c_cv, &c->c_lock);
+	c->c_work = w->w_next;
+	mutex_exit(&c->c_lock);
+
+	mutex_enter(cl);
+	if (q->q_bp->b_flags & B_READ)
+		rc = cz_read_chunk(c, w, t);
+	else
+		rc = cz_write_chunk(c, w, t);
+	mutex_exit(cl);
+
+	mutex_enter(&c->c_lock);
+	w->w_next = c->c_work;
+	c->c_work = w;
+	cv_broadcast(&c->c_cv);
+	mutex_exit(&c->c_lock);
+
+	cz_req_error(q, rc);
+	cz_req_rele(q);
+}
+
+/*
+ * First on the taskq for every I/O: mapio may not map the buf in, so it
+ * is done here before the chunks are handed out.
+ */
+static void
+cz_start(void *arg)
+{
+	cz_req_t	*q = arg;
+	struct buf	*bp = q->q_bp;
+
+	bp_mapin(bp);
+	for (size_t i = 0; i < q->q_ntasks; i++) {
+		cz_task_t	*t = &q->q_tasks[i];
+
+		t->t_addr = bp->b_un.b_addr + t->t_boff;
+		(void) ddi_taskq_dispatch(q->q_cz->c_tq, cz_task, t,
+		    DDI_SLEEP);
+	}
+	cz_req_rele(q);
+}
+
+/*
+ * Checkpoints
+ *
+ * Called by the syncer thread with the lock held.  The journal is drained
+ * first so that the snapshot covers every record before the position it
+ * gives, the changed pages are copied out and the lock is dropped while
+ * they are written.  The header goes last, once the pages are stable.
+ */
+static void
+cz_checkpoint(cz_t *c)
+{
+	int		slot = c->c_cpslot;
+	ulong_t		*dirty = c->c_dirty[slot];
+	uint64_t	base = c->c_sb.sb_cpstart[slot];
+	size_t		nwords = BT_BITOUL(c->c_sb.sb_npblks + 1);
+	cz_cphdr_t	*cp;
+	caddr_t		stage;
+	size_t		*pages;
+	size_t		ndirty = 0;
+	ulong_t		*tmp;
+	int		rc = 0;
+
+	ASSERT(MUTEX_HELD(&c->c_lock));
+
+	c->c_cpwant = B_TRUE;
+	while (c->c_busy || ((cz_jhdr_t *)c->c_fill->j_buf)->jh_n != 0) {
+		if (c->c_error != 0) {
+			/* The journal is gone, the last checkpoint has to do */
+			c->c_cpwant = B_FALSE;
+			cv_broadcast(&c->c_cv);
+			return;
+		}
+		if (c->c_busy)
+			cv_wait(&c->c_cv, &c->c_lock);
+		else
+			cz_journal_issue(c);
+	}
+
+	for (size_t pg = 0; pg < c->c_mappages; pg++) {
+		if (BT_TEST(dirty, pg))
+			ndirty++;
+	}
+
+	stage = kmem_alloc(MAX(ndirty, 1) * CZ_BSIZE, KM_SLEEP);
+	pages = kmem_alloc(MAX(ndirty, 1) * sizeof (size_t), KM_SLEEP);
+	cp = kmem_zalloc(CZ_BSIZE, KM_SLEEP);
+
+	for (size_t pg = 0, i = 0; pg < c->c_mappages; pg++) {
+		if (!BT_TEST(dirty, pg))
+			continue;
+		bcopy((caddr_t)c->c_map + pg * CZ_BSIZE,
+		    stage + i * CZ_BSIZE, CZ_BSIZE);
+		pages[i++] = pg;
+		BT_CLEAR(dirty, pg);
+	}
+
+	/* Blocks let go of so far are free once this is on the device */
+	tmp = c->c_freeing;
+	c->c_freeing = c->c_pend;
+	c->c_pend = tmp;
+	c->c_nfreeing = c->c_npend;
+	c->c_npend = 0;
+
+	cp->cp_magic = CZ_CPMAGIC;
+	cp->cp_seq = c->c_cpseq + 1;
+	cp->cp_jseq = c->c_jseq;
+	cp->cp_sum = dm_cksum(cp, offsetof(cz_cphdr_t, cp_sum));
+
+	c->c_cpwant = B_FALSE;
+	cv_broadcast(&c->c_cv);
+	mutex_exit(&c->c_lock);
+
+	/* Runs of consecutive pages go out together */
+	for (size_t i = 0; i < ndirty && rc == 0; ) {
+		size_t	j = i + 1;
+
+		while (j < ndirty && pages[j] == pages[j - 1] + 1 &&
+		    (j - i) * CZ_BSIZE < CZ_IOMAX)
+			j++;
+		rc = cz_bio(c, stage + i * CZ_BSIZE, (j - i) * CZ_BSIZE,
+		    base + 1 + pages[i], B_WRITE);
+		i = j;
+	}
+	if (rc == 0) {
+		(void) dm_target_flush_dev(c->c_dmip, c->c_dmip->lh);
+		rc = cz_bio(c, (caddr_t)cp, CZ_BSIZE, base, B_WRITE);
+		(void) dm_target_flush_dev(c->c_dmip, c->c_dmip->lh);
+	}
+
+	mutex_enter(&c->c_lock);
+
+	if (rc == 0) {
+		c->c_cpseq++;
+		c->c_cpslot ^= 1;
+		c->c_cpjseq = cp->cp_jseq;
+
+		for (size_t w = 0; w < nwords; w++) {
+			ulong_t	bits = c->c_freeing[w];
+
+			c->c_freeing[w] = 0;
+			c->c_used[w] &= ~bits;
+		}
+		c->c_nfree += c->c_nfreeing;
+	} else {
+		cmn_err(CE_WARN, "dm_compress: %s: checkpoint failed (%d)",
+		    refstr_value(c->c_dmip->name), rc);
+		for (size_t i = 0; i < ndirty; i++)
+			BT_SET(dirty, pages[i]);
+		for (size_t w = 0; w < nwords; w++) {
+			c->c_pend[w] |= c->c_freeing[w];
+			c->c_freeing[w] = 0;
+		}
+		c->c_npend += c->c_nfreeing;
+	}
+	c->c_nfreeing = 0;
+	cv_broadcast(&c->c_cv);
+
+	kmem_free(cp, CZ_BSIZE);
+	kmem_free(pages, MAX(ndirty, 1) * sizeof (size_t));
+	kmem_free(stage, MAX(ndirty, 1) * CZ_BSIZE);
+}
+
+static void
+cz_syncer(void *arg)
+{
+	cz_t		*c = arg;
+	clock_t		last = ddi_get_lbolt();
+
+	mutex_enter(&c->c_lock);
+
+	while (!c->c_exiting) {
+		(void) cv_reltimedwait(&c->c_scv, &c->c_lock,
+		    drv_usectohz(MICROSEC), TR_CLOCK_TICK);
+
+		if (c->c_error == 0 &&
+		    (CZ_JUSED(c) >= c->c_sb.sb_jblks / 2 ||
+		    (c->c_npend != 0 && (c->c_nfree <= CZ_RESERVE ||
+		    c->c_spacewait != 0)) ||
+		    (CZ_JUSED(c) != 0 && ddi_get_lbolt() - last >=
+		    drv_usectohz(CZ_CP_SECS * MICROSEC)))) {
+			cz_checkpoint(c);
+			last = ddi_get_lbolt();
+		}
+	}
+
+	mutex_exit(&c->c_lock);
+
+	thread_exit();
+}
+
+/*
+ * Format and mount
+ */
+static int
+cz_format(cz_t *c, uint64_t devsize, uint32_t cblks, uint64_t logical,
+    uint64_t jblks)
+{
+	cz_super_t	*sb = &c->c_sb;
+	uint64_t	nblks = devsize >> CZ_BSHIFT;
+	uint64_t	np = nblks, nchunks, cpblks, over;
+	caddr_t		zbuf;
+	cz_cphdr_t	*cp;
+	int		rc = 0;
+
+	if (jblks < CZ_JMIN)
+		return (EINVAL);
+
+	/* Shrink the data blocks until the metadata fits in front */
+	for (;;) {
+		nchunks = (logical != 0) ? logical / ((uint64_t)cblks <<
+		    CZ_BSHIFT) : np / cblks;
+		cpblks = 1 + howmany(nchunks, CZ_MAPPG);
+		over = 1 + 2 * cpblks + jblks;
+		if (over >= nblks)
+			return (ENOSPC);
+		if (np + over <= nblks)
+			break;
+		np = nblks - over;
+	}
+	if (np <= CZ_RESERVE * 4 || nchunks == 0)
+		return (ENOSPC);
+	if (np >= UINT32_MAX || nchunks > (UINT64_MAX >> CZ_BSHIFT) / cblks)
+		return (EINVAL);
+
+	bzero(sb, sizeof (*sb));
+	sb->sb_magic = CZ_MAGIC;
+	sb->sb_version = CZ_VERSION;
+	sb->sb_cblks = cblks;
+	sb->sb_nchunks = nchunks;
+	sb->sb_npblks = np;
+	sb->sb_cpblks = cpblks;
+	sb->sb_cpstart[0] = 1;
+	sb->sb_cpstart[1] = 1 + cpblks;
+	sb->sb_jstart = 1 + 2 * cpblks;
+	sb->sb_jblks = jblks;
+	sb->sb_datastart = sb->sb_jstart + jblks;
+	sb->sb_sum = dm_cksum(sb, offsetof(cz_super_t, sb_sum));
+
+	/* Both slots and the journal cleared */
+	zbuf = kmem_zalloc(CZ_IOMAX, KM_SLEEP);
+	for (uint64_t blk = sb->sb_cpstart[0]; blk < sb->sb_datastart &&
+	    rc == 0; ) {
+		uint64_t	n = MIN(sb->sb_datastart - blk,
+		    CZ_IOMAX >> CZ_BSHIFT);
+
+		rc = cz_bio(c, zbuf, n << CZ_BSHIFT, blk, B_WRITE);
+		blk += n;
+	}
+
+	cp = (cz_cphdr_t *)zbuf;
+	cp->cp_magic = CZ_CPMAGIC;
+	cp->cp_seq = 1;
+	cp->cp_jseq = 1;
+	cp->cp_sum = dm_cksum(cp, offsetof(cz_cphdr_t, cp_sum));
+	if (rc == 0)
+		rc = cz_bio(c, zbuf, CZ_BSIZE, sb->sb_cpstart[0], B_WRITE);
+
+	bzero(zbuf, CZ_BSIZE);
+	bcopy(sb, zbuf, sizeof (*sb));
+	if (rc == 0) {
+		(void) dm_target_flush_dev(c->c_dmip, c->c_dmip->lh);
+		rc = cz_bio(c, zbuf, CZ_BSIZE, 0, B_WRITE);
+		(void) dm_target_flush_dev(c->c_dmip, c->c_dmip->lh);
+	}
+
+	kmem_free(zbuf, CZ_IOMAX);
+
+	return (rc);
+}
+
+static boolean_t
+cz_ent_valid(cz_t *c, cz_ent_t ent)
+{
+	if (ent.ce_blk == CZ_NOBLK)
+		return (ent.ce_len == 0);
+	return (ent.ce_len != 0 && ent.ce_len <= c->c_csize &&
+	    (uint64_t)ent.ce_blk + CZ_NBLKS(ent.ce_len) - 1 <=
+	    c->c_sb.sb_npblks);
+}
+
+/* Apply the journal blocks written after the checkpoint */
+static void
+cz_replay(cz_t *c)
+{
+	caddr_t		buf;
+	cz_jhdr_t	*jh;
+	cz_jrec_t	*jr;
+	uint64_t	n = 0;
+
+	buf = kmem_alloc(CZ_BSIZE, KM_SLEEP);
+	jh = (cz_jhdr_t *)buf;
+	jr = (cz_jrec_t *)(jh + 1);
+
+	while (CZ_JUSED(c) < c->c_sb.sb_jblks) {
+		uint32_t	sum;
+
+		if (cz_bio(c, buf, CZ_BSIZE, c->c_sb.sb_jstart +
+		    c->c_jseq % c->c_sb.sb_jblks, B_READ) != 0)
+			break;
+
+		sum = jh->jh_sum;
+		jh->jh_sum = 0;
+		if (jh->jh_magic != CZ_JMAGIC || jh->jh_seq != c->c_jseq ||
+		    jh->jh_n == 0 || jh->jh_n > CZ_JMAX ||
+		    dm_cksum(buf, CZ_BSIZE) != sum)
+			break;
+
+		for (uint32_t i = 0; i < jh->jh_n; i++) {
+			size_t	pg = jr[i].jr_chunk / CZ_MAPPG;
+
+			if (jr[i].jr_chunk >= c->c_sb.sb_nchunks ||
+			    !cz_ent_valid(c, jr[i].jr_ent))
+				continue;
+			c->c_map[jr[i].jr_chunk] = jr[i].jr_ent;
+			BT_SET(c->c_dirty[0], pg);
+			BT_SET(c->c_dirty[1], pg);
+		}
+
+		c->c_jseq++;
+		n++;
+	}
+
+	if (n != 0) {
+		cmn_err(CE_CONT, "dm_compress: %s: replayed %llu journal "
+		    "blocks\n", refstr_value(c->c_dmip->name),
+		    (u_longlong_t)n);
+	}
+
+	kmem_free(buf, CZ_BSIZE);
+}
+
+/* Work out the blocks in use from the map */
+static void
+cz_scan(cz_t *c)
+{
+	uint64_t	bad = 0;
+
+	for (uint64_t ch = 0; ch < c->c_sb.sb_nchunks; ch++) {
+		cz_ent_t	ent = c->c_map[ch];
+		uint32_t	n = CZ_NBLKS(ent.ce_len);
+		boolean_t	ok = cz_ent_valid(c, ent);
+
+		if (ent.ce_blk == CZ_NOBLK && ok)
+			continue;
+
+		for (uint32_t i = 0; ok && i < n; i++) {
+			if (BT_TEST(c->c_used, ent.ce_blk + i))
+				ok = B_FALSE;
+		}
+		if (!ok) {
+			/* Lost, better than shared with another chunk */
+			bzero(&c->c_map[ch], sizeof (cz_ent_t));
+			BT_SET(c->c_dirty[0], ch / CZ_MAPPG);
+			BT_SET(c->c_dirty[1], ch / CZ_MAPPG);
+			bad++;
+			continue;
+		}
+		for (uint32_t i = 0; i < n; i++)
+			BT_SET(c->c_used, ent.ce_blk + i);
+		c->c_nfree -= n;
+		c->c_nmapped++;
+		c->c_stored += ent.ce_len;
+	}
+
+	if (bad != 0) {
+		cmn_err(CE_WARN, "dm_compress: %s: %llu chunks with bad map "
+		    "entries dropped", refstr_value(c->c_dmip->name),
+		    (u_longlong_t)bad);
+	}
+}
+
+static int
+cz_mount(cz_t *c)
+{
+	cz_super_t	*sb = &c->c_sb;
+	cz_cphdr_t	*cps[2];
+	cz_cphdr_t	*cp = NULL;
+	caddr_t		blk;
+	int		slot = 0;
+	int		rc;
+
+	blk = kmem_zalloc(CZ_BSIZE, KM_SLEEP);
+	if ((rc = cz_bio(c, blk, CZ_BSIZE, 0, B_READ)) != 0) {
+		kmem_free(blk, CZ_BSIZE);
+		return (rc);
+	}
+	bcopy(blk, sb, sizeof (*sb));
+	kmem_free(blk, CZ_BSIZE);
+
+	if (sb->sb_magic != CZ_MAGIC || sb->sb_version != CZ_VERSION ||
+	    sb->sb_sum != dm_cksum(sb, offsetof(cz_super_t, sb_sum)) ||
+	    !ISP2(sb->sb_cblks) ||
+	    sb->sb_cblks < (CZ_CHUNK_MIN << 10) / CZ_BSIZE ||
+	    sb->sb_cblks > (CZ_CHUNK_MAX << 10) / CZ_BSIZE ||
+	    sb->sb_npblks >= UINT32_MAX || sb->sb_jblks < CZ_JMIN ||
+	    sb->sb_datastart + sb->sb_npblks >
+	    (c->c_dmip->size >> CZ_BSHIFT))
+		return (EINVAL);
+	c->c_csize = (size_t)sb->sb_cblks << CZ_BSHIFT;
+
+	/* The newest valid checkpoint wins */
+	for (int i = 0; i < 2; i++) {
+		cps[i] = kmem_zalloc(CZ_BSIZE, KM_SLEEP);
+		if (cz_bio(c, (caddr_t)cps[i], CZ_BSIZE, sb->sb_cpstart[i],
+		    B_READ) != 0 || cps[i]->cp_magic != CZ_CPMAGIC ||
+		    cps[i]->cp_sum != dm_cksum(cps[i],
+		    offsetof(cz_cphdr_t, cp_sum)))
+			continue;
+		if (cp == NULL || cps[i]->cp_seq > cp->cp_seq) {
+			cp = cps[i];
+			slot = i;
+		}
+	}
+	if (cp == NULL) {
+		rc = EINVAL;
+		goto out;
+	}
+
+	c->c_mappages = howmany(sb->sb_nchunks, CZ_MAPPG);
+	c->c_map = kmem_zalloc(c->c_mappages * CZ_BSIZE, KM_SLEEP);
+	c->c_dirty[0] = kmem_zalloc(BT_SIZEOFMAP(c->c_mappages), KM_SLEEP);
+	c->c_dirty[1] = kmem_zalloc(BT_SIZEOFMAP(c->c_mappages), KM_SLEEP);
+	c->c_used = kmem_zalloc(BT_SIZEOFMAP(sb->sb_npblks + 1), KM_SLEEP);
+	c->c_pend = kmem_zalloc(BT_SIZEOFMAP(sb->sb_npblks + 1), KM_SLEEP);
+	c->c_freeing = kmem_zalloc(BT_SIZEOFMAP(sb->sb_npblks + 1), KM_SLEEP);
+
+	if ((rc = cz_bio_big(c, (caddr_t)c->c_map, c->c_mappages * CZ_BSIZE,
+	    sb->sb_cpstart[slot] + 1, B_READ)) != 0)
+		goto out;
+
+	/* The other slot is older than this one all over */
+	for (size_t pg = 0; pg < c->c_mappages; pg++)
+		BT_SET(c->c_dirty[slot ^ 1], pg);
+	c->c_cpslot = slot ^ 1;
+	c->c_cpseq = cp->cp_seq;
+	c->c_cpjseq = c->c_jseq = cp->cp_jseq;
+
+	cz_replay(c);
+
+	c->c_nfree = sb->sb_npblks;
+	cz_scan(c);
+
+out:
+	kmem_free(cps[0], CZ_BSIZE);
+	kmem_free(cps[1], CZ_BSIZE);
+
+	return (rc);
+}
+
+static void
+cz_free(cz_t *c)
+{
+	size_t	pmap = BT_SIZEOFMAP(c->c_sb.sb_npblks + 1);
+
+	if (c->c_tq != NULL)
+		ddi_taskq_destroy(c->c_tq);
+	while (c->c_work != NULL) {
+		cz_work_t	*w = c->c_work;
+
+		c->c_work = w->w_next;
+		kmem_free(w->w_tab, sizeof (uint32_t) << CZ_HASHLOG);
+		kmem_free(w->w_ubuf, c->c_csize);
+		kmem_free(w->w_cbuf, c->c_csize);
+		kmem_free(w, sizeof (*w));
+	}
+	for (int i = 0; i < c->c_ncache; i++)
+		kmem_free(c->c_cache[i].e_buf, c->c_csize);
+	if (c->c_cache != NULL)
+		kmem_free(c->c_cache, c->c_ncache * sizeof (cz_cent_t));
+	for (int i = 0; i < 2; i++) {
+		if (c->c_jblks[i].j_buf != NULL)
+			kmem_free(c->c_jblks[i].j_buf, CZ_BSIZE);
+		if (c->c_jblks[i].j_bp != NULL)
+			freerbuf(c->c_jblks[i].j_bp);
+		if (c->c_dirty[i] != NULL)
+			kmem_free(c->c_dirty[i], BT_SIZEOFMAP(c->c_mappages));
+	}
+	if (c->c_map != NULL)
+		kmem_free(c->c_map, c->c_mappages * CZ_BSIZE);
+	if (c->c_used != NULL)
+		kmem_free(c->c_used, pmap);
+	if (c->c_pend != NULL)
+		kmem_free(c->c_pend, pmap);
+	if (c->c_freeing != NULL)
+		kmem_free(c->c_freeing, pmap);
+
+	for (int i = 0; i < CZ_NLOCKS; i++)
+		mutex_destroy(&c->c_clocks[i]);
+	cv_destroy(&c->c_scv);
+	cv_destroy(&c->c_cv);
+	mutex_destroy(&c->c_lock);
+	kmem_free(c, sizeof (*c));
+}
+
+/*
+ * Plugin entry points
+ */
+static int
+dm_compress_init(void)
+{
+	return (0);
+}
+
+static void
+dm_compress_fini(void)
+{
+}
+
+static int
+dm_compress_create(dm_info_t *dmip, int argc, char **argv, cred_t *crp,
+    void **privp)
+{
+	cz_t		*c;
+	boolean_t	format = B_FALSE;
+	uint32_t	cblks = (CZ_CHUNK << 10) / CZ_BSIZE;
+	uint64_t	logical = 0;
+	uint64_t	jblks = CZ_JBLKS;
+	uint64_t	cache = (uint64_t)CZ_CACHE << 10;
+	int		rc;
+
+	for (int i = 0; i < argc; i++) {
+		unsigned long	val;
+
+		if (strcmp(argv[i], "format") == 0) {
+			format = B_TRUE;
+		} else if (strncmp(argv[i], "chunk=", 6) == 0 &&
+		    ddi_strtoul(argv[i] + 6, NULL, 10, &val) == 0 &&
+		    ISP2(val) && val >= CZ_CHUNK_MIN && val <= CZ_CHUNK_MAX) {
+			cblks = (uint32_t)((val << 10) / CZ_BSIZE);
+		} else if (strncmp(argv[i], "logical=", 8) == 0 &&
+		    ddi_strtoul(argv[i] + 8, NULL, 10, &val) == 0) {
+			logical = (uint64_t)val << 20;
+		} else if (strncmp(argv[i], "journal=", 8) == 0 &&
+		    ddi_strtoul(argv[i] + 8, NULL, 10, &val) == 0) {
+			jblks = (uint64_t)val * 1024 / CZ_BSIZE;
+		} else if (strncmp(argv[i], "cache=", 6) == 0 &&
+		    ddi_strtoul(argv[i] + 6, NULL, 10, &val) == 0) {
+			cache = (uint64_t)val << 10;
+		} else {
+			cmn_err(CE_WARN, "dm_compress: unknown argument '%s'",
+			    argv[i]);
+			return (EINVAL);
+		}
+	}
+
+	c = kmem_zalloc(sizeof (*c), KM_SLEEP);
+	c->c_dmip = dmip;
+	mutex_init(&c->c_lock, NULL, MUTEX_DRIVER, NULL);
+	cv_init(&c->c_cv, NULL, CV_DRIVER, NULL);
+	cv_init(&c->c_scv, NULL, CV_DRIVER, NULL);
+	for (int i = 0; i < CZ_NLOCKS; i++)
+		mutex_init(&c->c_clocks[i], NULL, MUTEX_DRIVER, NULL);
+
+	if (format && (rc = cz_format(c, dmip->size, cblks, logical,
+	    jblks)) != 0) {
+		cmn_err(CE_WARN, "dm_compress: %s: format failed (%d)",
+		    refstr_value(dmip->name), rc);
+		cz_free(c);
+		return (rc);
+	}
+
+	if ((rc = cz_mount(c)) != 0) {
+		cmn_err(CE_WARN, "dm_compress: %s: no valid metadata found "
+		    "(%d)", refstr_value(dmip->name), rc);
+		cz_free(c);
+		return (rc);
+	}
+
+	for (int i = 0; i < 2; i++) {
+		c->c_jblks[i].j_buf = kmem_zalloc(CZ_BSIZE, KM_SLEEP);
+		c->c_jblks[i].j_bp = getrbuf(KM_SLEEP);
+	}
+	c->c_fill = &c->c_jblks[0];
+	c->c_flight = &c->c_jblks[1];
+
+	/* A taskq thread per CPU, and scratch space for each */
+	for (c->c_nwork = 0; c->c_nwork < ncpus; c->c_nwork++) {
+		cz_work_t	*w = kmem_zalloc(sizeof (*w), KM_SLEEP);
+
+		w->w_tab = kmem_alloc(sizeof (uint32_t) << CZ_HASHLOG,
+		    KM_SLEEP);
+		w->w_ubuf = kmem_alloc(c->c_csize, KM_SLEEP);
+		w->w_cbuf = kmem_alloc(c->c_csize, KM_SLEEP);
+		w->w_next = c->c_work;
+		c->c_work = w;
+	}
+	c->c_ncache = (int)MAX(cache / c->c_csize, CZ_CACHE_MIN);
+	c->c_cache = kmem_zalloc(c->c_ncache * sizeof (cz_cent_t), KM_SLEEP);
+	for (int i = 0; i < c->c_ncache; i++) {
+		c->c_cache[i].e_chunk = CZ_NOCHUNK;
+		c->c_cache[i].e_buf = kmem_alloc(c->c_csize, KM_SLEEP);
+	}
+
+	c->c_tq = ddi_taskq_create(NULL, "dm_compress", c->c_nwork,
+	    TASKQ_DEFAULTPRI, 0);
+	c->c_syncer = thread_create(NULL, 0, cz_syncer, c, 0, &p0, TS_RUN,
+	    minclsyspri);
+
+	dmip->size = c->c_sb.sb_nchunks * c->c_csize;
+	*privp = c;
+
+	return (0);
+}
+
+static void
+dm_compress_destroy(dm_info_t *dmip, void *priv)
+{
+	cz_t		*c = priv;
+	kt_did_t	tid = c->c_syncer->t_did;
+
+	/* Chunks still being written may need the syncer */
+	ddi_taskq_wait(c->c_tq);
+
+	mutex_enter(&c->c_lock);
+	c->c_exiting = B_TRUE;
+	cv_signal(&c->c_scv);
+	mutex_exit(&c->c_lock);
+	thread_join(tid);
+
+	/* Push the journal out, leave a checkpoint behind */
+	mutex_enter(&c->c_lock);
+	if (c->c_error == 0)
+		cz_checkpoint(c);
+	while (c->c_busy)
+		cv_wait(&c->c_cv, &c->c_lock);
+	mutex_exit(&c->c_lock);
+
+	cz_free(c);
+}
+
+static dm_mapio_t
+dm_compress_mapio(dm_info_t *dmip, void *priv, struct buf *bp,
+    dm_remap_t *rp)
+{
+	cz_t		*c = priv;
+	cz_req_t	*q;
+	uint64_t	off = ldbtob(bp->b_lblkno);
+	uint64_t	first, last;
+	size_t		n;
+
+	if ((off & (CZ_BSIZE - 1)) != 0 ||
+	    (bp->b_bcount & (CZ_BSIZE - 1)) != 0) {
+		bioerror(bp, EINVAL);
+		return (DM_MAPIO_KILL);
+	}
+	if (bp->b_bcount == 0) {
+		bp->b_resid = 0;
+		biodone(bp);
+		return (DM_MAPIO_SUBMITTED);
+	}
+
+	first = off / c->c_csize;
+	last = (off + bp->b_bcount - 1) / c->c_csize;
+	n = (size_t)(last - first + 1);
+	if ((q = kmem_zalloc(CZ_REQSIZE(n), KM_NOSLEEP)) == NULL) {
+		bioerror(bp, ENOMEM);
+		return (DM_MAPIO_KILL);
+	}
+
+	/* A task per chunk, the request holds itself until all are out */
+	q->q_bp = bp;
+	q->q_cz = c;
+	q->q_ntasks = n;
+	q->q_pending = (uint32_t)n + 1;
+	for (size_t i = 0; i < n; i++) {
+		cz_task_t	*t = &q->q_tasks[i];
+		uint64_t	cstart = (first + i) * c->c_csize;
+		uint64_t	start = MAX(off, cstart);
+		uint64_t	end = MIN(off + bp->b_bcount,
+		    cstart + c->c_csize);
+
+		t->t_req = q;
+		t->t_chunk = first + i;
+		t->t_off = (size_t)(start - cstart);
+		t->t_len = (size_t)(end - start);
+		t->t_boff = (size_t)(start - off);
+	}
+	if (ddi_taskq_dispatch(c->c_tq, cz_start, q, DDI_NOSLEEP) !=
+	    DDI_SUCCESS) {
+		kmem_free(q, CZ_REQSIZE(n));
+		bioerror(bp, ENOMEM);
+		return (DM_MAPIO_KILL);
+	}
+
+	return (DM_MAPIO_SUBMITTED);
+}
+
+static int
+dm_compress_stats(dm_info_t *dmip, void *priv, nvlist_t *nvl)
+{
+	cz_t	*c = priv;
+
+	mutex_enter(&c->c_lock);
+	(void) nvlist_add_uint64(nvl, "chunk_size", c->c_csize);
+	(void) nvlist_add_uint64(nvl, "chunks", c->c_sb.sb_nchunks);
+	(void) nvlist_add_uint64(nvl, "chunks_stored", c->c_nmapped);
+	(void) nvlist_add_uint64(nvl, "bytes_stored", c->c_stored);
+	(void) nvlist_add_uint64(nvl, "physical", c->c_sb.sb_npblks);
+	(void) nvlist_add_uint64(nvl, "free", c->c_nfree);
+	(void) nvlist_add_uint64(nvl, "pending", c->c_npend + c->c_nfreeing);
+	(void) nvlist_add_uint64(nvl, "writes", c->c_writes);
+	(void) nvlist_add_uint64(nvl, "partial_writes", c->c_rmw);
+	(void) nvlist_add_uint64(nvl, "incompressible", c->c_raw);
+	(void) nvlist_add_uint64(nvl, "zeroes", c->c_zeroes);
+	(void) nvlist_add_uint64(nvl, "cache_hits", c->c_hits);
+	(void) nvlist_add_uint64(nvl, "cache_misses", c->c_misses);
+	(void) nvlist_add_uint64(nvl, "corrupt", c->c_corrupt);
+	(void) nvlist_add_uint64(nvl, "journal", c->c_jseq);
+	(void) nvlist_add_uint64(nvl, "checkpoint", c->c_cpseq);
+	(void) nvlist_add_int32(nvl, "error", c->c_error);
+	mutex_exit(&c->c_lock);
+
+	return (0);
+}
+
+
+dm_plugin_ops_t dm_ops = {
+	.dpo_rev	= DPO_REV,
+	.dpo_name	= "compress",
+	.dpo_init	= dm_compress_init,
+	.dpo_fini	= dm_compress_fini,
+	.dpo_create	= dm_compress_create,
+	.dpo_destroy	= dm_compress_destroy,
+	.dpo_mapio	= dm_compress_mapio,
+	.dpo_stats	= dm_compress_stats,
+};
+
+static struct modlmisc modlmisc = {
+	.misc_modops	= &mod_miscops,
+	.misc_linkinfo	= "Solaris Device Mapper compression plugin"
+};
+
+static struct modlinkage modlinkage = {
+	.ml_rev		= MODREV_1,
+	.ml_linkage	= {&modlmisc, NULL, NULL, NULL}
+};
+
+int
+_init(void)
+{
+	return (mod_install(&modlinkage));
+}
+
+int
+_info(struct modinfo *mip)
+{
+	return (mod_info(&modlinkage, mip));
+}
+
+int
+_fini(void)
+{
+	return (mod_remove(&modlinkage));
+}
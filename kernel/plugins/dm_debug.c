@@ -25,8 +25,18 @@
  */
 
 
+/*
+ * Debug target
+ *
+ * Passes I/O through to the mapping device on the dpo_mapio() path,
+ * counting it on the way; with the 'verbose' argument every failed I/O is
+ * logged as well.  Useful for exercising the plugin interface.
+ */
+
+#include <sys/atomic.h>
 #include <sys/conf.h>
 #include <sys/file.h>
+#include <sys/kmem.h>
 #include <sys/modctl.h>
 #include <sys/types.h>
 #include <sys/ddi.h>
@@ -36,49 +46,115 @@
 #include <sys/dm_impl.h>
 #include <sys/dm_ops.h>
 
-static void
+typedef struct {
+	boolean_t	dd_verbose;
+	uint64_t	dd_reads;
+	uint64_t	dd_writes;
+	uint64_t	dd_nread;	/* Bytes */
+	uint64_t	dd_nwritten;
+	uint64_t	dd_errors;
+} dm_debug_t;
+
+static int
 dm_debug_init(void)
 {
-	return;
+	return (0);
 }
 
 
 static void
 dm_debug_fini(void)
 {
-	return;
 }
 
 
-static void
-dm_debug_create(void)
+static int
+dm_debug_create(dm_info_t *dmip, int argc, char **argv, cred_t *crp,
+    void **privp)
 {
-	return;
+	dm_debug_t	*dd;
+
+	dd = kmem_zalloc(sizeof (*dd), KM_SLEEP);
+	for (int i = 0; i < argc; i++) {
+		if (strcmp(argv[i], "verbose") == 0) {
+			dd->dd_verbose = B_TRUE;
+		} else {
+			cmn_err(CE_WARN, "dm_debug: unknown argument '%s'",
+			    argv[i]);
+			kmem_free(dd, sizeof (*dd));
+			return (EINVAL);
+		}
+	}
+
+	*privp = dd;
+
+	return (0);
 }
 
 
 static void
-dm_debug_destroy(void)
+dm_debug_destroy(dm_info_t *dmip, void *priv)
 {
-	return;
+	kmem_free(priv, sizeof (dm_debug_t));
 }
 
 
-static void
-dm_debug_mapio(void)
+static dm_mapio_t
+dm_debug_mapio(dm_info_t *dmip, void *priv, struct buf *bp, dm_remap_t *rp)
+{
+	dm_debug_t	*dd = priv;
+
+	if (bp->b_flags & B_READ) {
+		atomic_inc_64(&dd->dd_reads);
+		atomic_add_64(&dd->dd_nread, bp->b_bcount);
+	} else {
+		atomic_inc_64(&dd->dd_writes);
+		atomic_add_64(&dd->dd_nwritten, bp->b_bcount);
+	}
+
+	rp->dr_lh = dmip->lh;
+	rp->dr_dev = dmip->tdev;
+	rp->dr_blkno = bp->b_lblkno;
+
+	return (DM_MAPIO_REMAPPED);
+}
+
+
+static int
+dm_debug_end_io(dm_info_t *dmip, void *priv, struct buf *bp, int error)
 {
-	return;
+	dm_debug_t	*dd = priv;
+
+	if (error != 0) {
+		atomic_inc_64(&dd->dd_errors);
+		if (dd->dd_verbose) {
+			cmn_err(CE_NOTE, "dm_debug: %s: %s of %lu at %lld: %d",
+			    refstr_value(dmip->name),
+			    (bp->b_flags & B_READ) ? "read" : "write",
+			    bp->b_bcount, (longlong_t)bp->b_lblkno, error);
+		}
+	}
+
+	return (error);
 }
 
 
-static void
-dm_debug_stats(void)
+static int
+dm_debug_stats(dm_info_t *dmip, void *priv, nvlist_t *nvl)
 {
-	return;
+	dm_debug_t	*dd = priv;
+
+	(void) nvlist_add_uint64(nvl, "reads", dd->dd_reads);
+	(void) nvlist_add_uint64(nvl, "writes", dd->dd_writes);
+	(void) nvlist_add_uint64(nvl, "nread", dd->dd_nread);
+	(void) nvlist_add_uint64(nvl, "nwritten", dd->dd_nwritten);
+	(void) nvlist_add_uint64(nvl, "errors", dd->dd_errors);
+
+	return (0);
 }
 
 
-static dm_plugin_ops_t dm_debug_ops = {
+dm_plugin_ops_t dm_ops = {
 	.dpo_rev	= DPO_REV,
 	.dpo_name	= "debug",
 	.dpo_init	= dm_debug_init,
@@ -86,6 +162,7 @@ static dm_plugin_ops_t dm_debug_ops = {
 	.dpo_create	= dm_debug_create,
 	.dpo_destroy	= dm_debug_destroy,
 	.dpo_mapio	= dm_debug_mapio,
+	.dpo_end_io	= dm_debug_end_io,
 	.dpo_stats	= dm_debug_stats,
 };
 
@@ -0,0 +1,1662 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright 2011 Grigale Ltd. All rights reserved.
+ * Use is subject to license terms.
+ */
+
+
+/*
+ * Deduplicating target
+ *
+ * Stores every distinct 4K block written to the mapping once.  Each block
+ * written is fingerprinted and looked up in an index of the blocks stored;
+ * a match is compared byte for byte and, if it holds, the logical block
+ * is simply pointed at the physical one already there.  Blocks of zeroes
+ * take no space at all.  The device is carved into 4K blocks:
+ *
+ *	block 0			superblock
+ *	cpstart[0]		checkpoint slot 0 (header, map, reference
+ *				counts, index, spill summary)
+ *	cpstart[1]		checkpoint slot 1
+ *	jstart			journal
+ *	spillstart		index spill
+ *	datastart		physical blocks
+ *
+ * The logical to physical map and a 32-bit reference count per physical
+ * block are kept in memory.  Their changes are committed to a circular
+ * journal, a block of records at a time: while one journal block is being
+ * written the next collects the records of every write that completes its
+ * data meanwhile, so a busy mapping gets few large metadata commits.  A
+ * write completes once its new blocks and the journal block(s) holding its
+ * records are on the device.  The tables are checkpointed to alternate
+ * slots, only the pages changed since the slot was last written, and the
+ * journal is replayed from the position recorded in the newest checkpoint
+ * at mount.  New data always goes to free blocks, and blocks are not freed
+ * before a checkpoint no longer refers to them.
+ *
+ * The index is an open addressed table of buckets one cache line long,
+ * each holding eight fingerprint tags with their physical block; a lookup
+ * probes two buckets.  Entries pushed out of a full pair go to the spill,
+ * a larger table of such buckets on the device, written in batches, with
+ * a bit per bucket in memory telling whether it is worth reading.  Index
+ * entries are only hints: they are not removed when blocks are freed, as
+ * the compare catches whatever they point to now.
+ *
+ * Arguments:	[format] [logical=<MB>] [index=<MB>] [journal=<KB>]
+ *
+ * 'format' initialises the device, the other arguments are only used then:
+ * logical is the size presented (the physical space by default), index
+ * the memory taken by the index and journal its size on the device.  The
+ * mapping is 4K native: I/O has to be 4K aligned.
+ */
+
+#include <sys/atomic.h>
+#include <sys/bitmap.h>
+#include <sys/buf.h>
+#include <sys/conf.h>
+#include <sys/cred.h>
+#include <sys/disp.h>
+#include <sys/errno.h>
+#include <sys/file.h>
+#include <sys/kmem.h>
+#include <sys/modctl.h>
+#include <sys/proc.h>
+#include <sys/sysmacros.h>
+#include <sys/systm.h>
+#include <sys/thread.h>
+#include <sys/types.h>
+#include <sys/ddi.h>
+#include <sys/sunddi.h>
+
+#include <sys/dm.h>
+#include <sys/dm_impl.h>
+#include <sys/dm_ops.h>
+
+#define	DD_MAGIC	0x444d444455503031ULL	/* "DMDDUP01" */
+#define	DD_CPMAGIC	0x444d444443503031ULL	/* "DMDDCP01" */
+#define	DD_JMAGIC	0x444d44444a4c3031ULL	/* "DMDDJL01" */
+#define	DD_VERSION	1
+
+#define	DD_BSIZE	4096
+#define	DD_BSHIFT	12
+#define	DD_DBPB		(DD_BSIZE / DEV_BSIZE)	/* Disk blocks per block */
+#define	DD_NOBLK	0			/* Unmapped, reads as zeroes */
+#define	DD_MAPPG	(DD_BSIZE / sizeof (uint32_t))	/* Entries/page */
+#define	DD_IOMAX	(1024 * 1024)		/* Metadata I/O size */
+
+#define	DD_SLOTS	8			/* Index entries per bucket */
+#define	DD_BKTPG	(DD_BSIZE / sizeof (dd_bucket_t))
+#define	DD_INDEX	64			/* Default index memory, MB */
+#define	DD_JBLKS	1024			/* Default journal, 4M */
+#define	DD_JMIN		16
+#define	DD_SPILLQ	1024			/* Entries queued to spill */
+#define	DD_RESERVE	256			/* Free blocks kept in hand */
+#define	DD_CP_SECS	30			/* Checkpoint interval, secs */
+
+#define	DD_P1		0x9e3779b185ebca87ULL
+#define	DD_P2		0xc2b2ae3d27d4eb4fULL
+#define	DD_P3		0x165667b19e3779f9ULL
+#define	DD_ROTL(x, r)	(((x) << (r)) | ((x) >> (64 - (r))))
+
+typedef struct {
+	uint64_t	sb_magic;
+	uint32_t	sb_version;
+	uint32_t	sb_pad0;
+	uint64_t	sb_nlblks;	/* Logical blocks */
+	uint64_t	sb_npblks;	/* Physical blocks */
+	uint64_t	sb_nbuckets;	/* Index buckets, a power of two */
+	uint64_t	sb_nspill;	/* Spill buckets */
+	uint64_t	sb_cpblks;	/* Blocks per checkpoint slot */
+	uint64_t	sb_cpstart[2];	/* First block of checkpoint slots */
+	uint64_t	sb_jstart;	/* First block of the journal */
+	uint64_t	sb_jblks;	/* and its length */
+	uint64_t	sb_spillstart;	/* First block of the spill */
+	uint64_t	sb_datastart;	/* Physical block 1 */
+	uint32_t	sb_pad;
+	uint32_t	sb_sum;		/* Checksum of the above */
+} dd_super_t;
+
+typedef struct {
+	uint64_t	cp_magic;
+	uint64_t	cp_seq;		/* Checkpoint sequence number */
+	uint64_t	cp_jseq;	/* First journal block not in it */
+	uint32_t	cp_pad;
+	uint32_t	cp_sum;		/* Checksum of the above */
+} dd_cphdr_t;
+
+/* Index entry, tag 0 is a free one */
+typedef struct {
+	uint32_t	de_tag;		/* High half of the fingerprint */
+	uint32_t	de_pba;
+} dd_entry_t;
+
+typedef struct {
+	dd_entry_t	db_ent[DD_SLOTS];
+} dd_bucket_t;
+
+/* Journal block: header and records, logical block now at pba */
+typedef struct {
+	uint64_t	jh_magic;
+	uint64_t	jh_seq;		/* Journal block sequence number */
+	uint32_t	jh_n;		/* Records */
+	uint32_t	jh_sum;		/* Checksum of the block */
+} dd_jhdr_t;
+
+typedef struct {
+	uint32_t	jr_lba;
+	uint32_t	jr_pba;
+} dd_jrec_t;
+
+#define	DD_JMAX		((DD_BSIZE - sizeof (dd_jhdr_t)) / sizeof (dd_jrec_t))
+
+struct dd;
+
+/* A mapped write, completes when its data and records are on the device */
+typedef struct {
+	struct buf	*q_bp;
+	struct dd	*q_dd;
+	uint32_t	q_pending;
+	int		q_error;
+} dd_req_t;
+
+typedef struct {
+	caddr_t		j_buf;		/* Header and records */
+	struct buf	*j_bp;		/* Preallocated write buf */
+	uint32_t	j_nreqs;	/* Writes completing with the block */
+	dd_req_t	*j_reqs[DD_JMAX];
+} dd_jblk_t;
+
+typedef struct dd {
+	dm_info_t	*d_dmip;
+	kmutex_t	d_lock;
+	kcondvar_t	d_cv;		/* Journal block done, blocks freed */
+	kcondvar_t	d_scv;		/* Syncer wakeup */
+	dd_super_t	d_sb;
+	int		d_error;	/* Journal write failed, sticky */
+
+	uint32_t	*d_map;		/* Logical to physical block map */
+	uint32_t	*d_ref;		/* References to physical blocks */
+	uint16_t	*d_hold;	/* Writes about to add one */
+	dd_bucket_t	*d_index;
+	ulong_t		*d_spilled;	/* Spill buckets with entries */
+	ulong_t		*d_pend;	/* Freed since the last checkpoint */
+	ulong_t		*d_freeing;	/* Freed before the one being written */
+	size_t		d_mappages;	/* Pages of each in the image */
+	size_t		d_refpages;
+	size_t		d_idxpages;
+	size_t		d_sppages;
+	size_t		d_npages;
+	ulong_t		*d_dirty[2];	/* Pages to write to each slot */
+	uint64_t	d_nfree;	/* Free physical blocks */
+	uint64_t	d_npend;	/* Blocks in d_pend */
+	uint64_t	d_nfreeing;	/* and in d_freeing */
+	uint64_t	d_rotor;	/* Free block search start */
+
+	dd_jblk_t	d_jblks[2];
+	dd_jblk_t	*d_fill;	/* Collecting records */
+	dd_jblk_t	*d_flight;	/* Being written */
+	boolean_t	d_busy;		/* d_flight in flight */
+	uint64_t	d_jseq;		/* Next journal block */
+	uint64_t	d_cpjseq;	/* Journal start, last checkpoint */
+	uint64_t	d_cpseq;
+	int		d_cpslot;	/* Slot the next checkpoint goes to */
+	boolean_t	d_cpwant;	/* Checkpoint waiting for the journal */
+
+	dd_entry_t	d_spillq[DD_SPILLQ];	/* Entries pushed out */
+	uint32_t	d_nspillq;
+	ddi_taskq_t	*d_tq;
+	kthread_t	*d_syncer;
+	boolean_t	d_exiting;
+
+	uint64_t	d_blocks;	/* Blocks written */
+	uint64_t	d_dups;		/* ... found stored already */
+	uint64_t	d_zeroes;	/* ... of zeroes */
+	uint64_t	d_mismatch;	/* Fingerprint matches that were not */
+	uint64_t	d_spillreads;
+	uint64_t	d_spilldrops;	/* Entries lost, spill queue full */
+} dd_t;
+
+#define	DD_JUSED(d)	((d)->d_jseq - (d)->d_cpjseq)
+
+
+/*
+ * Fingerprint of a block, four independent lanes of multiply and rotate
+ * that the compiler and the CPU can overlap.  Also tells blocks of zeroes.
+ */
+static uint64_t
+dd_hash(const void *buf, boolean_t *zero)
+{
+	const uint64_t	*p = buf;
+	uint64_t	a0 = DD_P1 + DD_P2, a1 = DD_P2, a2 = 0, a3 = -DD_P1;
+	uint64_t	z = 0, h;
+
+	for (size_t i = 0; i < DD_BSIZE / sizeof (uint64_t); i += 4) {
+		z |= p[i] | p[i + 1] | p[i + 2] | p[i + 3];
+		a0 = DD_ROTL(a0 + p[i] * DD_P2, 31) * DD_P1;
+		a1 = DD_ROTL(a1 + p[i + 1] * DD_P2, 31) * DD_P1;
+		a2 = DD_ROTL(a2 + p[i + 2] * DD_P2, 31) * DD_P1;
+		a3 = DD_ROTL(a3 + p[i + 3] * DD_P2, 31) * DD_P1;
+	}
+	h = DD_ROTL(a0, 1) + DD_ROTL(a1, 7) + DD_ROTL(a2, 12) +
+	    DD_ROTL(a3, 18);
+	h ^= h >> 33;
+	h *= DD_P2;
+	h ^= h >> 29;
+	h *= DD_P3;
+	h ^= h >> 32;
+
+	*zero = (z == 0);
+	return (h);
+}
+
+/* Synchronous I/O on the backing device, 'blk' in DD blocks */
+static int
+dd_bio(dd_t *d, caddr_t addr, size_t len, uint64_t blk, int rw)
+{
+	dm_info_t	*dmip = d->d_dmip;
+
+	return (dm_target_bio(dmip, dmip->lh, dmip->tdev, addr, len,
+	    blk * DD_DBPB, rw));
+}
+
+/* Large metadata transfers, in DD_IOMAX pieces */
+static int
+dd_bio_big(dd_t *d, caddr_t addr, size_t len, uint64_t blk, int rw)
+{
+	int	rc = 0;
+
+	while (len != 0 && rc == 0) {
+		size_t	n = MIN(len, DD_IOMAX);
+
+		rc = dd_bio(d, addr, n, blk, rw);
+		addr += n;
+		len -= n;
+		blk += n >> DD_BSHIFT;
+	}
+
+	return (rc);
+}
+
+static uint64_t
+dd_pba_blk(dd_t *d, uint32_t pba)
+{
+	return (d->d_sb.sb_datastart + pba - 1);
+}
+
+/*
+ * Checkpoint image: map pages, reference count pages, index pages and the
+ * spill summary, in that order.
+ */
+static caddr_t
+dd_page(dd_t *d, size_t pg)
+{
+	if (pg < d->d_mappages)
+		return ((caddr_t)d->d_map + pg * DD_BSIZE);
+	pg -= d->d_mappages;
+	if (pg < d->d_refpages)
+		return ((caddr_t)d->d_ref + pg * DD_BSIZE);
+	pg -= d->d_refpages;
+	if (pg < d->d_idxpages)
+		return ((caddr_t)d->d_index + pg * DD_BSIZE);
+	pg -= d->d_idxpages;
+	return ((caddr_t)d->d_spilled + pg * DD_BSIZE);
+}
+
+/* Note the image page holding byte 'off' of the table starting at 'pg' */
+static void
+dd_dirty(dd_t *d, size_t pg, size_t off)
+{
+	pg += off / DD_BSIZE;
+	BT_SET(d->d_dirty[0], pg);
+	BT_SET(d->d_dirty[1], pg);
+}
+
+#define	DD_DIRTY_MAP(d, lba)	\
+	dd_dirty(d, 0, (lba) * sizeof (uint32_t))
+#define	DD_DIRTY_REF(d, pba)	\
+	dd_dirty(d, (d)->d_mappages, (pba) * sizeof (uint32_t))
+#define	DD_DIRTY_IDX(d, b)	\
+	dd_dirty(d, (d)->d_mappages + (d)->d_refpages, \
+	    (b) * sizeof (dd_bucket_t))
+#define	DD_DIRTY_SPILL(d, sb)	\
+	dd_dirty(d, (d)->d_mappages + (d)->d_refpages + (d)->d_idxpages, \
+	    (sb) / NBBY)
+
+/*
+ * Point 'lba' at 'pba', keeping the reference counts straight.  A block
+ * left without references waits for the next checkpoint to be free.
+ */
+static void
+dd_apply(dd_t *d, uint32_t lba, uint32_t pba)
+{
+	uint32_t	old = d->d_map[lba];
+
+	ASSERT(MUTEX_HELD(&d->d_lock));
+
+	if (pba != DD_NOBLK) {
+		d->d_ref[pba]++;
+		DD_DIRTY_REF(d, pba);
+	}
+	if (old != DD_NOBLK) {
+		if (--d->d_ref[old] == 0 && !BT_TEST(d->d_pend, old)) {
+			BT_SET(d->d_pend, old);
+			d->d_npend++;
+		}
+		DD_DIRTY_REF(d, old);
+	}
+	d->d_map[lba] = pba;
+	DD_DIRTY_MAP(d, lba);
+}
+
+static boolean_t
+dd_isfree(dd_t *d, uint32_t pba)
+{
+	return (d->d_ref[pba] == 0 && d->d_hold[pba] == 0 &&
+	    !BT_TEST(d->d_pend, pba) && !BT_TEST(d->d_freeing, pba));
+}
+
+/* A free physical block held for the caller, DD_NOBLK if none */
+static uint32_t
+dd_alloc(dd_t *d)
+{
+	uint64_t	n = d->d_sb.sb_npblks;
+
+	ASSERT(MUTEX_HELD(&d->d_lock));
+
+	if (d->d_nfree <= DD_RESERVE)
+		cv_signal(&d->d_scv);
+	if (d->d_nfree == 0)
+		return (DD_NOBLK);
+
+	for (uint64_t i = 0; i < n; i++) {
+		uint32_t	pba = (uint32_t)((d->d_rotor + i) % n) + 1;
+
+		if (dd_isfree(d, pba)) {
+			d->d_rotor = pba;
+			d->d_hold[pba] = 1;
+			d->d_nfree--;
+			return (pba);
+		}
+	}
+	return (DD_NOBLK);
+}
+
+/*
+ * Index
+ */
+static uint32_t
+dd_tag(uint64_t fp)
+{
+	uint32_t	tag = (uint32_t)(fp >> 32);
+
+	return (tag != 0 ? tag : 1);
+}
+
+static uint64_t
+dd_bucket(dd_t *d, uint64_t fp, int probe)
+{
+	return ((fp + probe) & (d->d_sb.sb_nbuckets - 1));
+}
+
+static uint64_t
+dd_spill_bucket(dd_t *d, uint32_t tag)
+{
+	return (tag % d->d_sb.sb_nspill);
+}
+
+/*
+ * Record 'pba' as holding 'fp'.  A free or stale entry of the two buckets
+ * takes it, else the tag picks one whose entry is pushed to the spill.
+ */
+static void
+dd_insert(dd_t *d, uint64_t fp, uint32_t pba)
+{
+	uint32_t	tag = dd_tag(fp);
+	uint64_t	b;
+	dd_entry_t	*e;
+
+	ASSERT(MUTEX_HELD(&d->d_lock));
+
+	for (int probe = 0; probe < 2; probe++) {
+		b = dd_bucket(d, fp, probe);
+		for (int s = 0; s < DD_SLOTS; s++) {
+			e = &d->d_index[b].db_ent[s];
+			if (e->de_tag == 0 || e->de_tag == tag ||
+			    e->de_pba > d->d_sb.sb_npblks ||
+			    (d->d_ref[e->de_pba] == 0 &&
+			    d->d_hold[e->de_pba] == 0))
+				goto set;
+		}
+	}
+
+	b = dd_bucket(d, fp, 0);
+	e = &d->d_index[b].db_ent[tag % DD_SLOTS];
+	if (d->d_nspillq < DD_SPILLQ)
+		d->d_spillq[d->d_nspillq++] = *e;
+	else
+		d->d_spilldrops++;
+
+set:
+	e->de_tag = tag;
+	e->de_pba = pba;
+	DD_DIRTY_IDX(d, b);
+}
+
+/* Write the entries pushed out to their spill buckets, page by page */
+static void
+dd_spill_flush(dd_t *d, caddr_t buf)
+{
+	dd_entry_t	*q;
+	uint32_t	n;
+	uint64_t	spb = d->d_sb.sb_spillstart;
+
+	mutex_enter(&d->d_lock);
+	n = d->d_nspillq;
+	q = kmem_alloc(MAX(n, 1) * sizeof (dd_entry_t), KM_SLEEP);
+	bcopy(d->d_spillq, q, n * sizeof (dd_entry_t));
+	d->d_nspillq = 0;
+	mutex_exit(&d->d_lock);
+
+	for (uint32_t i = 0; i < n; i++) {
+		uint64_t	pg;
+
+		if (q[i].de_tag == 0)
+			continue;
+		pg = dd_spill_bucket(d, q[i].de_tag) / DD_BKTPG;
+		if (dd_bio(d, buf, DD_BSIZE, spb + pg, B_READ) != 0)
+			continue;
+
+		/* Every entry for this page goes in with this write */
+		for (uint32_t j = i; j < n; j++) {
+			uint64_t	sb;
+			dd_bucket_t	*bk;
+			dd_entry_t	*e;
+
+			if (q[j].de_tag == 0 ||
+			    (sb = dd_spill_bucket(d, q[j].de_tag)) / DD_BKTPG !=
+			    pg)
+				continue;
+			bk = (dd_bucket_t *)buf + sb % DD_BKTPG;
+			e = &bk->db_ent[q[j].de_tag % DD_SLOTS];
+			for (int s = 0; s < DD_SLOTS; s++) {
+				if (bk->db_ent[s].de_tag == 0 ||
+				    bk->db_ent[s].de_tag == q[j].de_tag) {
+					e = &bk->db_ent[s];
+					break;
+				}
+			}
+			*e = q[j];
+			q[j].de_tag = 0;
+
+			mutex_enter(&d->d_lock);
+			if (!BT_TEST(d->d_spilled, sb)) {
+				BT_SET(d->d_spilled, sb);
+				DD_DIRTY_SPILL(d, sb);
+			}
+			mutex_exit(&d->d_lock);
+		}
+		(void) dd_bio(d, buf, DD_BSIZE, spb + pg, B_WRITE);
+	}
+
+	kmem_free(q, MAX(n, 1) * sizeof (dd_entry_t));
+}
+
+/*
+ * A physical block holding what 'data' does, held for the caller, or
+ * DD_NOBLK.  Candidates come from the index, or else the spill, and are
+ * read back and compared: fingerprints only say where to look.
+ */
+static uint32_t
+dd_find(dd_t *d, uint64_t fp, caddr_t data, caddr_t buf)
+{
+	uint32_t	tag = dd_tag(fp);
+	uint32_t	cand[2 * DD_SLOTS];
+	uint64_t	sb = dd_spill_bucket(d, tag);
+	boolean_t	spilled, fromspill = B_FALSE;
+	int		nc = 0;
+
+	mutex_enter(&d->d_lock);
+	for (int probe = 0; probe < 2; probe++) {
+		dd_bucket_t	*bk = &d->d_index[dd_bucket(d, fp, probe)];
+
+		for (int s = 0; s < DD_SLOTS; s++) {
+			dd_entry_t	*e = &bk->db_ent[s];
+
+			if (e->de_tag == tag && e->de_pba != DD_NOBLK &&
+			    e->de_pba <= d->d_sb.sb_npblks &&
+			    d->d_ref[e->de_pba] != 0)
+				cand[nc++] = e->de_pba;
+		}
+	}
+	spilled = BT_TEST(d->d_spilled, sb);
+	mutex_exit(&d->d_lock);
+
+	if (nc == 0 && spilled && dd_bio(d, buf, DD_BSIZE,
+	    d->d_sb.sb_spillstart + sb / DD_BKTPG, B_READ) == 0) {
+		dd_bucket_t	*bk = (dd_bucket_t *)buf + sb % DD_BKTPG;
+
+		for (int s = 0; s < DD_SLOTS; s++) {
+			if (bk->db_ent[s].de_tag == tag &&
+			    bk->db_ent[s].de_pba != DD_NOBLK &&
+			    bk->db_ent[s].de_pba <= d->d_sb.sb_npblks)
+				cand[nc++] = bk->db_ent[s].de_pba;
+		}
+		fromspill = B_TRUE;
+		atomic_inc_64(&d->d_spillreads);
+	}
+
+	for (int i = 0; i < nc; i++) {
+		uint32_t	pba = cand[i];
+
+		mutex_enter(&d->d_lock);
+		if (d->d_ref[pba] == 0 || d->d_hold[pba] == UINT16_MAX) {
+			mutex_exit(&d->d_lock);
+			continue;
+		}
+		d->d_hold[pba]++;
+		mutex_exit(&d->d_lock);
+
+		if (dd_bio(d, buf, DD_BSIZE, dd_pba_blk(d, pba), B_READ) == 0 &&
+		    bcmp(buf, data, DD_BSIZE) == 0) {
+			/* Found in the spill, worth having at hand again */
+			mutex_enter(&d->d_lock);
+			if (fromspill)
+				dd_insert(d, fp, pba);
+			mutex_exit(&d->d_lock);
+			return (pba);
+		}
+
+		atomic_inc_64(&d->d_mismatch);
+		mutex_enter(&d->d_lock);
+		d->d_hold[pba]--;
+		mutex_exit(&d->d_lock);
+	}
+
+	return (DD_NOBLK);
+}
+
+static void
+dd_req_rele(dd_req_t *q)
+{
+	struct buf	*bp = q->q_bp;
+
+	if (atomic_dec_32_nv(&q->q_pending) != 0)
+		return;
+
+	if (q->q_error != 0) {
+		bioerror(bp, q->q_error);
+		bp->b_resid = bp->b_bcount;
+	} else {
+		bp->b_resid = 0;
+	}
+	kmem_free(q, sizeof (*q));
+	biodone(bp);
+}
+
+/*
+ * Journal
+ */
+static int dd_journal_done(struct buf *);
+
+/*
+ * Seal the fill block and write it out.  Called with the lock held and no
+ * block in flight; the lock is dropped around issuing it since the
+ * completion may run in this very thread.
+ */
+static void
+dd_journal_issue(dd_t *d)
+{
+	dd_jblk_t	*j = d->d_fill;
+	dd_jhdr_t	*jh = (dd_jhdr_t *)j->j_buf;
+	struct buf	*bp = j->j_bp;
+
+	ASSERT(MUTEX_HELD(&d->d_lock));
+	ASSERT(!d->d_busy && jh->jh_n != 0);
+	ASSERT(DD_JUSED(d) < d->d_sb.sb_jblks);
+
+	jh->jh_magic = DD_JMAGIC;
+	jh->jh_seq = d->d_jseq++;
+	jh->jh_sum = 0;
+	jh->jh_sum = dm_cksum(j->j_buf, DD_BSIZE);
+
+	bioreset(bp);
+	bp->b_flags = B_BUSY | B_WRITE;
+	bp->b_un.b_addr = j->j_buf;
+	bp->b_bcount = DD_BSIZE;
+	bp->b_lblkno = (d->d_sb.sb_jstart + jh->jh_seq % d->d_sb.sb_jblks) *
+	    DD_DBPB;
+	bp->b_blkno = bp->b_lblkno;
+	bp->b_edev = d->d_dmip->tdev;
+	bp->b_dev = cmpdev(d->d_dmip->tdev);
+	bp->b_iodone = dd_journal_done;
+	bp->b_private = d;
+
+	d->d_fill = d->d_flight;
+	d->d_flight = j;
+	d->d_busy = B_TRUE;
+
+	mutex_exit(&d->d_lock);
+	dm_split_issue(bp, d->d_dmip->lh, &d->d_dmip->limits);
+	mutex_enter(&d->d_lock);
+}
+
+/* Records on the device: they take effect, their writes are done */
+static int
+dd_journal_done(struct buf *bp)
+{
+	dd_t		*d = bp->b_private;
+	dd_jblk_t	*j;
+	dd_jhdr_t	*jh;
+	dd_jrec_t	*jr;
+	int		error = geterror(bp);
+
+	mutex_enter(&d->d_lock);
+
+	j = d->d_flight;
+	jh = (dd_jhdr_t *)j->j_buf;
+	jr = (dd_jrec_t *)(jh + 1);
+	if (error != 0) {
+		cmn_err(CE_WARN, "dm_dedup: %s: journal write failed (%d)",
+		    refstr_value(d->d_dmip->name), error);
+		d->d_error = error;
+	}
+
+	for (uint32_t i = 0; i < jh->jh_n; i++) {
+		if (jr[i].jr_pba != DD_NOBLK)
+			d->d_hold[jr[i].jr_pba]--;
+		if (error == 0)
+			dd_apply(d, jr[i].jr_lba, jr[i].jr_pba);
+	}
+	for (uint32_t i = 0; i < j->j_nreqs; i++) {
+		if (error != 0)
+			j->j_reqs[i]->q_error = error;
+		dd_req_rele(j->j_reqs[i]);
+	}
+	bzero(j->j_buf, DD_BSIZE);
+	j->j_nreqs = 0;
+	d->d_busy = B_FALSE;
+
+	/* Group commit: whatever piled up meanwhile goes right away */
+	j = d->d_fill;
+	jh = (dd_jhdr_t *)j->j_buf;
+	if (d->d_error != 0) {
+		jr = (dd_jrec_t *)(jh + 1);
+		for (uint32_t i = 0; i < jh->jh_n; i++) {
+			if (jr[i].jr_pba != DD_NOBLK)
+				d->d_hold[jr[i].jr_pba]--;
+		}
+		for (uint32_t i = 0; i < j->j_nreqs; i++) {
+			j->j_reqs[i]->q_error = d->d_error;
+			dd_req_rele(j->j_reqs[i]);
+		}
+		bzero(j->j_buf, DD_BSIZE);
+		j->j_nreqs = 0;
+	} else if (jh->jh_n != 0) {
+		dd_journal_issue(d);
+	}
+
+	cv_broadcast(&d->d_cv);
+	mutex_exit(&d->d_lock);
+
+	return (0);
+}
+
+/*
+ * Add a record of 'lba' now being at 'pba' for write 'q'.  A new journal
+ * block is not started within two of the checkpointed start, leaving room
+ * for a checkpoint to drain the journal.
+ */
+static int
+dd_journal_add(dd_t *d, uint32_t lba, uint32_t pba, dd_req_t *q)
+{
+	dd_jblk_t	*j;
+	dd_jhdr_t	*jh;
+	dd_jrec_t	*jr;
+
+	ASSERT(MUTEX_HELD(&d->d_lock));
+
+	for (;;) {
+		if (d->d_error != 0)
+			return (d->d_error);
+
+		j = d->d_fill;
+		jh = (dd_jhdr_t *)j->j_buf;
+		if (jh->jh_n == DD_JMAX) {
+			if (d->d_busy)
+				cv_wait(&d->d_cv, &d->d_lock);
+			else
+				dd_journal_issue(d);
+			continue;
+		}
+		if (jh->jh_n == 0 && DD_JUSED(d) + 2 >= d->d_sb.sb_jblks) {
+			cv_signal(&d->d_scv);
+			cv_wait(&d->d_cv, &d->d_lock);
+			continue;
+		}
+		break;
+	}
+
+	jr = (dd_jrec_t *)(jh + 1) + jh->jh_n++;
+	jr->jr_lba = lba;
+	jr->jr_pba = pba;
+	if (j->j_nreqs == 0 || j->j_reqs[j->j_nreqs - 1] != q) {
+		j->j_reqs[j->j_nreqs++] = q;
+		atomic_inc_32(&q->q_pending);
+	}
+
+	return (0);
+}
+
+/*
+ * Writes
+ */
+
+/* Write the new blocks of a request, runs of them at once */
+static int
+dd_write_data(dd_t *d, struct buf *bp, uint32_t *pbas, uint8_t *isnew,
+    size_t n)
+{
+	struct buf	**bps;
+	size_t		nbps = 0;
+	int		rc = 0, error;
+
+	bps = kmem_alloc(n * sizeof (struct buf *), KM_SLEEP);
+	for (size_t i = 0; i < n; ) {
+		struct buf	*cbp;
+		size_t		j;
+
+		if (!isnew[i]) {
+			i++;
+			continue;
+		}
+		for (j = i + 1; j < n && isnew[j] &&
+		    pbas[j] == pbas[i] + (j - i); j++)
+			;
+
+		cbp = bps[nbps++] = getrbuf(KM_SLEEP);
+		cbp->b_flags = B_BUSY | B_WRITE;
+		cbp->b_un.b_addr = bp->b_un.b_addr + i * DD_BSIZE;
+		cbp->b_bcount = (j - i) * DD_BSIZE;
+		cbp->b_lblkno = dd_pba_blk(d, pbas[i]) * DD_DBPB;
+		cbp->b_blkno = cbp->b_lblkno;
+		cbp->b_edev = d->d_dmip->tdev;
+		cbp->b_dev = cmpdev(d->d_dmip->tdev);
+		dm_split_issue(cbp, d->d_dmip->lh, &d->d_dmip->limits);
+		i = j;
+	}
+	for (size_t i = 0; i < nbps; i++) {
+		if ((error = biowait(bps[i])) != 0 && rc == 0)
+			rc = error;
+		freerbuf(bps[i]);
+	}
+	kmem_free(bps, n * sizeof (struct buf *));
+
+	return (rc);
+}
+
+/*
+ * Taskq: fingerprint every block of a write, store the ones not found and
+ * journal where they all are now.
+ */
+static void
+dd_write(void *arg)
+{
+	dd_req_t	*q = arg;
+	dd_t		*d = q->q_dd;
+	struct buf	*bp = q->q_bp;
+	uint32_t	lba = (uint32_t)(bp->b_lblkno / DD_DBPB);
+	size_t		n = bp->b_bcount >> DD_BSHIFT;
+	uint32_t	*pbas;
+	uint8_t		*isnew;
+	caddr_t		buf;
+	size_t		i, done = 0;
+	int		rc = 0;
+
+	pbas = kmem_zalloc(n * sizeof (uint32_t), KM_SLEEP);
+	isnew = kmem_zalloc(n, KM_SLEEP);
+	buf = kmem_alloc(DD_BSIZE, KM_SLEEP);
+	bp_mapin(bp);
+
+	for (i = 0; i < n && rc == 0; i++) {
+		caddr_t		data = bp->b_un.b_addr + i * DD_BSIZE;
+		boolean_t	zero;
+		uint64_t	fp = dd_hash(data, &zero);
+
+		atomic_inc_64(&d->d_blocks);
+		if (zero) {
+			atomic_inc_64(&d->d_zeroes);
+			continue;
+		}
+		if ((pbas[i] = dd_find(d, fp, data, buf)) != DD_NOBLK) {
+			atomic_inc_64(&d->d_dups);
+			continue;
+		}
+
+		/* Blocks freed come back with the next checkpoint */
+		mutex_enter(&d->d_lock);
+		while ((pbas[i] = dd_alloc(d)) == DD_NOBLK) {
+			if (d->d_npend + d->d_nfreeing == 0 ||
+			    d->d_error != 0 || d->d_exiting) {
+				rc = ENOSPC;
+				break;
+			}
+			cv_signal(&d->d_scv);
+			cv_wait(&d->d_cv, &d->d_lock);
+		}
+		if (rc == 0) {
+			dd_insert(d, fp, pbas[i]);
+			isnew[i] = 1;
+		}
+		mutex_exit(&d->d_lock);
+	}
+
+	if (rc == 0)
+		rc = dd_write_data(d, bp, pbas, isnew, n);
+
+	mutex_enter(&d->d_lock);
+	if (rc == 0) {
+		while (d->d_cpwant)
+			cv_wait(&d->d_cv, &d->d_lock);
+		for (; done < n; done++) {
+			if ((rc = dd_journal_add(d, lba + done, pbas[done],
+			    q)) != 0)
+				break;
+		}
+		if (!d->d_busy && d->d_error == 0 &&
+		    ((dd_jhdr_t *)d->d_fill->j_buf)->jh_n != 0)
+			dd_journal_issue(d);
+	}
+	if (rc != 0) {
+		/* Let go of whatever did not make it into the journal */
+		for (i = done; i < n; i++) {
+			uint32_t	pba = pbas[i];
+
+			if (pba == DD_NOBLK)
+				continue;
+			d->d_hold[pba]--;
+			if (isnew[i] && dd_isfree(d, pba))
+				d->d_nfree++;
+		}
+		q->q_error = rc;
+	}
+	mutex_exit(&d->d_lock);
+
+	kmem_free(buf, DD_BSIZE);
+	kmem_free(isnew, n);
+	kmem_free(pbas, n * sizeof (uint32_t));
+
+	dd_req_rele(q);
+}
+
+/*
+ * Reads
+ */
+static void dd_read_task(void *);
+
+/* From mapio unmapped, or from the taskq once the buffer is mapped in */
+static void
+dd_read(dd_t *d, dm_split_t *ds, boolean_t mapped)
+{
+	struct buf	*bp = ds->ds_bp;
+	dm_child_t	*chain = NULL;
+	size_t		max = d->d_dmip->limits.dl_maxxfer >> DD_BSHIFT;
+	uint64_t	lba = bp->b_lblkno / DD_DBPB;
+	size_t		n = bp->b_bcount >> DD_BSHIFT;
+	size_t		i;
+
+	/* Device reads no larger than it takes */
+	max = MAX(max, 1);
+
+	mutex_enter(&d->d_lock);
+
+	/* Zeroes to fill in? Then the buffer has to be mapped in, later */
+	if (!mapped) {
+		for (i = 0; i < n; i++) {
+			if (d->d_map[lba + i] == DD_NOBLK)
+				break;
+		}
+		if (i != n) {
+			mutex_exit(&d->d_lock);
+			if (ddi_taskq_dispatch(d->d_tq, dd_read_task, ds,
+			    DDI_NOSLEEP) != DDI_SUCCESS) {
+				dm_split_error(ds, ENOMEM);
+				dm_split_rele(ds);
+			}
+			return;
+		}
+	}
+
+	for (i = 0; i < n; ) {
+		uint32_t	pba = d->d_map[lba + i];
+		dm_child_t	*dc;
+		size_t		j;
+
+		if (pba == DD_NOBLK) {
+			bzero(bp->b_un.b_addr + i * DD_BSIZE, DD_BSIZE);
+			i++;
+			continue;
+		}
+
+		/* Physically contiguous run on the device */
+		for (j = i + 1; j < n && j - i < max &&
+		    d->d_map[lba + j] == pba + (j - i); j++)
+			;
+
+		dc = dm_split_child(ds, i * DD_BSIZE, (j - i) * DD_BSIZE,
+		    d->d_dmip->tdev, dd_pba_blk(d, pba) * DD_DBPB, KM_NOSLEEP);
+		if (dc == NULL)
+			break;
+		dc->dc_next = chain;
+		chain = dc;
+		i = j;
+	}
+
+	mutex_exit(&d->d_lock);
+
+	while (chain != NULL) {
+		dm_child_t	*dc = chain;
+
+		chain = dc->dc_next;
+		dm_issue(d->d_dmip->lh, &dc->dc_buf);
+	}
+
+	dm_split_rele(ds);
+}
+
+static void
+dd_read_task(void *arg)
+{
+	dm_split_t	*ds = arg;
+
+	bp_mapin(ds->ds_bp);
+	dd_read(ds->ds_arg, ds, B_TRUE);
+}
+
+/*
+ * Checkpoints
+ *
+ * Called by the syncer thread with the lock held.  The journal is drained
+ * first so that the snapshot covers every record before the position it
+ * gives, the changed pages are copied out and the lock is dropped while
+ * they are written.  The header goes last, once the pages are stable.
+ */
+static void
+dd_checkpoint(dd_t *d)
+{
+	int		slot = d->d_cpslot;
+	ulong_t		*dirty = d->d_dirty[slot];
+	uint64_t	base = d->d_sb.sb_cpstart[slot];
+	size_t		nwords = BT_BITOUL(d->d_sb.sb_npblks + 1);
+	dd_cphdr_t	*cp;
+	caddr_t		stage;
+	size_t		*pages;
+	size_t		ndirty = 0;
+	ulong_t		*tmp;
+	int		rc = 0;
+
+	ASSERT(MUTEX_HELD(&d->d_lock));
+
+	d->d_cpwant = B_TRUE;
+	while (d->d_busy || ((dd_jhdr_t *)d->d_fill->j_buf)->jh_n != 0) {
+		if (d->d_error != 0) {
+			/* The journal is gone, the last checkpoint has to do */
+			d->d_cpwant = B_FALSE;
+			cv_broadcast(&d->d_cv);
+			return;
+		}
+		if (d->d_busy)
+			cv_wait(&d->d_cv, &d->d_lock);
+		else
+			dd_journal_issue(d);
+	}
+
+	for (size_t pg = 0; pg < d->d_npages; pg++) {
+		if (BT_TEST(dirty, pg))
+			ndirty++;
+	}
+
+	stage = kmem_alloc(MAX(ndirty, 1) * DD_BSIZE, KM_SLEEP);
+	pages = kmem_alloc(MAX(ndirty, 1) * sizeof (size_t), KM_SLEEP);
+	cp = kmem_zalloc(DD_BSIZE, KM_SLEEP);
+
+	for (size_t pg = 0, i = 0; pg < d->d_npages; pg++) {
+		if (!BT_TEST(dirty, pg))
+			continue;
+		bcopy(dd_page(d, pg), stage + i * DD_BSIZE, DD_BSIZE);
+		pages[i++] = pg;
+		BT_CLEAR(dirty, pg);
+	}
+
+	/* Blocks freed so far are free once this is on the device */
+	tmp = d->d_freeing;
+	d->d_freeing = d->d_pend;
+	d->d_pend = tmp;
+	d->d_nfreeing = d->d_npend;
+	d->d_npend = 0;
+
+	cp->cp_magic = DD_CPMAGIC;
+	cp->cp_seq = d->d_cpseq + 1;
+	cp->cp_jseq = d->d_jseq;
+	cp->cp_sum = dm_cksum(cp, offsetof(dd_cphdr_t, cp_sum));
+
+	d->d_cpwant = B_FALSE;
+	cv_broadcast(&d->d_cv);
+	mutex_exit(&d->d_lock);
+
+	/* Runs of consecutive pages go out together */
+	for (size_t i = 0; i < ndirty && rc == 0; ) {
+		size_t	j = i + 1;
+
+		while (j < ndirty && pages[j] == pages[j - 1] + 1 &&
+		    (j - i) * DD_BSIZE < DD_IOMAX)
+			j++;
+		rc = dd_bio(d, stage + i * DD_BSIZE, (j - i) * DD_BSIZE,
+		    base + 1 + pages[i], B_WRITE);
+		i = j;
+	}
+	if (rc == 0) {
+		(void) dm_target_flush_dev(d->d_dmip, d->d_dmip->lh);
+		rc = dd_bio(d, (caddr_t)cp, DD_BSIZE, base, B_WRITE);
+		(void) dm_target_flush_dev(d->d_dmip, d->d_dmip->lh);
+	}
+
+	mutex_enter(&d->d_lock);
+
+	if (rc == 0) {
+		d->d_cpseq++;
+		d->d_cpslot ^= 1;
+		d->d_cpjseq = cp->cp_jseq;
+
+		for (size_t w = 0; w < nwords; w++) {
+			ulong_t	bits = d->d_freeing[w];
+
+			d->d_freeing[w] = 0;
+			for (uint32_t pba = w * BT_NBIPUL; bits != 0;
+			    pba++, bits >>= 1) {
+				if ((bits & 1) && dd_isfree(d, pba))
+					d->d_nfree++;
+			}
+		}
+	} else {
+		cmn_err(CE_WARN, "dm_dedup: %s: checkpoint failed (%d)",
+		    refstr_value(d->d_dmip->name), rc);
+		for (size_t i = 0; i < ndirty; i++)
+			BT_SET(dirty, pages[i]);
+		for (size_t w = 0; w < nwords; w++) {
+			d->d_pend[w] |= d->d_freeing[w];
+			d->d_freeing[w] = 0;
+		}
+		d->d_npend += d->d_nfreeing;
+	}
+	d->d_nfreeing = 0;
+	cv_broadcast(&d->d_cv);
+
+	kmem_free(cp, DD_BSIZE);
+	kmem_free(pages, MAX(ndirty, 1) * sizeof (size_t));
+	kmem_free(stage, MAX(ndirty, 1) * DD_BSIZE);
+}
+
+static void
+dd_syncer(void *arg)
+{
+	dd_t		*d = arg;
+	caddr_t		buf;
+	clock_t		last = ddi_get_lbolt();
+
+	buf = kmem_alloc(DD_BSIZE, KM_SLEEP);
+
+	mutex_enter(&d->d_lock);
+
+	while (!d->d_exiting) {
+		(void) cv_reltimedwait(&d->d_scv, &d->d_lock,
+		    drv_usectohz(MICROSEC), TR_CLOCK_TICK);
+
+		if (d->d_nspillq != 0) {
+			mutex_exit(&d->d_lock);
+			dd_spill_flush(d, buf);
+			mutex_enter(&d->d_lock);
+		}
+
+		if (d->d_error == 0 &&
+		    (DD_JUSED(d) >= d->d_sb.sb_jblks / 2 ||
+		    (d->d_npend != 0 && d->d_nfree <= DD_RESERVE) ||
+		    (DD_JUSED(d) != 0 && ddi_get_lbolt() - last >=
+		    drv_usectohz(DD_CP_SECS * MICROSEC)))) {
+			dd_checkpoint(d);
+			last = ddi_get_lbolt();
+		}
+	}
+
+	mutex_exit(&d->d_lock);
+
+	kmem_free(buf, DD_BSIZE);
+	thread_exit();
+}
+
+/*
+ * Format and mount
+ */
+
+/* Index buckets: enough for every physical block, within 'mem' bytes */
+static uint64_t
+dd_nbuckets(uint64_t npblks, uint64_t mem)
+{
+	uint64_t	want = howmany(npblks, DD_SLOTS);
+	uint64_t	nb;
+
+	for (nb = DD_BKTPG; nb < want &&
+	    nb * 2 * sizeof (dd_bucket_t) <= mem; nb <<= 1)
+		;
+	return (nb);
+}
+
+static int
+dd_format(dd_t *d, uint64_t devsize, uint64_t nlblks, uint64_t mem,
+    uint64_t jblks)
+{
+	dd_super_t	*sb = &d->d_sb;
+	uint64_t	nblks = devsize >> DD_BSHIFT;
+	uint64_t	np = nblks, nl, nbuckets, nspill, cpblks, over;
+	caddr_t		zbuf;
+	dd_cphdr_t	*cp;
+	int		rc = 0;
+
+	if (jblks < DD_JMIN)
+		return (EINVAL);
+
+	/* Shrink the physical blocks until the metadata fits in front */
+	for (;;) {
+		nl = (nlblks != 0) ? nlblks : np;
+		nspill = roundup(howmany(np, DD_SLOTS) * 2, DD_BKTPG);
+		nbuckets = dd_nbuckets(np, mem);
+		cpblks = 1 + howmany(nl, DD_MAPPG) + howmany(np + 1, DD_MAPPG) +
+		    nbuckets / DD_BKTPG + howmany(nspill, DD_BSIZE * NBBY);
+		over = 1 + 2 * cpblks + jblks + nspill / DD_BKTPG;
+		if (over >= nblks)
+			return (ENOSPC);
+		if (np + over <= nblks)
+			break;
+		np = nblks - over;
+	}
+	if (np <= DD_RESERVE * 4)
+		return (ENOSPC);
+	if (np >= UINT32_MAX || nl >= UINT32_MAX)
+		return (EINVAL);
+
+	bzero(sb, sizeof (*sb));
+	sb->sb_magic = DD_MAGIC;
+	sb->sb_version = DD_VERSION;
+	sb->sb_nlblks = nl;
+	sb->sb_npblks = np;
+	sb->sb_nbuckets = nbuckets;
+	sb->sb_nspill = nspill;
+	sb->sb_cpblks = cpblks;
+	sb->sb_cpstart[0] = 1;
+	sb->sb_cpstart[1] = 1 + cpblks;
+	sb->sb_jstart = 1 + 2 * cpblks;
+	sb->sb_jblks = jblks;
+	sb->sb_spillstart = sb->sb_jstart + jblks;
+	sb->sb_datastart = sb->sb_spillstart + nspill / DD_BKTPG;
+	sb->sb_sum = dm_cksum(sb, offsetof(dd_super_t, sb_sum));
+
+	/*
+	 * Both slots and the journal cleared.  The spill is not, whatever
+	 * is there stays out of sight until its bucket is written, and then
+	 * fails the compare.
+	 */
+	zbuf = kmem_zalloc(DD_IOMAX, KM_SLEEP);
+	for (uint64_t blk = sb->sb_cpstart[0]; blk < sb->sb_spillstart &&
+	    rc == 0; ) {
+		uint64_t	n = MIN(sb->sb_spillstart - blk,
+		    DD_IOMAX >> DD_BSHIFT);
+
+		rc = dd_bio(d, zbuf, n << DD_BSHIFT, blk, B_WRITE);
+		blk += n;
+	}
+
+	cp = (dd_cphdr_t *)zbuf;
+	cp->cp_magic = DD_CPMAGIC;
+	cp->cp_seq = 1;
+	cp->cp_jseq = 1;
+	cp->cp_sum = dm_cksum(cp, offsetof(dd_cphdr_t, cp_sum));
+	if (rc == 0)
+		rc = dd_bio(d, zbuf, DD_BSIZE, sb->sb_cpstart[0], B_WRITE);
+
+	bzero(zbuf, DD_BSIZE);
+	bcopy(sb, zbuf, sizeof (*sb));
+	if (rc == 0) {
+		(void) dm_target_flush_dev(d->d_dmip, d->d_dmip->lh);
+		rc = dd_bio(d, zbuf, DD_BSIZE, 0, B_WRITE);
+		(void) dm_target_flush_dev(d->d_dmip, d->d_dmip->lh);
+	}
+
+	kmem_free(zbuf, DD_IOMAX);
+
+	return (rc);
+}
+
+/* Apply the journal blocks written after the checkpoint */
+static void
+dd_replay(dd_t *d)
+{
+	caddr_t		buf;
+	dd_jhdr_t	*jh;
+	dd_jrec_t	*jr;
+	uint64_t	n = 0;
+
+	buf = kmem_alloc(DD_BSIZE, KM_SLEEP);
+	jh = (dd_jhdr_t *)buf;
+	jr = (dd_jrec_t *)(jh + 1);
+
+	while (DD_JUSED(d) < d->d_sb.sb_jblks) {
+		uint32_t	sum;
+
+		if (dd_bio(d, buf, DD_BSIZE, d->d_sb.sb_jstart +
+		    d->d_jseq % d->d_sb.sb_jblks, B_READ) != 0)
+			break;
+
+		sum = jh->jh_sum;
+		jh->jh_sum = 0;
+		if (jh->jh_magic != DD_JMAGIC || jh->jh_seq != d->d_jseq ||
+		    jh->jh_n == 0 || jh->jh_n > DD_JMAX ||
+		    dm_cksum(buf, DD_BSIZE) != sum)
+			break;
+
+		mutex_enter(&d->d_lock);
+		for (uint32_t i = 0; i < jh->jh_n; i++) {
+			if (jr[i].jr_lba < d->d_sb.sb_nlblks &&
+			    jr[i].jr_pba <= d->d_sb.sb_npblks)
+				dd_apply(d, jr[i].jr_lba, jr[i].jr_pba);
+		}
+		mutex_exit(&d->d_lock);
+
+		d->d_jseq++;
+		n++;
+	}
+
+	if (n != 0) {
+		cmn_err(CE_CONT, "dm_dedup: %s: replayed %llu journal "
+		    "blocks\n", refstr_value(d->d_dmip->name), (u_longlong_t)n);
+	}
+
+	kmem_free(buf, DD_BSIZE);
+}
+
+static int
+dd_mount(dd_t *d)
+{
+	dd_super_t	*sb = &d->d_sb;
+	dd_cphdr_t	*cps[2];
+	dd_cphdr_t	*cp = NULL;
+	caddr_t		blk;
+	uint64_t	base;
+	int		slot = 0;
+	int		rc;
+
+	blk = kmem_zalloc(DD_BSIZE, KM_SLEEP);
+	if ((rc = dd_bio(d, blk, DD_BSIZE, 0, B_READ)) != 0) {
+		kmem_free(blk, DD_BSIZE);
+		return (rc);
+	}
+	bcopy(blk, sb, sizeof (*sb));
+	kmem_free(blk, DD_BSIZE);
+
+	if (sb->sb_magic != DD_MAGIC || sb->sb_version != DD_VERSION ||
+	    sb->sb_sum != dm_cksum(sb, offsetof(dd_super_t, sb_sum)) ||
+	    sb->sb_datastart + sb->sb_npblks >
+	    (d->d_dmip->size >> DD_BSHIFT) || sb->sb_jblks < DD_JMIN ||
+	    sb->sb_nspill == 0 || !ISP2(sb->sb_nbuckets) ||
+	    sb->sb_nbuckets < DD_BKTPG)
+		return (EINVAL);
+
+	/* The newest valid checkpoint wins */
+	for (int i = 0; i < 2; i++) {
+		cps[i] = kmem_zalloc(DD_BSIZE, KM_SLEEP);
+		if (dd_bio(d, (caddr_t)cps[i], DD_BSIZE, sb->sb_cpstart[i],
+		    B_READ) != 0 || cps[i]->cp_magic != DD_CPMAGIC ||
+		    cps[i]->cp_sum != dm_cksum(cps[i],
+		    offsetof(dd_cphdr_t, cp_sum)))
+			continue;
+		if (cp == NULL || cps[i]->cp_seq > cp->cp_seq) {
+			cp = cps[i];
+			slot = i;
+		}
+	}
+	if (cp == NULL) {
+		rc = EINVAL;
+		goto out;
+	}
+
+	d->d_mappages = howmany(sb->sb_nlblks, DD_MAPPG);
+	d->d_refpages = howmany(sb->sb_npblks + 1, DD_MAPPG);
+	d->d_idxpages = sb->sb_nbuckets / DD_BKTPG;
+	d->d_sppages = howmany(sb->sb_nspill, DD_BSIZE * NBBY);
+	d->d_npages = d->d_mappages + d->d_refpages + d->d_idxpages +
+	    d->d_sppages;
+	d->d_map = kmem_zalloc(d->d_mappages * DD_BSIZE, KM_SLEEP);
+	d->d_ref = kmem_zalloc(d->d_refpages * DD_BSIZE, KM_SLEEP);
+	d->d_index = kmem_zalloc(d->d_idxpages * DD_BSIZE, KM_SLEEP);
+	d->d_spilled = kmem_zalloc(d->d_sppages * DD_BSIZE, KM_SLEEP);
+	d->d_hold = kmem_zalloc((sb->sb_npblks + 1) * sizeof (uint16_t),
+	    KM_SLEEP);
+	d->d_pend = kmem_zalloc(BT_SIZEOFMAP(sb->sb_npblks + 1), KM_SLEEP);
+	d->d_freeing = kmem_zalloc(BT_SIZEOFMAP(sb->sb_npblks + 1), KM_SLEEP);
+	d->d_dirty[0] = kmem_zalloc(BT_SIZEOFMAP(d->d_npages), KM_SLEEP);
+	d->d_dirty[1] = kmem_zalloc(BT_SIZEOFMAP(d->d_npages), KM_SLEEP);
+
+	base = sb->sb_cpstart[slot] + 1;
+	if ((rc = dd_bio_big(d, (caddr_t)d->d_map, d->d_mappages * DD_BSIZE,
+	    base, B_READ)) != 0 ||
+	    (rc = dd_bio_big(d, (caddr_t)d->d_ref, d->d_refpages * DD_BSIZE,
+	    base + d->d_mappages, B_READ)) != 0 ||
+	    (rc = dd_bio_big(d, (caddr_t)d->d_index,
+	    d->d_idxpages * DD_BSIZE, base + d->d_mappages + d->d_refpages,
+	    B_READ)) != 0 ||
+	    (rc = dd_bio_big(d, (caddr_t)d->d_spilled,
+	    d->d_sppages * DD_BSIZE, base + d->d_npages - d->d_sppages,
+	    B_READ)) != 0)
+		goto out;
+
+	/* The other slot is older than this one all over */
+	for (size_t pg = 0; pg < d->d_npages; pg++)
+		BT_SET(d->d_dirty[slot ^ 1], pg);
+	d->d_cpslot = slot ^ 1;
+	d->d_cpseq = cp->cp_seq;
+	d->d_cpjseq = d->d_jseq = cp->cp_jseq;
+
+	dd_replay(d);
+
+	for (uint32_t pba = 1; pba <= sb->sb_npblks; pba++) {
+		if (dd_isfree(d, pba))
+			d->d_nfree++;
+	}
+
+out:
+	kmem_free(cps[0], DD_BSIZE);
+	kmem_free(cps[1], DD_BSIZE);
+
+	return (rc);
+}
+
+static void
+dd_free(dd_t *d)
+{
+	size_t	pmap = BT_SIZEOFMAP(d->d_sb.sb_npblks + 1);
+
+	if (d->d_tq != NULL)
+		ddi_taskq_destroy(d->d_tq);
+	for (int i = 0; i < 2; i++) {
+		if (d->d_jblks[i].j_buf != NULL)
+			kmem_free(d->d_jblks[i].j_buf, DD_BSIZE);
+		if (d->d_jblks[i].j_bp != NULL)
+			freerbuf(d->d_jblks[i].j_bp);
+		if (d->d_dirty[i] != NULL)
+			kmem_free(d->d_dirty[i], BT_SIZEOFMAP(d->d_npages));
+	}
+	if (d->d_map != NULL)
+		kmem_free(d->d_map, d->d_mappages * DD_BSIZE);
+	if (d->d_ref != NULL)
+		kmem_free(d->d_ref, d->d_refpages * DD_BSIZE);
+	if (d->d_index != NULL)
+		kmem_free(d->d_index, d->d_idxpages * DD_BSIZE);
+	if (d->d_spilled != NULL)
+		kmem_free(d->d_spilled, d->d_sppages * DD_BSIZE);
+	if (d->d_hold != NULL)
+		kmem_free(d->d_hold, (d->d_sb.sb_npblks + 1) *
+		    sizeof (uint16_t));
+	if (d->d_pend != NULL)
+		kmem_free(d->d_pend, pmap);
+	if (d->d_freeing != NULL)
+		kmem_free(d->d_freeing, pmap);
+
+	cv_destroy(&d->d_scv);
+	cv_destroy(&d->d_cv);
+	mutex_destroy(&d->d_lock);
+	kmem_free(d, sizeof (*d));
+}
+
+/*
+ * Plugin entry points
+ */
+static int
+dm_dedup_init(void)
+{
+	return (0);
+}
+
+static void
+dm_dedup_fini(void)
+{
+}
+
+static int
+dm_dedup_create(dm_info_t *dmip, int argc, char **argv, cred_t *crp,
+    void **privp)
+{
+	dd_t		*d;
+	boolean_t	format = B_FALSE;
+	uint64_t	logical = 0;
+	uint64_t	mem = (uint64_t)DD_INDEX << 20;
+	uint64_t	jblks = DD_JBLKS;
+	int		rc;
+
+	for (int i = 0; i < argc; i++) {
+		unsigned long	val;
+
+		if (strcmp(argv[i], "format") == 0) {
+			format = B_TRUE;
+		} else if (strncmp(argv[i], "logical=", 8) == 0 &&
+		    ddi_strtoul(argv[i] + 8, NULL, 10, &val) == 0) {
+			logical = (uint64_t)val << (20 - DD_BSHIFT);
+		} else if (strncmp(argv[i], "index=", 6) == 0 &&
+		    ddi_strtoul(argv[i] + 6, NULL, 10, &val) == 0) {
+			mem = (uint64_t)val << 20;
+		} else if (strncmp(argv[i], "journal=", 8) == 0 &&
+		    ddi_strtoul(argv[i] + 8, NULL, 10, &val) == 0) {
+			jblks = (uint64_t)val * 1024 / DD_BSIZE;
+		} else {
+			cmn_err(CE_WARN, "dm_dedup: unknown argument '%s'",
+			    argv[i]);
+			return (EINVAL);
+		}
+	}
+
+	d = kmem_zalloc(sizeof (*d), KM_SLEEP);
+	d->d_dmip = dmip;
+	mutex_init(&d->d_lock, NULL, MUTEX_DRIVER, NULL);
+	cv_init(&d->d_cv, NULL, CV_DRIVER, NULL);
+	cv_init(&d->d_scv, NULL, CV_DRIVER, NULL);
+
+	if (format && (rc = dd_format(d, dmip->size, logical, mem,
+	    jblks)) != 0) {
+		cmn_err(CE_WARN, "dm_dedup: %s: format failed (%d)",
+		    refstr_value(dmip->name), rc);
+		dd_free(d);
+		return (rc);
+	}
+
+	if ((rc = dd_mount(d)) != 0) {
+		cmn_err(CE_WARN, "dm_dedup: %s: no valid metadata found (%d)",
+		    refstr_value(dmip->name), rc);
+		dd_free(d);
+		return (rc);
+	}
+
+	for (int i = 0; i < 2; i++) {
+		d->d_jblks[i].j_buf = kmem_zalloc(DD_BSIZE, KM_SLEEP);
+		d->d_jblks[i].j_bp = getrbuf(KM_SLEEP);
+	}
+	d->d_fill = &d->d_jblks[0];
+	d->d_flight = &d->d_jblks[1];
+
+	d->d_tq = ddi_taskq_create(NULL, "dm_dedup", ncpus, TASKQ_DEFAULTPRI,
+	    0);
+	d->d_syncer = thread_create(NULL, 0, dd_syncer, d, 0, &p0, TS_RUN,
+	    minclsyspri);
+
+	dmip->size = d->d_sb.sb_nlblks << DD_BSHIFT;
+	*privp = d;
+
+	return (0);
+}
+
+static void
+dm_dedup_destroy(dm_info_t *dmip, void *priv)
+{
+	dd_t		*d = priv;
+	kt_did_t	tid = d->d_syncer->t_did;
+	caddr_t		buf;
+
+	/* Writes still being fingerprinted may need the syncer */
+	ddi_taskq_wait(d->d_tq);
+
+	mutex_enter(&d->d_lock);
+	d->d_exiting = B_TRUE;
+	cv_signal(&d->d_scv);
+	mutex_exit(&d->d_lock);
+	thread_join(tid);
+
+	/* Push the spill and the journal out, leave a checkpoint behind */
+	buf = kmem_alloc(DD_BSIZE, KM_SLEEP);
+	dd_spill_flush(d, buf);
+	kmem_free(buf, DD_BSIZE);
+
+	mutex_enter(&d->d_lock);
+	if (d->d_error == 0)
+		dd_checkpoint(d);
+	while (d->d_busy)
+		cv_wait(&d->d_cv, &d->d_lock);
+	mutex_exit(&d->d_lock);
+
+	dd_free(d);
+}
+
+static dm_mapio_t
+dm_dedup_mapio(dm_info_t *dmip, void *priv, struct buf *bp, dm_remap_t *rp)
+{
+	dd_t		*d = priv;
+	dd_req_t	*q;
+	uint64_t	off = ldbtob(bp->b_lblkno);
+
+	if ((off & (DD_BSIZE - 1)) != 0 ||
+	    (bp->b_bcount & (DD_BSIZE - 1)) != 0) {
+		bioerror(bp, EINVAL);
+		return (DM_MAPIO_KILL);
+	}
+	if (bp->b_bcount == 0) {
+		bp->b_resid = 0;
+		biodone(bp);
+		return (DM_MAPIO_SUBMITTED);
+	}
+	if (bp->b_flags & B_READ) {
+		dm_split_t	*ds;
+
+		if ((ds = dm_split_alloc(bp, NULL, d, KM_NOSLEEP)) == NULL) {
+			bioerror(bp, ENOMEM);
+			return (DM_MAPIO_KILL);
+		}
+		dd_read(d, ds, B_FALSE);
+		return (DM_MAPIO_SUBMITTED);
+	}
+
+	if ((q = kmem_zalloc(sizeof (*q), KM_NOSLEEP)) == NULL) {
+		bioerror(bp, ENOMEM);
+		return (DM_MAPIO_KILL);
+	}
+	q->q_bp = bp;
+	q->q_dd = d;
+	q->q_pending = 1;
+	if (ddi_taskq_dispatch(d->d_tq, dd_write, q, DDI_NOSLEEP) !=
+	    DDI_SUCCESS) {
+		kmem_free(q, sizeof (*q));
+		bioerror(bp, ENOMEM);
+		return (DM_MAPIO_KILL);
+	}
+
+	return (DM_MAPIO_SUBMITTED);
+}
+
+static int
+dm_dedup_stats(dm_info_t *dmip, void *priv, nvlist_t *nvl)
+{
+	dd_t	*d = priv;
+
+	mutex_enter(&d->d_lock);
+	(void) nvlist_add_uint64(nvl, "logical", d->d_sb.sb_nlblks);
+	(void) nvlist_add_uint64(nvl, "physical", d->d_sb.sb_npblks);
+	(void) nvlist_add_uint64(nvl, "free", d->d_nfree);
+	(void) nvlist_add_uint64(nvl, "pending", d->d_npend + d->d_nfreeing);
+	(void) nvlist_add_uint64(nvl, "blocks", d->d_blocks);
+	(void) nvlist_add_uint64(nvl, "duplicates", d->d_dups);
+	(void) nvlist_add_uint64(nvl, "zeroes", d->d_zeroes);
+	(void) nvlist_add_uint64(nvl, "mismatches", d->d_mismatch);
+	(void) nvlist_add_uint64(nvl, "index_buckets", d->d_sb.sb_nbuckets);
+	(void) nvlist_add_uint64(nvl, "spill_reads", d->d_spillreads);
+	(void) nvlist_add_uint64(nvl, "spill_drops", d->d_spilldrops);
+	(void) nvlist_add_uint64(nvl, "journal", d->d_jseq);
+	(void) nvlist_add_uint64(nvl, "checkpoint", d->d_cpseq);
+	(void) nvlist_add_int32(nvl, "error", d->d_error);
+	mutex_exit(&d->d_lock);
+
+	return (0);
+}
+
+
+dm_plugin_ops_t dm_ops = {
+	.dpo_rev	= DPO_REV,
+	.dpo_name	= "dedup",
+	.dpo_init	= dm_dedup_init,
+	.dpo_fini	= dm_dedup_fini,
+	.dpo_create	= dm_dedup_create,
+	.dpo_destroy	= dm_dedup_destroy,
+	.dpo_mapio	= dm_dedup_mapio,
+	.dpo_stats	= dm_dedup_stats,
+};
+
+static struct modlmisc modlmisc = {
+	.misc_modops	= &mod_miscops,
+	.misc_linkinfo	= "Solaris Device Mapper deduplication plugin"
+};
+
+static struct modlinkage modlinkage = {
+	.ml_rev		= MODREV_1,
+	.ml_linkage	= {&modlmisc, NULL, NULL, NULL}
+};
+
+int
+_init(void)
+{
+	return (mod_install(&modlinkage));
+}
+
+int
+_info(struct modinfo *mip)
+{
+	return (mod_info(&modlinkage, mip));
+}
+
+int
+_fini(void)
+{
+	return (mod_remove(&modlinkage));
+}
@@ -0,0 +1,906 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright 2011 Grigale Ltd. All rights reserved.
+ * Use is subject to license terms.
+ */
+
+
+/*
+ * 512-byte sector emulation target
+ *
+ * Presents 512-byte sectors on a device that only takes whole blocks of a
+ * larger size, 4K native drives mostly.  I/O covering whole blocks goes
+ * straight to the device, aligned reads by the core's in-place remap; the
+ * parts of blocks at either end are read, merged and written back whole.
+ *
+ * Every block with partial I/O on it gets an entry, which is its lock:
+ * pieces queue on it and are dealt with one round at a time, a read of the
+ * block if it is needed and a write of it with all the writes waiting laid
+ * over.  Writes arriving while the block is read join that round, the
+ * ones arriving while it is written the next, which needs no read as the
+ * block is in memory by then; so sectors written together cost a block
+ * write, not one each.  Entries of blocks left alone stay as a cache of
+ * recently used ones, serving reads and saving the read of a later write.
+ *
+ * Whole blocks of a write that have an entry go through it too, the rest
+ * are written directly and are kept track of until done: a block is not
+ * read while a direct write to it is in flight, so nothing older gets
+ * written back over it nor cached.
+ *
+ * Only aligned reads are dealt with in mapio.  Everything else is cut up
+ * on a taskq, where the I/O can be mapped in.
+ *
+ * Arguments:	[block=<bytes>] [cache=<KB>]
+ *
+ * block is the size emulated over, the device's logical block size by
+ * default, a power of two up to 64K.  cache is the memory blocks are kept
+ * in, which also bounds how many can be worked on at once.
+ */
+
+#include <sys/atomic.h>
+#include <sys/bitmap.h>
+#include <sys/buf.h>
+#include <sys/conf.h>
+#include <sys/errno.h>
+#include <sys/file.h>
+#include <sys/kmem.h>
+#include <sys/modctl.h>
+#include <sys/sysmacros.h>
+#include <sys/systm.h>
+#include <sys/types.h>
+#include <sys/ddi.h>
+#include <sys/sunddi.h>
+
+#include <sys/dm.h>
+#include <sys/dm_impl.h>
+#include <sys/dm_ops.h>
+
+#define	EMU_BMAX	(64 * 1024)		/* Largest block */
+#define	EMU_SECTS	(EMU_BMAX / DEV_BSIZE)	/* and its sectors */
+#define	EMU_CACHE	1024			/* Default cache, KB */
+#define	EMU_MINBLKS	16			/* Blocks cached at least */
+
+struct emu;
+
+/* A block with I/O on it, or cached */
+typedef struct emu_blk {
+	struct emu	*eb_emu;
+	struct emu_blk	*eb_next;	/* Hash chain, or free list */
+	struct emu_blk	*eb_lnext;	/* LRU list, idle blocks only */
+	struct emu_blk	*eb_lprev;
+	struct emu_blk	*eb_rnext;	/* Blocked list, or I/O to start */
+	uint64_t	eb_blk;
+	int		eb_state;
+	boolean_t	eb_valid;	/* eb_buf holds what is on the device */
+	dm_child_t	*eb_writes;	/* Waiting, newest first */
+	dm_child_t	*eb_reads;
+	dm_child_t	*eb_round;	/* Being written */
+	caddr_t		eb_buf;
+	struct buf	*eb_bp;
+} emu_blk_t;
+
+#define	EB_FREE		0
+#define	EB_IDLE		1		/* Cached, on the LRU list */
+#define	EB_NEW		2		/* Taking I/O, nothing in flight */
+#define	EB_BLOCKED	3		/* Waiting for a direct write */
+#define	EB_READ		4
+#define	EB_WRITE	5
+
+/* What to do once the lock is dropped */
+typedef struct {
+	emu_blk_t	*w_issue;	/* Blocks with I/O to start */
+	dm_child_t	*w_direct;	/* Direct pieces, on av_forw */
+	dm_child_t	*w_done;	/* Pieces complete */
+} emu_work_t;
+
+typedef struct emu {
+	dm_info_t	*e_dmip;
+	kmutex_t	e_lock;
+	ddi_taskq_t	*e_tq;		/* Mapped I/O, which is mapped in */
+	uint32_t	e_bshift;	/* log2 of the block size */
+
+	emu_blk_t	*e_blks;
+	uint32_t	e_nblks;
+	emu_blk_t	*e_free;
+	emu_blk_t	**e_hash;
+	uint32_t	e_hmask;
+	uint32_t	e_nhashed;	/* Blocks in the hash */
+	emu_blk_t	*e_lru;		/* Idle blocks, oldest first */
+	emu_blk_t	*e_mru;
+	emu_blk_t	*e_blocked;	/* Waiting for direct writes */
+	dm_child_t	*e_direct;	/* Direct writes in flight */
+	dm_child_t	*e_waitq;	/* Pieces waiting for a block */
+	dm_child_t	*e_waittail;
+
+	uint64_t	e_reads;
+	uint64_t	e_writes;
+	uint64_t	e_preads;	/* Pieces of blocks read */
+	uint64_t	e_pwrites;	/* ... written */
+	uint64_t	e_rounds;	/* Block writes merging them */
+	uint64_t	e_rmw;		/* ... that read the block first */
+	uint64_t	e_merged;	/* Writes that shared a round */
+	uint64_t	e_hits;		/* Pieces finding their block cached */
+	uint64_t	e_misses;
+	uint64_t	e_blockwaits;	/* Reads held for a direct write */
+	uint64_t	e_waits;	/* Pieces waiting for a block */
+} emu_t;
+
+#define	EMU_BSIZE(e)		((size_t)1 << (e)->e_bshift)
+#define	EMU_BOFF(e, off)	((size_t)((off) & (EMU_BSIZE(e) - 1)))
+
+static int emu_read_done(struct buf *);
+static int emu_write_done(struct buf *);
+static void emu_attach_locked(emu_t *, dm_child_t *, emu_work_t *);
+
+/* Where a piece's data is, the I/O it was cut from being mapped in */
+static caddr_t
+emu_addr(dm_child_t *dc)
+{
+	struct buf	*bp = dc->dc_split->ds_bp;
+
+	return (bp->b_un.b_addr + (dc->dc_tag - ldbtob(bp->b_lblkno)));
+}
+
+static void
+emu_piece_done(dm_child_t *dc, int error, emu_work_t *w)
+{
+	dc->dc_buf.b_resid = 0;
+	if (error != 0)
+		bioerror(&dc->dc_buf, error);
+	dc->dc_next = w->w_done;
+	w->w_done = dc;
+}
+
+/* Start the I/O and complete the pieces gathered under the lock */
+static void
+emu_work(emu_t *e, emu_work_t *w)
+{
+	ldi_handle_t	lh = e->e_dmip->lh;
+	emu_blk_t	*eb;
+	dm_child_t	*dc;
+
+	while ((dc = w->w_direct) != NULL) {
+		w->w_direct = (dm_child_t *)dc->dc_buf.av_forw;
+		dm_issue(lh, &dc->dc_buf);
+	}
+	while ((eb = w->w_issue) != NULL) {
+		w->w_issue = eb->eb_rnext;
+		dm_issue(lh, eb->eb_bp);
+	}
+	while ((dc = w->w_done) != NULL) {
+		w->w_done = dc->dc_next;
+		biodone(&dc->dc_buf);
+	}
+}
+
+/*
+ * Block entries
+ */
+static emu_blk_t *
+emu_lookup(emu_t *e, uint64_t blk)
+{
+	emu_blk_t	*eb;
+
+	ASSERT(MUTEX_HELD(&e->e_lock));
+	for (eb = e->e_hash[blk & e->e_hmask]; eb != NULL; eb = eb->eb_next) {
+		if (eb->eb_blk == blk)
+			return (eb);
+	}
+	return (NULL);
+}
+
+static void
+emu_unhash(emu_t *e, emu_blk_t *eb)
+{
+	emu_blk_t	**ebp;
+
+	for (ebp = &e->e_hash[eb->eb_blk & e->e_hmask]; *ebp != eb;
+	    ebp = &(*ebp)->eb_next)
+		;
+	*ebp = eb->eb_next;
+	e->e_nhashed--;
+}
+
+static void
+emu_lru_remove(emu_t *e, emu_blk_t *eb)
+{
+	if (eb->eb_lprev != NULL)
+		eb->eb_lprev->eb_lnext = eb->eb_lnext;
+	else
+		e->e_lru = eb->eb_lnext;
+	if (eb->eb_lnext != NULL)
+		eb->eb_lnext->eb_lprev = eb->eb_lprev;
+	else
+		e->e_mru = eb->eb_lprev;
+	eb->eb_lnext = eb->eb_lprev = NULL;
+}
+
+static void
+emu_lru_add(emu_t *e, emu_blk_t *eb)
+{
+	eb->eb_lnext = NULL;
+	if ((eb->eb_lprev = e->e_mru) != NULL)
+		e->e_mru->eb_lnext = eb;
+	else
+		e->e_lru = eb;
+	e->e_mru = eb;
+}
+
+/* An entry for 'blk', free or the least recently used, NULL if none */
+static emu_blk_t *
+emu_get(emu_t *e, uint64_t blk)
+{
+	emu_blk_t	*eb;
+
+	ASSERT(MUTEX_HELD(&e->e_lock));
+	if ((eb = e->e_free) != NULL) {
+		e->e_free = eb->eb_next;
+	} else if ((eb = e->e_lru) != NULL) {
+		emu_lru_remove(e, eb);
+		emu_unhash(e, eb);
+	} else {
+		return (NULL);
+	}
+
+	eb->eb_blk = blk;
+	eb->eb_state = EB_NEW;
+	eb->eb_valid = B_FALSE;
+	eb->eb_next = e->e_hash[blk & e->e_hmask];
+	e->e_hash[blk & e->e_hmask] = eb;
+	e->e_nhashed++;
+
+	return (eb);
+}
+
+/* Nothing more on the block: cache it if it is any use, else free it */
+static void
+emu_release(emu_t *e, emu_blk_t *eb, emu_work_t *w)
+{
+	dm_child_t	*dc;
+
+	ASSERT(MUTEX_HELD(&e->e_lock));
+	ASSERT(eb->eb_reads == NULL && eb->eb_writes == NULL);
+	if (eb->eb_valid) {
+		eb->eb_state = EB_IDLE;
+		emu_lru_add(e, eb);
+	} else {
+		emu_unhash(e, eb);
+		eb->eb_state = EB_FREE;
+		eb->eb_next = e->e_free;
+		e->e_free = eb;
+	}
+
+	while ((dc = e->e_waitq) != NULL &&
+	    (e->e_free != NULL || e->e_lru != NULL)) {
+		if ((e->e_waitq = dc->dc_next) == NULL)
+			e->e_waittail = NULL;
+		emu_attach_locked(e, dc, w);
+	}
+}
+
+/* Whether a direct write in flight covers 'blk' */
+static boolean_t
+emu_direct_over(emu_t *e, uint64_t blk)
+{
+	uint64_t	off = blk << e->e_bshift;
+
+	for (dm_child_t *dc = e->e_direct; dc != NULL; dc = dc->dc_next) {
+		if (off >= dc->dc_tag && off < dc->dc_tag + dc->dc_buf.b_bcount)
+			return (B_TRUE);
+	}
+	return (B_FALSE);
+}
+
+/* Whether the writes waiting cover the whole block between them */
+static boolean_t
+emu_covered(emu_t *e, emu_blk_t *eb)
+{
+	ulong_t		map[BT_BITOUL(EMU_SECTS)];
+	size_t		nsect = EMU_BSIZE(e) >> DEV_BSHIFT;
+	size_t		n = 0;
+
+	bzero(map, sizeof (map));
+	for (dm_child_t *dc = eb->eb_writes; dc != NULL; dc = dc->dc_next) {
+		size_t	first = EMU_BOFF(e, dc->dc_tag) >> DEV_BSHIFT;
+		size_t	last = first + btodb(dc->dc_buf.b_bcount);
+
+		for (size_t i = first; i < last; i++) {
+			if (!BT_TEST(map, i)) {
+				BT_SET(map, i);
+				n++;
+			}
+		}
+	}
+	return (n == nsect);
+}
+
+static dm_child_t *
+emu_reverse(dm_child_t *dc)
+{
+	dm_child_t	*list = NULL, *next;
+
+	for (; dc != NULL; dc = next) {
+		next = dc->dc_next;
+		dc->dc_next = list;
+		list = dc;
+	}
+	return (list);
+}
+
+/* Set the block's own buf up to read or write it */
+static void
+emu_blk_io(emu_t *e, emu_blk_t *eb, int rw, emu_work_t *w)
+{
+	dm_info_t	*dmip = e->e_dmip;
+	struct buf	*bp = eb->eb_bp;
+
+	bioreset(bp);
+	bp->b_flags = B_BUSY | rw;
+	bp->b_un.b_addr = eb->eb_buf;
+	bp->b_bcount = EMU_BSIZE(e);
+	bp->b_lblkno = btodb(eb->eb_blk << e->e_bshift);
+	bp->b_blkno = (daddr_t)bp->b_lblkno;
+	bp->b_edev = dmip->tdev;
+	bp->b_dev = cmpdev(dmip->tdev);
+	bp->b_iodone = (rw == B_READ) ? emu_read_done : emu_write_done;
+	bp->b_private = eb;
+
+	eb->eb_state = (rw == B_READ) ? EB_READ : EB_WRITE;
+	eb->eb_rnext = w->w_issue;
+	w->w_issue = eb;
+}
+
+/*
+ * Next round on a block with nothing in flight: serve the reads if it is
+ * in memory, write the writes over it if it is or they cover it all, read
+ * it otherwise.
+ */
+static void
+emu_run(emu_t *e, emu_blk_t *eb, emu_work_t *w)
+{
+	dm_child_t	*dc;
+	uint32_t	n = 0;
+
+	ASSERT(MUTEX_HELD(&e->e_lock));
+	if (eb->eb_valid) {
+		while ((dc = eb->eb_reads) != NULL) {
+			eb->eb_reads = dc->dc_next;
+			bcopy(eb->eb_buf + EMU_BOFF(e, dc->dc_tag),
+			    emu_addr(dc), dc->dc_buf.b_bcount);
+			emu_piece_done(dc, 0, w);
+		}
+	}
+
+	if (eb->eb_writes == NULL && eb->eb_reads == NULL) {
+		emu_release(e, eb, w);
+		return;
+	}
+
+	if (eb->eb_writes != NULL && (eb->eb_valid || emu_covered(e, eb))) {
+		eb->eb_round = emu_reverse(eb->eb_writes);
+		eb->eb_writes = NULL;
+		for (dc = eb->eb_round; dc != NULL; dc = dc->dc_next, n++) {
+			bcopy(emu_addr(dc), eb->eb_buf +
+			    EMU_BOFF(e, dc->dc_tag), dc->dc_buf.b_bcount);
+		}
+		eb->eb_valid = B_TRUE;
+		e->e_rounds++;
+		e->e_merged += n - 1;
+		emu_blk_io(e, eb, B_WRITE, w);
+		return;
+	}
+
+	if (emu_direct_over(e, eb->eb_blk)) {
+		eb->eb_state = EB_BLOCKED;
+		eb->eb_rnext = e->e_blocked;
+		e->e_blocked = eb;
+		e->e_blockwaits++;
+		return;
+	}
+	if (eb->eb_writes != NULL)
+		e->e_rmw++;
+	emu_blk_io(e, eb, B_READ, w);
+}
+
+static int
+emu_read_done(struct buf *bp)
+{
+	emu_blk_t	*eb = bp->b_private;
+	emu_t		*e = eb->eb_emu;
+	emu_work_t	w = { NULL, NULL, NULL };
+	int		error = geterror(bp);
+	dm_child_t	*dc;
+
+	mutex_enter(&e->e_lock);
+	ASSERT(eb->eb_state == EB_READ);
+	eb->eb_state = EB_NEW;
+	if (error != 0) {
+		while ((dc = eb->eb_reads) != NULL) {
+			eb->eb_reads = dc->dc_next;
+			emu_piece_done(dc, error, &w);
+		}
+		while ((dc = eb->eb_writes) != NULL) {
+			eb->eb_writes = dc->dc_next;
+			emu_piece_done(dc, error, &w);
+		}
+	} else {
+		eb->eb_valid = B_TRUE;
+	}
+	emu_run(e, eb, &w);
+	mutex_exit(&e->e_lock);
+
+	emu_work(e, &w);
+
+	return (0);
+}
+
+static int
+emu_write_done(struct buf *bp)
+{
+	emu_blk_t	*eb = bp->b_private;
+	emu_t		*e = eb->eb_emu;
+	emu_work_t	w = { NULL, NULL, NULL };
+	int		error = geterror(bp);
+	dm_child_t	*dc;
+
+	mutex_enter(&e->e_lock);
+	ASSERT(eb->eb_state == EB_WRITE);
+	eb->eb_state = EB_NEW;
+	while ((dc = eb->eb_round) != NULL) {
+		eb->eb_round = dc->dc_next;
+		emu_piece_done(dc, error, &w);
+	}
+	/* What is on the device is anyone's guess */
+	if (error != 0)
+		eb->eb_valid = B_FALSE;
+	emu_run(e, eb, &w);
+	mutex_exit(&e->e_lock);
+
+	emu_work(e, &w);
+
+	return (0);
+}
+
+/* Queue a piece of a block on its entry, or for one to come free */
+static void
+emu_attach_locked(emu_t *e, dm_child_t *dc, emu_work_t *w)
+{
+	uint64_t	blk = dc->dc_tag >> e->e_bshift;
+	emu_blk_t	*eb;
+
+	ASSERT(MUTEX_HELD(&e->e_lock));
+	dc->dc_next = NULL;
+	if ((eb = emu_lookup(e, blk)) == NULL &&
+	    (eb = emu_get(e, blk)) == NULL) {
+		if (e->e_waittail != NULL)
+			e->e_waittail->dc_next = dc;
+		else
+			e->e_waitq = dc;
+		e->e_waittail = dc;
+		e->e_waits++;
+		return;
+	}
+
+	if (dc->dc_buf.b_flags & B_READ) {
+		/* Served right away if the block is in memory */
+		if (eb->eb_valid) {
+			e->e_hits++;
+			bcopy(eb->eb_buf + EMU_BOFF(e, dc->dc_tag),
+			    emu_addr(dc), dc->dc_buf.b_bcount);
+			emu_piece_done(dc, 0, w);
+			if (eb->eb_state == EB_IDLE) {
+				emu_lru_remove(e, eb);
+				emu_lru_add(e, eb);
+			}
+			return;
+		}
+		e->e_misses++;
+		dc->dc_next = eb->eb_reads;
+		eb->eb_reads = dc;
+	} else {
+		if (eb->eb_valid)
+			e->e_hits++;
+		else
+			e->e_misses++;
+		dc->dc_next = eb->eb_writes;
+		eb->eb_writes = dc;
+	}
+
+	switch (eb->eb_state) {
+	case EB_IDLE:
+		emu_lru_remove(e, eb);
+		eb->eb_state = EB_NEW;
+		/* FALLTHROUGH */
+	case EB_NEW:
+		emu_run(e, eb, w);
+		break;
+	default:
+		/* Picked up when what is in flight is done */
+		break;
+	}
+}
+
+/*
+ * Whether whole block 'blk' of a write has to go through its entry.  A
+ * cached copy of it is dropped, the write going round it.
+ */
+static boolean_t
+emu_busy(emu_t *e, uint64_t blk, emu_work_t *w)
+{
+	emu_blk_t	*eb;
+
+	if (e->e_nhashed == 0 || (eb = emu_lookup(e, blk)) == NULL)
+		return (B_FALSE);
+	if (eb->eb_state != EB_IDLE)
+		return (B_TRUE);
+
+	emu_lru_remove(e, eb);
+	eb->eb_valid = B_FALSE;
+	emu_release(e, eb, w);
+
+	return (B_FALSE);
+}
+
+/*
+ * Cut whole blocks from 'off' for 'len' bytes to go to the device
+ * directly, noting writes as in flight.
+ */
+static boolean_t
+emu_direct(emu_t *e, dm_split_t *ds, uint64_t off, size_t len,
+    emu_work_t *w)
+{
+	dm_info_t	*dmip = e->e_dmip;
+	uint64_t	base = ldbtob(ds->ds_bp->b_lblkno);
+	size_t		max = P2ALIGN(dmip->maxxfer, EMU_BSIZE(e));
+	dm_child_t	*dc;
+
+	while (len != 0) {
+		size_t	n = MIN(len, max);
+
+		if ((dc = dm_split_child(ds, (size_t)(off - base), n,
+		    dmip->tdev, btodb(off), KM_NOSLEEP)) == NULL)
+			return (B_FALSE);
+		dc->dc_tag = off;
+		dc->dc_lh = dmip->lh;
+		if (!(ds->ds_bp->b_flags & B_READ)) {
+			dc->dc_next = e->e_direct;
+			e->e_direct = dc;
+		}
+		dc->dc_buf.av_forw = (struct buf *)w->w_direct;
+		w->w_direct = dc;
+		off += n;
+		len -= n;
+	}
+	return (B_TRUE);
+}
+
+/* A direct write done, blocks waiting for it can go on */
+static void
+emu_direct_done(dm_child_t *dc, void *arg)
+{
+	emu_t		*e = arg;
+	emu_work_t	w = { NULL, NULL, NULL };
+	emu_blk_t	*eb, **ebp;
+	dm_child_t	**dcp;
+
+	if (dc->dc_lh == NULL || (dc->dc_buf.b_flags & B_READ))
+		return;
+
+	mutex_enter(&e->e_lock);
+	for (dcp = &e->e_direct; *dcp != dc; dcp = &(*dcp)->dc_next)
+		;
+	*dcp = dc->dc_next;
+
+	for (ebp = &e->e_blocked; (eb = *ebp) != NULL; ) {
+		if (emu_direct_over(e, eb->eb_blk)) {
+			ebp = &eb->eb_rnext;
+			continue;
+		}
+		*ebp = eb->eb_rnext;
+		eb->eb_state = EB_NEW;
+		emu_run(e, eb, &w);
+	}
+	mutex_exit(&e->e_lock);
+
+	emu_work(e, &w);
+}
+
+static void
+emu_free(emu_t *e)
+{
+	if (e->e_blks != NULL) {
+		for (uint32_t i = 0; i < e->e_nblks; i++) {
+			emu_blk_t	*eb = &e->e_blks[i];
+
+			kmem_free(eb->eb_buf, EMU_BSIZE(e));
+			freerbuf(eb->eb_bp);
+		}
+		kmem_free(e->e_blks, e->e_nblks * sizeof (emu_blk_t));
+		kmem_free(e->e_hash, (e->e_hmask + 1) * sizeof (emu_blk_t *));
+	}
+	if (e->e_tq != NULL)
+		ddi_taskq_destroy(e->e_tq);
+	mutex_destroy(&e->e_lock);
+	kmem_free(e, sizeof (*e));
+}
+
+/*
+ * Plugin entry points
+ */
+static int
+dm_emu512_init(void)
+{
+	return (0);
+}
+
+static void
+dm_emu512_fini(void)
+{
+}
+
+static int
+dm_emu512_create(dm_info_t *dmip, int argc, char **argv, cred_t *crp,
+    void **privp)
+{
+	emu_t		*e;
+	unsigned long	block = dmip->limits.dl_lbsize;
+	uint64_t	cache = (uint64_t)EMU_CACHE << 10;
+
+	for (int i = 0; i < argc; i++) {
+		unsigned long	val;
+
+		if (strncmp(argv[i], "block=", 6) == 0 &&
+		    ddi_strtoul(argv[i] + 6, NULL, 10, &val) == 0 &&
+		    ISP2(val) && val >= dmip->limits.dl_lbsize &&
+		    val <= EMU_BMAX) {
+			block = val;
+		} else if (strncmp(argv[i], "cache=", 6) == 0 &&
+		    ddi_strtoul(argv[i] + 6, NULL, 10, &val) == 0) {
+			cache = (uint64_t)val << 10;
+		} else {
+			cmn_err(CE_WARN, "dm_emu512: unknown argument '%s'",
+			    argv[i]);
+			return (EINVAL);
+		}
+	}
+	if (block > EMU_BMAX || block > dmip->maxxfer) {
+		cmn_err(CE_WARN, "dm_emu512: %s: blocks of %lu not supported",
+		    refstr_value(dmip->name), block);
+		return (ENOTSUP);
+	}
+
+	e = kmem_zalloc(sizeof (*e), KM_SLEEP);
+	e->e_dmip = dmip;
+	mutex_init(&e->e_lock, NULL, MUTEX_DRIVER, NULL);
+	e->e_bshift = highbit(block) - 1;
+	e->e_tq = ddi_taskq_create(NULL, "dm_emu512", ncpus, TASKQ_DEFAULTPRI,
+	    0);
+	if (e->e_tq == NULL) {
+		emu_free(e);
+		return (ENOMEM);
+	}
+
+	e->e_nblks = (uint32_t)MAX(cache >> e->e_bshift, EMU_MINBLKS);
+	e->e_hmask = (1U << highbit(e->e_nblks)) - 1;
+	e->e_hash = kmem_zalloc((e->e_hmask + 1) * sizeof (emu_blk_t *),
+	    KM_SLEEP);
+	e->e_blks = kmem_zalloc(e->e_nblks * sizeof (emu_blk_t), KM_SLEEP);
+	for (uint32_t i = 0; i < e->e_nblks; i++) {
+		emu_blk_t	*eb = &e->e_blks[i];
+
+		eb->eb_emu = e;
+		eb->eb_buf = kmem_alloc(block, KM_SLEEP);
+		eb->eb_bp = getrbuf(KM_SLEEP);
+		eb->eb_next = e->e_free;
+		e->e_free = eb;
+	}
+
+	dmip->size = P2ALIGN(dmip->size, (uint64_t)block);
+	*privp = e;
+
+	return (0);
+}
+
+static void
+dm_emu512_destroy(dm_info_t *dmip, void *priv)
+{
+	emu_t	*e = priv;
+
+	ddi_taskq_wait(e->e_tq);
+	ASSERT(e->e_direct == NULL && e->e_waitq == NULL);
+	emu_free(e);
+}
+
+/* Reads of whole blocks only need redirecting */
+static boolean_t
+dm_emu512_remap(void *priv, const struct buf *bp, dm_remap_t *rp)
+{
+	emu_t		*e = priv;
+	uint64_t	off = ldbtob(bp->b_lblkno);
+
+	if (!(bp->b_flags & B_READ) || EMU_BOFF(e, off) != 0 ||
+	    EMU_BOFF(e, bp->b_bcount) != 0)
+		return (B_FALSE);
+
+	atomic_inc_64(&e->e_reads);
+	rp->dr_lh = e->e_dmip->lh;
+	rp->dr_dev = e->e_dmip->tdev;
+	rp->dr_blkno = bp->b_lblkno;
+
+	return (B_TRUE);
+}
+
+/*
+ * Cut I/O at block boundaries: runs of whole blocks go to the device,
+ * parts of blocks, and whole ones a write finds busy, to their entries.
+ * On the taskq, the I/O is mapped in here.
+ */
+static void
+emu_start(void *arg)
+{
+	dm_split_t	*ds = arg;
+	emu_t		*e = ds->ds_arg;
+	dm_info_t	*dmip = e->e_dmip;
+	struct buf	*bp = ds->ds_bp;
+	boolean_t	rd = (bp->b_flags & B_READ) != 0;
+	uint64_t	base = ldbtob(bp->b_lblkno);
+	uint64_t	end = base + bp->b_bcount;
+	uint64_t	run, off;
+	emu_work_t	w = { NULL, NULL, NULL };
+	dm_child_t	*dc;
+
+	bp_mapin(bp);
+
+	mutex_enter(&e->e_lock);
+	for (run = off = base; off < end; ) {
+		uint64_t	next = MIN(P2ALIGN(off, EMU_BSIZE(e)) +
+		    EMU_BSIZE(e), end);
+		size_t		n = (size_t)(next - off);
+
+		if (n == EMU_BSIZE(e) &&
+		    (rd || !emu_busy(e, off >> e->e_bshift, &w))) {
+			off = next;
+			continue;
+		}
+
+		if (off > run && !emu_direct(e, ds, run, off - run, &w))
+			break;
+		if ((dc = dm_split_child(ds, (size_t)(off - base), n,
+		    dmip->tdev, btodb(off), KM_NOSLEEP)) == NULL)
+			break;
+		dc->dc_tag = off;
+		if (n != EMU_BSIZE(e)) {
+			if (rd)
+				e->e_preads++;
+			else
+				e->e_pwrites++;
+		}
+		emu_attach_locked(e, dc, &w);
+		run = off = next;
+	}
+	if (off == end && end > run)
+		(void) emu_direct(e, ds, run, end - run, &w);
+	mutex_exit(&e->e_lock);
+
+	emu_work(e, &w);
+	dm_split_rele(ds);
+}
+
+static dm_mapio_t
+dm_emu512_mapio(dm_info_t *dmip, void *priv, struct buf *bp,
+    dm_remap_t *rp)
+{
+	emu_t		*e = priv;
+	boolean_t	rd = (bp->b_flags & B_READ) != 0;
+	dm_split_t	*ds;
+
+	if (bp->b_bcount == 0) {
+		bp->b_resid = 0;
+		biodone(bp);
+		return (DM_MAPIO_SUBMITTED);
+	}
+	if (rd && dm_emu512_remap(priv, bp, rp))
+		return (DM_MAPIO_REMAPPED);
+	if (!rd)
+		atomic_inc_64(&e->e_writes);
+	else
+		atomic_inc_64(&e->e_reads);
+
+	if ((ds = dm_split_alloc(bp, emu_direct_done, e, KM_NOSLEEP)) ==
+	    NULL) {
+		bioerror(bp, ENOMEM);
+		return (DM_MAPIO_KILL);
+	}
+	if (ddi_taskq_dispatch(e->e_tq, emu_start, ds, DDI_NOSLEEP) !=
+	    DDI_SUCCESS) {
+		dm_split_error(ds, ENOMEM);
+		dm_split_rele(ds);
+	}
+
+	return (DM_MAPIO_SUBMITTED);
+}
+
+static int
+dm_emu512_stats(dm_info_t *dmip, void *priv, nvlist_t *nvl)
+{
+	emu_t	*e = priv;
+
+	mutex_enter(&e->e_lock);
+	(void) nvlist_add_uint64(nvl, "block_size", EMU_BSIZE(e));
+	(void) nvlist_add_uint64(nvl, "cache_blocks", e->e_nblks);
+	(void) nvlist_add_uint64(nvl, "reads", e->e_reads);
+	(void) nvlist_add_uint64(nvl, "writes", e->e_writes);
+	(void) nvlist_add_uint64(nvl, "partial_reads", e->e_preads);
+	(void) nvlist_add_uint64(nvl, "partial_writes", e->e_pwrites);
+	(void) nvlist_add_uint64(nvl, "block_writes", e->e_rounds);
+	(void) nvlist_add_uint64(nvl, "rmw_reads", e->e_rmw);
+	(void) nvlist_add_uint64(nvl, "coalesced", e->e_merged);
+	(void) nvlist_add_uint64(nvl, "cache_hits", e->e_hits);
+	(void) nvlist_add_uint64(nvl, "cache_misses", e->e_misses);
+	(void) nvlist_add_uint64(nvl, "direct_waits", e->e_blockwaits);
+	(void) nvlist_add_uint64(nvl, "block_waits", e->e_waits);
+	mutex_exit(&e->e_lock);
+
+	return (0);
+}
+
+
+dm_plugin_ops_t dm_ops = {
+	.dpo_rev	= DPO_REV,
+	.dpo_name	= "emu512",
+	.dpo_init	= dm_emu512_init,
+	.dpo_fini	= dm_emu512_fini,
+	.dpo_create	= dm_emu512_create,
+	.dpo_destroy	= dm_emu512_destroy,
+	.dpo_mapio	= dm_emu512_mapio,
+	.dpo_remap	= dm_emu512_remap,
+	.dpo_stats	= dm_emu512_stats,
+};
+
+static struct modlmisc modlmisc = {
+	.misc_modops	= &mod_miscops,
+	.misc_linkinfo	= "Solaris Device Mapper 512-byte sector plugin"
+};
+
+static struct modlinkage modlinkage = {
+	.ml_rev		= MODREV_1,
+	.ml_linkage	= {&modlmisc, NULL, NULL, NULL}
+};
+
+int
+_init(void)
+{
+	return (mod_install(&modlinkage));
+}
+
+int
+_info(struct modinfo *mip)
+{
+	return (mod_info(&modlinkage, mip));
+}
+
+int
+_fini(void)
+{
+	return (mod_remove(&modlinkage));
+}
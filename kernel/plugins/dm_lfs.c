@@ -0,0 +1,1463 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright 2011 Grigale Ltd. All rights reserved.
+ * Use is subject to license terms.
+ */
+
+/*
+ * Log-structured target
+ *
+ * All writes are appended to a log on the backing device, so whatever the
+ * write pattern the device only sees large sequential writes.  The device
+ * is carved into 4K blocks:
+ *
+ *	block 0			superblock
+ *	cpstart[0]		checkpoint slot 0 (header, map, usage table)
+ *	cpstart[1]		checkpoint slot 1
+ *	segstart		segments, segblks blocks each
+ *
+ * The log is written in chunks: a summary block listing the logical block
+ * of every data block that follows it, then the data blocks.  Chunks are
+ * group-committed, while one chunk is being written the next one collects
+ * all the writes that arrive and goes out as soon as the first completes,
+ * so a lone writer does not wait for a batch to fill up and a busy mapping
+ * gets large writes.  A write completes when the chunk(s) holding its
+ * blocks are on the device.
+ *
+ * The logical to physical map is a flat in-memory array with one 32-bit
+ * entry per logical block (about 0.1% of the mapping size), together with
+ * the per-segment usage table it is checkpointed to alternate slots; only
+ * the pages changed since the slot was last written go out.  At mount the
+ * newest valid checkpoint is loaded and the log is rolled forward from the
+ * position recorded in it for as long as the chunks that follow verify.
+ *
+ * A cleaner thread keeps a pool of free segments.  It picks victims by
+ * cost-benefit, (1 - u) * age / (1 + u) with u the live fraction, moves
+ * their live blocks to the head of the log and frees them once the next
+ * checkpoint no longer references them.
+ *
+ * Arguments:	[format] [segsize=<KB>] [op=<percent>]
+ *
+ * 'format' initialises the device, segsize and op (space kept back from
+ * the logical size for the cleaner) are only used then.  The mapping is
+ * 4K native: I/O has to be 4K aligned.
+ */
+
+#include <sys/atomic.h>
+#include <sys/bitmap.h>
+#include <sys/buf.h>
+#include <sys/conf.h>
+#include <sys/cred.h>
+#include <sys/disp.h>
+#include <sys/errno.h>
+#include <sys/file.h>
+#include <sys/kmem.h>
+#include <sys/modctl.h>
+#include <sys/proc.h>
+#include <sys/sysmacros.h>
+#include <sys/systm.h>
+#include <sys/thread.h>
+#include <sys/types.h>
+#include <sys/ddi.h>
+#include <sys/sunddi.h>
+
+#include <sys/dm.h>
+#include <sys/dm_impl.h>
+#include <sys/dm_ops.h>
+
+#define	LFS_MAGIC	0x444d4c4653303031ULL	/* "DMLFS001" */
+#define	LFS_CPMAGIC	0x444d4c4643503031ULL	/* "DMLFCP01" */
+#define	LFS_SSMAGIC	0x444d4c4653533031ULL	/* "DMLFSS01" */
+#define	LFS_VERSION	1
+
+#define	LFS_BSIZE	4096
+#define	LFS_BSHIFT	12
+#define	LFS_DBPB	(LFS_BSIZE / DEV_BSIZE)	/* Disk blocks per block */
+#define	LFS_NOBLK	0			/* Unmapped block */
+#define	LFS_MAPPG	(LFS_BSIZE / sizeof (uint32_t))	/* Map entries/page */
+#define	LFS_IOMAX	(1024 * 1024)		/* Metadata I/O size */
+
+#define	LFS_SEGBLKS	256		/* Default segment size, 1M */
+#define	LFS_OP		10		/* Default overprovisioning, % */
+#define	LFS_RESERVE	4		/* Free segments kept for the cleaner */
+#define	LFS_GC_LOW	8		/* Start cleaning below this */
+#define	LFS_GC_HIGH	16		/* and stop above this */
+#define	LFS_CP_CHUNKS	4096		/* Chunks between checkpoints */
+#define	LFS_CP_SECS	30		/* Seconds between checkpoints */
+
+/* Segment states */
+#define	LFS_SEG_FREE	0
+#define	LFS_SEG_USED	1		/* Holds (or is about to hold) data */
+#define	LFS_SEG_CLEANED	2		/* Free once a checkpoint is done */
+
+typedef struct {
+	uint64_t	sb_magic;
+	uint32_t	sb_version;
+	uint32_t	sb_segblks;	/* Blocks per segment */
+	uint64_t	sb_nlblks;	/* Logical blocks */
+	uint64_t	sb_nsegs;	/* Segments */
+	uint64_t	sb_cpblks;	/* Blocks per checkpoint slot */
+	uint64_t	sb_cpstart[2];	/* First block of checkpoint slots */
+	uint64_t	sb_segstart;	/* First block of segment 0 */
+	uint32_t	sb_pad;
+	uint32_t	sb_sum;		/* Checksum of the above */
+} lfs_super_t;
+
+typedef struct {
+	uint64_t	cp_magic;
+	uint64_t	cp_seq;		/* Checkpoint sequence number */
+	uint64_t	cp_logseq;	/* Sequence number of the next chunk */
+	uint32_t	cp_seg;		/* Log head segment */
+	uint32_t	cp_segoff;	/* and block within it */
+	uint32_t	cp_nextseg;	/* Segment following the head one */
+	uint32_t	cp_sum;		/* Checksum of the above */
+} lfs_cphdr_t;
+
+typedef struct {
+	uint32_t	su_live;	/* Live data blocks */
+	uint32_t	su_state;	/* LFS_SEG_* */
+	uint64_t	su_seq;		/* Chunk sequence when last written */
+} lfs_usage_t;
+
+typedef struct {
+	uint64_t	ss_magic;
+	uint64_t	ss_seq;		/* Chunk sequence number */
+	uint32_t	ss_seg;		/* Segment the chunk is in */
+	uint32_t	ss_nextseg;	/* Segment following that one */
+	uint32_t	ss_nblks;	/* Data blocks in the chunk */
+	uint32_t	ss_datasum;	/* Checksum of the data blocks */
+	uint32_t	ss_sum;		/* Checksum of the summary block */
+	uint32_t	ss_pad;
+} lfs_sumhdr_t;
+
+#define	LFS_SUMMAX	\
+	((LFS_BSIZE - sizeof (lfs_sumhdr_t)) / sizeof (uint32_t))
+
+/* A mapped write, completes when all the chunks holding it are */
+typedef struct {
+	struct buf	*r_bp;
+	struct lfs	*r_lfs;
+	uint32_t	r_pending;
+	int		r_error;
+} lfs_req_t;
+
+typedef struct {
+	uint32_t	c_seg;		/* Segment of the chunk */
+	uint32_t	c_off;		/* Summary block within it */
+	uint32_t	c_n;		/* Data blocks */
+	caddr_t		c_buf;		/* Segment buffer holding it */
+	struct buf	*c_bp;		/* Preallocated write buf */
+	uint32_t	c_lba[LFS_SUMMAX];
+	uint32_t	c_nreqs;	/* Writes completing with the chunk */
+	lfs_req_t	*c_reqs[LFS_SUMMAX];
+} lfs_chunk_t;
+
+typedef struct lfs {
+	dm_info_t	*l_dmip;
+	kmutex_t	l_lock;
+	kcondvar_t	l_cv;		/* Chunk done, segments freed */
+	kcondvar_t	l_gccv;		/* Cleaner wakeup */
+	lfs_super_t	l_sb;
+	int		l_error;	/* Log write failed, sticky */
+
+	uint32_t	*l_map;		/* Logical to physical block map */
+	lfs_usage_t	*l_usage;	/* Segment usage table */
+	size_t		l_mappages;	/* Pages of the map */
+	size_t		l_npages;	/* Map and usage table pages */
+	ulong_t		*l_dirty[2];	/* Pages to write to each slot */
+
+	uint32_t	l_seg;		/* Log head segment */
+	uint32_t	l_segoff;	/* Next free block in it */
+	uint32_t	l_nextseg;	/* Segment to go to next */
+	uint64_t	l_logseq;	/* Sequence number of the next chunk */
+	caddr_t		l_bufs[2];	/* Contents of the last two segments */
+	uint32_t	l_bufseg[2];	/* and their numbers */
+	int		l_bufidx;	/* Buffer of the head segment */
+
+	lfs_chunk_t	l_chunks[2];
+	lfs_chunk_t	*l_fill;	/* Collecting writes */
+	lfs_chunk_t	*l_flight;	/* Being written */
+	boolean_t	l_busy;		/* l_flight in flight */
+
+	uint32_t	l_nfree;	/* Free segments */
+	uint32_t	l_ncleaned;	/* Cleaned, free after a checkpoint */
+	uint32_t	l_rotor;	/* Free segment search start */
+	uint64_t	l_cpseq;	/* Last checkpoint */
+	int		l_cpslot;	/* Slot the next checkpoint goes to */
+	boolean_t	l_cpwant;	/* Checkpoint waiting for the log */
+	uint32_t	l_cpchunks;	/* Chunks since the last checkpoint */
+	kthread_t	*l_cleaner;
+	boolean_t	l_exiting;
+	ddi_taskq_t	*l_tq;		/* Mapped I/O, which may have to wait */
+} lfs_t;
+
+#define	LFS_NOSEG	((uint32_t)-1)
+
+
+static uint64_t
+lfs_pba(lfs_t *lfs, uint32_t seg, uint32_t off)
+{
+	return (lfs->l_sb.sb_segstart + (uint64_t)seg * lfs->l_sb.sb_segblks +
+	    off);
+}
+
+static uint32_t
+lfs_pba2seg(lfs_t *lfs, uint64_t pba)
+{
+	return ((uint32_t)((pba - lfs->l_sb.sb_segstart) /
+	    lfs->l_sb.sb_segblks));
+}
+
+/* Synchronous I/O on the backing device, 'blk' in LFS blocks */
+static int
+lfs_bio(lfs_t *lfs, caddr_t addr, size_t len, uint64_t blk, int rw)
+{
+	dm_info_t	*dmip = lfs->l_dmip;
+
+	return (dm_target_bio(dmip, dmip->lh, dmip->tdev, addr, len,
+	    blk * LFS_DBPB, rw));
+}
+
+/* Large metadata transfers, in LFS_IOMAX pieces */
+static int
+lfs_bio_big(lfs_t *lfs, caddr_t addr, size_t len, uint64_t blk, int rw)
+{
+	int	rc = 0;
+
+	while (len != 0 && rc == 0) {
+		size_t	n = MIN(len, LFS_IOMAX);
+
+		rc = lfs_bio(lfs, addr, n, blk, rw);
+		addr += n;
+		len -= n;
+		blk += n >> LFS_BSHIFT;
+	}
+
+	return (rc);
+}
+
+/* Note the map entry of 'lba' as changed */
+static void
+lfs_dirty_map(lfs_t *lfs, uint64_t lba)
+{
+	size_t	pg = lba / LFS_MAPPG;
+
+	BT_SET(lfs->l_dirty[0], pg);
+	BT_SET(lfs->l_dirty[1], pg);
+}
+
+/* Note the usage table entry of 'seg' as changed */
+static void
+lfs_dirty_usage(lfs_t *lfs, uint32_t seg)
+{
+	size_t	pg = lfs->l_mappages +
+	    (seg * sizeof (lfs_usage_t)) / LFS_BSIZE;
+
+	BT_SET(lfs->l_dirty[0], pg);
+	BT_SET(lfs->l_dirty[1], pg);
+}
+
+/* Address of image page 'pg': map pages first, then the usage table */
+static caddr_t
+lfs_page(lfs_t *lfs, size_t pg)
+{
+	if (pg < lfs->l_mappages)
+		return ((caddr_t)lfs->l_map + pg * LFS_BSIZE);
+	return ((caddr_t)lfs->l_usage + (pg - lfs->l_mappages) * LFS_BSIZE);
+}
+
+/* Point 'lba' at 'pba', keeping the usage table straight */
+static void
+lfs_map_set(lfs_t *lfs, uint64_t lba, uint64_t pba)
+{
+	uint32_t	old = lfs->l_map[lba];
+	uint32_t	seg;
+
+	if (old != LFS_NOBLK) {
+		seg = lfs_pba2seg(lfs, old);
+		lfs->l_usage[seg].su_live--;
+		lfs_dirty_usage(lfs, seg);
+	}
+
+	seg = lfs_pba2seg(lfs, pba);
+	lfs->l_usage[seg].su_live++;
+	lfs->l_usage[seg].su_seq = lfs->l_logseq;
+	lfs_dirty_usage(lfs, seg);
+
+	lfs->l_map[lba] = (uint32_t)pba;
+	lfs_dirty_map(lfs, lba);
+}
+
+static void
+lfs_req_rele(lfs_req_t *req)
+{
+	struct buf	*bp = req->r_bp;
+
+	if (atomic_dec_32_nv(&req->r_pending) != 0)
+		return;
+
+	if (req->r_error != 0) {
+		bioerror(bp, req->r_error);
+		bp->b_resid = bp->b_bcount;
+	} else {
+		bp->b_resid = 0;
+	}
+	kmem_free(req, sizeof (*req));
+	biodone(bp);
+}
+
+/*
+ * Segment allocation
+ */
+static uint32_t
+lfs_seg_alloc(lfs_t *lfs)
+{
+	uint64_t	nsegs = lfs->l_sb.sb_nsegs;
+
+	ASSERT(MUTEX_HELD(&lfs->l_lock));
+
+	for (uint64_t i = 0; i < nsegs; i++) {
+		uint32_t	seg = (lfs->l_rotor + i) % nsegs;
+
+		if (lfs->l_usage[seg].su_state == LFS_SEG_FREE) {
+			lfs->l_usage[seg].su_state = LFS_SEG_USED;
+			lfs->l_usage[seg].su_live = 0;
+			lfs->l_usage[seg].su_seq = lfs->l_logseq;
+			lfs_dirty_usage(lfs, seg);
+			lfs->l_nfree--;
+			lfs->l_rotor = seg + 1;
+			return (seg);
+		}
+	}
+
+	return (LFS_NOSEG);
+}
+
+/*
+ * Move the log head to the next segment.  Ordinary writes leave the last
+ * LFS_RESERVE free segments to the cleaner.
+ */
+static boolean_t
+lfs_seg_advance(lfs_t *lfs, boolean_t gc)
+{
+	uint32_t	next;
+
+	if (lfs->l_nfree <= (gc ? 0 : LFS_RESERVE)) {
+		cv_signal(&lfs->l_gccv);
+		return (B_FALSE);
+	}
+
+	if ((next = lfs_seg_alloc(lfs)) == LFS_NOSEG)
+		return (B_FALSE);
+
+	lfs->l_seg = lfs->l_nextseg;
+	lfs->l_segoff = 0;
+	lfs->l_nextseg = next;
+	lfs->l_bufidx ^= 1;
+	lfs->l_bufseg[lfs->l_bufidx] = lfs->l_seg;
+
+	if (lfs->l_nfree < LFS_GC_LOW)
+		cv_signal(&lfs->l_gccv);
+
+	return (B_TRUE);
+}
+
+/*
+ * Chunk writing
+ */
+static int lfs_chunk_done(struct buf *);
+
+/*
+ * Seal the fill chunk and write it out.  Called with the lock held and no
+ * chunk in flight; the lock is dropped around issuing it since the
+ * completion may run in this very thread.
+ */
+static void
+lfs_chunk_issue(lfs_t *lfs)
+{
+	lfs_chunk_t	*c = lfs->l_fill;
+	lfs_sumhdr_t	*ss;
+	caddr_t		sum;
+	struct buf	*bp = c->c_bp;
+
+	ASSERT(MUTEX_HELD(&lfs->l_lock));
+	ASSERT(!lfs->l_busy && c->c_n != 0);
+
+	sum = c->c_buf + (size_t)c->c_off * LFS_BSIZE;
+	bzero(sum, LFS_BSIZE);
+	ss = (lfs_sumhdr_t *)sum;
+	ss->ss_magic = LFS_SSMAGIC;
+	ss->ss_seq = lfs->l_logseq++;
+	ss->ss_seg = c->c_seg;
+	ss->ss_nextseg = lfs->l_nextseg;
+	ss->ss_nblks = c->c_n;
+	ss->ss_datasum = dm_cksum(sum + LFS_BSIZE,
+	    (size_t)c->c_n * LFS_BSIZE);
+	bcopy(c->c_lba, sum + sizeof (*ss), c->c_n * sizeof (uint32_t));
+	ss->ss_sum = dm_cksum(sum, LFS_BSIZE);
+
+	bioreset(bp);
+	bp->b_flags = B_BUSY | B_WRITE;
+	bp->b_un.b_addr = sum;
+	bp->b_bcount = (size_t)(c->c_n + 1) * LFS_BSIZE;
+	bp->b_lblkno = lfs_pba(lfs, c->c_seg, c->c_off) * LFS_DBPB;
+	bp->b_blkno = bp->b_lblkno;
+	bp->b_edev = lfs->l_dmip->tdev;
+	bp->b_dev = cmpdev(lfs->l_dmip->tdev);
+	bp->b_iodone = lfs_chunk_done;
+	bp->b_private = lfs;
+
+	lfs->l_fill = lfs->l_flight;
+	lfs->l_flight = c;
+	lfs->l_fill->c_n = 0;
+	lfs->l_fill->c_nreqs = 0;
+	lfs->l_busy = B_TRUE;
+	lfs->l_cpchunks++;
+
+	mutex_exit(&lfs->l_lock);
+	dm_split_issue(bp, lfs->l_dmip->lh, &lfs->l_dmip->limits);
+	mutex_enter(&lfs->l_lock);
+}
+
+static int
+lfs_chunk_done(struct buf *bp)
+{
+	lfs_t		*lfs = bp->b_private;
+	lfs_chunk_t	*c;
+	int		error = geterror(bp);
+
+	mutex_enter(&lfs->l_lock);
+
+	c = lfs->l_flight;
+	if (error != 0) {
+		cmn_err(CE_WARN, "dm_lfs: %s: log write failed (%d)",
+		    refstr_value(lfs->l_dmip->name), error);
+		lfs->l_error = error;
+	}
+
+	for (uint32_t i = 0; i < c->c_nreqs; i++) {
+		if (error != 0)
+			c->c_reqs[i]->r_error = error;
+		lfs_req_rele(c->c_reqs[i]);
+	}
+	c->c_nreqs = 0;
+	c->c_n = 0;
+	lfs->l_busy = B_FALSE;
+
+	/* Group commit: whatever piled up meanwhile goes right away */
+	c = lfs->l_fill;
+	if (lfs->l_error != 0) {
+		for (uint32_t i = 0; i < c->c_nreqs; i++) {
+			c->c_reqs[i]->r_error = lfs->l_error;
+			lfs_req_rele(c->c_reqs[i]);
+		}
+		c->c_nreqs = 0;
+		c->c_n = 0;
+	} else if (c->c_n != 0) {
+		lfs_chunk_issue(lfs);
+	}
+
+	cv_broadcast(&lfs->l_cv);
+	mutex_exit(&lfs->l_lock);
+
+	return (0);
+}
+
+/*
+ * Append one block to the log.  'expect', when set, is the block the
+ * cleaner found live; the append is skipped if a write moved the logical
+ * block meanwhile (the lock may be dropped while waiting for room).
+ * Returns B_FALSE if the block was not appended.
+ */
+static boolean_t
+lfs_append(lfs_t *lfs, uint64_t lba, caddr_t src, lfs_req_t *req,
+    uint64_t expect)
+{
+	uint32_t	segblks = lfs->l_sb.sb_segblks;
+	boolean_t	gc = (expect != LFS_NOBLK);
+	lfs_chunk_t	*c;
+	uint32_t	off;
+
+	ASSERT(MUTEX_HELD(&lfs->l_lock));
+
+	for (;;) {
+		if (lfs->l_error != 0 || lfs->l_exiting)
+			return (B_FALSE);
+
+		c = lfs->l_fill;
+
+		/* Chunk full, or no room left for it in the segment */
+		if (c->c_n == LFS_SUMMAX ||
+		    (c->c_n != 0 && lfs->l_segoff >= segblks)) {
+			if (lfs->l_busy)
+				cv_wait(&lfs->l_cv, &lfs->l_lock);
+			else
+				lfs_chunk_issue(lfs);
+			continue;
+		}
+
+		/* A new chunk needs room for its summary too */
+		if (c->c_n == 0 && lfs->l_segoff + 2 > segblks) {
+			if (lfs_seg_advance(lfs, gc))
+				continue;
+			/* Only the cleaner itself can free segments */
+			if (gc)
+				return (B_FALSE);
+			cv_wait(&lfs->l_cv, &lfs->l_lock);
+			continue;
+		}
+
+		break;
+	}
+
+	if (gc && lfs->l_map[lba] != expect)
+		return (B_FALSE);
+
+	if (c->c_n == 0) {
+		c->c_seg = lfs->l_seg;
+		c->c_off = lfs->l_segoff++;
+		c->c_buf = lfs->l_bufs[lfs->l_bufidx];
+	}
+
+	off = lfs->l_segoff++;
+	bcopy(src, c->c_buf + (size_t)off * LFS_BSIZE, LFS_BSIZE);
+	c->c_lba[c->c_n++] = (uint32_t)lba;
+	lfs_map_set(lfs, lba, lfs_pba(lfs, lfs->l_seg, off));
+
+	if (req != NULL &&
+	    (c->c_nreqs == 0 || c->c_reqs[c->c_nreqs - 1] != req)) {
+		c->c_reqs[c->c_nreqs++] = req;
+		atomic_inc_32(&req->r_pending);
+	}
+
+	return (B_TRUE);
+}
+
+/* Taskq, may wait for room in the log */
+static void
+lfs_write(void *arg)
+{
+	lfs_req_t	*req = arg;
+	lfs_t		*lfs = req->r_lfs;
+	struct buf	*bp = req->r_bp;
+	uint64_t	lba = bp->b_lblkno / LFS_DBPB;
+	size_t		n = bp->b_bcount >> LFS_BSHIFT;
+
+	bp_mapin(bp);
+
+	mutex_enter(&lfs->l_lock);
+
+	while (lfs->l_cpwant)
+		cv_wait(&lfs->l_cv, &lfs->l_lock);
+
+	for (size_t i = 0; i < n; i++) {
+		if (!lfs_append(lfs, lba + i,
+		    bp->b_un.b_addr + i * LFS_BSIZE, req, LFS_NOBLK)) {
+			req->r_error = (lfs->l_error != 0) ? lfs->l_error : EIO;
+			break;
+		}
+	}
+
+	if (!lfs->l_busy && lfs->l_fill->c_n != 0 && lfs->l_error == 0)
+		lfs_chunk_issue(lfs);
+
+	mutex_exit(&lfs->l_lock);
+
+	lfs_req_rele(req);
+}
+
+/*
+ * Reads
+ */
+/* Is the physical block in one of the in-memory segment buffers? */
+static caddr_t
+lfs_mem_block(lfs_t *lfs, uint64_t pba)
+{
+	uint32_t	seg = lfs_pba2seg(lfs, pba);
+	uint64_t	off = pba - lfs_pba(lfs, seg, 0);
+
+	for (int i = 0; i < 2; i++) {
+		if (lfs->l_bufseg[i] == seg)
+			return (lfs->l_bufs[i] + off * LFS_BSIZE);
+	}
+	return (NULL);
+}
+
+static void
+lfs_read(lfs_t *lfs, dm_split_t *ds)
+{
+	struct buf	*bp = ds->ds_bp;
+	dm_child_t	*chain = NULL;
+	size_t		max = lfs->l_dmip->limits.dl_maxxfer >> LFS_BSHIFT;
+	uint64_t	lba = bp->b_lblkno / LFS_DBPB;
+	size_t		n = bp->b_bcount >> LFS_BSHIFT;
+	boolean_t	mapped = B_FALSE;
+	size_t		i;
+
+	/* Device reads no larger than it takes */
+	max = MAX(max, 1);
+
+retry:
+	mutex_enter(&lfs->l_lock);
+
+	/* Anything to copy here? Then the buffer has to be mapped in */
+	if (!mapped) {
+		for (i = 0; i < n; i++) {
+			uint32_t	pba = lfs->l_map[lba + i];
+
+			if (pba == LFS_NOBLK || lfs_mem_block(lfs, pba) != NULL)
+				break;
+		}
+		if (i != n) {
+			mutex_exit(&lfs->l_lock);
+			bp_mapin(bp);
+			mapped = B_TRUE;
+			goto retry;
+		}
+	}
+
+	for (i = 0; i < n; ) {
+		uint32_t	pba = lfs->l_map[lba + i];
+		caddr_t		mem;
+		dm_child_t	*dc;
+		size_t		j;
+
+		if (pba == LFS_NOBLK) {
+			bzero(bp->b_un.b_addr + i * LFS_BSIZE, LFS_BSIZE);
+			i++;
+			continue;
+		}
+		if ((mem = lfs_mem_block(lfs, pba)) != NULL) {
+			bcopy(mem, bp->b_un.b_addr + i * LFS_BSIZE, LFS_BSIZE);
+			i++;
+			continue;
+		}
+
+		/* Physically contiguous run on the device */
+		for (j = i + 1; j < n && j - i < max; j++) {
+			uint32_t	next = lfs->l_map[lba + j];
+
+			if (next != pba + (j - i) ||
+			    lfs_mem_block(lfs, next) != NULL)
+				break;
+		}
+
+		dc = dm_split_child(ds, i * LFS_BSIZE, (j - i) * LFS_BSIZE,
+		    lfs->l_dmip->tdev, (diskaddr_t)pba * LFS_DBPB, KM_NOSLEEP);
+		if (dc == NULL)
+			break;
+		dc->dc_next = chain;
+		chain = dc;
+		i = j;
+	}
+
+	mutex_exit(&lfs->l_lock);
+
+	while (chain != NULL) {
+		dm_child_t	*dc = chain;
+
+		chain = dc->dc_next;
+		dm_issue(lfs->l_dmip->lh, &dc->dc_buf);
+	}
+
+	dm_split_rele(ds);
+}
+
+/* Taskq, the buffer may have to be mapped in */
+static void
+lfs_read_task(void *arg)
+{
+	dm_split_t	*ds = arg;
+
+	lfs_read(ds->ds_arg, ds);
+}
+
+/*
+ * Checkpoints
+ *
+ * Called by the cleaner thread with the lock held.  The log is drained
+ * first so that everything the snapshot refers to is on the device, the
+ * changed pages are copied out and the lock is dropped while they are
+ * written.  The header goes last, once the pages are stable.
+ */
+static void
+lfs_checkpoint(lfs_t *lfs)
+{
+	int		slot = lfs->l_cpslot;
+	ulong_t		*dirty = lfs->l_dirty[slot];
+	uint64_t	base = lfs->l_sb.sb_cpstart[slot];
+	lfs_cphdr_t	*cp;
+	caddr_t		stage;
+	size_t		*pages;
+	size_t		ndirty = 0;
+	int		rc = 0;
+
+	ASSERT(MUTEX_HELD(&lfs->l_lock));
+
+	lfs->l_cpwant = B_TRUE;
+	while (lfs->l_busy || lfs->l_fill->c_n != 0) {
+		if (lfs->l_error != 0) {
+			/* The log is gone, the last checkpoint has to do */
+			lfs->l_cpwant = B_FALSE;
+			cv_broadcast(&lfs->l_cv);
+			return;
+		}
+		if (lfs->l_busy)
+			cv_wait(&lfs->l_cv, &lfs->l_lock);
+		else
+			lfs_chunk_issue(lfs);
+	}
+
+	for (size_t pg = 0; pg < lfs->l_npages; pg++) {
+		if (BT_TEST(dirty, pg))
+			ndirty++;
+	}
+
+	stage = kmem_alloc(MAX(ndirty, 1) * LFS_BSIZE, KM_SLEEP);
+	pages = kmem_alloc(MAX(ndirty, 1) * sizeof (size_t), KM_SLEEP);
+	cp = kmem_zalloc(LFS_BSIZE, KM_SLEEP);
+
+	for (size_t pg = 0, i = 0; pg < lfs->l_npages; pg++) {
+		if (!BT_TEST(dirty, pg))
+			continue;
+		bcopy(lfs_page(lfs, pg), stage + i * LFS_BSIZE, LFS_BSIZE);
+		pages[i++] = pg;
+		BT_CLEAR(dirty, pg);
+	}
+
+	cp->cp_magic = LFS_CPMAGIC;
+	cp->cp_seq = lfs->l_cpseq + 1;
+	cp->cp_logseq = lfs->l_logseq;
+	cp->cp_seg = lfs->l_seg;
+	cp->cp_segoff = lfs->l_segoff;
+	cp->cp_nextseg = lfs->l_nextseg;
+	cp->cp_sum = dm_cksum(cp, offsetof(lfs_cphdr_t, cp_sum));
+
+	lfs->l_cpwant = B_FALSE;
+	cv_broadcast(&lfs->l_cv);
+	mutex_exit(&lfs->l_lock);
+
+	/* Runs of consecutive pages go out together */
+	for (size_t i = 0; i < ndirty && rc == 0; ) {
+		size_t	j = i + 1;
+
+		while (j < ndirty && pages[j] == pages[j - 1] + 1 &&
+		    (j - i) * LFS_BSIZE < LFS_IOMAX)
+			j++;
+		rc = lfs_bio(lfs, stage + i * LFS_BSIZE, (j - i) * LFS_BSIZE,
+		    base + 1 + pages[i], B_WRITE);
+		i = j;
+	}
+	if (rc == 0) {
+		(void) dm_target_flush_dev(lfs->l_dmip, lfs->l_dmip->lh);
+		rc = lfs_bio(lfs, (caddr_t)cp, LFS_BSIZE, base, B_WRITE);
+		(void) dm_target_flush_dev(lfs->l_dmip, lfs->l_dmip->lh);
+	}
+
+	mutex_enter(&lfs->l_lock);
+
+	if (rc == 0) {
+		lfs->l_cpseq++;
+		lfs->l_cpslot ^= 1;
+		lfs->l_cpchunks = 0;
+
+		/* Nothing durable refers to the cleaned segments anymore */
+		for (uint32_t seg = 0; seg < lfs->l_sb.sb_nsegs; seg++) {
+			if (lfs->l_usage[seg].su_state == LFS_SEG_CLEANED) {
+				lfs->l_usage[seg].su_state = LFS_SEG_FREE;
+				lfs_dirty_usage(lfs, seg);
+				lfs->l_nfree++;
+				lfs->l_ncleaned--;
+			}
+		}
+		cv_broadcast(&lfs->l_cv);
+	} else {
+		cmn_err(CE_WARN, "dm_lfs: %s: checkpoint failed (%d)",
+		    refstr_value(lfs->l_dmip->name), rc);
+		for (size_t i = 0; i < ndirty; i++)
+			BT_SET(dirty, pages[i]);
+	}
+
+	kmem_free(cp, LFS_BSIZE);
+	kmem_free(pages, MAX(ndirty, 1) * sizeof (size_t));
+	kmem_free(stage, MAX(ndirty, 1) * LFS_BSIZE);
+}
+
+/*
+ * Cleaner
+ */
+
+/* Cost-benefit victim choice, LFS_NOSEG when nothing is worth cleaning */
+static uint32_t
+lfs_victim(lfs_t *lfs)
+{
+	uint32_t	segblks = lfs->l_sb.sb_segblks;
+	uint32_t	best = LFS_NOSEG;
+	uint64_t	bestscore = 0;
+
+	for (uint32_t seg = 0; seg < lfs->l_sb.sb_nsegs; seg++) {
+		lfs_usage_t	*su = &lfs->l_usage[seg];
+		uint64_t	u, age, score;
+
+		if (su->su_state != LFS_SEG_USED || seg == lfs->l_seg ||
+		    seg == lfs->l_nextseg || seg == lfs->l_bufseg[0] ||
+		    seg == lfs->l_bufseg[1])
+			continue;
+		/* Full of live data, moving it gains nothing */
+		if (su->su_live >= segblks - 1)
+			continue;
+
+		u = (uint64_t)su->su_live * 1000 / segblks;
+		age = lfs->l_logseq - su->su_seq + 1;
+		score = (1000 - u) * age / (1000 + u) + 1;
+		if (score > bestscore) {
+			bestscore = score;
+			best = seg;
+		}
+	}
+
+	return (best);
+}
+
+/* Move the live blocks out of 'seg'.  Called and returns without lock. */
+static void
+lfs_clean(lfs_t *lfs, uint32_t seg, caddr_t buf)
+{
+	uint32_t	segblks = lfs->l_sb.sb_segblks;
+	uint32_t	off = 0;
+
+	if (lfs_bio_big(lfs, buf, (size_t)segblks * LFS_BSIZE,
+	    lfs_pba(lfs, seg, 0), B_READ) != 0) {
+		return;
+	}
+
+	mutex_enter(&lfs->l_lock);
+
+	while (off + 1 < segblks) {
+		lfs_sumhdr_t	*ss = (lfs_sumhdr_t *)(buf + off * LFS_BSIZE);
+		uint32_t	*lbas = (uint32_t *)(ss + 1);
+		uint32_t	sum = ss->ss_sum;
+
+		ss->ss_sum = 0;
+		if (ss->ss_magic != LFS_SSMAGIC || ss->ss_seg != seg ||
+		    ss->ss_nblks == 0 || ss->ss_nblks > LFS_SUMMAX ||
+		    off + 1 + ss->ss_nblks > segblks ||
+		    dm_cksum(ss, LFS_BSIZE) != sum)
+			break;
+
+		for (uint32_t i = 0; i < ss->ss_nblks; i++) {
+			uint64_t	pba = lfs_pba(lfs, seg, off + 1 + i);
+
+			if (lbas[i] < lfs->l_sb.sb_nlblks &&
+			    lfs->l_map[lbas[i]] == pba) {
+				(void) lfs_append(lfs, lbas[i],
+				    buf + (off + 1 + i) * LFS_BSIZE, NULL, pba);
+			}
+		}
+		off += 1 + ss->ss_nblks;
+	}
+
+	if (lfs->l_usage[seg].su_live == 0 && lfs->l_error == 0) {
+		lfs->l_usage[seg].su_state = LFS_SEG_CLEANED;
+		lfs_dirty_usage(lfs, seg);
+		lfs->l_ncleaned++;
+	}
+
+	mutex_exit(&lfs->l_lock);
+}
+
+static void
+lfs_cleaner(void *arg)
+{
+	lfs_t		*lfs = arg;
+	caddr_t		buf;
+	clock_t		last = ddi_get_lbolt();
+
+	buf = kmem_alloc((size_t)lfs->l_sb.sb_segblks * LFS_BSIZE, KM_SLEEP);
+
+	mutex_enter(&lfs->l_lock);
+
+	while (!lfs->l_exiting) {
+		(void) cv_reltimedwait(&lfs->l_gccv, &lfs->l_lock,
+		    drv_usectohz(MICROSEC), TR_CLOCK_TICK);
+
+		while (!lfs->l_exiting && lfs->l_error == 0 &&
+		    lfs->l_nfree < LFS_GC_LOW + lfs->l_ncleaned &&
+		    lfs->l_nfree + lfs->l_ncleaned < LFS_GC_HIGH) {
+			uint32_t	seg = lfs_victim(lfs);
+
+			if (seg == LFS_NOSEG)
+				break;
+			mutex_exit(&lfs->l_lock);
+			lfs_clean(lfs, seg, buf);
+			mutex_enter(&lfs->l_lock);
+
+			/* Writers may be stuck waiting for segments */
+			if (lfs->l_nfree <= LFS_RESERVE)
+				lfs_checkpoint(lfs);
+		}
+
+		if (lfs->l_error == 0 && (lfs->l_ncleaned != 0 ||
+		    lfs->l_cpchunks >= LFS_CP_CHUNKS ||
+		    (lfs->l_cpchunks != 0 && ddi_get_lbolt() - last >=
+		    drv_usectohz(LFS_CP_SECS * MICROSEC)))) {
+			lfs_checkpoint(lfs);
+			last = ddi_get_lbolt();
+		}
+	}
+
+	mutex_exit(&lfs->l_lock);
+
+	kmem_free(buf, (size_t)lfs->l_sb.sb_segblks * LFS_BSIZE);
+	thread_exit();
+}
+
+/*
+ * Format and mount
+ */
+static size_t
+lfs_usage_pages(uint64_t nsegs)
+{
+	return (howmany(nsegs * sizeof (lfs_usage_t), LFS_BSIZE));
+}
+
+static int
+lfs_format(lfs_t *lfs, uint64_t devsize, uint32_t segblks, uint32_t op)
+{
+	lfs_super_t	*sb = &lfs->l_sb;
+	uint64_t	nblks = devsize >> LFS_BSHIFT;
+	uint64_t	nsegs, nlblks = 0, cpblks = 0;
+	caddr_t		zbuf;
+	lfs_cphdr_t	*cp;
+	lfs_usage_t	*usage;
+	size_t		upages;
+	int		rc = 0;
+
+	if (nblks >= UINT32_MAX || segblks < 16 || op >= 100)
+		return (EINVAL);
+	if (nblks < (uint64_t)segblks * LFS_GC_HIGH * 4)
+		return (ENOSPC);
+
+	/* Shrink the segment count until the metadata fits in front */
+	for (nsegs = (nblks - 1) / segblks; nsegs > LFS_GC_HIGH * 2; nsegs--) {
+		nlblks = nsegs * segblks * (100 - op) / 100;
+		cpblks = 1 + howmany(nlblks, LFS_MAPPG) +
+		    lfs_usage_pages(nsegs);
+		if (1 + 2 * cpblks + nsegs * segblks <= nblks)
+			break;
+	}
+	if (nsegs <= LFS_GC_HIGH * 2)
+		return (ENOSPC);
+
+	bzero(sb, sizeof (*sb));
+	sb->sb_magic = LFS_MAGIC;
+	sb->sb_version = LFS_VERSION;
+	sb->sb_segblks = segblks;
+	sb->sb_nlblks = nlblks;
+	sb->sb_nsegs = nsegs;
+	sb->sb_cpblks = cpblks;
+	sb->sb_cpstart[0] = 1;
+	sb->sb_cpstart[1] = 1 + cpblks;
+	sb->sb_segstart = 1 + 2 * cpblks;
+	sb->sb_sum = dm_cksum(sb, offsetof(lfs_super_t, sb_sum));
+
+	/* Both slots: empty map, segment 0 open and 1 next */
+	zbuf = kmem_zalloc(LFS_IOMAX, KM_SLEEP);
+	for (int slot = 0; slot < 2 && rc == 0; slot++) {
+		uint64_t	blk = sb->sb_cpstart[slot];
+
+		for (uint64_t left = cpblks; left != 0 && rc == 0; ) {
+			uint64_t	n = MIN(left, LFS_IOMAX >> LFS_BSHIFT);
+
+			rc = lfs_bio(lfs, zbuf, n << LFS_BSHIFT, blk, B_WRITE);
+			blk += n;
+			left -= n;
+		}
+	}
+
+	upages = lfs_usage_pages(nsegs);
+	usage = kmem_zalloc(upages * LFS_BSIZE, KM_SLEEP);
+	usage[0].su_state = LFS_SEG_USED;
+	usage[1].su_state = LFS_SEG_USED;
+	if (rc == 0) {
+		rc = lfs_bio_big(lfs, (caddr_t)usage, upages * LFS_BSIZE,
+		    sb->sb_cpstart[0] + 1 + howmany(nlblks, LFS_MAPPG),
+		    B_WRITE);
+	}
+	kmem_free(usage, upages * LFS_BSIZE);
+
+	cp = (lfs_cphdr_t *)zbuf;
+	bzero(zbuf, LFS_BSIZE);
+	cp->cp_magic = LFS_CPMAGIC;
+	cp->cp_seq = 1;
+	cp->cp_logseq = 1;
+	cp->cp_seg = 0;
+	cp->cp_segoff = 0;
+	cp->cp_nextseg = 1;
+	cp->cp_sum = dm_cksum(cp, offsetof(lfs_cphdr_t, cp_sum));
+	if (rc == 0)
+		rc = lfs_bio(lfs, zbuf, LFS_BSIZE, sb->sb_cpstart[0], B_WRITE);
+
+	bzero(zbuf, LFS_BSIZE);
+	bcopy(sb, zbuf, sizeof (*sb));
+	if (rc == 0) {
+		(void) dm_target_flush_dev(lfs->l_dmip, lfs->l_dmip->lh);
+		rc = lfs_bio(lfs, zbuf, LFS_BSIZE, 0, B_WRITE);
+		(void) dm_target_flush_dev(lfs->l_dmip, lfs->l_dmip->lh);
+	}
+
+	kmem_free(zbuf, LFS_IOMAX);
+
+	return (rc);
+}
+
+/* Replay the chunks written after the checkpoint */
+static void
+lfs_rollforward(lfs_t *lfs, lfs_cphdr_t *cp)
+{
+	uint32_t	segblks = lfs->l_sb.sb_segblks;
+	uint32_t	seg = cp->cp_seg;
+	uint32_t	off = cp->cp_segoff;
+	uint32_t	nextseg = cp->cp_nextseg;
+	uint64_t	seq = cp->cp_logseq;
+	caddr_t		sum, data;
+	uint64_t	nchunks = 0;
+
+	sum = kmem_alloc(LFS_BSIZE, KM_SLEEP);
+	data = kmem_alloc(LFS_SUMMAX * LFS_BSIZE, KM_SLEEP);
+
+	for (;;) {
+		lfs_sumhdr_t	*ss = (lfs_sumhdr_t *)sum;
+		uint32_t	*lbas = (uint32_t *)(ss + 1);
+		uint32_t	cksum;
+
+		if (off + 2 > segblks) {
+			if (nextseg >= lfs->l_sb.sb_nsegs)
+				break;
+			seg = nextseg;
+			off = 0;
+			nextseg = LFS_NOSEG;
+		}
+
+		if (lfs_bio(lfs, sum, LFS_BSIZE, lfs_pba(lfs, seg, off),
+		    B_READ) != 0)
+			break;
+
+		cksum = ss->ss_sum;
+		ss->ss_sum = 0;
+		if (ss->ss_magic != LFS_SSMAGIC || ss->ss_seq != seq ||
+		    ss->ss_seg != seg || ss->ss_nblks == 0 ||
+		    ss->ss_nblks > LFS_SUMMAX ||
+		    off + 1 + ss->ss_nblks > segblks ||
+		    dm_cksum(sum, LFS_BSIZE) != cksum)
+			break;
+
+		if (lfs_bio(lfs, data, (size_t)ss->ss_nblks * LFS_BSIZE,
+		    lfs_pba(lfs, seg, off + 1), B_READ) != 0 ||
+		    dm_cksum(data, (size_t)ss->ss_nblks * LFS_BSIZE) !=
+		    ss->ss_datasum)
+			break;
+
+		lfs->l_logseq = seq;
+		if (lfs->l_usage[seg].su_state != LFS_SEG_USED) {
+			lfs->l_usage[seg].su_state = LFS_SEG_USED;
+			lfs->l_usage[seg].su_live = 0;
+		}
+		for (uint32_t i = 0; i < ss->ss_nblks; i++) {
+			if (lbas[i] < lfs->l_sb.sb_nlblks)
+				lfs_map_set(lfs, lbas[i],
+				    lfs_pba(lfs, seg, off + 1 + i));
+		}
+
+		nextseg = ss->ss_nextseg;
+		off += 1 + ss->ss_nblks;
+		seq++;
+		nchunks++;
+	}
+
+	/* Where the log stopped is where it continues */
+	lfs->l_seg = seg;
+	lfs->l_segoff = off;
+	lfs->l_nextseg = nextseg;
+	lfs->l_logseq = seq;
+
+	if (nchunks != 0) {
+		cmn_err(CE_CONT, "dm_lfs: %s: rolled forward %llu chunks\n",
+		    refstr_value(lfs->l_dmip->name), (u_longlong_t)nchunks);
+	}
+
+	kmem_free(data, LFS_SUMMAX * LFS_BSIZE);
+	kmem_free(sum, LFS_BSIZE);
+}
+
+static int
+lfs_mount(lfs_t *lfs)
+{
+	lfs_super_t	*sb = &lfs->l_sb;
+	lfs_cphdr_t	*cps[2];
+	lfs_cphdr_t	*cp = NULL;
+	caddr_t		blk;
+	size_t		upages;
+	int		slot = 0;
+	int		rc;
+
+	blk = kmem_zalloc(LFS_BSIZE, KM_SLEEP);
+	if ((rc = lfs_bio(lfs, blk, LFS_BSIZE, 0, B_READ)) != 0) {
+		kmem_free(blk, LFS_BSIZE);
+		return (rc);
+	}
+	bcopy(blk, sb, sizeof (*sb));
+	kmem_free(blk, LFS_BSIZE);
+
+	if (sb->sb_magic != LFS_MAGIC || sb->sb_version != LFS_VERSION ||
+	    sb->sb_sum != dm_cksum(sb, offsetof(lfs_super_t, sb_sum)) ||
+	    sb->sb_segstart + sb->sb_nsegs * sb->sb_segblks >
+	    (lfs->l_dmip->size >> LFS_BSHIFT))
+		return (EINVAL);
+
+	/* The newest valid checkpoint wins */
+	for (int i = 0; i < 2; i++) {
+		cps[i] = kmem_zalloc(LFS_BSIZE, KM_SLEEP);
+		if (lfs_bio(lfs, (caddr_t)cps[i], LFS_BSIZE,
+		    sb->sb_cpstart[i], B_READ) != 0 ||
+		    cps[i]->cp_magic != LFS_CPMAGIC || cps[i]->cp_sum !=
+		    dm_cksum(cps[i], offsetof(lfs_cphdr_t, cp_sum)))
+			continue;
+		if (cp == NULL || cps[i]->cp_seq > cp->cp_seq) {
+			cp = cps[i];
+			slot = i;
+		}
+	}
+	if (cp == NULL) {
+		rc = EINVAL;
+		goto out;
+	}
+
+	lfs->l_mappages = howmany(sb->sb_nlblks, LFS_MAPPG);
+	upages = lfs_usage_pages(sb->sb_nsegs);
+	lfs->l_npages = lfs->l_mappages + upages;
+	lfs->l_map = kmem_zalloc(lfs->l_mappages * LFS_BSIZE, KM_SLEEP);
+	lfs->l_usage = kmem_zalloc(upages * LFS_BSIZE, KM_SLEEP);
+	lfs->l_dirty[0] = kmem_zalloc(BT_SIZEOFMAP(lfs->l_npages), KM_SLEEP);
+	lfs->l_dirty[1] = kmem_zalloc(BT_SIZEOFMAP(lfs->l_npages), KM_SLEEP);
+
+	if ((rc = lfs_bio_big(lfs, (caddr_t)lfs->l_map,
+	    lfs->l_mappages * LFS_BSIZE, sb->sb_cpstart[slot] + 1,
+	    B_READ)) != 0 ||
+	    (rc = lfs_bio_big(lfs, (caddr_t)lfs->l_usage, upages * LFS_BSIZE,
+	    sb->sb_cpstart[slot] + 1 + lfs->l_mappages, B_READ)) != 0)
+		goto out;
+
+	/* The other slot is older than this one all over */
+	for (size_t pg = 0; pg < lfs->l_npages; pg++)
+		BT_SET(lfs->l_dirty[slot ^ 1], pg);
+	lfs->l_cpslot = slot ^ 1;
+	lfs->l_cpseq = cp->cp_seq;
+
+	lfs_rollforward(lfs, cp);
+
+	lfs->l_nfree = 0;
+	for (uint32_t seg = 0; seg < sb->sb_nsegs; seg++) {
+		lfs_usage_t	*su = &lfs->l_usage[seg];
+
+		if (seg == lfs->l_seg || seg == lfs->l_nextseg) {
+			su->su_state = LFS_SEG_USED;
+		} else if (su->su_state == LFS_SEG_CLEANED) {
+			su->su_state = LFS_SEG_FREE;
+		}
+		if (su->su_state == LFS_SEG_FREE)
+			lfs->l_nfree++;
+	}
+
+	/* The log stopped right at the start of its next segment */
+	if (lfs->l_nextseg == LFS_NOSEG) {
+		mutex_enter(&lfs->l_lock);
+		lfs->l_nextseg = lfs_seg_alloc(lfs);
+		mutex_exit(&lfs->l_lock);
+		if (lfs->l_nextseg == LFS_NOSEG) {
+			rc = ENOSPC;
+			goto out;
+		}
+	}
+
+	/* Reads of the head segment are served from its buffer */
+	for (int i = 0; i < 2; i++) {
+		lfs->l_bufs[i] = kmem_zalloc((size_t)sb->sb_segblks *
+		    LFS_BSIZE, KM_SLEEP);
+	}
+	lfs->l_bufidx = 0;
+	lfs->l_bufseg[0] = lfs->l_seg;
+	lfs->l_bufseg[1] = LFS_NOSEG;
+	if (lfs->l_segoff != 0) {
+		rc = lfs_bio_big(lfs, lfs->l_bufs[0],
+		    (size_t)lfs->l_segoff * LFS_BSIZE,
+		    lfs_pba(lfs, lfs->l_seg, 0), B_READ);
+	}
+
+out:
+	kmem_free(cps[0], LFS_BSIZE);
+	kmem_free(cps[1], LFS_BSIZE);
+
+	return (rc);
+}
+
+static void
+lfs_free(lfs_t *lfs)
+{
+	size_t	segsz = (size_t)lfs->l_sb.sb_segblks * LFS_BSIZE;
+
+	for (int i = 0; i < 2; i++) {
+		if (lfs->l_bufs[i] != NULL)
+			kmem_free(lfs->l_bufs[i], segsz);
+		if (lfs->l_chunks[i].c_bp != NULL)
+			freerbuf(lfs->l_chunks[i].c_bp);
+		if (lfs->l_dirty[i] != NULL)
+			kmem_free(lfs->l_dirty[i],
+			    BT_SIZEOFMAP(lfs->l_npages));
+	}
+	if (lfs->l_map != NULL)
+		kmem_free(lfs->l_map, lfs->l_mappages * LFS_BSIZE);
+	if (lfs->l_usage != NULL)
+		kmem_free(lfs->l_usage,
+		    (lfs->l_npages - lfs->l_mappages) * LFS_BSIZE);
+
+	if (lfs->l_tq != NULL)
+		ddi_taskq_destroy(lfs->l_tq);
+
+	cv_destroy(&lfs->l_gccv);
+	cv_destroy(&lfs->l_cv);
+	mutex_destroy(&lfs->l_lock);
+	kmem_free(lfs, sizeof (*lfs));
+}
+
+/*
+ * Plugin entry points
+ */
+static int
+dm_lfs_init(void)
+{
+	return (0);
+}
+
+static void
+dm_lfs_fini(void)
+{
+}
+
+static int
+dm_lfs_create(dm_info_t *dmip, int argc, char **argv, cred_t *crp,
+    void **privp)
+{
+	lfs_t		*lfs;
+	boolean_t	format = B_FALSE;
+	uint32_t	segblks = LFS_SEGBLKS;
+	uint32_t	op = LFS_OP;
+	int		rc;
+
+	for (int i = 0; i < argc; i++) {
+		unsigned long	val;
+
+		if (strcmp(argv[i], "format") == 0) {
+			format = B_TRUE;
+		} else if (strncmp(argv[i], "segsize=", 8) == 0 &&
+		    ddi_strtoul(argv[i] + 8, NULL, 10, &val) == 0) {
+			segblks = (uint32_t)(val * 1024 / LFS_BSIZE);
+		} else if (strncmp(argv[i], "op=", 3) == 0 &&
+		    ddi_strtoul(argv[i] + 3, NULL, 10, &val) == 0) {
+			op = (uint32_t)val;
+		} else {
+			cmn_err(CE_WARN, "dm_lfs: unknown argument '%s'",
+			    argv[i]);
+			return (EINVAL);
+		}
+	}
+
+	lfs = kmem_zalloc(sizeof (*lfs), KM_SLEEP);
+	lfs->l_dmip = dmip;
+	mutex_init(&lfs->l_lock, NULL, MUTEX_DRIVER, NULL);
+	cv_init(&lfs->l_cv, NULL, CV_DRIVER, NULL);
+	cv_init(&lfs->l_gccv, NULL, CV_DRIVER, NULL);
+
+	if (format && (rc = lfs_format(lfs, dmip->size, segblks, op)) != 0) {
+		cmn_err(CE_WARN, "dm_lfs: %s: format failed (%d)",
+		    refstr_value(dmip->name), rc);
+		lfs_free(lfs);
+		return (rc);
+	}
+
+	if ((rc = lfs_mount(lfs)) != 0) {
+		cmn_err(CE_WARN, "dm_lfs: %s: no valid log found (%d)",
+		    refstr_value(dmip->name), rc);
+		lfs_free(lfs);
+		return (rc);
+	}
+
+	for (int i = 0; i < 2; i++) {
+		lfs->l_chunks[i].c_bp = getrbuf(KM_SLEEP);
+	}
+	lfs->l_fill = &lfs->l_chunks[0];
+	lfs->l_flight = &lfs->l_chunks[1];
+
+	lfs->l_tq = ddi_taskq_create(NULL, "dm_lfs", ncpus, TASKQ_DEFAULTPRI,
+	    0);
+	lfs->l_cleaner = thread_create(NULL, 0, lfs_cleaner, lfs, 0, &p0,
+	    TS_RUN, minclsyspri);
+
+	dmip->size = lfs->l_sb.sb_nlblks << LFS_BSHIFT;
+	*privp = lfs;
+
+	return (0);
+}
+
+static void
+dm_lfs_destroy(dm_info_t *dmip, void *priv)
+{
+	lfs_t		*lfs = priv;
+	kt_did_t	tid = lfs->l_cleaner->t_did;
+
+	/* Writes still queued may need the cleaner */
+	ddi_taskq_wait(lfs->l_tq);
+
+	/* Push the log out and leave a checkpoint behind */
+	mutex_enter(&lfs->l_lock);
+	lfs->l_exiting = B_TRUE;
+	cv_signal(&lfs->l_gccv);
+	mutex_exit(&lfs->l_lock);
+	thread_join(tid);
+
+	mutex_enter(&lfs->l_lock);
+	if (lfs->l_error == 0)
+		lfs_checkpoint(lfs);
+	while (lfs->l_busy)
+		cv_wait(&lfs->l_cv, &lfs->l_lock);
+	mutex_exit(&lfs->l_lock);
+
+	lfs_free(lfs);
+}
+
+static dm_mapio_t
+dm_lfs_mapio(dm_info_t *dmip, void *priv, struct buf *bp, dm_remap_t *rp)
+{
+	lfs_t		*lfs = priv;
+	lfs_req_t	*req;
+	uint64_t	off = ldbtob(bp->b_lblkno);
+
+	if ((off & (LFS_BSIZE - 1)) != 0 ||
+	    (bp->b_bcount & (LFS_BSIZE - 1)) != 0) {
+		bioerror(bp, EINVAL);
+		return (DM_MAPIO_KILL);
+	}
+	if (bp->b_bcount == 0) {
+		bp->b_resid = 0;
+		biodone(bp);
+		return (DM_MAPIO_SUBMITTED);
+	}
+	if (bp->b_flags & B_READ) {
+		dm_split_t	*ds;
+
+		if ((ds = dm_split_alloc(bp, NULL, lfs, KM_NOSLEEP)) == NULL) {
+			bioerror(bp, ENOMEM);
+			return (DM_MAPIO_KILL);
+		}
+		if (ddi_taskq_dispatch(lfs->l_tq, lfs_read_task, ds,
+		    DDI_NOSLEEP) != DDI_SUCCESS) {
+			dm_split_error(ds, ENOMEM);
+			dm_split_rele(ds);
+		}
+		return (DM_MAPIO_SUBMITTED);
+	}
+
+	if ((req = kmem_zalloc(sizeof (*req), KM_NOSLEEP)) == NULL) {
+		bioerror(bp, ENOMEM);
+		return (DM_MAPIO_KILL);
+	}
+	req->r_bp = bp;
+	req->r_lfs = lfs;
+	req->r_pending = 1;
+	if (ddi_taskq_dispatch(lfs->l_tq, lfs_write, req, DDI_NOSLEEP) !=
+	    DDI_SUCCESS) {
+		kmem_free(req, sizeof (*req));
+		bioerror(bp, ENOMEM);
+		return (DM_MAPIO_KILL);
+	}
+
+	return (DM_MAPIO_SUBMITTED);
+}
+
+static int
+dm_lfs_stats(dm_info_t *dmip, void *priv, nvlist_t *nvl)
+{
+	lfs_t	*lfs = priv;
+
+	mutex_enter(&lfs->l_lock);
+	(void) nvlist_add_uint64(nvl, "segments", lfs->l_sb.sb_nsegs);
+	(void) nvlist_add_uint32(nvl, "segblks", lfs->l_sb.sb_segblks);
+	(void) nvlist_add_uint32(nvl, "free", lfs->l_nfree);
+	(void) nvlist_add_uint32(nvl, "cleaned", lfs->l_ncleaned);
+	(void) nvlist_add_uint64(nvl, "logseq", lfs->l_logseq);
+	(void) nvlist_add_uint64(nvl, "checkpoint", lfs->l_cpseq);
+	(void) nvlist_add_int32(nvl, "error", lfs->l_error);
+	mutex_exit(&lfs->l_lock);
+
+	return (0);
+}
+
+
+dm_plugin_ops_t dm_ops = {
+	.dpo_rev	= DPO_REV,
+	.dpo_name	= "lfs",
+	.dpo_init	= dm_lfs_init,
+	.dpo_fini	= dm_lfs_fini,
+	.dpo_create	= dm_lfs_create,
+	.dpo_destroy	= dm_lfs_destroy,
+	.dpo_mapio	= dm_lfs_mapio,
+	.dpo_stats	= dm_lfs_stats,
+};
+
+static struct modlmisc modlmisc = {
+	.misc_modops	= &mod_miscops,
+	.misc_linkinfo	= "Solaris Device Mapper log-structured plugin"
+};
+
+static struct modlinkage modlinkage = {
+	.ml_rev		= MODREV_1,
+	.ml_linkage	= {&modlmisc, NULL, NULL, NULL}
+};
+
+int
+_init(void)
+{
+	return (mod_install(&modlinkage));
+}
+
+int
+_info(struct modinfo *mip)
+{
+	return (mod_info(&modlinkage, mip));
+}
+
+int
+_fini(void)
+{
+	return (mod_remove(&modlinkage));
+}
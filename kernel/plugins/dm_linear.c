@@ -25,8 +25,20 @@
  */
 
 
+/*
+ * Linear target
+ *
+ * Presents a contiguous range of the mapping device.
+ *
+ * Arguments:	[offset=<blocks>] [length=<blocks>]
+ *
+ * Both in DEV_BSIZE blocks; the range runs to the end of the device unless
+ * a length is given.  All I/O takes the core's in-place remap path.
+ */
+
 #include <sys/conf.h>
 #include <sys/file.h>
+#include <sys/kmem.h>
 #include <sys/modctl.h>
 #include <sys/types.h>
 #include <sys/ddi.h>
@@ -36,49 +48,109 @@
 #include <sys/dm_impl.h>
 #include <sys/dm_ops.h>
 
-static void
+typedef struct {
+	ldi_handle_t	lt_lh;
+	dev_t		lt_dev;
+	diskaddr_t	lt_offset;	/* Start on the device, blocks */
+	diskaddr_t	lt_length;	/* Blocks */
+} dm_linear_t;
+
+static int
 dm_linear_init(void)
 {
-	return;
+	return (0);
 }
 
 
 static void
 dm_linear_fini(void)
 {
-	return;
 }
 
 
-static void
-dm_linear_create(void)
+static int
+dm_linear_create(dm_info_t *dmip, int argc, char **argv, cred_t *crp,
+    void **privp)
 {
-	return;
+	dm_linear_t	*lt;
+	diskaddr_t	devblks = lbtodb(dmip->size);
+	u_longlong_t	offset = 0;
+	u_longlong_t	length = 0;
+
+	for (int i = 0; i < argc; i++) {
+		if (strncmp(argv[i], "offset=", 7) == 0 &&
+		    ddi_strtoull(argv[i] + 7, NULL, 10, &offset) == 0)
+			continue;
+		if (strncmp(argv[i], "length=", 7) == 0 &&
+		    ddi_strtoull(argv[i] + 7, NULL, 10, &length) == 0)
+			continue;
+		cmn_err(CE_WARN, "dm_linear: unknown argument '%s'", argv[i]);
+		return (EINVAL);
+	}
+
+	if (offset >= devblks)
+		return (EINVAL);
+	if (length == 0)
+		length = devblks - offset;
+	if (length > devblks - offset)
+		return (EINVAL);
+
+	lt = kmem_zalloc(sizeof (*lt), KM_SLEEP);
+	lt->lt_lh = dmip->lh;
+	lt->lt_dev = dmip->tdev;
+	lt->lt_offset = offset;
+	lt->lt_length = length;
+
+	dmip->size = ldbtob(length);
+	*privp = lt;
+
+	return (0);
 }
 
 
 static void
-dm_linear_destroy(void)
+dm_linear_destroy(dm_info_t *dmip, void *priv)
 {
-	return;
+	kmem_free(priv, sizeof (dm_linear_t));
 }
 
 
-static void
-dm_linear_mapio(void)
+static boolean_t
+dm_linear_remap(void *priv, const struct buf *bp, dm_remap_t *rp)
 {
-	return;
+	dm_linear_t	*lt = priv;
+
+	rp->dr_lh = lt->lt_lh;
+	rp->dr_dev = lt->lt_dev;
+	rp->dr_blkno = lt->lt_offset + bp->b_lblkno;
+
+	return (B_TRUE);
 }
 
 
-static void
-dm_linear_stats(void)
+/* Only reached when the core is out of in-place remap slots */
+static dm_mapio_t
+dm_linear_mapio(dm_info_t *dmip, void *priv, struct buf *bp, dm_remap_t *rp)
+{
+	(void) dm_linear_remap(priv, bp, rp);
+
+	return (DM_MAPIO_REMAPPED);
+}
+
+
+static int
+dm_linear_stats(dm_info_t *dmip, void *priv, nvlist_t *nvl)
 {
-	return;
+	dm_linear_t	*lt = priv;
+
+	(void) nvlist_add_uint64(nvl, "offset", lt->lt_offset);
+	(void) nvlist_add_uint64(nvl, "length", lt->lt_length);
+
+	return (0);
 }
 
 
-static dm_plugin_ops_t dm_linear_ops = {
+dm_plugin_ops_t dm_ops = {
 	.dpo_rev	= DPO_REV,
 	.dpo_name	= "linear",
 	.dpo_init	= dm_linear_init,
@@ -86,6 +158,7 @@ static dm_plugin_ops_t dm_linear_ops = {
 	.dpo_create	= dm_linear_create,
 	.dpo_destroy	= dm_linear_destroy,
 	.dpo_mapio	= dm_linear_mapio,
+	.dpo_remap	= dm_linear_remap,
 	.dpo_stats	= dm_linear_stats,
 };
 
@@ -0,0 +1,746 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright 2011 Grigale Ltd. All rights reserved.
+ * Use is subject to license terms.
+ */
+
+
+/*
+ * Migration target
+ *
+ * Moves a live mapping from its device (the source) to another one (the
+ * destination) while I/O goes on.  The mapping is cut into regions and a
+ * copier thread walks them in order, copying each with one large read and
+ * one large write, throttled to the configured rate.  The source stays
+ * authoritative until the end: every write goes to it, and writes to
+ * regions already copied go to the destination as well.  Writes landing in
+ * the region being copied mark it dirty and it is copied again; after a
+ * few passes writes to it are held while the last copy is made.
+ *
+ * Once all regions are copied, reads go to the destination, writes are
+ * held while the source drains, and a marker naming the source is written
+ * to the last block of the destination, which has to be past the end of
+ * the mapping.  From then on the source is not touched.  It is never
+ * written by the migration itself, so it stays as it was at the switch to
+ * fall back on.  A mapping recreated with a destination carrying the
+ * marker for its source goes straight to the destination; one without it
+ * starts the copy over, which is safe since the source had every write up
+ * to that point.
+ *
+ * Arguments:	dest=<device> [region=<KB>] [rate=<KB/s>]
+ *
+ * region is a power of two from 64K to 64M, rate 0 lifts the cap.
+ */
+
+#include <sys/atomic.h>
+#include <sys/bitmap.h>
+#include <sys/buf.h>
+#include <sys/conf.h>
+#include <sys/cred.h>
+#include <sys/disp.h>
+#include <sys/errno.h>
+#include <sys/file.h>
+#include <sys/kmem.h>
+#include <sys/modctl.h>
+#include <sys/proc.h>
+#include <sys/sysmacros.h>
+#include <sys/systm.h>
+#include <sys/thread.h>
+#include <sys/types.h>
+#include <sys/ddi.h>
+#include <sys/sunddi.h>
+
+#include <sys/dm.h>
+#include <sys/dm_impl.h>
+#include <sys/dm_ops.h>
+
+#define	MIG_MAGIC	0x444d4d4947523031ULL	/* "DMMIGR01" */
+
+#define	MIG_RGSHIFT	11			/* Default region size, 1M */
+#define	MIG_RGMIN	(64 * 1024)
+#define	MIG_RGMAX	(64 * 1024 * 1024)
+#define	MIG_RATE	(50 * 1024)		/* Default copy rate, KB/s */
+#define	MIG_PASSES	3			/* Copies with writes flowing */
+#define	MIG_NOREGION	((uint64_t)-1)
+
+/* Device indices */
+#define	MIG_SRC		0
+#define	MIG_DST		1
+
+/* Pieces are tagged with their region, and whether they are bound for */
+#define	MIG_TAG_DST	(1ULL << 63)	/* the destination */
+
+/* Left on the destination, past the mapping, once it is all there */
+typedef struct {
+	uint64_t	mm_magic;
+	uint64_t	mm_size;	/* Bytes migrated */
+	char		mm_src[256];	/* Where from */
+	uint32_t	mm_pad;
+	uint32_t	mm_sum;		/* Checksum of the above */
+} mig_marker_t;
+
+typedef struct {
+	dm_info_t	*m_dmip;
+	kmutex_t	m_lock;
+	kcondvar_t	m_cv;		/* Source I/O drained */
+	kcondvar_t	m_cpcv;		/* Copier wakeup */
+
+	ldi_handle_t	m_lh[2];	/* Source and destination */
+	dev_t		m_dev[2];
+	refstr_t	*m_dest;	/* Destination path */
+	uint64_t	m_size;		/* Bytes */
+	diskaddr_t	m_mkblk;	/* Marker block on the destination */
+	size_t		m_mklen;	/* and its length */
+	uint32_t	m_rgshift;	/* log2 of disk blocks per region */
+	uint64_t	m_nregions;
+
+	ulong_t		*m_copied;	/* Regions on both devices */
+	ulong_t		*m_dirty;	/* Written to while being copied */
+	uint16_t	*m_busy;	/* Source writes in flight */
+	uint64_t	m_incopy;	/* Region being copied */
+	uint64_t	m_ncopied;
+	uint32_t	m_srcios;	/* Source I/O in flight */
+	boolean_t	m_holding;	/* Writes to m_incopy are held */
+	boolean_t	m_switching;	/* All writes are held */
+	boolean_t	m_readdst;	/* Reads go to the destination */
+	boolean_t	m_switched;	/* and so does everything else */
+	dm_child_t	*m_held;	/* Held writes */
+
+	uint64_t	m_rate;		/* Copy bytes per second, 0 no cap */
+	caddr_t		m_buf;		/* Copy buffer, a region */
+	kthread_t	*m_copier;
+	boolean_t	m_exiting;
+	int		m_error;	/* Copy failed, migration stopped */
+
+	uint64_t	m_mirrored;	/* Writes sent to both devices */
+	uint64_t	m_recopied;	/* Regions copied again */
+	uint64_t	m_nheld;	/* Writes held */
+	uint64_t	m_copybytes;	/* Bytes copied */
+} mig_t;
+
+
+/* Synchronous I/O to either device */
+static int
+mig_bio(mig_t *m, int idx, caddr_t addr, size_t len, diskaddr_t blk, int rw)
+{
+	return (dm_target_bio(m->m_dmip, m->m_lh[idx], m->m_dev[idx], addr,
+	    len, blk, rw));
+}
+
+/*
+ * I/O path
+ */
+static void
+mig_piece_done(dm_child_t *dc, void *arg)
+{
+	mig_t		*m = arg;
+	uint64_t	region = dc->dc_tag;
+
+	if (region & MIG_TAG_DST)
+		return;
+
+	mutex_enter(&m->m_lock);
+	if (!(dc->dc_buf.b_flags & B_READ)) {
+		m->m_busy[region]--;
+		if (region == m->m_incopy) {
+			BT_SET(m->m_dirty, region);
+			if (m->m_busy[region] == 0)
+				cv_broadcast(&m->m_cv);
+		}
+	}
+	if (--m->m_srcios == 0 && m->m_switching)
+		cv_broadcast(&m->m_cv);
+	mutex_exit(&m->m_lock);
+}
+
+/* Send pieces where they belong now, mirroring writes to copied regions */
+static void
+mig_dispatch(mig_t *m, dm_child_t *list)
+{
+	dm_child_t	*ready = NULL;
+	dm_child_t	*dc;
+
+	mutex_enter(&m->m_lock);
+	while ((dc = list) != NULL) {
+		struct buf	*cbp = &dc->dc_buf;
+		uint64_t	region = dc->dc_tag;
+		boolean_t	write = !(cbp->b_flags & B_READ);
+
+		list = dc->dc_next;
+
+		if (m->m_switched || (!write && m->m_readdst)) {
+			cbp->b_edev = m->m_dev[MIG_DST];
+			cbp->b_dev = cmpdev(m->m_dev[MIG_DST]);
+			dc->dc_lh = m->m_lh[MIG_DST];
+			dc->dc_tag |= MIG_TAG_DST;
+			dc->dc_next = ready;
+			ready = dc;
+			continue;
+		}
+
+		if (write && (m->m_switching ||
+		    (m->m_holding && region == m->m_incopy))) {
+			dc->dc_next = m->m_held;
+			m->m_held = dc;
+			m->m_nheld++;
+			continue;
+		}
+
+		dc->dc_lh = m->m_lh[MIG_SRC];
+		dc->dc_next = ready;
+		ready = dc;
+		m->m_srcios++;
+		if (!write)
+			continue;
+		m->m_busy[region]++;
+
+		if (BT_TEST(m->m_copied, region)) {
+			dm_split_t	*ds = dc->dc_split;
+			dm_child_t	*mc;
+
+			/* Same place on both, the mapping is the identity */
+			mc = dm_split_child(ds,
+			    (size_t)ldbtob(cbp->b_lblkno - ds->ds_bp->b_lblkno),
+			    cbp->b_bcount, m->m_dev[MIG_DST], cbp->b_lblkno,
+			    KM_NOSLEEP);
+			if (mc != NULL) {
+				mc->dc_lh = m->m_lh[MIG_DST];
+				mc->dc_tag = region | MIG_TAG_DST;
+				mc->dc_next = ready;
+				ready = mc;
+				m->m_mirrored++;
+			}
+		}
+	}
+	mutex_exit(&m->m_lock);
+
+	while ((dc = ready) != NULL) {
+		ready = dc->dc_next;
+		dm_issue(dc->dc_lh, &dc->dc_buf);
+	}
+}
+
+/*
+ * Copier
+ */
+
+/* Sleep off whatever a copy of 'len' since 'start' is ahead of the rate */
+static void
+mig_throttle(mig_t *m, size_t len, clock_t start)
+{
+	clock_t	want, spent;
+
+	if (m->m_rate == 0)
+		return;
+
+	want = drv_usectohz((clock_t)((uint64_t)len * MICROSEC / m->m_rate));
+	spent = ddi_get_lbolt() - start;
+	if (spent >= want)
+		return;
+
+	mutex_enter(&m->m_lock);
+	if (!m->m_exiting) {
+		(void) cv_reltimedwait(&m->m_cpcv, &m->m_lock, want - spent,
+		    TR_CLOCK_TICK);
+	}
+	mutex_exit(&m->m_lock);
+}
+
+static int
+mig_copy(mig_t *m, uint64_t region, boolean_t throttle)
+{
+	diskaddr_t	blk = region << m->m_rgshift;
+	size_t		len = MIN(ldbtob(1ULL << m->m_rgshift),
+	    m->m_size - ldbtob(blk));
+	clock_t		start = ddi_get_lbolt();
+	int		rc;
+
+	if (m->m_exiting)
+		return (EINTR);
+
+	if ((rc = mig_bio(m, MIG_SRC, m->m_buf, len, blk, B_READ)) != 0 ||
+	    (rc = mig_bio(m, MIG_DST, m->m_buf, len, blk, B_WRITE)) != 0)
+		return (rc);
+	m->m_copybytes += len;
+
+	if (throttle)
+		mig_throttle(m, len, start);
+
+	return (0);
+}
+
+/* Copy one region, and again for as long as writes get in the way */
+static int
+mig_copy_region(mig_t *m, uint64_t region)
+{
+	dm_child_t	*held;
+	int		rc;
+
+	mutex_enter(&m->m_lock);
+	m->m_incopy = region;
+	BT_CLEAR(m->m_dirty, region);
+	mutex_exit(&m->m_lock);
+
+	for (int pass = 0; pass < MIG_PASSES; pass++) {
+		if ((rc = mig_copy(m, region, B_TRUE)) != 0)
+			break;
+
+		mutex_enter(&m->m_lock);
+		if (!BT_TEST(m->m_dirty, region) && m->m_busy[region] == 0) {
+			BT_SET(m->m_copied, region);
+			m->m_ncopied++;
+			m->m_incopy = MIG_NOREGION;
+			mutex_exit(&m->m_lock);
+			return (0);
+		}
+		BT_CLEAR(m->m_dirty, region);
+		m->m_recopied++;
+		mutex_exit(&m->m_lock);
+	}
+
+	/* Hold writes to it, let the rest drain and copy it once more */
+	if (rc == 0) {
+		mutex_enter(&m->m_lock);
+		m->m_holding = B_TRUE;
+		while (m->m_busy[region] != 0)
+			cv_wait(&m->m_cv, &m->m_lock);
+		mutex_exit(&m->m_lock);
+
+		rc = mig_copy(m, region, B_FALSE);
+	}
+
+	mutex_enter(&m->m_lock);
+	if (rc == 0) {
+		BT_SET(m->m_copied, region);
+		m->m_ncopied++;
+	}
+	m->m_incopy = MIG_NOREGION;
+	m->m_holding = B_FALSE;
+	held = m->m_held;
+	m->m_held = NULL;
+	mutex_exit(&m->m_lock);
+
+	mig_dispatch(m, held);
+
+	return (rc);
+}
+
+/* Mark the destination as holding all of the source */
+static int
+mig_mark(mig_t *m)
+{
+	mig_marker_t	*mm;
+	caddr_t		blk;
+	int		rc;
+
+	blk = kmem_zalloc(m->m_mklen, KM_SLEEP);
+	mm = (mig_marker_t *)blk;
+	mm->mm_magic = MIG_MAGIC;
+	mm->mm_size = m->m_size;
+	(void) strlcpy(mm->mm_src, refstr_value(m->m_dmip->dev),
+	    sizeof (mm->mm_src));
+	mm->mm_sum = dm_cksum(mm, offsetof(mig_marker_t, mm_sum));
+
+	if ((rc = mig_bio(m, MIG_DST, blk, m->m_mklen, m->m_mkblk,
+	    B_WRITE)) == 0)
+		rc = dm_target_flush_dev(m->m_dmip, m->m_lh[MIG_DST]);
+	kmem_free(blk, m->m_mklen);
+
+	return (rc);
+}
+
+/*
+ * Has the source been migrated to this destination already?  A
+ * destination holding another device's migration is refused, the copy
+ * would overwrite it.
+ */
+static int
+mig_marked(mig_t *m, boolean_t *markedp)
+{
+	mig_marker_t	*mm;
+	caddr_t		blk;
+	int		rc;
+
+	*markedp = B_FALSE;
+
+	blk = kmem_zalloc(m->m_mklen, KM_SLEEP);
+	mm = (mig_marker_t *)blk;
+	if ((rc = mig_bio(m, MIG_DST, blk, m->m_mklen, m->m_mkblk,
+	    B_READ)) == 0 && mm->mm_magic == MIG_MAGIC &&
+	    mm->mm_sum == dm_cksum(mm, offsetof(mig_marker_t, mm_sum))) {
+		mm->mm_src[sizeof (mm->mm_src) - 1] = '\0';
+		if (mm->mm_size == m->m_size &&
+		    strncmp(mm->mm_src, refstr_value(m->m_dmip->dev),
+		    sizeof (mm->mm_src) - 1) == 0) {
+			*markedp = B_TRUE;
+		} else {
+			cmn_err(CE_WARN, "dm_migrate: %s: %s holds a "
+			    "migration from %s", refstr_value(m->m_dmip->name),
+			    refstr_value(m->m_dest), mm->mm_src);
+			rc = EBUSY;
+		}
+	}
+	kmem_free(blk, m->m_mklen);
+
+	return (rc);
+}
+
+/*
+ * Every region is on both devices.  Send reads to the destination, hold
+ * writes until the source is idle and mark the destination; then it is
+ * all there is.
+ */
+static int
+mig_switch(mig_t *m)
+{
+	dm_child_t	*held;
+	int		rc;
+
+	mutex_enter(&m->m_lock);
+	m->m_readdst = B_TRUE;
+	m->m_switching = B_TRUE;
+	while (m->m_srcios != 0)
+		cv_wait(&m->m_cv, &m->m_lock);
+	mutex_exit(&m->m_lock);
+
+	if ((rc = dm_target_flush_dev(m->m_dmip, m->m_lh[MIG_DST])) == 0)
+		rc = mig_mark(m);
+
+	/* Without the mark, writes keep going to both */
+	mutex_enter(&m->m_lock);
+	m->m_switched = (rc == 0);
+	m->m_switching = B_FALSE;
+	held = m->m_held;
+	m->m_held = NULL;
+	mutex_exit(&m->m_lock);
+
+	mig_dispatch(m, held);
+
+	if (rc == 0)
+		dm_target_event(m->m_dmip, DM_EVENT_MIGRATED, 0);
+
+	return (rc);
+}
+
+static void
+mig_copier(void *arg)
+{
+	mig_t	*m = arg;
+	int	rc = 0;
+
+	for (uint64_t region = 0; region < m->m_nregions && rc == 0;
+	    region++) {
+		rc = mig_copy_region(m, region);
+	}
+	if (rc == 0)
+		rc = mig_switch(m);
+
+	mutex_enter(&m->m_lock);
+	if (rc != 0 && rc != EINTR) {
+		cmn_err(CE_WARN, "dm_migrate: %s: migration stopped (%d)",
+		    refstr_value(m->m_dmip->name), rc);
+		m->m_error = rc;
+	}
+	while (!m->m_exiting)
+		cv_wait(&m->m_cpcv, &m->m_lock);
+	mutex_exit(&m->m_lock);
+
+	thread_exit();
+}
+
+static void
+mig_free(mig_t *m)
+{
+	if (m->m_buf != NULL)
+		kmem_free(m->m_buf, ldbtob(1ULL << m->m_rgshift));
+	if (m->m_busy != NULL)
+		kmem_free(m->m_busy, m->m_nregions * sizeof (uint16_t));
+	if (m->m_dirty != NULL)
+		kmem_free(m->m_dirty, BT_SIZEOFMAP(m->m_nregions));
+	if (m->m_copied != NULL)
+		kmem_free(m->m_copied, BT_SIZEOFMAP(m->m_nregions));
+	if (m->m_lh[MIG_DST] != NULL)
+		dm_target_close(m->m_dmip, m->m_lh[MIG_DST]);
+	if (m->m_dest != NULL)
+		refstr_rele(m->m_dest);
+
+	cv_destroy(&m->m_cpcv);
+	cv_destroy(&m->m_cv);
+	mutex_destroy(&m->m_lock);
+	kmem_free(m, sizeof (*m));
+}
+
+/*
+ * Plugin entry points
+ */
+static int
+dm_migrate_init(void)
+{
+	return (0);
+}
+
+static void
+dm_migrate_fini(void)
+{
+}
+
+static int
+dm_migrate_create(dm_info_t *dmip, int argc, char **argv, cred_t *crp,
+    void **privp)
+{
+	mig_t		*m;
+	char		*dest = NULL;
+	uint32_t	rgshift = MIG_RGSHIFT;
+	unsigned long	rate = MIG_RATE;
+	uint64_t	destsize, mkoff;
+	uint32_t	lbsize;
+	boolean_t	marked;
+	int		rc;
+
+	for (int i = 0; i < argc; i++) {
+		unsigned long	val;
+
+		if (strncmp(argv[i], "dest=", 5) == 0 && argv[i][5] != '\0') {
+			dest = argv[i] + 5;
+		} else if (strncmp(argv[i], "region=", 7) == 0 &&
+		    ddi_strtoul(argv[i] + 7, NULL, 10, &val) == 0 &&
+		    val >= MIG_RGMIN / 1024 && val <= MIG_RGMAX / 1024 &&
+		    ISP2(val)) {
+			rgshift = highbit(val * 1024 / DEV_BSIZE) - 1;
+		} else if (strncmp(argv[i], "rate=", 5) == 0 &&
+		    ddi_strtoul(argv[i] + 5, NULL, 10, &val) == 0) {
+			rate = val;
+		} else {
+			cmn_err(CE_WARN, "dm_migrate: unknown argument '%s'",
+			    argv[i]);
+			return (EINVAL);
+		}
+	}
+	if (dest == NULL) {
+		cmn_err(CE_WARN, "dm_migrate: no destination device given");
+		return (EINVAL);
+	}
+
+	m = kmem_zalloc(sizeof (*m), KM_SLEEP);
+	m->m_dmip = dmip;
+	mutex_init(&m->m_lock, NULL, MUTEX_DRIVER, NULL);
+	cv_init(&m->m_cv, NULL, CV_DRIVER, NULL);
+	cv_init(&m->m_cpcv, NULL, CV_DRIVER, NULL);
+	m->m_lh[MIG_SRC] = dmip->lh;
+	m->m_dev[MIG_SRC] = dmip->tdev;
+	m->m_dest = refstr_alloc(dest);
+	m->m_size = dmip->size;
+	m->m_rgshift = rgshift;
+	m->m_nregions = howmany(lbtodb(m->m_size), 1ULL << rgshift);
+	m->m_incopy = MIG_NOREGION;
+	m->m_rate = (uint64_t)rate * 1024;
+
+	if ((rc = dm_target_open(dmip, crp, dest, &m->m_lh[MIG_DST],
+	    &m->m_dev[MIG_DST])) != 0) {
+		mig_free(m);
+		return (rc);
+	}
+
+	/* The marker goes in the last block, which the data must not use */
+	lbsize = dm_target_limits(dmip, m->m_lh[MIG_DST])->dl_lbsize;
+	if (ldi_get_size(m->m_lh[MIG_DST], &destsize) != DDI_SUCCESS ||
+	    destsize < lbsize ||
+	    (mkoff = P2ALIGN(destsize, (uint64_t)lbsize) - lbsize) <
+	    m->m_size) {
+		cmn_err(CE_WARN, "dm_migrate: %s: %s has no room for the "
+		    "mapping and a block after it", refstr_value(dmip->name),
+		    dest);
+		mig_free(m);
+		return (ENOSPC);
+	}
+	m->m_mkblk = lbtodb(mkoff);
+	m->m_mklen = lbsize;
+
+	m->m_copied = kmem_zalloc(BT_SIZEOFMAP(m->m_nregions), KM_SLEEP);
+	m->m_dirty = kmem_zalloc(BT_SIZEOFMAP(m->m_nregions), KM_SLEEP);
+	m->m_busy = kmem_zalloc(m->m_nregions * sizeof (uint16_t), KM_SLEEP);
+
+	if ((rc = mig_marked(m, &marked)) != 0) {
+		mig_free(m);
+		return (rc);
+	}
+	if (marked) {
+		/* Done before, the source is not to be used again */
+		m->m_ncopied = m->m_nregions;
+		m->m_readdst = B_TRUE;
+		m->m_switched = B_TRUE;
+	} else {
+		m->m_buf = kmem_alloc(ldbtob(1ULL << rgshift), KM_SLEEP);
+		m->m_copier = thread_create(NULL, 0, mig_copier, m, 0, &p0,
+		    TS_RUN, minclsyspri);
+	}
+
+	*privp = m;
+
+	return (0);
+}
+
+static void
+dm_migrate_destroy(dm_info_t *dmip, void *priv)
+{
+	mig_t	*m = priv;
+
+	if (m->m_copier != NULL) {
+		kt_did_t	tid = m->m_copier->t_did;
+
+		mutex_enter(&m->m_lock);
+		m->m_exiting = B_TRUE;
+		cv_broadcast(&m->m_cpcv);
+		mutex_exit(&m->m_lock);
+		thread_join(tid);
+	}
+
+	mig_free(m);
+}
+
+/* Once switched over everything goes straight to the destination */
+static boolean_t
+dm_migrate_remap(void *priv, const struct buf *bp, dm_remap_t *rp)
+{
+	mig_t	*m = priv;
+
+	if (!m->m_switched)
+		return (B_FALSE);
+
+	rp->dr_lh = m->m_lh[MIG_DST];
+	rp->dr_dev = m->m_dev[MIG_DST];
+	rp->dr_blkno = bp->b_lblkno;
+
+	return (B_TRUE);
+}
+
+static dm_mapio_t
+dm_migrate_mapio(dm_info_t *dmip, void *priv, struct buf *bp, dm_remap_t *rp)
+{
+	mig_t		*m = priv;
+	diskaddr_t	blk = bp->b_lblkno;
+	dm_child_t	*list = NULL;
+	dm_split_t	*ds;
+	size_t		off;
+
+	if (dm_migrate_remap(priv, bp, rp))
+		return (DM_MAPIO_REMAPPED);
+
+	if (bp->b_bcount == 0) {
+		bp->b_resid = 0;
+		biodone(bp);
+		return (DM_MAPIO_SUBMITTED);
+	}
+	if ((ds = dm_split_alloc(bp, mig_piece_done, m, KM_NOSLEEP)) ==
+	    NULL) {
+		bioerror(bp, ENOMEM);
+		return (DM_MAPIO_KILL);
+	}
+
+	/* A piece per region touched, no larger than the devices take */
+	for (off = 0; off < bp->b_bcount; ) {
+		uint64_t	region = blk >> m->m_rgshift;
+		size_t		len = MIN(bp->b_bcount - off,
+		    ldbtob(((region + 1) << m->m_rgshift) - blk));
+		dm_child_t	*dc;
+
+		len = MIN(len, dmip->maxxfer);
+		if ((dc = dm_split_child(ds, off, len, m->m_dev[MIG_SRC], blk,
+		    KM_NOSLEEP)) == NULL)
+			break;
+		dc->dc_tag = region;
+		dc->dc_next = list;
+		list = dc;
+
+		blk += btodb(len);
+		off += len;
+	}
+
+	mig_dispatch(m, list);
+	dm_split_rele(ds);
+
+	return (DM_MAPIO_SUBMITTED);
+}
+
+static int
+dm_migrate_stats(dm_info_t *dmip, void *priv, nvlist_t *nvl)
+{
+	mig_t	*m = priv;
+
+	mutex_enter(&m->m_lock);
+	(void) nvlist_add_string(nvl, "dest", refstr_value(m->m_dest));
+	(void) nvlist_add_uint64(nvl, "regions", m->m_nregions);
+	(void) nvlist_add_uint64(nvl, "region_size",
+	    ldbtob(1ULL << m->m_rgshift));
+	(void) nvlist_add_uint64(nvl, "copied", m->m_ncopied);
+	(void) nvlist_add_uint64(nvl, "copied_bytes", m->m_copybytes);
+	(void) nvlist_add_uint64(nvl, "recopied", m->m_recopied);
+	(void) nvlist_add_uint64(nvl, "mirrored", m->m_mirrored);
+	(void) nvlist_add_uint64(nvl, "held", m->m_nheld);
+	(void) nvlist_add_boolean_value(nvl, "switched", m->m_switched);
+	(void) nvlist_add_int32(nvl, "error", m->m_error);
+	mutex_exit(&m->m_lock);
+
+	return (0);
+}
+
+
+dm_plugin_ops_t dm_ops = {
+	.dpo_rev	= DPO_REV,
+	.dpo_name	= "migrate",
+	.dpo_init	= dm_migrate_init,
+	.dpo_fini	= dm_migrate_fini,
+	.dpo_create	= dm_migrate_create,
+	.dpo_destroy	= dm_migrate_destroy,
+	.dpo_mapio	= dm_migrate_mapio,
+	.dpo_remap	= dm_migrate_remap,
+	.dpo_stats	= dm_migrate_stats,
+};
+
+static struct modlmisc modlmisc = {
+	.misc_modops	= &mod_miscops,
+	.misc_linkinfo	= "Solaris Device Mapper migration plugin"
+};
+
+static struct modlinkage modlinkage = {
+	.ml_rev		= MODREV_1,
+	.ml_linkage	= {&modlmisc, NULL, NULL, NULL}
+};
+
+int
+_init(void)
+{
+	return (mod_install(&modlinkage));
+}
+
+int
+_info(struct modinfo *mip)
+{
+	return (mod_info(&modlinkage, mip));
+}
+
+int
+_fini(void)
+{
+	return (mod_remove(&modlinkage));
+}
@@ -0,0 +1,790 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright 2011 Grigale Ltd. All rights reserved.
+ * Use is subject to license terms.
+ */
+
+
+/*
+ * Mirror target
+ *
+ * Keeps the mapping on two to four devices (legs): the mapping device and
+ * the ones given as leg= arguments, in that order, at the same offsets.
+ * Writes go to every leg, reads to one of them in turn.  A write-intent
+ * bitmap on the log device records the regions writes may be in flight
+ * to, so that after a crash only those have to be copied between legs.
+ *
+ * A leg failing I/O is dropped from the mirror as long as another one is
+ * left, and the failure is recorded with the bitmap.  Writes skip it from
+ * then on and the regions they touch are kept dirty; the failed I/O is
+ * retried on, or left to, the other legs.  The leg stays out until the
+ * mapping is created again.
+ *
+ * A resync thread copies dirty regions from the first good leg to the
+ * others, with writes to the region held meanwhile, unless a leg is out:
+ * its regions have to stay dirty, and reads of dirty regions all go to
+ * the same leg anyway.  Legs found failed when the mapping is created are
+ * copied to and taken back once every region is in sync.
+ *
+ * Arguments:	leg=<device> [leg=<device> ...] log=<device> [format]
+ *		[nosync] [region=<KB>] [rate=<KB/s>]
+ *
+ * format writes a clean bitmap and resyncs everything unless nosync says
+ * the legs are known to be the same.  region is a power of two from 64K
+ * to 64M, rate 0 lifts the cap on resync.
+ */
+
+#include <sys/atomic.h>
+#include <sys/buf.h>
+#include <sys/conf.h>
+#include <sys/cred.h>
+#include <sys/disp.h>
+#include <sys/errno.h>
+#include <sys/file.h>
+#include <sys/kmem.h>
+#include <sys/modctl.h>
+#include <sys/proc.h>
+#include <sys/sysmacros.h>
+#include <sys/systm.h>
+#include <sys/thread.h>
+#include <sys/types.h>
+#include <sys/ddi.h>
+#include <sys/sunddi.h>
+
+#include <sys/dm.h>
+#include <sys/dm_impl.h>
+#include <sys/dm_ops.h>
+
+#define	MIR_MAXLEGS	4
+#define	MIR_RGSHIFT	13			/* Default region size, 4M */
+#define	MIR_RGMIN	(64 * 1024)
+#define	MIR_RGMAX	(64 * 1024 * 1024)
+#define	MIR_COPYSZ	(1024 * 1024)		/* Resync transfer size */
+#define	MIR_RATE	(50 * 1024)		/* Default resync rate, KB/s */
+#define	MIR_RETRY	30			/* Seconds, after failures */
+#define	MIR_NOREGION	((uint64_t)-1)
+
+/* A write that lost a leg, completes once its regions are marked on disk */
+typedef struct mir_mark {
+	struct mir_mark	*mk_next;
+	dm_split_t	*mk_ds;
+	diskaddr_t	mk_blkno;
+	size_t		mk_len;
+} mir_mark_t;
+
+typedef struct {
+	dm_info_t	*m_dmip;
+	kmutex_t	m_lock;
+	kcondvar_t	m_cv;		/* Region being resynced drained */
+	kcondvar_t	m_scv;		/* Resync thread wakeup */
+
+	int		m_nlegs;
+	ldi_handle_t	m_lh[MIR_MAXLEGS];
+	dev_t		m_dev[MIR_MAXLEGS];
+	ldi_handle_t	m_loglh;
+	dev_t		m_logdev;
+	dm_wib_t	*m_wib;
+	uint32_t	m_rgshift;	/* log2 of disk blocks per region */
+	uint64_t	m_nregions;
+
+	uint32_t	m_failed;	/* Legs out of the mirror */
+	uint32_t	m_failsaved;	/* as on the log */
+	uint32_t	m_rejoin;	/* Failed ones being brought back */
+	uint32_t	m_rr;		/* Next leg to read from */
+	uint16_t	*m_busy;	/* Writes in flight */
+	uint64_t	m_syncing;	/* Region being resynced */
+	struct buf	*m_held;	/* Writes held meanwhile */
+	struct buf	*m_heldtail;
+	mir_mark_t	*m_marks;	/* Writes waiting for their marks */
+
+	uint64_t	m_rate;		/* Resync bytes per second, 0 no cap */
+	caddr_t		m_buf;		/* Resync buffer */
+	kthread_t	*m_syncer;
+	boolean_t	m_exiting;
+
+	uint64_t	m_reads;
+	uint64_t	m_writes;
+	uint64_t	m_retries;	/* Reads retried on another leg */
+	uint64_t	m_nheld;	/* Writes held */
+	uint64_t	m_resynced;	/* Regions copied */
+} mir_t;
+
+#define	MIR_LEG(m, i)	(((m)->m_failed & (1U << (i))) == 0)
+
+/* Synchronous I/O to one leg */
+static int
+mir_bio(mir_t *m, int leg, caddr_t addr, size_t len, diskaddr_t blk, int rw)
+{
+	return (dm_target_bio(m->m_dmip, m->m_lh[leg], m->m_dev[leg], addr,
+	    len, blk, rw));
+}
+
+static int
+mir_leg(mir_t *m, dev_t dev)
+{
+	for (int i = 0; i < m->m_nlegs; i++) {
+		if (m->m_dev[i] == dev)
+			return (i);
+	}
+	return (-1);
+}
+
+/* The first leg still in the mirror, where resyncs copy from */
+static int
+mir_source(mir_t *m)
+{
+	for (int i = 0; i < m->m_nlegs; i++) {
+		if (MIR_LEG(m, i))
+			return (i);
+	}
+	return (0);
+}
+
+/* Drop a leg, unless it is the last one.  B_TRUE if it was dropped. */
+static boolean_t
+mir_fail(mir_t *m, int leg, int error)
+{
+	uint32_t	all = (1U << m->m_nlegs) - 1;
+	boolean_t	dropped = B_FALSE;
+
+	mutex_enter(&m->m_lock);
+	if ((m->m_failed & (1U << leg)) != 0) {
+		dropped = B_TRUE;
+	} else if ((m->m_failed | (1U << leg)) != all) {
+		m->m_failed |= 1U << leg;
+		cmn_err(CE_WARN, "dm_mirror: %s: leg %d failed (%d)",
+		    refstr_value(m->m_dmip->name), leg, error);
+		cv_signal(&m->m_scv);
+		dropped = B_TRUE;
+	}
+	mutex_exit(&m->m_lock);
+
+	return (dropped);
+}
+
+/*
+ * I/O path
+ */
+static void
+mir_piece_done(dm_child_t *dc, void *arg)
+{
+	mir_t		*m = arg;
+	struct buf	*cbp = &dc->dc_buf;
+	dm_split_t	*ds = dc->dc_split;
+	dm_child_t	*rc;
+	int		error = geterror(cbp);
+	int		leg;
+
+	if (error == 0 || (leg = mir_leg(m, cbp->b_edev)) == -1 ||
+	    !mir_fail(m, leg, error))
+		return;
+
+	if (!(cbp->b_flags & B_READ)) {
+		mir_mark_t	*mk;
+
+		/*
+		 * The others have it, keep the region dirty for this one.
+		 * Until that is on disk the write is not done, the syncer
+		 * sees to it and fails the write if it cannot be.
+		 */
+		dm_wib_mark(m->m_wib, cbp->b_lblkno, cbp->b_bcount);
+		if ((mk = kmem_alloc(sizeof (*mk), KM_NOSLEEP)) == NULL)
+			return;
+		mk->mk_ds = ds;
+		mk->mk_blkno = cbp->b_lblkno;
+		mk->mk_len = cbp->b_bcount;
+		dm_split_hold(ds);
+		bioerror(cbp, 0);
+		cbp->b_resid = 0;
+
+		mutex_enter(&m->m_lock);
+		mk->mk_next = m->m_marks;
+		m->m_marks = mk;
+		cv_signal(&m->m_scv);
+		cv_broadcast(&m->m_cv);
+		mutex_exit(&m->m_lock);
+		return;
+	}
+
+	/* Try a leg this read has not been to yet */
+	dc->dc_tag |= 1U << leg;
+	for (int i = 0; i < m->m_nlegs; i++) {
+		if ((dc->dc_tag & (1U << i)) || !MIR_LEG(m, i))
+			continue;
+		rc = dm_split_child(ds,
+		    (size_t)ldbtob(cbp->b_lblkno - ds->ds_bp->b_lblkno),
+		    cbp->b_bcount, m->m_dev[i], cbp->b_lblkno, KM_NOSLEEP);
+		if (rc == NULL)
+			return;
+		rc->dc_tag = dc->dc_tag;
+		atomic_inc_64(&m->m_retries);
+		bioerror(cbp, 0);
+		cbp->b_resid = 0;
+		dm_issue(m->m_lh[i], &rc->dc_buf);
+		return;
+	}
+}
+
+/* Send a write to every leg still in the mirror */
+static void
+mir_write(struct buf *bp, void *arg)
+{
+	mir_t		*m = arg;
+	uint32_t	failed = m->m_failed;
+	dm_split_t	*ds;
+
+	if ((ds = dm_split_alloc(bp, mir_piece_done, m, KM_NOSLEEP)) ==
+	    NULL) {
+		bioerror(bp, ENOMEM);
+		biodone(bp);
+		return;
+	}
+
+	if (failed != 0)
+		dm_wib_mark(m->m_wib, bp->b_lblkno, bp->b_bcount);
+	for (int i = 0; i < m->m_nlegs; i++) {
+		if (failed & (1U << i))
+			continue;
+		dm_split_submit(ds, 0, bp->b_bcount, m->m_lh[i], m->m_dev[i],
+		    bp->b_lblkno, dm_target_limits(m->m_dmip, m->m_lh[i]));
+	}
+	dm_split_rele(ds);
+}
+
+/* Hold a write while its region is resynced, else count it and go */
+static void
+mir_start(mir_t *m, struct buf *bp)
+{
+	uint64_t	first = bp->b_lblkno >> m->m_rgshift;
+	uint64_t	last;
+
+	last = (bp->b_lblkno + btodb(bp->b_bcount) - 1) >> m->m_rgshift;
+
+	mutex_enter(&m->m_lock);
+	if (m->m_syncing >= first && m->m_syncing <= last) {
+		bp->av_forw = NULL;
+		if (m->m_heldtail != NULL)
+			m->m_heldtail->av_forw = bp;
+		else
+			m->m_held = bp;
+		m->m_heldtail = bp;
+		m->m_nheld++;
+		mutex_exit(&m->m_lock);
+		return;
+	}
+	for (uint64_t r = first; r <= last; r++)
+		m->m_busy[r]++;
+	m->m_writes++;
+	mutex_exit(&m->m_lock);
+
+	if (dm_wib_write(m->m_wib, bp))
+		mir_write(bp, m);
+}
+
+/*
+ * Resync
+ */
+
+/* Sleep off whatever a copy of 'len' since 'start' is ahead of the rate */
+static void
+mir_throttle(mir_t *m, size_t len, clock_t start)
+{
+	clock_t	want, spent;
+
+	if (m->m_rate == 0)
+		return;
+
+	want = drv_usectohz((clock_t)((uint64_t)len * MICROSEC / m->m_rate));
+	spent = ddi_get_lbolt() - start;
+	if (spent >= want)
+		return;
+
+	mutex_enter(&m->m_lock);
+	if (!m->m_exiting) {
+		(void) cv_reltimedwait(&m->m_scv, &m->m_lock, want - spent,
+		    TR_CLOCK_TICK);
+	}
+	mutex_exit(&m->m_lock);
+}
+
+/* Let the writes that lost a leg go once their marks are on disk */
+static void
+mir_commit(mir_t *m)
+{
+	mir_mark_t	*mk;
+
+	ASSERT(MUTEX_HELD(&m->m_lock));
+
+	while ((mk = m->m_marks) != NULL) {
+		m->m_marks = NULL;
+		mutex_exit(&m->m_lock);
+		while (mk != NULL) {
+			mir_mark_t	*next = mk->mk_next;
+
+			dm_split_error(mk->mk_ds, dm_wib_commit(m->m_wib,
+			    mk->mk_blkno, mk->mk_len));
+			dm_split_rele(mk->mk_ds);
+			kmem_free(mk, sizeof (*mk));
+			mk = next;
+		}
+		mutex_enter(&m->m_lock);
+	}
+}
+
+/*
+ * Copy a region from the source to every other leg, writes to it held.
+ * It is in sync once all of them, failed ones included, took it.
+ */
+static int
+mir_resync(mir_t *m, uint64_t region)
+{
+	diskaddr_t	blk = region << m->m_rgshift;
+	size_t		len = MIN(ldbtob(1ULL << m->m_rgshift),
+	    m->m_dmip->size - ldbtob(blk));
+	int		src = mir_source(m);
+	struct buf	*held, *bp;
+	int		rc = 0;
+
+	mutex_enter(&m->m_lock);
+	m->m_syncing = region;
+	while (m->m_busy[region] != 0) {
+		/* Some may be waiting for their marks, which is up to us */
+		if (m->m_marks != NULL)
+			mir_commit(m);
+		else
+			cv_wait(&m->m_cv, &m->m_lock);
+	}
+	mutex_exit(&m->m_lock);
+
+	for (size_t off = 0; off < len && rc == 0 && !m->m_exiting; ) {
+		size_t	n = MIN(len - off, MIR_COPYSZ);
+		clock_t	start = ddi_get_lbolt();
+
+		if ((rc = mir_bio(m, src, m->m_buf, n, blk + btodb(off),
+		    B_READ)) != 0) {
+			(void) mir_fail(m, src, rc);
+			break;
+		}
+		for (int i = 0; i < m->m_nlegs; i++) {
+			int	error;
+
+			if (i == src || (error = mir_bio(m, i, m->m_buf, n,
+			    blk + btodb(off), B_WRITE)) == 0)
+				continue;
+			mutex_enter(&m->m_lock);
+			if (m->m_rejoin & (1U << i)) {
+				cmn_err(CE_WARN, "dm_mirror: %s: leg %d cannot "
+				    "be taken back (%d)",
+				    refstr_value(m->m_dmip->name), i, error);
+				m->m_rejoin &= ~(1U << i);
+			}
+			mutex_exit(&m->m_lock);
+			(void) mir_fail(m, i, error);
+			rc = error;
+		}
+		off += n;
+		mir_throttle(m, n, start);
+	}
+	if (rc == 0 && !m->m_exiting) {
+		dm_wib_resynced(m->m_wib, region);
+		m->m_resynced++;
+	}
+
+	mutex_enter(&m->m_lock);
+	m->m_syncing = MIR_NOREGION;
+	held = m->m_held;
+	m->m_held = m->m_heldtail = NULL;
+	mutex_exit(&m->m_lock);
+
+	while ((bp = held) != NULL) {
+		held = bp->av_forw;
+		bp->av_forw = NULL;
+		mir_start(m, bp);
+	}
+
+	return (rc);
+}
+
+static void
+mir_syncer(void *arg)
+{
+	mir_t		*m = arg;
+	uint64_t	region = 0;
+	boolean_t	clean = B_TRUE;
+	clock_t		wait = 0;
+
+	mutex_enter(&m->m_lock);
+
+	while (!m->m_exiting) {
+		mir_commit(m);
+
+		if (m->m_failed != m->m_failsaved && wait == 0) {
+			uint32_t	failed = m->m_failed;
+
+			mutex_exit(&m->m_lock);
+			if (dm_wib_set_flags(m->m_wib, failed) == 0)
+				m->m_failsaved = failed;
+			else
+				wait = drv_usectohz(MICROSEC) * MIR_RETRY;
+			mutex_enter(&m->m_lock);
+			continue;
+		}
+
+		/* Nothing to do with a leg out, or for a while after errors */
+		if (wait != 0 || (m->m_failed & ~m->m_rejoin) != 0) {
+			(void) cv_reltimedwait(&m->m_scv, &m->m_lock,
+			    MAX(wait, drv_usectohz(MICROSEC)), TR_CLOCK_TICK);
+			wait = 0;
+			continue;
+		}
+		mutex_exit(&m->m_lock);
+
+		region = dm_wib_resync_next(m->m_wib, region);
+		if (region < m->m_nregions) {
+			if (mir_resync(m, region) != 0)
+				clean = B_FALSE;
+			region++;
+			mutex_enter(&m->m_lock);
+			continue;
+		}
+
+		/* A whole pass done */
+		mutex_enter(&m->m_lock);
+		region = 0;
+		if (!clean) {
+			wait = drv_usectohz(MICROSEC) * MIR_RETRY;
+		} else if (m->m_rejoin != 0 &&
+		    dm_wib_resync_next(m->m_wib, 0) == m->m_nregions) {
+			cmn_err(CE_NOTE, "dm_mirror: %s: all legs in sync",
+			    refstr_value(m->m_dmip->name));
+			m->m_failed &= ~m->m_rejoin;
+			m->m_rejoin = 0;
+		} else {
+			wait = drv_usectohz(MICROSEC);
+		}
+		clean = B_TRUE;
+	}
+
+	mir_commit(m);
+	mutex_exit(&m->m_lock);
+
+	if (m->m_failed != m->m_failsaved)
+		(void) dm_wib_set_flags(m->m_wib, m->m_failed);
+
+	thread_exit();
+}
+
+static void
+mir_free(mir_t *m)
+{
+	if (m->m_wib != NULL)
+		dm_wib_close(m->m_wib);
+	if (m->m_buf != NULL)
+		kmem_free(m->m_buf, MIR_COPYSZ);
+	if (m->m_busy != NULL)
+		kmem_free(m->m_busy, m->m_nregions * sizeof (uint16_t));
+	if (m->m_loglh != NULL)
+		dm_target_close(m->m_dmip, m->m_loglh);
+	for (int i = 1; i < m->m_nlegs; i++)
+		dm_target_close(m->m_dmip, m->m_lh[i]);
+
+	cv_destroy(&m->m_scv);
+	cv_destroy(&m->m_cv);
+	mutex_destroy(&m->m_lock);
+	kmem_free(m, sizeof (*m));
+}
+
+/*
+ * Plugin entry points
+ */
+static int
+dm_mirror_init(void)
+{
+	return (0);
+}
+
+static void
+dm_mirror_fini(void)
+{
+}
+
+static int
+dm_mirror_create(dm_info_t *dmip, int argc, char **argv, cred_t *crp,
+    void **privp)
+{
+	mir_t		*m;
+	char		*legs[MIR_MAXLEGS];
+	char		*log = NULL;
+	int		nlegs = 1;
+	uint32_t	rgshift = MIR_RGSHIFT;
+	unsigned long	rate = MIR_RATE;
+	boolean_t	format = B_FALSE;
+	boolean_t	nosync = B_FALSE;
+	uint64_t	size;
+	int		rc;
+
+	for (int i = 0; i < argc; i++) {
+		unsigned long	val;
+
+		if (strncmp(argv[i], "leg=", 4) == 0 && argv[i][4] != '\0' &&
+		    nlegs < MIR_MAXLEGS) {
+			legs[nlegs++] = argv[i] + 4;
+		} else if (strncmp(argv[i], "log=", 4) == 0 &&
+		    argv[i][4] != '\0') {
+			log = argv[i] + 4;
+		} else if (strcmp(argv[i], "format") == 0) {
+			format = B_TRUE;
+		} else if (strcmp(argv[i], "nosync") == 0) {
+			nosync = B_TRUE;
+		} else if (strncmp(argv[i], "region=", 7) == 0 &&
+		    ddi_strtoul(argv[i] + 7, NULL, 10, &val) == 0 &&
+		    val >= MIR_RGMIN / 1024 && val <= MIR_RGMAX / 1024 &&
+		    ISP2(val)) {
+			rgshift = highbit(val * 1024 / DEV_BSIZE) - 1;
+		} else if (strncmp(argv[i], "rate=", 5) == 0 &&
+		    ddi_strtoul(argv[i] + 5, NULL, 10, &val) == 0) {
+			rate = val;
+		} else {
+			cmn_err(CE_WARN, "dm_mirror: unknown argument '%s'",
+			    argv[i]);
+			return (EINVAL);
+		}
+	}
+	if (nlegs < 2 || log == NULL) {
+		cmn_err(CE_WARN, "dm_mirror: a leg and a log device are "
+		    "needed");
+		return (EINVAL);
+	}
+
+	m = kmem_zalloc(sizeof (*m), KM_SLEEP);
+	m->m_dmip = dmip;
+	mutex_init(&m->m_lock, NULL, MUTEX_DRIVER, NULL);
+	cv_init(&m->m_cv, NULL, CV_DRIVER, NULL);
+	cv_init(&m->m_scv, NULL, CV_DRIVER, NULL);
+	m->m_lh[0] = dmip->lh;
+	m->m_dev[0] = dmip->tdev;
+	m->m_syncing = MIR_NOREGION;
+	m->m_rate = (uint64_t)rate * 1024;
+
+	m->m_nlegs = 1;
+	for (int i = 1; i < nlegs; i++) {
+		if ((rc = dm_target_open(dmip, crp, legs[i], &m->m_lh[i],
+		    &m->m_dev[i])) != 0) {
+			mir_free(m);
+			return (rc);
+		}
+		m->m_nlegs = i + 1;
+		if (ldi_get_size(m->m_lh[i], &size) != DDI_SUCCESS ||
+		    size < dmip->size) {
+			cmn_err(CE_WARN, "dm_mirror: %s: %s is smaller than "
+			    "the mapping", refstr_value(dmip->name), legs[i]);
+			mir_free(m);
+			return (ENOSPC);
+		}
+	}
+
+	rc = dm_target_open(dmip, crp, log, &m->m_loglh, &m->m_logdev);
+	if (rc != 0) {
+		mir_free(m);
+		return (rc);
+	}
+	if (format && (ldi_get_size(m->m_loglh, &size) != DDI_SUCCESS ||
+	    size < dm_wib_size(dmip->size, rgshift))) {
+		cmn_err(CE_WARN, "dm_mirror: %s: %s is too small for the "
+		    "bitmap", refstr_value(dmip->name), log);
+		mir_free(m);
+		return (ENOSPC);
+	}
+	if ((rc = dm_wib_open(dmip, m->m_loglh, m->m_logdev, 0, dmip->size,
+	    rgshift, format, mir_write, m, &m->m_wib)) != 0) {
+		cmn_err(CE_WARN, "dm_mirror: %s: no bitmap on %s (%d)",
+		    refstr_value(dmip->name), log, rc);
+		mir_free(m);
+		return (rc);
+	}
+
+	m->m_rgshift = dm_wib_rgshift(m->m_wib);
+	m->m_nregions = dm_wib_nregions(m->m_wib);
+	m->m_failed = m->m_failsaved = (uint32_t)dm_wib_flags(m->m_wib) &
+	    ((1U << nlegs) - 1);
+	if (m->m_failed == (1U << nlegs) - 1)
+		m->m_failed &= ~1U;	/* Legs were dropped, trust the first */
+	m->m_rejoin = m->m_failed;
+	if (format && !nosync)
+		dm_wib_mark(m->m_wib, 0, dmip->size);
+
+	m->m_busy = kmem_zalloc(m->m_nregions * sizeof (uint16_t), KM_SLEEP);
+	m->m_buf = kmem_alloc(MIR_COPYSZ, KM_SLEEP);
+	m->m_syncer = thread_create(NULL, 0, mir_syncer, m, 0, &p0, TS_RUN,
+	    minclsyspri);
+
+	*privp = m;
+
+	return (0);
+}
+
+static void
+dm_mirror_destroy(dm_info_t *dmip, void *priv)
+{
+	mir_t		*m = priv;
+	kt_did_t	tid = m->m_syncer->t_did;
+
+	mutex_enter(&m->m_lock);
+	m->m_exiting = B_TRUE;
+	cv_broadcast(&m->m_scv);
+	mutex_exit(&m->m_lock);
+	thread_join(tid);
+
+	mir_free(m);
+}
+
+static dm_mapio_t
+dm_mirror_mapio(dm_info_t *dmip, void *priv, struct buf *bp, dm_remap_t *rp)
+{
+	mir_t		*m = priv;
+	uint64_t	first, last;
+	dm_split_t	*ds;
+	int		leg = -1;
+
+	if (bp->b_bcount == 0) {
+		bp->b_resid = 0;
+		biodone(bp);
+		return (DM_MAPIO_SUBMITTED);
+	}
+	if (!(bp->b_flags & B_READ)) {
+		mir_start(m, bp);
+		return (DM_MAPIO_SUBMITTED);
+	}
+
+	/* Regions not in sync are read from the source, the rest in turn */
+	first = bp->b_lblkno >> m->m_rgshift;
+	last = (bp->b_lblkno + btodb(bp->b_bcount) - 1) >> m->m_rgshift;
+	for (uint64_t r = first; r <= last; r++) {
+		if (dm_wib_stale(m->m_wib, r)) {
+			leg = mir_source(m);
+			break;
+		}
+	}
+	if (leg == -1) {
+		leg = atomic_inc_32_nv(&m->m_rr) % m->m_nlegs;
+		while (!MIR_LEG(m, leg))
+			leg = (leg + 1) % m->m_nlegs;
+	}
+	atomic_inc_64(&m->m_reads);
+
+	if ((ds = dm_split_alloc(bp, mir_piece_done, m, KM_NOSLEEP)) ==
+	    NULL) {
+		bioerror(bp, ENOMEM);
+		return (DM_MAPIO_KILL);
+	}
+	dm_split_submit(ds, 0, bp->b_bcount, m->m_lh[leg], m->m_dev[leg],
+	    bp->b_lblkno, dm_target_limits(dmip, m->m_lh[leg]));
+	dm_split_rele(ds);
+
+	return (DM_MAPIO_SUBMITTED);
+}
+
+static int
+dm_mirror_end_io(dm_info_t *dmip, void *priv, struct buf *bp, int error)
+{
+	mir_t		*m = priv;
+	uint64_t	first, last;
+
+	if ((bp->b_flags & B_READ) || bp->b_bcount == 0)
+		return (error);
+
+	first = bp->b_lblkno >> m->m_rgshift;
+	last = (bp->b_lblkno + btodb(bp->b_bcount) - 1) >> m->m_rgshift;
+
+	mutex_enter(&m->m_lock);
+	for (uint64_t r = first; r <= last; r++) {
+		if (--m->m_busy[r] == 0 && r == m->m_syncing)
+			cv_broadcast(&m->m_cv);
+	}
+	mutex_exit(&m->m_lock);
+
+	dm_wib_done(m->m_wib, bp->b_lblkno, bp->b_bcount);
+
+	return (error);
+}
+
+static int
+dm_mirror_stats(dm_info_t *dmip, void *priv, nvlist_t *nvl)
+{
+	mir_t	*m = priv;
+
+	mutex_enter(&m->m_lock);
+	(void) nvlist_add_int32(nvl, "legs", m->m_nlegs);
+	(void) nvlist_add_uint32(nvl, "failed", m->m_failed);
+	(void) nvlist_add_uint64(nvl, "reads", m->m_reads);
+	(void) nvlist_add_uint64(nvl, "writes", m->m_writes);
+	(void) nvlist_add_uint64(nvl, "read_retries", m->m_retries);
+	(void) nvlist_add_uint64(nvl, "held", m->m_nheld);
+	(void) nvlist_add_uint64(nvl, "resynced", m->m_resynced);
+	mutex_exit(&m->m_lock);
+
+	dm_wib_stats(m->m_wib, nvl);
+
+	return (0);
+}
+
+
+dm_plugin_ops_t dm_ops = {
+	.dpo_rev	= DPO_REV,
+	.dpo_name	= "mirror",
+	.dpo_init	= dm_mirror_init,
+	.dpo_fini	= dm_mirror_fini,
+	.dpo_create	= dm_mirror_create,
+	.dpo_destroy	= dm_mirror_destroy,
+	.dpo_mapio	= dm_mirror_mapio,
+	.dpo_end_io	= dm_mirror_end_io,
+	.dpo_stats	= dm_mirror_stats,
+};
+
+static struct modlmisc modlmisc = {
+	.misc_modops	= &mod_miscops,
+	.misc_linkinfo	= "Solaris Device Mapper mirror plugin"
+};
+
+static struct modlinkage modlinkage = {
+	.ml_rev		= MODREV_1,
+	.ml_linkage	= {&modlmisc, NULL, NULL, NULL}
+};
+
+int
+_init(void)
+{
+	return (mod_install(&modlinkage));
+}
+
+int
+_info(struct modinfo *mip)
+{
+	return (mod_info(&modlinkage, mip));
+}
+
+int
+_fini(void)
+{
+	return (mod_remove(&modlinkage));
+}
@@ -0,0 +1,1507 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright 2011 Grigale Ltd. All rights reserved.
+ * Use is subject to license terms.
+ */
+
+
+/*
+ * Parity target
+ *
+ * Stripes the mapping over three to sixteen devices (legs), the mapping
+ * device and the ones given as leg= arguments, with one (level 5) or two
+ * (level 6) chunks of each stripe holding parity.  P is the XOR of the
+ * data chunks, Q their sum weighted by powers of 2 in GF(2^8) (polynomial
+ * 0x11d); both move one leg to the left with every stripe.  Either one
+ * brings back a leg, the two of them any two.
+ *
+ * Writes are gathered in a stripe cache: they wait there a little while
+ * for the rest of the stripe, and a stripe written all over goes out with
+ * its parity without reading anything.  Otherwise the data it does not
+ * write is read over the rows it does and parity is computed afresh.
+ * Reads go straight to the leg holding them, unless that is out or the
+ * stripe is in the cache, in which case they are served from there,
+ * rebuilt from the other legs if needed.  The cache work is done on a
+ * taskq, so that stripes go out in parallel.
+ *
+ * Parity is computed eight bytes at a time in integer registers: XOR for
+ * P and a multiply by 2 done on every byte of a word at once for Q.  The
+ * rarer multiplies by other constants, needed to bring back data through
+ * Q, go through log tables a byte at a time.
+ *
+ * A write-intent bitmap on the log device records the regions writes may
+ * be in flight to, so that after a crash only their parity is recomputed.
+ * A leg failing I/O is dropped, recorded with the bitmap and left out
+ * until the mapping is created again; legs found that way are rebuilt from
+ * the others, stripe by stripe with I/O going on, at a capped rate.
+ *
+ * Arguments:	leg=<device> [leg=<device> ...] log=<device> [level=5|6]
+ *		[chunk=<KB>] [cache=<KB>] [gather=<usecs>] [rate=<KB/s>]
+ *		[format] [nosync]
+ *
+ * chunk is a power of two from 4K to 1M, cache the memory stripes are kept
+ * in, gather how long a partial stripe waits for more writes (0 not at
+ * all), rate 0 lifts the cap on rebuild and resync.  format writes a clean
+ * bitmap and computes all parity unless nosync says it is right already.
+ */
+
+#include <sys/atomic.h>
+#include <sys/bitmap.h>
+#include <sys/buf.h>
+#include <sys/conf.h>
+#include <sys/cred.h>
+#include <sys/disp.h>
+#include <sys/errno.h>
+#include <sys/file.h>
+#include <sys/kmem.h>
+#include <sys/modctl.h>
+#include <sys/proc.h>
+#include <sys/sysmacros.h>
+#include <sys/systm.h>
+#include <sys/thread.h>
+#include <sys/types.h>
+#include <sys/ddi.h>
+#include <sys/sunddi.h>
+
+#include <sys/dm.h>
+#include <sys/dm_impl.h>
+#include <sys/dm_ops.h>
+
+#define	RAID_MAXLEGS	16
+#define	RAID_CSHIFT	16			/* Default chunk size, 64K */
+#define	RAID_CMIN	(4 * 1024)
+#define	RAID_CMAX	(1024 * 1024)
+#define	RAID_CACHE	(16 * 1024)		/* Default stripe cache, KB */
+#define	RAID_MINSTR	4			/* Stripes cached at least */
+#define	RAID_GATHER	2000			/* Default gather time, us */
+#define	RAID_RGSHIFT	13			/* Bitmap region size, 4M */
+#define	RAID_RATE	(50 * 1024)		/* Default rebuild rate, KB/s */
+#define	RAID_THREADS	8			/* Stripes written at once */
+#define	RAID_RETRY	30			/* Seconds, after failures */
+
+#define	RAID_M80	0x8080808080808080ULL
+#define	RAID_MFE	0xfefefefefefefefeULL
+#define	RAID_M1D	0x1d1d1d1d1d1d1d1dULL
+
+struct raid;
+
+/* A stripe in the cache */
+typedef struct raid_stripe {
+	struct raid	*rs_raid;
+	struct raid_stripe *rs_next;	/* Hash chain, or free list */
+	struct raid_stripe *rs_gnext;	/* Gathering list */
+	uint64_t	rs_stripe;
+	int		rs_state;
+	clock_t		rs_since;	/* First I/O waiting */
+	dm_child_t	*rs_writes;	/* Waiting, newest first */
+	dm_child_t	*rs_reads;
+	ulong_t		*rs_cover;	/* Data sectors the writes cover */
+	ulong_t		*rs_snap;	/* ... those being written */
+	uint32_t	rs_ncover;
+	caddr_t		rs_buf;		/* A chunk for every leg */
+} raid_stripe_t;
+
+#define	RS_FREE		0
+#define	RS_GATHER	1		/* Taking I/O, on the gathering list */
+#define	RS_BUSY		2		/* Being written, or rebuilt */
+
+typedef struct raid {
+	dm_info_t	*r_dmip;
+	kmutex_t	r_lock;
+	kcondvar_t	r_cv;		/* A stripe went back to the cache */
+	kcondvar_t	r_wcv;		/* Worker wakeup */
+	kcondvar_t	r_scv;		/* Syncer wakeup */
+
+	int		r_nlegs;
+	int		r_nparity;
+	int		r_ndata;
+	ldi_handle_t	r_lh[RAID_MAXLEGS];
+	dev_t		r_dev[RAID_MAXLEGS];
+	ldi_handle_t	r_loglh;
+	dev_t		r_logdev;
+	dm_wib_t	*r_wib;
+	uint32_t	r_cshift;	/* log2 of the chunk size, bytes */
+	uint64_t	r_nstripes;
+	uint32_t	r_rgshift;
+	uint64_t	r_nregions;
+
+	uint32_t	r_failed;	/* Legs out, neither read nor written */
+	uint32_t	r_rebuild;	/* Legs being rebuilt, written only */
+	uint32_t	r_saved;	/* Both, as on the log */
+
+	raid_stripe_t	*r_stripes;
+	uint32_t	r_nstr;
+	uint32_t	r_nfree;
+	raid_stripe_t	*r_free;
+	raid_stripe_t	**r_hash;
+	uint32_t	r_hmask;
+	raid_stripe_t	*r_gather;	/* Stripes taking I/O */
+	dm_child_t	*r_waitq;	/* I/O waiting for a stripe */
+	dm_child_t	*r_waittail;
+	clock_t		r_delay;	/* Partial stripes wait that long */
+	ddi_taskq_t	*r_tq;
+
+	uint64_t	r_rate;		/* Rebuild bytes per second, 0 no cap */
+	kthread_t	*r_worker;
+	kthread_t	*r_syncer;
+	boolean_t	r_exiting;
+
+	uint64_t	r_reads;
+	uint64_t	r_writes;
+	uint64_t	r_full;		/* Stripes written without reads */
+	uint64_t	r_partial;	/* ... with */
+	uint64_t	r_recon;	/* Stripes brought back from parity */
+	uint64_t	r_retries;	/* Reads retried that way */
+	uint64_t	r_waits;	/* I/O waiting for a stripe */
+	uint64_t	r_rebuilt;	/* Stripes rebuilt */
+	uint64_t	r_resynced;	/* Regions whose parity was redone */
+} raid_t;
+
+#define	RAID_CSIZE(r)		((size_t)1 << (r)->r_cshift)
+#define	RAID_SDATA(r)		((uint64_t)(r)->r_ndata << (r)->r_cshift)
+#define	RAID_STRIPE(r, off)	(((off) >> (r)->r_cshift) / (r)->r_ndata)
+#define	RAID_DATA(r, off)	((int)(((off) >> (r)->r_cshift) % (r)->r_ndata))
+#define	RAID_SECTORS(r)		((r)->r_ndata << ((r)->r_cshift - DEV_BSHIFT))
+#define	RAID_ALL(r)		((1U << (r)->r_nlegs) - 1)
+#define	RAID_CHUNK(r, b, leg)	((b) + ((size_t)(leg) << (r)->r_cshift))
+#define	RAID_WORDS(r, b, leg, lo) \
+	((uint64_t *)(void *)(RAID_CHUNK(r, b, leg) + (lo)))
+
+static uint8_t	raid_gfexp[512];
+static uint8_t	raid_gflog[256];
+
+static int
+raid_nbits(uint32_t v)
+{
+	int	n = 0;
+
+	for (; v != 0; v &= v - 1)
+		n++;
+	return (n);
+}
+
+/* Where P, Q and the data chunks of a stripe are */
+static int
+raid_pleg(raid_t *r, uint64_t s)
+{
+	return (r->r_nlegs - 1 - (int)(s % r->r_nlegs));
+}
+
+static int
+raid_dleg(raid_t *r, uint64_t s, int k)
+{
+	return ((raid_pleg(r, s) + r->r_nparity + k) % r->r_nlegs);
+}
+
+static uint32_t
+raid_pmask(raid_t *r, uint64_t s)
+{
+	int	p = raid_pleg(r, s);
+
+	if (r->r_nparity == 1)
+		return (1U << p);
+	return ((1U << p) | (1U << ((p + 1) % r->r_nlegs)));
+}
+
+static int
+raid_leg(raid_t *r, dev_t dev)
+{
+	for (int i = 0; i < r->r_nlegs; i++) {
+		if (r->r_dev[i] == dev)
+			return (i);
+	}
+	return (-1);
+}
+
+/* Drop the legs in 'legs' */
+static void
+raid_fail(raid_t *r, uint32_t legs, int error)
+{
+	mutex_enter(&r->r_lock);
+	for (int i = 0; i < r->r_nlegs; i++) {
+		if ((legs & (1U << i)) == 0 || (r->r_failed & (1U << i)) != 0)
+			continue;
+		r->r_failed |= 1U << i;
+		r->r_rebuild &= ~(1U << i);
+		cmn_err(CE_WARN, "dm_raid: %s: leg %d failed (%d)%s",
+		    refstr_value(r->r_dmip->name), i, error,
+		    raid_nbits(r->r_failed) > r->r_nparity ?
+		    ", too many out" : "");
+		cv_signal(&r->r_scv);
+	}
+	mutex_exit(&r->r_lock);
+}
+
+/*
+ * Parity
+ */
+
+/* Multiply every byte of a word by 2 */
+static inline uint64_t
+raid_mul2(uint64_t v)
+{
+	uint64_t	m = v & RAID_M80;
+
+	m = (m << 1) - (m >> 7);
+	return (((v << 1) & RAID_MFE) ^ (m & RAID_M1D));
+}
+
+static inline uint8_t
+raid_gfmul(uint8_t a, uint8_t b)
+{
+	if (a == 0 || b == 0)
+		return (0);
+	return (raid_gfexp[raid_gflog[a] + raid_gflog[b]]);
+}
+
+/*
+ * P and Q, either may be NULL, over 'len' bytes at 'lo' into each data
+ * chunk of stripe 's', taking the ones in 'zero' as zeroes.
+ */
+static void
+raid_syndrome(raid_t *r, uint64_t s, caddr_t buf, size_t lo, size_t len,
+    uint32_t zero, uint64_t *p, uint64_t *q)
+{
+	uint64_t	*d[RAID_MAXLEGS];
+	size_t		nw = len / sizeof (uint64_t);
+	boolean_t	first = B_TRUE;
+
+	for (int k = 0; k < r->r_ndata; k++) {
+		d[k] = (zero & (1U << k)) ? NULL :
+		    RAID_WORDS(r, buf, raid_dleg(r, s, k), lo);
+	}
+
+	if (q == NULL) {
+		/* P alone streams through one chunk at a time */
+		for (int k = 0; k < r->r_ndata; k++) {
+			uint64_t	*dk = d[k];
+
+			if (dk == NULL)
+				continue;
+			if (first) {
+				bcopy(dk, p, len);
+				first = B_FALSE;
+				continue;
+			}
+			for (size_t w = 0; w < nw; w += 4) {
+				p[w] ^= dk[w];
+				p[w + 1] ^= dk[w + 1];
+				p[w + 2] ^= dk[w + 2];
+				p[w + 3] ^= dk[w + 3];
+			}
+		}
+		if (first)
+			bzero(p, len);
+		return;
+	}
+
+	for (size_t w = 0; w < nw; w++) {
+		uint64_t	pv = 0, qv = 0;
+
+		for (int k = r->r_ndata - 1; k >= 0; k--) {
+			qv = raid_mul2(qv);
+			if (d[k] != NULL) {
+				pv ^= d[k][w];
+				qv ^= d[k][w];
+			}
+		}
+		if (p != NULL)
+			p[w] = pv;
+		q[w] = qv;
+	}
+}
+
+/*
+ * Fill in the chunks of the legs in 'missing', no more of them than there
+ * is parity, over 'len' bytes at 'lo' from the others.
+ */
+static void
+raid_recover(raid_t *r, uint64_t s, caddr_t buf, size_t lo, size_t len,
+    uint32_t missing)
+{
+	int		pl = raid_pleg(r, s);
+	int		ql = (pl + 1) % r->r_nlegs;
+	uint64_t	*p = RAID_WORDS(r, buf, pl, lo);
+	uint64_t	*q = RAID_WORDS(r, buf, ql, lo);
+	boolean_t	pmiss = (missing & (1U << pl)) != 0;
+	boolean_t	qmiss;
+	uint8_t		*pb, *qb, *xb, *yb;
+	uint8_t		a, inv, ca, cb;
+	int		x = -1, y = -1;
+
+	if (r->r_nparity == 1) {
+		q = NULL;
+		qmiss = B_FALSE;
+	} else {
+		qmiss = (missing & (1U << ql)) != 0;
+	}
+	for (int k = 0; k < r->r_ndata; k++) {
+		if ((missing & (1U << raid_dleg(r, s, k))) == 0)
+			continue;
+		if (x == -1)
+			x = k;
+		else
+			y = k;
+	}
+
+	/* Parity alone */
+	if (x == -1) {
+		if (pmiss || qmiss) {
+			raid_syndrome(r, s, buf, lo, len, 0, pmiss ? p : NULL,
+			    qmiss ? q : NULL);
+		}
+		return;
+	}
+
+	xb = (uint8_t *)RAID_WORDS(r, buf, raid_dleg(r, s, x), lo);
+
+	/* One data chunk, from P */
+	if (y == -1 && !pmiss) {
+		uint64_t	*dx = (uint64_t *)(void *)xb;
+
+		raid_syndrome(r, s, buf, lo, len, 1U << x, dx, NULL);
+		for (size_t w = 0; w < len / sizeof (uint64_t); w++)
+			dx[w] ^= p[w];
+		if (qmiss)
+			raid_syndrome(r, s, buf, lo, len, 0, NULL, q);
+		return;
+	}
+
+	qb = (uint8_t *)q;
+
+	/* One data chunk and P, from Q: Dx = (Q + Qx) / g^x */
+	if (y == -1) {
+		raid_syndrome(r, s, buf, lo, len, 1U << x, NULL,
+		    (uint64_t *)(void *)xb);
+		cb = raid_gfexp[255 - x];
+		for (size_t i = 0; i < len; i++)
+			xb[i] = raid_gfmul(qb[i] ^ xb[i], cb);
+		raid_syndrome(r, s, buf, lo, len, 0, p, NULL);
+		return;
+	}
+
+	/*
+	 * Two data chunks, from both: with Pxy and Qxy the syndromes taken
+	 * without them, Dx = (g^(y-x) (P + Pxy) + g^-x (Q + Qxy)) /
+	 * (g^(y-x) + 1) and Dy = P + Pxy + Dx.
+	 */
+	pb = (uint8_t *)p;
+	yb = (uint8_t *)RAID_WORDS(r, buf, raid_dleg(r, s, y), lo);
+	raid_syndrome(r, s, buf, lo, len, (1U << x) | (1U << y),
+	    (uint64_t *)(void *)xb, (uint64_t *)(void *)yb);
+	a = raid_gfexp[y - x];
+	inv = raid_gfexp[255 - raid_gflog[a ^ 1]];
+	ca = raid_gfmul(a, inv);
+	cb = raid_gfmul(raid_gfexp[255 - x], inv);
+	for (size_t i = 0; i < len; i++) {
+		uint8_t	pxy = pb[i] ^ xb[i];
+		uint8_t	qxy = qb[i] ^ yb[i];
+
+		xb[i] = raid_gfmul(ca, pxy) ^ raid_gfmul(cb, qxy);
+		yb[i] = pxy ^ xb[i];
+	}
+}
+
+/*
+ * Stripe I/O
+ */
+
+/*
+ * Read or write 'lo' to 'hi' into the chunks of the legs in 'legs', all at
+ * once.  Returns the legs that failed, the first error in 'errp'.
+ */
+static uint32_t
+raid_rw(raid_t *r, uint64_t s, caddr_t buf, uint32_t legs, size_t lo,
+    size_t hi, int rw, int *errp)
+{
+	struct buf	*bps[RAID_MAXLEGS];
+	diskaddr_t	blk = btodb((s << r->r_cshift) + lo);
+	uint32_t	errs = 0;
+	int		error;
+
+	for (int i = 0; i < r->r_nlegs; i++) {
+		struct buf	*bp;
+
+		if ((legs & (1U << i)) == 0)
+			continue;
+		bp = bps[i] = getrbuf(KM_SLEEP);
+		bp->b_flags = B_BUSY | rw;
+		bp->b_un.b_addr = RAID_CHUNK(r, buf, i) + lo;
+		bp->b_bcount = hi - lo;
+		bp->b_lblkno = blk;
+		bp->b_blkno = (daddr_t)blk;
+		bp->b_edev = r->r_dev[i];
+		bp->b_dev = cmpdev(r->r_dev[i]);
+		dm_split_issue(bp, r->r_lh[i], dm_target_limits(r->r_dmip,
+		    r->r_lh[i]));
+	}
+	for (int i = 0; i < r->r_nlegs; i++) {
+		if ((legs & (1U << i)) == 0)
+			continue;
+		if ((error = biowait(bps[i])) != 0) {
+			errs |= 1U << i;
+			if (*errp == 0)
+				*errp = error;
+		}
+		freerbuf(bps[i]);
+	}
+
+	return (errs);
+}
+
+/*
+ * Widen 'lo' to 'hi' to the rows within a chunk a piece of I/O in the
+ * cache touches, and note the data chunks it does in 'kmask'.
+ */
+static void
+raid_span(raid_t *r, dm_child_t *dc, size_t *lo, size_t *hi,
+    uint32_t *kmask)
+{
+	uint64_t	off = dc->dc_tag;
+	uint64_t	end = off + dc->dc_buf.b_bcount;
+
+	while (off < end) {
+		size_t	row = off & (RAID_CSIZE(r) - 1);
+		size_t	n = MIN(RAID_CSIZE(r) - row, end - off);
+
+		*lo = MIN(*lo, row);
+		*hi = MAX(*hi, row + n);
+		*kmask |= 1U << RAID_DATA(r, off);
+		off += n;
+	}
+}
+
+/* Copy a piece of I/O in the cache to (writes) or from the stripe */
+static void
+raid_copy(raid_t *r, raid_stripe_t *rs, dm_child_t *dc)
+{
+	struct buf	*cbp = &dc->dc_buf;
+	uint64_t	off = dc->dc_tag;
+	size_t		done = 0;
+
+	bp_mapin(cbp);
+	while (done < cbp->b_bcount) {
+		size_t	row = off & (RAID_CSIZE(r) - 1);
+		size_t	n = MIN(RAID_CSIZE(r) - row, cbp->b_bcount - done);
+		caddr_t	chunk = RAID_CHUNK(r, rs->rs_buf,
+		    raid_dleg(r, rs->rs_stripe, RAID_DATA(r, off))) + row;
+
+		if (cbp->b_flags & B_READ)
+			bcopy(chunk, cbp->b_un.b_addr + done, n);
+		else
+			bcopy(cbp->b_un.b_addr + done, chunk, n);
+		done += n;
+		off += n;
+	}
+	bp_mapout(cbp);
+}
+
+/* Sectors of rows 'lo' to 'hi' of data chunk 'k' the writes cover */
+static size_t
+raid_covered(raid_t *r, raid_stripe_t *rs, int k, size_t lo, size_t hi)
+{
+	size_t	n = 0;
+
+	for (size_t row = lo; row < hi; row += DEV_BSIZE) {
+		if (BT_TEST(rs->rs_snap,
+		    (((size_t)k << r->r_cshift) + row) >> DEV_BSHIFT))
+			n++;
+	}
+	return (n);
+}
+
+/*
+ * Do the I/O gathered on a stripe: read what is needed of it over the rows
+ * touched, bring back what is on legs out, serve the reads, lay the writes
+ * over and write them with fresh parity.  Returns the reads' error, the
+ * writes' goes to 'werr'.
+ */
+static int
+raid_stripe_io(raid_t *r, raid_stripe_t *rs, dm_child_t *writes,
+    dm_child_t *reads, int *werr)
+{
+	uint64_t	s = rs->rs_stripe;
+	size_t		lo = RAID_CSIZE(r), hi = 0;
+	uint32_t	kmask = 0, rmask = 0;
+	uint32_t	missing, failed, need, errs, out;
+	boolean_t	recon;
+	dm_child_t	*dc;
+	int		error = 0;
+
+	for (dc = writes; dc != NULL; dc = dc->dc_next)
+		raid_span(r, dc, &lo, &hi, &kmask);
+	for (dc = reads; dc != NULL; dc = dc->dc_next)
+		raid_span(r, dc, &lo, &hi, &rmask);
+
+	for (int tries = 0; ; tries++) {
+		mutex_enter(&r->r_lock);
+		failed = r->r_failed;
+		missing = failed | r->r_rebuild;
+		mutex_exit(&r->r_lock);
+		if (raid_nbits(missing) > r->r_nparity || tries == r->r_nlegs) {
+			*werr = EIO;
+			return (EIO);
+		}
+
+		/*
+		 * Writes need every data chunk over the rows, bar the ones
+		 * they overwrite, reads their own.  Any of them on a leg out
+		 * needs all the others, parity included.
+		 */
+		need = 0;
+		for (int k = 0; k < r->r_ndata; k++) {
+			if (writes == NULL && (rmask & (1U << k)) == 0)
+				continue;
+			if (raid_covered(r, rs, k, lo, hi) ==
+			    (hi - lo) >> DEV_BSHIFT)
+				continue;
+			need |= 1U << raid_dleg(r, s, k);
+		}
+		if ((recon = (need & missing) != 0))
+			need = RAID_ALL(r);
+		need &= ~missing;
+
+		if ((errs = raid_rw(r, s, rs->rs_buf, need, lo, hi, B_READ,
+		    &error)) == 0)
+			break;
+		raid_fail(r, errs, error);
+		error = 0;
+	}
+	if (recon) {
+		raid_recover(r, s, rs->rs_buf, lo, hi - lo, missing);
+		atomic_inc_64(&r->r_recon);
+	}
+
+	for (dc = writes; dc != NULL; dc = dc->dc_next)
+		raid_copy(r, rs, dc);
+	for (dc = reads; dc != NULL; dc = dc->dc_next)
+		raid_copy(r, rs, dc);
+	if (writes == NULL)
+		return (0);
+
+	if (r->r_nparity == 1) {
+		raid_syndrome(r, s, rs->rs_buf, lo, hi - lo, 0,
+		    RAID_WORDS(r, rs->rs_buf, raid_pleg(r, s), lo), NULL);
+	} else {
+		raid_syndrome(r, s, rs->rs_buf, lo, hi - lo, 0,
+		    RAID_WORDS(r, rs->rs_buf, raid_pleg(r, s), lo),
+		    RAID_WORDS(r, rs->rs_buf,
+		    (raid_pleg(r, s) + 1) % r->r_nlegs, lo));
+	}
+
+	out = raid_pmask(r, s);
+	for (int k = 0; k < r->r_ndata; k++) {
+		if ((kmask & (1U << k)) != 0)
+			out |= 1U << raid_dleg(r, s, k);
+	}
+	error = 0;
+	if ((errs = raid_rw(r, s, rs->rs_buf, out & ~failed, lo, hi, B_WRITE,
+	    &error)) != 0)
+		raid_fail(r, errs, error);
+
+	mutex_enter(&r->r_lock);
+	if (raid_nbits(r->r_failed | r->r_rebuild) > r->r_nparity)
+		*werr = EIO;
+	mutex_exit(&r->r_lock);
+
+	return (0);
+}
+
+/*
+ * Stripe cache
+ */
+static raid_stripe_t *
+raid_lookup(raid_t *r, uint64_t s)
+{
+	raid_stripe_t	*rs;
+
+	ASSERT(MUTEX_HELD(&r->r_lock));
+	for (rs = r->r_hash[s & r->r_hmask]; rs != NULL; rs = rs->rs_next) {
+		if (rs->rs_stripe == s)
+			return (rs);
+	}
+	return (NULL);
+}
+
+/* Take a free stripe for 's', NULL if there is none */
+static raid_stripe_t *
+raid_get(raid_t *r, uint64_t s, int state)
+{
+	raid_stripe_t	*rs;
+
+	ASSERT(MUTEX_HELD(&r->r_lock));
+	if ((rs = r->r_free) == NULL)
+		return (NULL);
+	r->r_free = rs->rs_next;
+	r->r_nfree--;
+
+	rs->rs_stripe = s;
+	rs->rs_state = state;
+	rs->rs_since = ddi_get_lbolt();
+	rs->rs_next = r->r_hash[s & r->r_hmask];
+	r->r_hash[s & r->r_hmask] = rs;
+	if (state == RS_GATHER) {
+		rs->rs_gnext = r->r_gather;
+		r->r_gather = rs;
+	}
+	return (rs);
+}
+
+/* Note the sectors a write covers */
+static void
+raid_cover(raid_t *r, raid_stripe_t *rs, dm_child_t *dc)
+{
+	size_t	first = (dc->dc_tag - rs->rs_stripe * RAID_SDATA(r)) >>
+	    DEV_BSHIFT;
+	size_t	last = first + btodb(dc->dc_buf.b_bcount);
+
+	for (size_t i = first; i < last; i++) {
+		if (!BT_TEST(rs->rs_cover, i)) {
+			BT_SET(rs->rs_cover, i);
+			rs->rs_ncover++;
+		}
+	}
+}
+
+/* Queue a piece of I/O on its stripe, or for one to come free */
+static void
+raid_attach_locked(raid_t *r, dm_child_t *dc)
+{
+	uint64_t	s = RAID_STRIPE(r, dc->dc_tag);
+	raid_stripe_t	*rs;
+	boolean_t	ready;
+
+	ASSERT(MUTEX_HELD(&r->r_lock));
+	dc->dc_next = NULL;
+	if ((rs = raid_lookup(r, s)) == NULL &&
+	    (rs = raid_get(r, s, RS_GATHER)) == NULL) {
+		if (r->r_waittail != NULL)
+			r->r_waittail->dc_next = dc;
+		else
+			r->r_waitq = dc;
+		r->r_waittail = dc;
+		r->r_waits++;
+		cv_signal(&r->r_wcv);
+		return;
+	}
+
+	if (rs->rs_writes == NULL && rs->rs_reads == NULL)
+		rs->rs_since = ddi_get_lbolt();
+	if (dc->dc_buf.b_flags & B_READ) {
+		dc->dc_next = rs->rs_reads;
+		rs->rs_reads = dc;
+		ready = B_TRUE;
+	} else {
+		dc->dc_next = rs->rs_writes;
+		rs->rs_writes = dc;
+		raid_cover(r, rs, dc);
+		ready = rs->rs_ncover == RAID_SECTORS(r) || r->r_delay == 0;
+	}
+	if (ready && rs->rs_state == RS_GATHER)
+		cv_signal(&r->r_wcv);
+}
+
+static void
+raid_attach(raid_t *r, dm_child_t *dc)
+{
+	mutex_enter(&r->r_lock);
+	raid_attach_locked(r, dc);
+	mutex_exit(&r->r_lock);
+}
+
+/* Back to gathering if more I/O came meanwhile, else to the free list */
+static void
+raid_release(raid_t *r, raid_stripe_t *rs)
+{
+	raid_stripe_t	**rsp;
+	dm_child_t	*dc;
+
+	mutex_enter(&r->r_lock);
+	if (rs->rs_writes != NULL || rs->rs_reads != NULL) {
+		rs->rs_state = RS_GATHER;
+		rs->rs_gnext = r->r_gather;
+		r->r_gather = rs;
+		cv_signal(&r->r_wcv);
+	} else {
+		for (rsp = &r->r_hash[rs->rs_stripe & r->r_hmask]; *rsp != rs;
+		    rsp = &(*rsp)->rs_next)
+			;
+		*rsp = rs->rs_next;
+		rs->rs_state = RS_FREE;
+		rs->rs_next = r->r_free;
+		r->r_free = rs;
+		r->r_nfree++;
+
+		while ((dc = r->r_waitq) != NULL && r->r_free != NULL) {
+			if ((r->r_waitq = dc->dc_next) == NULL)
+				r->r_waittail = NULL;
+			raid_attach_locked(r, dc);
+		}
+	}
+	cv_broadcast(&r->r_cv);
+	mutex_exit(&r->r_lock);
+}
+
+static dm_child_t *
+raid_reverse(dm_child_t *dc)
+{
+	dm_child_t	*list = NULL, *next;
+
+	for (; dc != NULL; dc = next) {
+		next = dc->dc_next;
+		dc->dc_next = list;
+		list = dc;
+	}
+	return (list);
+}
+
+/* Taskq: do the I/O gathered on a stripe and complete it */
+static void
+raid_process(void *arg)
+{
+	raid_stripe_t	*rs = arg;
+	raid_t		*r = rs->rs_raid;
+	dm_child_t	*writes, *reads, *dc;
+	int		rerr, werr = 0;
+
+	mutex_enter(&r->r_lock);
+	writes = raid_reverse(rs->rs_writes);
+	reads = raid_reverse(rs->rs_reads);
+	rs->rs_writes = rs->rs_reads = NULL;
+	if (writes != NULL) {
+		if (rs->rs_ncover == RAID_SECTORS(r))
+			r->r_full++;
+		else
+			r->r_partial++;
+	}
+	bcopy(rs->rs_cover, rs->rs_snap, BT_SIZEOFMAP(RAID_SECTORS(r)));
+	bzero(rs->rs_cover, BT_SIZEOFMAP(RAID_SECTORS(r)));
+	rs->rs_ncover = 0;
+	mutex_exit(&r->r_lock);
+
+	rerr = raid_stripe_io(r, rs, writes, reads, &werr);
+
+	while ((dc = reads) != NULL) {
+		reads = dc->dc_next;
+		dc->dc_buf.b_resid = 0;
+		if (rerr != 0)
+			bioerror(&dc->dc_buf, rerr);
+		biodone(&dc->dc_buf);
+	}
+	while ((dc = writes) != NULL) {
+		writes = dc->dc_next;
+		dc->dc_buf.b_resid = 0;
+		if (werr != 0)
+			bioerror(&dc->dc_buf, werr);
+		biodone(&dc->dc_buf);
+	}
+
+	raid_release(r, rs);
+}
+
+static boolean_t
+raid_ready(raid_t *r, raid_stripe_t *rs, clock_t now)
+{
+	return (rs->rs_reads != NULL || rs->rs_ncover == RAID_SECTORS(r) ||
+	    now - rs->rs_since >= r->r_delay || r->r_waitq != NULL ||
+	    r->r_exiting);
+}
+
+/* Hand stripes done gathering to the taskq */
+static void
+raid_worker(void *arg)
+{
+	raid_t		*r = arg;
+	raid_stripe_t	*rs, **rsp;
+
+	mutex_enter(&r->r_lock);
+
+	while (!r->r_exiting || r->r_nfree < r->r_nstr) {
+		clock_t	now = ddi_get_lbolt();
+
+		for (rsp = &r->r_gather; (rs = *rsp) != NULL; ) {
+			if (!raid_ready(r, rs, now)) {
+				rsp = &rs->rs_gnext;
+				continue;
+			}
+			if (ddi_taskq_dispatch(r->r_tq, raid_process, rs,
+			    DDI_NOSLEEP) != DDI_SUCCESS)
+				break;
+			*rsp = rs->rs_gnext;
+			rs->rs_state = RS_BUSY;
+		}
+		(void) cv_reltimedwait(&r->r_wcv, &r->r_lock,
+		    MAX(r->r_delay, 1), TR_CLOCK_TICK);
+	}
+
+	mutex_exit(&r->r_lock);
+	thread_exit();
+}
+
+/*
+ * I/O path
+ */
+
+/* A read that failed on its leg is retried through the cache */
+static void
+raid_piece_done(dm_child_t *dc, void *arg)
+{
+	raid_t		*r = arg;
+	struct buf	*cbp = &dc->dc_buf;
+	dm_split_t	*ds = dc->dc_split;
+	dm_child_t	*rc;
+	int		error = geterror(cbp);
+	int		leg;
+
+	if (dc->dc_lh == NULL || error == 0 ||
+	    (leg = raid_leg(r, cbp->b_edev)) == -1)
+		return;
+
+	raid_fail(r, 1U << leg, error);
+	rc = dm_split_child(ds, (size_t)(dc->dc_tag -
+	    ldbtob(ds->ds_bp->b_lblkno)), cbp->b_bcount, r->r_dev[0],
+	    btodb(dc->dc_tag), KM_NOSLEEP);
+	if (rc == NULL)
+		return;
+	rc->dc_tag = dc->dc_tag;
+	atomic_inc_64(&r->r_retries);
+	bioerror(cbp, 0);
+	raid_attach(r, rc);
+}
+
+/* Cut a write at stripe boundaries into the cache */
+static void
+raid_write(struct buf *bp, void *arg)
+{
+	raid_t		*r = arg;
+	uint64_t	base = ldbtob(bp->b_lblkno);
+	dm_split_t	*ds;
+	dm_child_t	*dc;
+
+	if ((ds = dm_split_alloc(bp, raid_piece_done, r, KM_NOSLEEP)) ==
+	    NULL) {
+		bioerror(bp, ENOMEM);
+		biodone(bp);
+		return;
+	}
+
+	for (size_t off = 0; off < bp->b_bcount; ) {
+		uint64_t	lo = base + off;
+		size_t		n = MIN(bp->b_bcount - off,
+		    RAID_SDATA(r) - lo % RAID_SDATA(r));
+
+		if ((dc = dm_split_child(ds, off, n, r->r_dev[0], btodb(lo),
+		    KM_NOSLEEP)) == NULL)
+			break;
+		dc->dc_tag = lo;
+		raid_attach(r, dc);
+		off += n;
+	}
+	dm_split_rele(ds);
+}
+
+/*
+ * Send reads chunk by chunk to their legs, or through the cache for those
+ * on legs out or stripes in it.
+ */
+static void
+raid_read(raid_t *r, dm_split_t *ds)
+{
+	struct buf	*bp = ds->ds_bp;
+	uint64_t	base = ldbtob(bp->b_lblkno);
+	dm_child_t	*dc;
+
+	for (size_t off = 0; off < bp->b_bcount; ) {
+		uint64_t	lo = base + off;
+		uint64_t	s = RAID_STRIPE(r, lo);
+		int		leg = raid_dleg(r, s, RAID_DATA(r, lo));
+		size_t		row = lo & (RAID_CSIZE(r) - 1);
+		size_t		n;
+
+		n = MIN(bp->b_bcount - off, RAID_CSIZE(r) - row);
+		n = MIN(n, dm_target_limits(r->r_dmip,
+		    r->r_lh[leg])->dl_maxxfer);
+
+		mutex_enter(&r->r_lock);
+		if (((r->r_failed | r->r_rebuild) & (1U << leg)) != 0 ||
+		    raid_lookup(r, s) != NULL) {
+			if ((dc = dm_split_child(ds, off, n, r->r_dev[0],
+			    btodb(lo), KM_NOSLEEP)) != NULL) {
+				dc->dc_tag = lo;
+				raid_attach_locked(r, dc);
+			}
+			mutex_exit(&r->r_lock);
+		} else {
+			mutex_exit(&r->r_lock);
+			if ((dc = dm_split_child(ds, off, n, r->r_dev[leg],
+			    btodb((s << r->r_cshift) + row), KM_NOSLEEP)) !=
+			    NULL) {
+				dc->dc_tag = lo;
+				dc->dc_lh = r->r_lh[leg];
+				dm_issue(dc->dc_lh, &dc->dc_buf);
+			}
+		}
+		if (dc == NULL)
+			break;
+		off += n;
+	}
+}
+
+/*
+ * Rebuild and resync
+ */
+
+/* Sleep off whatever I/O of 'len' since 'start' is ahead of the rate */
+static void
+raid_throttle(raid_t *r, size_t len, clock_t start)
+{
+	clock_t	want, spent;
+
+	if (r->r_rate == 0)
+		return;
+
+	want = drv_usectohz((clock_t)((uint64_t)len * MICROSEC / r->r_rate));
+	spent = ddi_get_lbolt() - start;
+	if (spent >= want)
+		return;
+
+	mutex_enter(&r->r_lock);
+	if (!r->r_exiting) {
+		(void) cv_reltimedwait(&r->r_scv, &r->r_lock, want - spent,
+		    TR_CLOCK_TICK);
+	}
+	mutex_exit(&r->r_lock);
+}
+
+/* Take stripe 's' for ourselves, once nothing is queued on it */
+static raid_stripe_t *
+raid_hold(raid_t *r, uint64_t s)
+{
+	raid_stripe_t	*rs = NULL;
+
+	mutex_enter(&r->r_lock);
+	while (!r->r_exiting &&
+	    (raid_lookup(r, s) != NULL || r->r_free == NULL))
+		cv_wait(&r->r_cv, &r->r_lock);
+	if (!r->r_exiting)
+		rs = raid_get(r, s, RS_BUSY);
+	mutex_exit(&r->r_lock);
+
+	return (rs);
+}
+
+/*
+ * Rewrite the chunks of stripe 's' on the legs in 'targets', its parity if
+ * none, from the others.
+ */
+static int
+raid_sync(raid_t *r, uint64_t s, uint32_t targets)
+{
+	raid_stripe_t	*rs;
+	clock_t		start = ddi_get_lbolt();
+	uint32_t	missing, errs;
+	int		error = 0;
+
+	if ((rs = raid_hold(r, s)) == NULL)
+		return (EINTR);
+
+	if (targets == 0)
+		targets = raid_pmask(r, s);
+	mutex_enter(&r->r_lock);
+	missing = r->r_failed | r->r_rebuild | targets;
+	targets &= ~r->r_failed;
+	mutex_exit(&r->r_lock);
+
+	if (raid_nbits(missing) > r->r_nparity) {
+		error = EIO;
+	} else if ((errs = raid_rw(r, s, rs->rs_buf, RAID_ALL(r) & ~missing,
+	    0, RAID_CSIZE(r), B_READ, &error)) != 0) {
+		raid_fail(r, errs, error);
+	} else {
+		raid_recover(r, s, rs->rs_buf, 0, RAID_CSIZE(r), missing);
+		if ((errs = raid_rw(r, s, rs->rs_buf, targets, 0,
+		    RAID_CSIZE(r), B_WRITE, &error)) != 0)
+			raid_fail(r, errs, error);
+	}
+
+	raid_release(r, rs);
+	raid_throttle(r, (size_t)r->r_nlegs << r->r_cshift, start);
+
+	return (error);
+}
+
+/* Redo the parity of the stripes a dirty region is in */
+static int
+raid_resync(raid_t *r, uint64_t region)
+{
+	uint64_t	first, last;
+	int		rc;
+
+	first = ldbtob(region << r->r_rgshift) / RAID_SDATA(r);
+	last = (MIN(ldbtob((region + 1) << r->r_rgshift), r->r_dmip->size) -
+	    1) / RAID_SDATA(r);
+	for (uint64_t s = first; s <= last; s++) {
+		if ((rc = raid_sync(r, s, 0)) != 0)
+			return (rc);
+	}
+	dm_wib_resynced(r->r_wib, region);
+	r->r_resynced++;
+
+	return (0);
+}
+
+static void
+raid_syncer(void *arg)
+{
+	raid_t		*r = arg;
+	uint64_t	region = 0, s = 0;
+	boolean_t	clean = B_TRUE;
+	clock_t		wait = 0;
+	uint32_t	out;
+
+	mutex_enter(&r->r_lock);
+
+	while (!r->r_exiting) {
+		out = r->r_failed | r->r_rebuild;
+		if (out != r->r_saved && wait == 0) {
+			mutex_exit(&r->r_lock);
+			if (dm_wib_set_flags(r->r_wib, out) == 0)
+				r->r_saved = out;
+			else
+				wait = drv_usectohz(MICROSEC) * RAID_RETRY;
+			mutex_enter(&r->r_lock);
+			continue;
+		}
+
+		/* Nothing to do with a leg out, or for a while after errors */
+		if (wait != 0 || r->r_failed != 0) {
+			(void) cv_reltimedwait(&r->r_scv, &r->r_lock,
+			    MAX(wait, drv_usectohz(MICROSEC)), TR_CLOCK_TICK);
+			wait = 0;
+			continue;
+		}
+
+		if (r->r_rebuild != 0) {
+			uint32_t	rebuild = r->r_rebuild;
+
+			if (s == r->r_nstripes) {
+				cmn_err(CE_NOTE, "dm_raid: %s: rebuilt",
+				    refstr_value(r->r_dmip->name));
+				r->r_rebuild = 0;
+				s = 0;
+				continue;
+			}
+			mutex_exit(&r->r_lock);
+			if (raid_sync(r, s, rebuild) == 0)
+				s++;
+			else
+				clean = B_FALSE;
+			mutex_enter(&r->r_lock);
+			r->r_rebuilt = s;
+			if (!clean) {
+				wait = drv_usectohz(MICROSEC) * RAID_RETRY;
+				clean = B_TRUE;
+			}
+			continue;
+		}
+		mutex_exit(&r->r_lock);
+
+		region = dm_wib_resync_next(r->r_wib, region);
+		if (region < r->r_nregions) {
+			if (raid_resync(r, region) != 0)
+				clean = B_FALSE;
+			region++;
+			mutex_enter(&r->r_lock);
+			continue;
+		}
+
+		/* A whole pass done */
+		mutex_enter(&r->r_lock);
+		region = 0;
+		wait = drv_usectohz(MICROSEC) * (clean ? 1 : RAID_RETRY);
+		clean = B_TRUE;
+	}
+
+	mutex_exit(&r->r_lock);
+
+	out = r->r_failed | r->r_rebuild;
+	if (out != r->r_saved)
+		(void) dm_wib_set_flags(r->r_wib, out);
+
+	thread_exit();
+}
+
+static void
+raid_free(raid_t *r)
+{
+	size_t	mapsz = BT_SIZEOFMAP(RAID_SECTORS(r));
+	size_t	ssz = (size_t)r->r_nlegs << r->r_cshift;
+
+	if (r->r_tq != NULL)
+		ddi_taskq_destroy(r->r_tq);
+	if (r->r_wib != NULL)
+		dm_wib_close(r->r_wib);
+	if (r->r_stripes != NULL) {
+		for (uint32_t i = 0; i < r->r_nstr; i++) {
+			raid_stripe_t	*rs = &r->r_stripes[i];
+
+			kmem_free(rs->rs_buf, ssz);
+			kmem_free(rs->rs_cover, mapsz);
+			kmem_free(rs->rs_snap, mapsz);
+		}
+		kmem_free(r->r_stripes, r->r_nstr * sizeof (raid_stripe_t));
+		kmem_free(r->r_hash, (r->r_hmask + 1) *
+		    sizeof (raid_stripe_t *));
+	}
+	if (r->r_loglh != NULL)
+		dm_target_close(r->r_dmip, r->r_loglh);
+	for (int i = 1; i < r->r_nlegs; i++)
+		dm_target_close(r->r_dmip, r->r_lh[i]);
+
+	cv_destroy(&r->r_scv);
+	cv_destroy(&r->r_wcv);
+	cv_destroy(&r->r_cv);
+	mutex_destroy(&r->r_lock);
+	kmem_free(r, sizeof (*r));
+}
+
+/* Set the stripe cache up, 'cache' bytes of it */
+static void
+raid_cache_init(raid_t *r, uint64_t cache)
+{
+	size_t	mapsz = BT_SIZEOFMAP(RAID_SECTORS(r));
+	size_t	ssz = (size_t)r->r_nlegs << r->r_cshift;
+
+	r->r_nstr = (uint32_t)MAX(cache / ssz, RAID_MINSTR);
+	r->r_hmask = (1U << highbit(r->r_nstr)) - 1;
+	r->r_hash = kmem_zalloc((r->r_hmask + 1) * sizeof (raid_stripe_t *),
+	    KM_SLEEP);
+	r->r_stripes = kmem_zalloc(r->r_nstr * sizeof (raid_stripe_t),
+	    KM_SLEEP);
+	for (uint32_t i = 0; i < r->r_nstr; i++) {
+		raid_stripe_t	*rs = &r->r_stripes[i];
+
+		rs->rs_raid = r;
+		rs->rs_buf = kmem_alloc(ssz, KM_SLEEP);
+		rs->rs_cover = kmem_zalloc(mapsz, KM_SLEEP);
+		rs->rs_snap = kmem_zalloc(mapsz, KM_SLEEP);
+		rs->rs_next = r->r_free;
+		r->r_free = rs;
+	}
+	r->r_nfree = r->r_nstr;
+}
+
+/*
+ * Plugin entry points
+ */
+static int
+dm_raid_init(void)
+{
+	uint_t	v = 1;
+
+	for (int i = 0; i < 255; i++) {
+		raid_gfexp[i] = raid_gfexp[i + 255] = (uint8_t)v;
+		raid_gflog[v] = (uint8_t)i;
+		v <<= 1;
+		if (v & 0x100)
+			v ^= 0x11d;
+	}
+	return (0);
+}
+
+static void
+dm_raid_fini(void)
+{
+}
+
+static int
+dm_raid_create(dm_info_t *dmip, int argc, char **argv, cred_t *crp,
+    void **privp)
+{
+	raid_t		*r;
+	char		*legs[RAID_MAXLEGS];
+	char		*log = NULL;
+	int		nlegs = 1;
+	int		level = 5;
+	uint32_t	cshift = RAID_CSHIFT;
+	unsigned long	cache = RAID_CACHE;
+	unsigned long	gather = RAID_GATHER;
+	unsigned long	rate = RAID_RATE;
+	boolean_t	format = B_FALSE;
+	boolean_t	nosync = B_FALSE;
+	uint64_t	size, min = dmip->size;
+	int		rc;
+
+	for (int i = 0; i < argc; i++) {
+		unsigned long	val;
+
+		if (strncmp(argv[i], "leg=", 4) == 0 && argv[i][4] != '\0' &&
+		    nlegs < RAID_MAXLEGS) {
+			legs[nlegs++] = argv[i] + 4;
+		} else if (strncmp(argv[i], "log=", 4) == 0 &&
+		    argv[i][4] != '\0') {
+			log = argv[i] + 4;
+		} else if (strcmp(argv[i], "level=5") == 0) {
+			level = 5;
+		} else if (strcmp(argv[i], "level=6") == 0) {
+			level = 6;
+		} else if (strncmp(argv[i], "chunk=", 6) == 0 &&
+		    ddi_strtoul(argv[i] + 6, NULL, 10, &val) == 0 &&
+		    val >= RAID_CMIN / 1024 && val <= RAID_CMAX / 1024 &&
+		    ISP2(val)) {
+			cshift = highbit(val * 1024) - 1;
+		} else if (strncmp(argv[i], "cache=", 6) == 0 &&
+		    ddi_strtoul(argv[i] + 6, NULL, 10, &val) == 0) {
+			cache = val;
+		} else if (strncmp(argv[i], "gather=", 7) == 0 &&
+		    ddi_strtoul(argv[i] + 7, NULL, 10, &val) == 0) {
+			gather = val;
+		} else if (strncmp(argv[i], "rate=", 5) == 0 &&
+		    ddi_strtoul(argv[i] + 5, NULL, 10, &val) == 0) {
+			rate = val;
+		} else if (strcmp(argv[i], "format") == 0) {
+			format = B_TRUE;
+		} else if (strcmp(argv[i], "nosync") == 0) {
+			nosync = B_TRUE;
+		} else {
+			cmn_err(CE_WARN, "dm_raid: unknown argument '%s'",
+			    argv[i]);
+			return (EINVAL);
+		}
+	}
+	if (nlegs < (level == 6 ? 4 : 3) || log == NULL) {
+		cmn_err(CE_WARN, "dm_raid: level %d needs %d legs and a log "
+		    "device", level, level == 6 ? 4 : 3);
+		return (EINVAL);
+	}
+
+	r = kmem_zalloc(sizeof (*r), KM_SLEEP);
+	r->r_dmip = dmip;
+	mutex_init(&r->r_lock, NULL, MUTEX_DRIVER, NULL);
+	cv_init(&r->r_cv, NULL, CV_DRIVER, NULL);
+	cv_init(&r->r_wcv, NULL, CV_DRIVER, NULL);
+	cv_init(&r->r_scv, NULL, CV_DRIVER, NULL);
+	r->r_lh[0] = dmip->lh;
+	r->r_dev[0] = dmip->tdev;
+	r->r_nparity = level == 6 ? 2 : 1;
+	r->r_ndata = nlegs - r->r_nparity;
+	r->r_cshift = cshift;
+	r->r_delay = gather == 0 ? 0 : MAX(drv_usectohz(gather), 1);
+	r->r_rate = (uint64_t)rate * 1024;
+
+	r->r_nlegs = 1;
+	for (int i = 1; i < nlegs; i++) {
+		if ((rc = dm_target_open(dmip, crp, legs[i], &r->r_lh[i],
+		    &r->r_dev[i])) != 0) {
+			raid_free(r);
+			return (rc);
+		}
+		r->r_nlegs = i + 1;
+		if (ldi_get_size(r->r_lh[i], &size) != DDI_SUCCESS) {
+			raid_free(r);
+			return (ENXIO);
+		}
+		min = MIN(min, size);
+	}
+	r->r_nstripes = min >> cshift;
+	if (r->r_nstripes == 0) {
+		raid_free(r);
+		return (ENOSPC);
+	}
+	dmip->size = r->r_nstripes * RAID_SDATA(r);
+
+	rc = dm_target_open(dmip, crp, log, &r->r_loglh, &r->r_logdev);
+	if (rc != 0) {
+		raid_free(r);
+		return (rc);
+	}
+	if (format && (ldi_get_size(r->r_loglh, &size) != DDI_SUCCESS ||
+	    size < dm_wib_size(dmip->size, RAID_RGSHIFT))) {
+		cmn_err(CE_WARN, "dm_raid: %s: %s is too small for the "
+		    "bitmap", refstr_value(dmip->name), log);
+		raid_free(r);
+		return (ENOSPC);
+	}
+	if ((rc = dm_wib_open(dmip, r->r_loglh, r->r_logdev, 0, dmip->size,
+	    RAID_RGSHIFT, format, raid_write, r, &r->r_wib)) != 0) {
+		cmn_err(CE_WARN, "dm_raid: %s: no bitmap on %s (%d)",
+		    refstr_value(dmip->name), log, rc);
+		raid_free(r);
+		return (rc);
+	}
+
+	r->r_rgshift = dm_wib_rgshift(r->r_wib);
+	r->r_nregions = dm_wib_nregions(r->r_wib);
+	r->r_rebuild = r->r_saved = (uint32_t)dm_wib_flags(r->r_wib) &
+	    RAID_ALL(r);
+	if (raid_nbits(r->r_rebuild) > r->r_nparity) {
+		cmn_err(CE_WARN, "dm_raid: %s: too many legs out of date",
+		    refstr_value(dmip->name));
+		raid_free(r);
+		return (EIO);
+	}
+	if (format && !nosync)
+		dm_wib_mark(r->r_wib, 0, dmip->size);
+
+	raid_cache_init(r, (uint64_t)cache * 1024);
+	r->r_tq = ddi_taskq_create(NULL, "dm_raid", RAID_THREADS,
+	    TASKQ_DEFAULTPRI, 0);
+	r->r_worker = thread_create(NULL, 0, raid_worker, r, 0, &p0, TS_RUN,
+	    minclsyspri);
+	r->r_syncer = thread_create(NULL, 0, raid_syncer, r, 0, &p0, TS_RUN,
+	    minclsyspri);
+
+	*privp = r;
+
+	return (0);
+}
+
+static void
+dm_raid_destroy(dm_info_t *dmip, void *priv)
+{
+	raid_t		*r = priv;
+	kt_did_t	stid = r->r_syncer->t_did;
+	kt_did_t	wtid = r->r_worker->t_did;
+
+	/* The worker stays until every stripe is written */
+	mutex_enter(&r->r_lock);
+	r->r_exiting = B_TRUE;
+	cv_broadcast(&r->r_cv);
+	cv_broadcast(&r->r_scv);
+	cv_broadcast(&r->r_wcv);
+	mutex_exit(&r->r_lock);
+	thread_join(stid);
+	thread_join(wtid);
+
+	raid_free(r);
+}
+
+static dm_mapio_t
+dm_raid_mapio(dm_info_t *dmip, void *priv, struct buf *bp, dm_remap_t *rp)
+{
+	raid_t		*r = priv;
+	dm_split_t	*ds;
+
+	if (bp->b_bcount == 0) {
+		bp->b_resid = 0;
+		biodone(bp);
+		return (DM_MAPIO_SUBMITTED);
+	}
+	if (!(bp->b_flags & B_READ)) {
+		atomic_inc_64(&r->r_writes);
+		if (dm_wib_write(r->r_wib, bp))
+			raid_write(bp, r);
+		return (DM_MAPIO_SUBMITTED);
+	}
+
+	atomic_inc_64(&r->r_reads);
+	if ((ds = dm_split_alloc(bp, raid_piece_done, r, KM_NOSLEEP)) ==
+	    NULL) {
+		bioerror(bp, ENOMEM);
+		return (DM_MAPIO_KILL);
+	}
+	raid_read(r, ds);
+	dm_split_rele(ds);
+
+	return (DM_MAPIO_SUBMITTED);
+}
+
+static int
+dm_raid_end_io(dm_info_t *dmip, void *priv, struct buf *bp, int error)
+{
+	raid_t	*r = priv;
+
+	if (!(bp->b_flags & B_READ) && bp->b_bcount != 0)
+		dm_wib_done(r->r_wib, bp->b_lblkno, bp->b_bcount);
+
+	return (error);
+}
+
+static int
+dm_raid_stats(dm_info_t *dmip, void *priv, nvlist_t *nvl)
+{
+	raid_t	*r = priv;
+
+	mutex_enter(&r->r_lock);
+	(void) nvlist_add_int32(nvl, "legs", r->r_nlegs);
+	(void) nvlist_add_int32(nvl, "parity", r->r_nparity);
+	(void) nvlist_add_uint64(nvl, "chunk", RAID_CSIZE(r));
+	(void) nvlist_add_uint32(nvl, "failed", r->r_failed);
+	(void) nvlist_add_uint32(nvl, "rebuilding", r->r_rebuild);
+	(void) nvlist_add_uint64(nvl, "reads", r->r_reads);
+	(void) nvlist_add_uint64(nvl, "writes", r->r_writes);
+	(void) nvlist_add_uint64(nvl, "full_stripes", r->r_full);
+	(void) nvlist_add_uint64(nvl, "partial_stripes", r->r_partial);
+	(void) nvlist_add_uint64(nvl, "reconstructed", r->r_recon);
+	(void) nvlist_add_uint64(nvl, "read_retries", r->r_retries);
+	(void) nvlist_add_uint64(nvl, "cache_waits", r->r_waits);
+	(void) nvlist_add_uint64(nvl, "cache_stripes", r->r_nstr);
+	(void) nvlist_add_uint64(nvl, "rebuilt", r->r_rebuilt);
+	(void) nvlist_add_uint64(nvl, "resynced", r->r_resynced);
+	mutex_exit(&r->r_lock);
+
+	dm_wib_stats(r->r_wib, nvl);
+
+	return (0);
+}
+
+
+dm_plugin_ops_t dm_ops = {
+	.dpo_rev	= DPO_REV,
+	.dpo_name	= "raid",
+	.dpo_init	= dm_raid_init,
+	.dpo_fini	= dm_raid_fini,
+	.dpo_create	= dm_raid_create,
+	.dpo_destroy	= dm_raid_destroy,
+	.dpo_mapio	= dm_raid_mapio,
+	.dpo_end_io	= dm_raid_end_io,
+	.dpo_stats	= dm_raid_stats,
+};
+
+static struct modlmisc modlmisc = {
+	.misc_modops	= &mod_miscops,
+	.misc_linkinfo	= "Solaris Device Mapper parity plugin"
+};
+
+static struct modlinkage modlinkage = {
+	.ml_rev		= MODREV_1,
+	.ml_linkage	= {&modlmisc, NULL, NULL, NULL}
+};
+
+int
+_init(void)
+{
+	return (mod_install(&modlinkage));
+}
+
+int
+_info(struct modinfo *mip)
+{
+	return (mod_info(&modlinkage, mip));
+}
+
+int
+_fini(void)
+{
+	return (mod_remove(&modlinkage));
+}
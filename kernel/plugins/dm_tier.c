@@ -0,0 +1,952 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright 2011 Grigale Ltd. All rights reserved.
+ * Use is subject to license terms.
+ */
+
+
+/*
+ * Tiering target
+ *
+ * Presents one device made of a small fast device and a large slow one
+ * (the mapping device), with hot data kept on the fast one.  Both are
+ * carved into extent sized slots and every extent of the mapping lives in
+ * exactly one slot, so the mapping is as large as the two tiers together
+ * less one extent: a single spare slow slot lets a cold fast extent be
+ * demoted whenever a hot slow extent is to take its place.
+ *
+ * The fast device holds the metadata:
+ *
+ *	block 0			superblock
+ *	mapstart		extent map, one 32-bit slot entry per extent
+ *	faststart		fast slots, extent aligned
+ *
+ * Heat is a 16-bit access count per extent, kept in a flat array next to
+ * the map and halved every half-life so that it decays exponentially.  It
+ * is not saved, a mapping starts out cold after it is recreated.
+ *
+ * A mover thread compares the hottest slow extent with the coldest fast
+ * one and exchanges them when the former is hotter by a margin.  Moves are
+ * copies in chunks, throttled to the configured rate, with I/O to the
+ * extent flowing to its old slot all along.  Chunks written meanwhile are
+ * copied again, a few passes at most; I/O to the extent is then held
+ * briefly while what is left is copied, the new slot is recorded in the
+ * on-disk map and the held I/O is sent on to the new slot.  The old slot
+ * stays intact until the map no longer points at it, so a crash at any
+ * point leaves a consistent mapping.
+ *
+ * Arguments:	fast=<device> [format] [extent=<KB>] [rate=<KB/s>]
+ *		[halflife=<secs>]
+ *
+ * 'format' initialises the metadata, extent (a power of two, 256K to 16M)
+ * is only used then.  rate caps the bandwidth taken by moves, 0 lifts the
+ * cap.
+ */
+
+#include <sys/atomic.h>
+#include <sys/bitmap.h>
+#include <sys/buf.h>
+#include <sys/conf.h>
+#include <sys/cred.h>
+#include <sys/disp.h>
+#include <sys/errno.h>
+#include <sys/file.h>
+#include <sys/kmem.h>
+#include <sys/modctl.h>
+#include <sys/proc.h>
+#include <sys/sysmacros.h>
+#include <sys/systm.h>
+#include <sys/thread.h>
+#include <sys/types.h>
+#include <sys/ddi.h>
+#include <sys/sunddi.h>
+
+#include <sys/dm.h>
+#include <sys/dm_impl.h>
+#include <sys/dm_ops.h>
+
+#define	TIER_MAGIC	0x444d544945523031ULL	/* "DMTIER01" */
+#define	TIER_VERSION	1
+
+#define	TIER_BSIZE	4096			/* Metadata block */
+#define	TIER_DBPB	(TIER_BSIZE / DEV_BSIZE)
+#define	TIER_MAPPG	(TIER_BSIZE / sizeof (uint32_t)) /* Map entries/page */
+#define	TIER_IOMAX	(1024 * 1024)		/* Metadata I/O size */
+
+#define	TIER_CHUNK	(256 * 1024)		/* Copy unit */
+#define	TIER_CHUNKSHIFT	9			/* log2 of its disk blocks */
+#define	TIER_MAXCHUNKS	64			/* Per extent, bits of a mask */
+#define	TIER_EXTSHIFT	13			/* Default extent size, 4M */
+#define	TIER_RATE	(10 * 1024)		/* Default move rate, KB/s */
+#define	TIER_HALFLIFE	300			/* Default half-life, seconds */
+#define	TIER_MINHEAT	8			/* Coolest extent promoted */
+#define	TIER_MARGIN	8			/* Heat a promotion wins by */
+#define	TIER_PASSES	3			/* Copies with I/O flowing */
+
+/* Map entries */
+#define	TIER_FAST	0x80000000U		/* Slot on the fast device */
+#define	TIER_SLOTMASK	0x7fffffffU
+#define	TIER_NOEXT	((uint32_t)-1)
+
+/* Tier indices */
+#define	TIER_S		0
+#define	TIER_F		1
+#define	TIER_IDX(loc)	(((loc) & TIER_FAST) ? TIER_F : TIER_S)
+
+typedef struct {
+	uint64_t	ts_magic;
+	uint32_t	ts_version;
+	uint32_t	ts_extshift;	/* log2 of disk blocks per extent */
+	uint64_t	ts_nexts;	/* Extents presented */
+	uint64_t	ts_nslots[2];	/* Slots on the slow and fast devices */
+	uint64_t	ts_mapstart;	/* Map, in TIER_BSIZE blocks */
+	uint64_t	ts_faststart;	/* First fast slot, likewise */
+	uint32_t	ts_pad;
+	uint32_t	ts_sum;		/* Checksum of the above */
+} tier_super_t;
+
+/* Pieces of an I/O are tagged with their extent and offset into it */
+#define	TIER_TAG(ext, off)	(((uint64_t)(ext) << 32) | (off))
+#define	TIER_TAG_EXT(tag)	((uint32_t)((tag) >> 32))
+#define	TIER_TAG_OFF(tag)	((uint32_t)(tag))
+
+typedef struct tier {
+	dm_info_t	*t_dmip;
+	kmutex_t	t_lock;
+	kcondvar_t	t_cv;		/* Moving extent drained */
+	kcondvar_t	t_mvcv;		/* Mover wakeup */
+	tier_super_t	t_sb;
+
+	ldi_handle_t	t_lh[2];	/* Slow and fast devices */
+	dev_t		t_dev[2];
+
+	uint32_t	*t_map;		/* Extent to slot map, as on disk */
+	size_t		t_mappages;
+	uint16_t	*t_heat;	/* Decaying access counts */
+	uint16_t	*t_busy;	/* I/Os in flight */
+	ulong_t		*t_used[2];	/* Slots in use on either tier */
+	uint64_t	t_nfree[2];	/* and how many are not */
+
+	uint32_t	t_moving;	/* Extent being moved */
+	uint64_t	t_dirty;	/* Its chunks written since copied */
+	boolean_t	t_holding;	/* Its I/O is being held */
+	dm_child_t	*t_held;	/* on this list */
+
+	uint64_t	t_rate;		/* Move bytes per second, 0 no cap */
+	clock_t		t_halflife;	/* Ticks */
+	caddr_t		t_mvbuf;	/* Copy buffer */
+	kthread_t	*t_mover;
+	boolean_t	t_exiting;
+	int		t_error;	/* Move failed, stops the mover */
+
+	uint64_t	t_ios[2];	/* Pieces sent to either tier */
+	uint64_t	t_promotions;
+	uint64_t	t_demotions;
+	uint64_t	t_moved;	/* Bytes copied */
+	uint64_t	t_nheld;	/* Pieces held by a switch */
+} tier_t;
+
+
+/* First disk block of a slot */
+static diskaddr_t
+tier_slot_blk(tier_t *t, uint32_t loc)
+{
+	diskaddr_t	blk;
+
+	blk = (diskaddr_t)(loc & TIER_SLOTMASK) << t->t_sb.ts_extshift;
+	if (loc & TIER_FAST)
+		blk += t->t_sb.ts_faststart * TIER_DBPB;
+
+	return (blk);
+}
+
+/* Synchronous I/O, 'blk' in disk blocks */
+static int
+tier_bio(tier_t *t, int idx, caddr_t addr, size_t len, diskaddr_t blk,
+    int rw)
+{
+	return (dm_target_bio(t->t_dmip, t->t_lh[idx], t->t_dev[idx], addr,
+	    len, blk, rw));
+}
+
+/* Large metadata transfers, 'blk' in TIER_BSIZE blocks */
+static int
+tier_bio_big(tier_t *t, caddr_t addr, size_t len, uint64_t blk, int rw)
+{
+	int	rc = 0;
+
+	while (len != 0 && rc == 0) {
+		size_t	n = MIN(len, TIER_IOMAX);
+
+		rc = tier_bio(t, TIER_F, addr, n, blk * TIER_DBPB, rw);
+		addr += n;
+		len -= n;
+		blk += n / TIER_BSIZE;
+	}
+
+	return (rc);
+}
+
+/*
+ * Slots
+ */
+static uint32_t
+tier_slot_alloc(tier_t *t, int idx)
+{
+	uint64_t	nslots = t->t_sb.ts_nslots[idx];
+	uint32_t	fast = (idx == TIER_F) ? TIER_FAST : 0;
+
+	ASSERT(MUTEX_HELD(&t->t_lock));
+
+	for (uint64_t slot = 0; slot < nslots; slot++) {
+		if (!BT_TEST(t->t_used[idx], slot)) {
+			BT_SET(t->t_used[idx], slot);
+			t->t_nfree[idx]--;
+			return (fast | (uint32_t)slot);
+		}
+	}
+
+	return (TIER_NOEXT);
+}
+
+static void
+tier_slot_free(tier_t *t, uint32_t loc)
+{
+	int	idx = TIER_IDX(loc);
+
+	ASSERT(MUTEX_HELD(&t->t_lock));
+	ASSERT(BT_TEST(t->t_used[idx], loc & TIER_SLOTMASK));
+
+	BT_CLEAR(t->t_used[idx], loc & TIER_SLOTMASK);
+	t->t_nfree[idx]++;
+}
+
+/*
+ * I/O path
+ */
+
+/* Chunks of an extent a piece covers */
+static uint64_t
+tier_chunks(dm_child_t *dc)
+{
+	uint32_t	off = TIER_TAG_OFF(dc->dc_tag);
+	uint32_t	first = off >> TIER_CHUNKSHIFT;
+	uint32_t	last = (off + btodb(dc->dc_buf.b_bcount) - 1) >>
+	    TIER_CHUNKSHIFT;
+	uint64_t	mask = 0;
+
+	for (uint32_t c = first; c <= last; c++)
+		mask |= 1ULL << c;
+
+	return (mask);
+}
+
+static void
+tier_piece_done(dm_child_t *dc, void *arg)
+{
+	tier_t		*t = arg;
+	uint32_t	ext = TIER_TAG_EXT(dc->dc_tag);
+
+	mutex_enter(&t->t_lock);
+	t->t_busy[ext]--;
+	if (ext == t->t_moving) {
+		/* Whatever it wrote has to be copied again */
+		if (!(dc->dc_buf.b_flags & B_READ))
+			t->t_dirty |= tier_chunks(dc);
+		if (t->t_busy[ext] == 0)
+			cv_broadcast(&t->t_cv);
+	}
+	mutex_exit(&t->t_lock);
+}
+
+/*
+ * Send pieces to wherever their extents are now, holding back those of an
+ * extent that is being switched to its new slot.
+ */
+static void
+tier_dispatch(tier_t *t, dm_child_t *list)
+{
+	dm_child_t	*ready = NULL;
+	dm_child_t	*dc;
+
+	mutex_enter(&t->t_lock);
+	while ((dc = list) != NULL) {
+		struct buf	*cbp = &dc->dc_buf;
+		uint32_t	ext = TIER_TAG_EXT(dc->dc_tag);
+		uint32_t	loc;
+		diskaddr_t	blk;
+		int		idx;
+
+		list = dc->dc_next;
+		if (ext == t->t_moving && t->t_holding) {
+			dc->dc_next = t->t_held;
+			t->t_held = dc;
+			t->t_nheld++;
+			continue;
+		}
+
+		loc = t->t_map[ext];
+		idx = TIER_IDX(loc);
+		blk = tier_slot_blk(t, loc) + TIER_TAG_OFF(dc->dc_tag);
+		cbp->b_edev = t->t_dev[idx];
+		cbp->b_dev = cmpdev(t->t_dev[idx]);
+		cbp->b_lblkno = blk;
+		cbp->b_blkno = (daddr_t)blk;
+		dc->dc_lh = t->t_lh[idx];
+		t->t_busy[ext]++;
+		t->t_ios[idx]++;
+
+		dc->dc_next = ready;
+		ready = dc;
+	}
+	mutex_exit(&t->t_lock);
+
+	while ((dc = ready) != NULL) {
+		ready = dc->dc_next;
+		dm_issue(dc->dc_lh, &dc->dc_buf);
+	}
+}
+
+/*
+ * Moves
+ *
+ * Only the mover changes the map, so it reads it without the lock.
+ */
+
+/* Sleep off whatever a chunk copied since 'start' is ahead of the rate */
+static void
+tier_throttle(tier_t *t, clock_t start)
+{
+	clock_t	want, spent;
+
+	if (t->t_rate == 0)
+		return;
+
+	want = drv_usectohz((clock_t)((uint64_t)TIER_CHUNK * MICROSEC /
+	    t->t_rate));
+	spent = ddi_get_lbolt() - start;
+	if (spent >= want)
+		return;
+
+	mutex_enter(&t->t_lock);
+	if (!t->t_exiting) {
+		(void) cv_reltimedwait(&t->t_mvcv, &t->t_lock, want - spent,
+		    TR_CLOCK_TICK);
+	}
+	mutex_exit(&t->t_lock);
+}
+
+/* All the chunks of an extent */
+static uint64_t
+tier_allchunks(tier_t *t)
+{
+	int	nchunks = 1 << (t->t_sb.ts_extshift - TIER_CHUNKSHIFT);
+
+	return (nchunks == TIER_MAXCHUNKS ? UINT64_MAX :
+	    (1ULL << nchunks) - 1);
+}
+
+/* Copy the chunks in 'mask' of an extent from slot 'src' to 'dst' */
+static int
+tier_copy(tier_t *t, uint32_t src, uint32_t dst, uint64_t mask,
+    boolean_t throttle)
+{
+	int	nchunks = 1 << (t->t_sb.ts_extshift - TIER_CHUNKSHIFT);
+	int	rc;
+
+	for (int c = 0; c < nchunks; c++) {
+		diskaddr_t	off = (diskaddr_t)c << TIER_CHUNKSHIFT;
+		clock_t		start = ddi_get_lbolt();
+
+		if (!(mask & (1ULL << c)))
+			continue;
+		if (t->t_exiting)
+			return (EINTR);
+
+		if ((rc = tier_bio(t, TIER_IDX(src), t->t_mvbuf, TIER_CHUNK,
+		    tier_slot_blk(t, src) + off, B_READ)) != 0 ||
+		    (rc = tier_bio(t, TIER_IDX(dst), t->t_mvbuf, TIER_CHUNK,
+		    tier_slot_blk(t, dst) + off, B_WRITE)) != 0)
+			return (rc);
+		t->t_moved += TIER_CHUNK;
+
+		if (throttle)
+			tier_throttle(t, start);
+	}
+
+	return (0);
+}
+
+/* Point the on-disk map entry of an extent at 'loc' */
+static int
+tier_map_write(tier_t *t, uint32_t ext, uint32_t loc)
+{
+	size_t	pg = ext / TIER_MAPPG;
+	int	rc;
+
+	mutex_enter(&t->t_lock);
+	t->t_map[ext] = loc;
+	bcopy(&t->t_map[pg * TIER_MAPPG], t->t_mvbuf, TIER_BSIZE);
+	mutex_exit(&t->t_lock);
+
+	if ((rc = tier_bio(t, TIER_F, t->t_mvbuf, TIER_BSIZE,
+	    (t->t_sb.ts_mapstart + pg) * TIER_DBPB, B_WRITE)) == 0)
+		rc = dm_target_flush_dev(t->t_dmip, t->t_lh[TIER_F]);
+
+	return (rc);
+}
+
+/* Move an extent to a free slot on tier 'idx' */
+static int
+tier_move(tier_t *t, uint32_t ext, int idx)
+{
+	uint32_t	src = t->t_map[ext];
+	uint32_t	dst;
+	uint64_t	mask;
+	dm_child_t	*held;
+	int		pass;
+	int		rc;
+
+	mutex_enter(&t->t_lock);
+	if ((dst = tier_slot_alloc(t, idx)) == TIER_NOEXT) {
+		mutex_exit(&t->t_lock);
+		return (ENOSPC);
+	}
+	t->t_moving = ext;
+	t->t_dirty = 0;
+	mutex_exit(&t->t_lock);
+
+	/* Copy it all, then again what got written meanwhile */
+	mask = tier_allchunks(t);
+	for (pass = 0; mask != 0 && pass < TIER_PASSES; pass++) {
+		if ((rc = tier_copy(t, src, dst, mask, B_TRUE)) != 0)
+			goto out;
+		mutex_enter(&t->t_lock);
+		mask = t->t_dirty;
+		t->t_dirty = 0;
+		mutex_exit(&t->t_lock);
+	}
+
+	/* Hold new I/O, let the rest drain and copy what is left */
+	mutex_enter(&t->t_lock);
+	t->t_holding = B_TRUE;
+	while (t->t_busy[ext] != 0)
+		cv_wait(&t->t_cv, &t->t_lock);
+	mask |= t->t_dirty;
+	mutex_exit(&t->t_lock);
+
+	if ((rc = tier_copy(t, src, dst, mask, B_FALSE)) != 0 ||
+	    (rc = dm_target_flush_dev(t->t_dmip, t->t_lh[idx])) != 0)
+		goto out;
+
+	/* On failure try to leave the old entry behind */
+	if ((rc = tier_map_write(t, ext, dst)) != 0)
+		(void) tier_map_write(t, ext, src);
+
+out:
+	/* Moves stop at the first failure, the data is where it was */
+	if (rc != 0 && rc != EINTR) {
+		cmn_err(CE_WARN, "dm_tier: %s: moving extent %u failed (%d)",
+		    refstr_value(t->t_dmip->name), ext, rc);
+		t->t_error = rc;
+	}
+
+	mutex_enter(&t->t_lock);
+	tier_slot_free(t, rc == 0 ? src : dst);
+	t->t_moving = TIER_NOEXT;
+	t->t_holding = B_FALSE;
+	held = t->t_held;
+	t->t_held = NULL;
+	mutex_exit(&t->t_lock);
+
+	tier_dispatch(t, held);
+
+	return (rc);
+}
+
+/*
+ * Promote the hottest slow extent if it is hot enough, demoting the
+ * coldest fast one to make room for it.  The scan reads the heat without
+ * the lock, counts a few I/Os off do not matter.
+ */
+static boolean_t
+tier_balance(tier_t *t)
+{
+	uint32_t	hot = TIER_NOEXT, cold = TIER_NOEXT;
+	int		hotheat = -1, coldheat = UINT16_MAX + 1;
+
+	for (uint64_t e = 0; e < t->t_sb.ts_nexts; e++) {
+		int	heat = t->t_heat[e];
+
+		if (t->t_map[e] & TIER_FAST) {
+			if (heat < coldheat) {
+				coldheat = heat;
+				cold = (uint32_t)e;
+			}
+		} else if (heat > hotheat) {
+			hotheat = heat;
+			hot = (uint32_t)e;
+		}
+	}
+
+	if (hot == TIER_NOEXT || hotheat < TIER_MINHEAT)
+		return (B_FALSE);
+
+	if (t->t_nfree[TIER_F] == 0) {
+		if (cold == TIER_NOEXT || hotheat < coldheat + TIER_MARGIN)
+			return (B_FALSE);
+		if (tier_move(t, cold, TIER_S) != 0)
+			return (B_FALSE);
+		t->t_demotions++;
+	}
+
+	if (tier_move(t, hot, TIER_F) != 0)
+		return (B_FALSE);
+	t->t_promotions++;
+
+	return (B_TRUE);
+}
+
+/* Halve every extent's heat, racing with I/O just like the scan */
+static void
+tier_decay(tier_t *t)
+{
+	for (uint64_t e = 0; e < t->t_sb.ts_nexts; e++)
+		t->t_heat[e] >>= 1;
+}
+
+static void
+tier_mover(void *arg)
+{
+	tier_t	*t = arg;
+	clock_t	last = ddi_get_lbolt();
+
+	mutex_enter(&t->t_lock);
+
+	while (!t->t_exiting) {
+		(void) cv_reltimedwait(&t->t_mvcv, &t->t_lock,
+		    drv_usectohz(MICROSEC), TR_CLOCK_TICK);
+		if (t->t_exiting || t->t_error != 0)
+			continue;
+		mutex_exit(&t->t_lock);
+
+		if (ddi_get_lbolt() - last >= t->t_halflife) {
+			tier_decay(t);
+			last = ddi_get_lbolt();
+		}
+		while (!t->t_exiting && t->t_error == 0 && tier_balance(t))
+			;
+
+		mutex_enter(&t->t_lock);
+	}
+
+	mutex_exit(&t->t_lock);
+	thread_exit();
+}
+
+/*
+ * Format and mount
+ */
+static int
+tier_format(tier_t *t, uint64_t slowsize, uint64_t fastsize,
+    uint32_t extshift)
+{
+	tier_super_t	*sb = &t->t_sb;
+	uint64_t	extblks = (1ULL << extshift) / TIER_DBPB;
+	uint64_t	fastblks = fastsize / TIER_BSIZE;
+	uint64_t	nfast;
+	uint32_t	*map;
+	caddr_t		blk;
+	size_t		mappages;
+	int		rc;
+
+	bzero(sb, sizeof (*sb));
+	sb->ts_magic = TIER_MAGIC;
+	sb->ts_version = TIER_VERSION;
+	sb->ts_extshift = extshift;
+	sb->ts_nslots[TIER_S] = lbtodb(slowsize) >> extshift;
+
+	/* Room for the largest map there can be, then extent aligned */
+	mappages = howmany(sb->ts_nslots[TIER_S] + fastblks / extblks,
+	    TIER_MAPPG);
+	sb->ts_mapstart = 1;
+	sb->ts_faststart = roundup(sb->ts_mapstart + mappages, extblks);
+	if (fastblks <= sb->ts_faststart)
+		return (ENOSPC);
+	nfast = (fastblks - sb->ts_faststart) / extblks;
+	sb->ts_nslots[TIER_F] = nfast;
+	if (nfast == 0 || sb->ts_nslots[TIER_S] < 2)
+		return (ENOSPC);
+	sb->ts_nexts = sb->ts_nslots[TIER_S] + nfast - 1;
+	if (sb->ts_nexts > TIER_SLOTMASK)
+		return (EOVERFLOW);
+	sb->ts_sum = dm_cksum(sb, offsetof(tier_super_t, ts_sum));
+
+	/* The first extents start out fast, the last slow slot is spare */
+	mappages = howmany(sb->ts_nexts, TIER_MAPPG);
+	map = kmem_zalloc(mappages * TIER_BSIZE, KM_SLEEP);
+	for (uint64_t e = 0; e < sb->ts_nexts; e++) {
+		map[e] = (e < nfast) ? (TIER_FAST | (uint32_t)e) :
+		    (uint32_t)(e - nfast);
+	}
+	rc = tier_bio_big(t, (caddr_t)map, mappages * TIER_BSIZE,
+	    sb->ts_mapstart, B_WRITE);
+	kmem_free(map, mappages * TIER_BSIZE);
+	if (rc != 0 ||
+	    (rc = dm_target_flush_dev(t->t_dmip, t->t_lh[TIER_F])) != 0)
+		return (rc);
+
+	/* The superblock goes last */
+	blk = kmem_zalloc(TIER_BSIZE, KM_SLEEP);
+	bcopy(sb, blk, sizeof (*sb));
+	rc = tier_bio(t, TIER_F, blk, TIER_BSIZE, 0, B_WRITE);
+	kmem_free(blk, TIER_BSIZE);
+	if (rc == 0)
+		rc = dm_target_flush_dev(t->t_dmip, t->t_lh[TIER_F]);
+
+	return (rc);
+}
+
+static int
+tier_mount(tier_t *t, uint64_t slowsize, uint64_t fastsize)
+{
+	tier_super_t	*sb = &t->t_sb;
+	uint64_t	extblks;
+	caddr_t		blk;
+	int		rc;
+
+	blk = kmem_zalloc(TIER_BSIZE, KM_SLEEP);
+	if ((rc = tier_bio(t, TIER_F, blk, TIER_BSIZE, 0, B_READ)) != 0) {
+		kmem_free(blk, TIER_BSIZE);
+		return (rc);
+	}
+	bcopy(blk, sb, sizeof (*sb));
+	kmem_free(blk, TIER_BSIZE);
+
+	if (sb->ts_magic != TIER_MAGIC || sb->ts_version != TIER_VERSION ||
+	    sb->ts_sum != dm_cksum(sb, offsetof(tier_super_t, ts_sum)) ||
+	    sb->ts_extshift < TIER_CHUNKSHIFT ||
+	    sb->ts_extshift - TIER_CHUNKSHIFT > 6 ||
+	    sb->ts_nexts != sb->ts_nslots[TIER_S] + sb->ts_nslots[TIER_F] - 1)
+		return (EINVAL);
+
+	extblks = (1ULL << sb->ts_extshift) / TIER_DBPB;
+	if ((sb->ts_nslots[TIER_S] << sb->ts_extshift) > lbtodb(slowsize) ||
+	    sb->ts_faststart + sb->ts_nslots[TIER_F] * extblks >
+	    fastsize / TIER_BSIZE)
+		return (ENOSPC);
+
+	t->t_mappages = howmany(sb->ts_nexts, TIER_MAPPG);
+	t->t_map = kmem_zalloc(t->t_mappages * TIER_BSIZE, KM_SLEEP);
+	t->t_heat = kmem_zalloc(sb->ts_nexts * sizeof (uint16_t), KM_SLEEP);
+	t->t_busy = kmem_zalloc(sb->ts_nexts * sizeof (uint16_t), KM_SLEEP);
+	for (int i = 0; i < 2; i++) {
+		t->t_used[i] = kmem_zalloc(BT_SIZEOFMAP(sb->ts_nslots[i]),
+		    KM_SLEEP);
+		t->t_nfree[i] = sb->ts_nslots[i];
+	}
+
+	if ((rc = tier_bio_big(t, (caddr_t)t->t_map,
+	    t->t_mappages * TIER_BSIZE, sb->ts_mapstart, B_READ)) != 0)
+		return (rc);
+
+	/* Every extent in a slot of its own */
+	for (uint64_t e = 0; e < sb->ts_nexts; e++) {
+		uint32_t	loc = t->t_map[e];
+		uint32_t	slot = loc & TIER_SLOTMASK;
+		int		idx = TIER_IDX(loc);
+
+		if (slot >= sb->ts_nslots[idx] || BT_TEST(t->t_used[idx], slot))
+			return (EINVAL);
+		BT_SET(t->t_used[idx], slot);
+		t->t_nfree[idx]--;
+	}
+
+	t->t_mvbuf = kmem_alloc(TIER_CHUNK, KM_SLEEP);
+
+	return (0);
+}
+
+static void
+tier_free(tier_t *t)
+{
+	uint64_t	nexts = t->t_sb.ts_nexts;
+
+	if (t->t_mvbuf != NULL)
+		kmem_free(t->t_mvbuf, TIER_CHUNK);
+	for (int i = 0; i < 2; i++) {
+		if (t->t_used[i] != NULL)
+			kmem_free(t->t_used[i],
+			    BT_SIZEOFMAP(t->t_sb.ts_nslots[i]));
+	}
+	if (t->t_busy != NULL)
+		kmem_free(t->t_busy, nexts * sizeof (uint16_t));
+	if (t->t_heat != NULL)
+		kmem_free(t->t_heat, nexts * sizeof (uint16_t));
+	if (t->t_map != NULL)
+		kmem_free(t->t_map, t->t_mappages * TIER_BSIZE);
+	if (t->t_lh[TIER_F] != NULL)
+		dm_target_close(t->t_dmip, t->t_lh[TIER_F]);
+
+	cv_destroy(&t->t_mvcv);
+	cv_destroy(&t->t_cv);
+	mutex_destroy(&t->t_lock);
+	kmem_free(t, sizeof (*t));
+}
+
+/*
+ * Plugin entry points
+ */
+
+static int
+dm_tier_init(void)
+{
+	return (0);
+}
+
+static void
+dm_tier_fini(void)
+{
+}
+
+static int
+dm_tier_create(dm_info_t *dmip, int argc, char **argv, cred_t *crp,
+    void **privp)
+{
+	tier_t		*t;
+	char		*fast = NULL;
+	boolean_t	format = B_FALSE;
+	uint32_t	extshift = TIER_EXTSHIFT;
+	unsigned long	rate = TIER_RATE;
+	unsigned long	halflife = TIER_HALFLIFE;
+	uint64_t	fastsize;
+	int		rc;
+
+	for (int i = 0; i < argc; i++) {
+		unsigned long	val;
+
+		if (strncmp(argv[i], "fast=", 5) == 0 && argv[i][5] != '\0') {
+			fast = argv[i] + 5;
+		} else if (strcmp(argv[i], "format") == 0) {
+			format = B_TRUE;
+		} else if (strncmp(argv[i], "extent=", 7) == 0 &&
+		    ddi_strtoul(argv[i] + 7, NULL, 10, &val) == 0 &&
+		    val >= TIER_CHUNK / 1024 &&
+		    val <= TIER_MAXCHUNKS * TIER_CHUNK / 1024 && ISP2(val)) {
+			extshift = highbit(val * 1024 / DEV_BSIZE) - 1;
+		} else if (strncmp(argv[i], "rate=", 5) == 0 &&
+		    ddi_strtoul(argv[i] + 5, NULL, 10, &val) == 0) {
+			rate = val;
+		} else if (strncmp(argv[i], "halflife=", 9) == 0 &&
+		    ddi_strtoul(argv[i] + 9, NULL, 10, &val) == 0 &&
+		    val != 0) {
+			halflife = val;
+		} else {
+			cmn_err(CE_WARN, "dm_tier: unknown argument '%s'",
+			    argv[i]);
+			return (EINVAL);
+		}
+	}
+	if (fast == NULL) {
+		cmn_err(CE_WARN, "dm_tier: no fast device given");
+		return (EINVAL);
+	}
+
+	t = kmem_zalloc(sizeof (*t), KM_SLEEP);
+	t->t_dmip = dmip;
+	mutex_init(&t->t_lock, NULL, MUTEX_DRIVER, NULL);
+	cv_init(&t->t_cv, NULL, CV_DRIVER, NULL);
+	cv_init(&t->t_mvcv, NULL, CV_DRIVER, NULL);
+	t->t_lh[TIER_S] = dmip->lh;
+	t->t_dev[TIER_S] = dmip->tdev;
+	t->t_moving = TIER_NOEXT;
+	t->t_rate = (uint64_t)rate * 1024;
+	t->t_halflife = drv_usectohz(MICROSEC) * (clock_t)halflife;
+
+	if ((rc = dm_target_open(dmip, crp, fast, &t->t_lh[TIER_F],
+	    &t->t_dev[TIER_F])) != 0) {
+		tier_free(t);
+		return (rc);
+	}
+	if (ldi_get_size(t->t_lh[TIER_F], &fastsize) != DDI_SUCCESS) {
+		tier_free(t);
+		return (ENXIO);
+	}
+
+	if (format &&
+	    (rc = tier_format(t, dmip->size, fastsize, extshift)) != 0) {
+		cmn_err(CE_WARN, "dm_tier: %s: format failed (%d)",
+		    refstr_value(dmip->name), rc);
+		tier_free(t);
+		return (rc);
+	}
+
+	if ((rc = tier_mount(t, dmip->size, fastsize)) != 0) {
+		cmn_err(CE_WARN, "dm_tier: %s: no valid metadata on %s (%d)",
+		    refstr_value(dmip->name), fast, rc);
+		tier_free(t);
+		return (rc);
+	}
+
+	t->t_mover = thread_create(NULL, 0, tier_mover, t, 0, &p0, TS_RUN,
+	    minclsyspri);
+
+	dmip->size = ldbtob(t->t_sb.ts_nexts << t->t_sb.ts_extshift);
+	*privp = t;
+
+	return (0);
+}
+
+static void
+dm_tier_destroy(dm_info_t *dmip, void *priv)
+{
+	tier_t		*t = priv;
+	kt_did_t	tid = t->t_mover->t_did;
+
+	mutex_enter(&t->t_lock);
+	t->t_exiting = B_TRUE;
+	cv_signal(&t->t_mvcv);
+	mutex_exit(&t->t_lock);
+	thread_join(tid);
+
+	tier_free(t);
+}
+
+static dm_mapio_t
+dm_tier_mapio(dm_info_t *dmip, void *priv, struct buf *bp, dm_remap_t *rp)
+{
+	tier_t		*t = priv;
+	uint32_t	shift = t->t_sb.ts_extshift;
+	diskaddr_t	blk = bp->b_lblkno;
+	dm_child_t	*list = NULL;
+	dm_split_t	*ds;
+	size_t		off;
+
+	if (bp->b_bcount == 0) {
+		bp->b_resid = 0;
+		biodone(bp);
+		return (DM_MAPIO_SUBMITTED);
+	}
+	if ((ds = dm_split_alloc(bp, tier_piece_done, t, KM_NOSLEEP)) ==
+	    NULL) {
+		bioerror(bp, ENOMEM);
+		return (DM_MAPIO_KILL);
+	}
+
+	/*
+	 * A piece per extent touched, usually just the one, and no larger
+	 * than either device takes.
+	 */
+	for (off = 0; off < bp->b_bcount; ) {
+		uint32_t	ext = (uint32_t)(blk >> shift);
+		uint32_t	eoff = (uint32_t)(blk & ((1ULL << shift) - 1));
+		size_t		len = MIN(bp->b_bcount - off,
+		    ldbtob((1ULL << shift) - eoff));
+		dm_child_t	*dc;
+
+		len = MIN(len, dmip->maxxfer);
+		if ((dc = dm_split_child(ds, off, len, t->t_dev[TIER_S], blk,
+		    KM_NOSLEEP)) == NULL)
+			break;
+		dc->dc_tag = TIER_TAG(ext, eoff);
+		dc->dc_next = list;
+		list = dc;
+
+		/* Kept loosely, see tier_balance() */
+		if (t->t_heat[ext] != UINT16_MAX)
+			t->t_heat[ext]++;
+
+		blk += btodb(len);
+		off += len;
+	}
+
+	tier_dispatch(t, list);
+	dm_split_rele(ds);
+
+	return (DM_MAPIO_SUBMITTED);
+}
+
+static int
+dm_tier_stats(dm_info_t *dmip, void *priv, nvlist_t *nvl)
+{
+	tier_t	*t = priv;
+
+	mutex_enter(&t->t_lock);
+	(void) nvlist_add_uint64(nvl, "extents", t->t_sb.ts_nexts);
+	(void) nvlist_add_uint64(nvl, "extsize",
+	    ldbtob(1ULL << t->t_sb.ts_extshift));
+	(void) nvlist_add_uint64(nvl, "fast_slots", t->t_sb.ts_nslots[TIER_F]);
+	(void) nvlist_add_uint64(nvl, "fast_free", t->t_nfree[TIER_F]);
+	(void) nvlist_add_uint64(nvl, "slow_slots", t->t_sb.ts_nslots[TIER_S]);
+	(void) nvlist_add_uint64(nvl, "slow_free", t->t_nfree[TIER_S]);
+	(void) nvlist_add_uint64(nvl, "fast_ios", t->t_ios[TIER_F]);
+	(void) nvlist_add_uint64(nvl, "slow_ios", t->t_ios[TIER_S]);
+	(void) nvlist_add_uint64(nvl, "promotions", t->t_promotions);
+	(void) nvlist_add_uint64(nvl, "demotions", t->t_demotions);
+	(void) nvlist_add_uint64(nvl, "moved", t->t_moved);
+	(void) nvlist_add_uint64(nvl, "held", t->t_nheld);
+	(void) nvlist_add_int32(nvl, "error", t->t_error);
+	mutex_exit(&t->t_lock);
+
+	return (0);
+}
+
+
+dm_plugin_ops_t dm_ops = {
+	.dpo_rev	= DPO_REV,
+	.dpo_name	= "tier",
+	.dpo_init	= dm_tier_init,
+	.dpo_fini	= dm_tier_fini,
+	.dpo_create	= dm_tier_create,
+	.dpo_destroy	= dm_tier_destroy,
+	.dpo_mapio	= dm_tier_mapio,
+	.dpo_stats	= dm_tier_stats,
+};
+
+static struct modlmisc modlmisc = {
+	.misc_modops	= &mod_miscops,
+	.misc_linkinfo	= "Solaris Device Mapper tiering plugin"
+};
+
+static struct modlinkage modlinkage = {
+	.ml_rev		= MODREV_1,
+	.ml_linkage	= {&modlmisc, NULL, NULL, NULL}
+};
+
+int
+_init(void)
+{
+	return (mod_install(&modlinkage));
+}
+
+int
+_info(struct modinfo *mip)
+{
+	return (mod_info(&modlinkage, mip));
+}
+
+int
+_fini(void)
+{
+	return (mod_remove(&modlinkage));
+}
@@ -0,0 +1,643 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright 2011 Grigale Ltd. All rights reserved.
+ * Use is subject to license terms.
+ */
+
+
+/*
+ * Verity target
+ *
+ * A read-only mapping whose every data block is checked against a SHA-256
+ * hash tree kept on another device, up to a root hash given when the
+ * mapping is created.  A block failing the check fails the read with EIO
+ * and posts DM_EVENT_CORRUPT.
+ *
+ * Hash device layout, in blocks of the data block size: the levels of the
+ * tree from the top down, each an array of hash blocks packed with the
+ * digests of the level below (of the data blocks for the bottom level),
+ * zero filled at the end.  The top level is a single block and the root
+ * hash is its digest.
+ *
+ * Hash blocks are read and checked the first time they are needed and
+ * then kept in a cache, so a read normally costs the hash of its data
+ * blocks only.  The cache is replaced by clock, interior blocks getting an
+ * extra turn.  Hashing goes through the kernel crypto framework, which
+ * uses the fastest SHA-256 provider the machine has; checks run on a
+ * taskq rather than in the completion path.
+ *
+ * Arguments:	hash=<device> root=<hex digest> [block=<bytes>]
+ *		[cache=<KB>]
+ */
+
+#include <sys/atomic.h>
+#include <sys/buf.h>
+#include <sys/conf.h>
+#include <sys/errno.h>
+#include <sys/file.h>
+#include <sys/kmem.h>
+#include <sys/modctl.h>
+#include <sys/sysmacros.h>
+#include <sys/systm.h>
+#include <sys/types.h>
+#include <sys/crypto/api.h>
+#include <sys/ddi.h>
+#include <sys/sunddi.h>
+
+#include <sys/dm.h>
+#include <sys/dm_impl.h>
+#include <sys/dm_ops.h>
+
+#define	VER_DIGEST	32			/* SHA-256 */
+#define	VER_BSIZE	4096			/* Default block size */
+#define	VER_BMIN	512
+#define	VER_BMAX	65536
+#define	VER_CACHE	(8 * 1024)		/* Default cache, KB */
+#define	VER_MAXLEVELS	16
+#define	VER_NOBLK	((uint64_t)-1)
+
+/* A cached hash block, checked */
+typedef struct ver_cblk {
+	uint64_t	vc_blk;		/* Hash device block, or VER_NOBLK */
+	struct ver_cblk	*vc_next;	/* Hash chain */
+	uint8_t		vc_ref;		/* Clock turns left */
+	caddr_t		vc_data;
+} ver_cblk_t;
+
+typedef struct {
+	dm_info_t	*v_dmip;
+	ldi_handle_t	v_hlh;		/* Hash device */
+	dev_t		v_hdev;
+	uint32_t	v_bshift;	/* log2 of the block size */
+	uint32_t	v_fanout;	/* Digests per hash block */
+	uint64_t	v_nblocks;	/* Data blocks */
+	int		v_nlevels;
+	uint64_t	v_lstart[VER_MAXLEVELS];	/* Where levels start */
+	uint8_t		v_root[VER_DIGEST];
+	crypto_mech_type_t v_mech;
+
+	kmutex_t	v_lock;		/* Protects the cache */
+	ver_cblk_t	*v_cache;
+	uint32_t	v_ncache;
+	uint32_t	v_hand;		/* Clock hand */
+	ver_cblk_t	**v_hash;
+	uint32_t	v_hmask;
+
+	uint64_t	v_reads;
+	uint64_t	v_hashed;	/* Data blocks checked */
+	uint64_t	v_hits;		/* Hash block cache */
+	uint64_t	v_misses;
+	uint64_t	v_corrupt;	/* Blocks failing the check */
+} ver_t;
+
+/* A read being checked */
+typedef struct {
+	struct buf	vi_buf;		/* Read of the data, has to be first */
+	ver_t		*vi_ver;
+	struct buf	*vi_bp;		/* What it is for */
+	uint64_t	vi_first;	/* First data block */
+	caddr_t		vi_bounce;	/* Whole blocks, for unaligned reads */
+	size_t		vi_bouncesz;
+} ver_io_t;
+
+static ddi_taskq_t	*ver_tq;
+
+static int
+ver_hash(ver_t *v, caddr_t addr, size_t len, uint8_t *digest)
+{
+	crypto_mechanism_t	mech;
+	crypto_data_t		in, out;
+
+	bzero(&mech, sizeof (mech));
+	mech.cm_type = v->v_mech;
+
+	bzero(&in, sizeof (in));
+	in.cd_format = CRYPTO_DATA_RAW;
+	in.cd_length = len;
+	in.cd_raw.iov_base = addr;
+	in.cd_raw.iov_len = len;
+
+	bzero(&out, sizeof (out));
+	out.cd_format = CRYPTO_DATA_RAW;
+	out.cd_length = VER_DIGEST;
+	out.cd_raw.iov_base = (caddr_t)digest;
+	out.cd_raw.iov_len = VER_DIGEST;
+
+	return (crypto_digest(&mech, &in, &out, NULL) == CRYPTO_SUCCESS ?
+	    0 : EIO);
+}
+
+/* Read one block of the hash device */
+static int
+ver_bio(ver_t *v, caddr_t addr, uint64_t blk)
+{
+	return (dm_target_bio(v->v_dmip, v->v_hlh, v->v_hdev, addr,
+	    1U << v->v_bshift, blk << (v->v_bshift - DEV_BSHIFT), B_READ));
+}
+
+static void
+ver_corrupt(ver_t *v, int level, uint64_t blk)
+{
+	atomic_inc_64(&v->v_corrupt);
+	cmn_err(CE_WARN, "dm_verity: %s: %s block %llu failed verification",
+	    refstr_value(v->v_dmip->name), level < 0 ? "data" : "hash",
+	    (u_longlong_t)blk);
+	dm_target_event(v->v_dmip, DM_EVENT_CORRUPT, EIO);
+}
+
+/*
+ * Hash block cache
+ */
+static ver_cblk_t *
+ver_cache_lookup(ver_t *v, uint64_t blk)
+{
+	ver_cblk_t	*vc;
+
+	ASSERT(MUTEX_HELD(&v->v_lock));
+
+	for (vc = v->v_hash[blk & v->v_hmask]; vc != NULL; vc = vc->vc_next) {
+		if (vc->vc_blk == blk)
+			return (vc);
+	}
+	return (NULL);
+}
+
+static void
+ver_cache_insert(ver_t *v, uint64_t blk, int level, caddr_t data)
+{
+	ver_cblk_t	*vc, **vcp;
+
+	ASSERT(MUTEX_HELD(&v->v_lock));
+
+	/* Someone may have got there first */
+	if (ver_cache_lookup(v, blk) != NULL)
+		return;
+
+	for (;;) {
+		vc = &v->v_cache[v->v_hand];
+		v->v_hand = (v->v_hand + 1) % v->v_ncache;
+		if (vc->vc_ref == 0)
+			break;
+		vc->vc_ref--;
+	}
+
+	if (vc->vc_blk != VER_NOBLK) {
+		for (vcp = &v->v_hash[vc->vc_blk & v->v_hmask]; *vcp != vc;
+		    vcp = &(*vcp)->vc_next)
+			;
+		*vcp = vc->vc_next;
+	}
+
+	vc->vc_blk = blk;
+	vc->vc_ref = (level > 0) ? 2 : 1;
+	bcopy(data, vc->vc_data, 1U << v->v_bshift);
+	vc->vc_next = v->v_hash[blk & v->v_hmask];
+	v->v_hash[blk & v->v_hmask] = vc;
+}
+
+/*
+ * The checked digest of item 'idx' of the level below 'level' (of data
+ * block 'idx' for level 0), walking up the tree as far as the cache does
+ * not reach.
+ */
+static int
+ver_digest(ver_t *v, int level, uint64_t idx, uint8_t *digest)
+{
+	uint64_t	blk = v->v_lstart[level] + idx / v->v_fanout;
+	size_t		off = (idx % v->v_fanout) * VER_DIGEST;
+	size_t		bsize = 1U << v->v_bshift;
+	uint8_t		got[VER_DIGEST], want[VER_DIGEST];
+	ver_cblk_t	*vc;
+	caddr_t		buf;
+	int		rc;
+
+	mutex_enter(&v->v_lock);
+	if ((vc = ver_cache_lookup(v, blk)) != NULL) {
+		bcopy(vc->vc_data + off, digest, VER_DIGEST);
+		vc->vc_ref = (level > 0) ? 2 : 1;
+		v->v_hits++;
+		mutex_exit(&v->v_lock);
+		return (0);
+	}
+	v->v_misses++;
+	mutex_exit(&v->v_lock);
+
+	buf = kmem_alloc(bsize, KM_SLEEP);
+	if ((rc = ver_bio(v, buf, blk)) != 0 ||
+	    (rc = ver_hash(v, buf, bsize, got)) != 0)
+		goto out;
+
+	if (level == v->v_nlevels - 1)
+		bcopy(v->v_root, want, VER_DIGEST);
+	else if ((rc = ver_digest(v, level + 1, idx / v->v_fanout, want)) != 0)
+		goto out;
+	if (bcmp(got, want, VER_DIGEST) != 0) {
+		ver_corrupt(v, level, blk);
+		rc = EIO;
+		goto out;
+	}
+
+	bcopy(buf + off, digest, VER_DIGEST);
+	mutex_enter(&v->v_lock);
+	ver_cache_insert(v, blk, level, buf);
+	mutex_exit(&v->v_lock);
+
+out:
+	kmem_free(buf, bsize);
+	return (rc);
+}
+
+/*
+ * I/O path
+ */
+static void
+ver_check(void *arg)
+{
+	ver_io_t	*vi = arg;
+	ver_t		*v = vi->vi_ver;
+	struct buf	*bp = vi->vi_bp;
+	struct buf	*dbp = &vi->vi_buf;
+	size_t		bsize = 1U << v->v_bshift;
+	uint8_t		got[VER_DIGEST], want[VER_DIGEST];
+	caddr_t		addr;
+	int		rc;
+
+	if ((rc = geterror(dbp)) == 0 && dbp->b_resid != 0)
+		rc = EIO;
+
+	if (rc == 0) {
+		if (vi->vi_bounce != NULL) {
+			addr = vi->vi_bounce;
+		} else {
+			bp_mapin(dbp);
+			addr = dbp->b_un.b_addr;
+		}
+		for (size_t off = 0; off < dbp->b_bcount && rc == 0;
+		    off += bsize) {
+			uint64_t	blk;
+
+			blk = vi->vi_first + (off >> v->v_bshift);
+
+			if ((rc = ver_hash(v, addr + off, bsize, got)) != 0 ||
+			    (rc = ver_digest(v, 0, blk, want)) != 0)
+				break;
+			atomic_inc_64(&v->v_hashed);
+			if (bcmp(got, want, VER_DIGEST) != 0) {
+				ver_corrupt(v, -1, blk);
+				rc = EIO;
+			}
+		}
+		bp_mapout(dbp);
+	}
+
+	if (rc == 0 && vi->vi_bounce != NULL) {
+		bp_mapin(bp);
+		bcopy(vi->vi_bounce + (ldbtob(bp->b_lblkno) -
+		    (vi->vi_first << v->v_bshift)), bp->b_un.b_addr,
+		    bp->b_bcount);
+		bp_mapout(bp);
+	}
+
+	if (vi->vi_bounce != NULL)
+		kmem_free(vi->vi_bounce, vi->vi_bouncesz);
+	biofini(dbp);
+	kmem_free(vi, sizeof (*vi));
+
+	if (rc != 0) {
+		bioerror(bp, rc);
+		bp->b_resid = bp->b_bcount;
+	} else {
+		bp->b_resid = 0;
+	}
+	biodone(bp);
+}
+
+static int
+ver_read_done(struct buf *dbp)
+{
+	ver_io_t	*vi = (ver_io_t *)dbp;
+
+	if (ddi_taskq_dispatch(ver_tq, ver_check, vi, DDI_NOSLEEP) !=
+	    DDI_SUCCESS) {
+		/* Unchecked data is not to be handed out */
+		bioerror(dbp, ENOMEM);
+		ver_check(vi);
+	}
+
+	return (0);
+}
+
+static void
+ver_free(ver_t *v)
+{
+	if (v->v_cache != NULL) {
+		for (uint32_t i = 0; i < v->v_ncache; i++)
+			kmem_free(v->v_cache[i].vc_data, 1U << v->v_bshift);
+		kmem_free(v->v_cache, v->v_ncache * sizeof (ver_cblk_t));
+		kmem_free(v->v_hash, (v->v_hmask + 1) * sizeof (ver_cblk_t *));
+	}
+	if (v->v_hlh != NULL)
+		dm_target_close(v->v_dmip, v->v_hlh);
+	mutex_destroy(&v->v_lock);
+	kmem_free(v, sizeof (*v));
+}
+
+static int
+ver_unhex(const char *s, uint8_t *out, size_t len)
+{
+	for (size_t i = 0; i < len * 2; i++) {
+		char	c = s[i];
+		int	d;
+
+		if (c >= '0' && c <= '9')
+			d = c - '0';
+		else if (c >= 'a' && c <= 'f')
+			d = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			d = c - 'A' + 10;
+		else
+			return (EINVAL);
+		out[i / 2] = (i & 1) ? (out[i / 2] | d) : (d << 4);
+	}
+
+	return (s[len * 2] == '\0' ? 0 : EINVAL);
+}
+
+/*
+ * Plugin entry points
+ */
+static int
+dm_verity_init(void)
+{
+	ver_tq = ddi_taskq_create(NULL, "dm_verity", ncpus, TASKQ_DEFAULTPRI,
+	    0);
+
+	return (ver_tq == NULL ? ENOMEM : 0);
+}
+
+static void
+dm_verity_fini(void)
+{
+	ddi_taskq_destroy(ver_tq);
+}
+
+static int
+dm_verity_create(dm_info_t *dmip, int argc, char **argv, cred_t *crp,
+    void **privp)
+{
+	ver_t		*v;
+	char		*hash = NULL;
+	char		*root = NULL;
+	unsigned long	bsize = VER_BSIZE;
+	unsigned long	cache = VER_CACHE;
+	uint64_t	n, start, size;
+	uint8_t		digest[VER_DIGEST];
+	int		rc;
+
+	for (int i = 0; i < argc; i++) {
+		unsigned long	val;
+
+		if (strncmp(argv[i], "hash=", 5) == 0 && argv[i][5] != '\0') {
+			hash = argv[i] + 5;
+		} else if (strncmp(argv[i], "root=", 5) == 0) {
+			root = argv[i] + 5;
+		} else if (strncmp(argv[i], "block=", 6) == 0 &&
+		    ddi_strtoul(argv[i] + 6, NULL, 10, &val) == 0 &&
+		    val >= VER_BMIN && val <= VER_BMAX && ISP2(val)) {
+			bsize = val;
+		} else if (strncmp(argv[i], "cache=", 6) == 0 &&
+		    ddi_strtoul(argv[i] + 6, NULL, 10, &val) == 0) {
+			cache = val;
+		} else {
+			cmn_err(CE_WARN, "dm_verity: unknown argument '%s'",
+			    argv[i]);
+			return (EINVAL);
+		}
+	}
+	if (hash == NULL || root == NULL) {
+		cmn_err(CE_WARN, "dm_verity: a hash device and the root hash "
+		    "are needed");
+		return (EINVAL);
+	}
+
+	v = kmem_zalloc(sizeof (*v), KM_SLEEP);
+	v->v_dmip = dmip;
+	mutex_init(&v->v_lock, NULL, MUTEX_DRIVER, NULL);
+	v->v_bshift = highbit(bsize) - 1;
+	v->v_fanout = bsize / VER_DIGEST;
+
+	if (ver_unhex(root, v->v_root, VER_DIGEST) != 0) {
+		cmn_err(CE_WARN, "dm_verity: %s: bad root hash '%s'",
+		    refstr_value(dmip->name), root);
+		ver_free(v);
+		return (EINVAL);
+	}
+	if ((v->v_mech = crypto_mech2id(SUN_CKM_SHA256)) ==
+	    CRYPTO_MECH_INVALID) {
+		cmn_err(CE_WARN, "dm_verity: no SHA-256 provider");
+		ver_free(v);
+		return (ENOTSUP);
+	}
+
+	/* Lay the tree out over the data blocks, top level first */
+	v->v_nblocks = dmip->size >> v->v_bshift;
+	if (v->v_nblocks == 0) {
+		ver_free(v);
+		return (EINVAL);
+	}
+	n = v->v_nblocks;
+	do {
+		n = howmany(n, v->v_fanout);
+		v->v_lstart[v->v_nlevels++] = n;
+	} while (n > 1 && v->v_nlevels < VER_MAXLEVELS);
+	start = 0;
+	for (int l = v->v_nlevels - 1; l >= 0; l--) {
+		n = v->v_lstart[l];
+		v->v_lstart[l] = start;
+		start += n;
+	}
+
+	if ((rc = dm_target_open(dmip, crp, hash, &v->v_hlh,
+	    &v->v_hdev)) != 0) {
+		ver_free(v);
+		return (rc);
+	}
+	if (ldi_get_size(v->v_hlh, &size) != DDI_SUCCESS ||
+	    size < (start << v->v_bshift)) {
+		cmn_err(CE_WARN, "dm_verity: %s: %s is too small for the "
+		    "hash tree", refstr_value(dmip->name), hash);
+		ver_free(v);
+		return (ENOSPC);
+	}
+
+	v->v_ncache = MAX(cache * 1024 / bsize, v->v_nlevels);
+	v->v_cache = kmem_zalloc(v->v_ncache * sizeof (ver_cblk_t), KM_SLEEP);
+	for (uint32_t i = 0; i < v->v_ncache; i++) {
+		v->v_cache[i].vc_blk = VER_NOBLK;
+		v->v_cache[i].vc_data = kmem_alloc(bsize, KM_SLEEP);
+	}
+	v->v_hmask = (1U << highbit(v->v_ncache)) - 1;
+	v->v_hash = kmem_zalloc((v->v_hmask + 1) * sizeof (ver_cblk_t *),
+	    KM_SLEEP);
+
+	/* Only whole blocks are covered, and the top has to match now */
+	dmip->size = v->v_nblocks << v->v_bshift;
+	if ((rc = ver_digest(v, v->v_nlevels - 1, 0, digest)) != 0) {
+		cmn_err(CE_WARN, "dm_verity: %s: hash tree does not match the "
+		    "root hash", refstr_value(dmip->name));
+		ver_free(v);
+		return (rc);
+	}
+
+	*privp = v;
+
+	return (0);
+}
+
+static void
+dm_verity_destroy(dm_info_t *dmip, void *priv)
+{
+	ver_free(priv);
+}
+
+static dm_mapio_t
+dm_verity_mapio(dm_info_t *dmip, void *priv, struct buf *bp, dm_remap_t *rp)
+{
+	ver_t		*v = priv;
+	size_t		bsize = 1U << v->v_bshift;
+	uint64_t	off = ldbtob(bp->b_lblkno);
+	uint64_t	first, end;
+	ver_io_t	*vi;
+	struct buf	*dbp;
+
+	if (!(bp->b_flags & B_READ)) {
+		bioerror(bp, EROFS);
+		return (DM_MAPIO_KILL);
+	}
+	if (bp->b_bcount == 0) {
+		bp->b_resid = 0;
+		biodone(bp);
+		return (DM_MAPIO_SUBMITTED);
+	}
+
+	if ((vi = kmem_zalloc(sizeof (*vi), KM_NOSLEEP)) == NULL) {
+		bioerror(bp, ENOMEM);
+		return (DM_MAPIO_KILL);
+	}
+	vi->vi_ver = v;
+	vi->vi_bp = bp;
+	dbp = &vi->vi_buf;
+	bioinit(dbp);
+
+	first = off >> v->v_bshift;
+	end = howmany(off + bp->b_bcount, bsize);
+	vi->vi_first = first;
+
+	if ((off & (bsize - 1)) == 0 && (bp->b_bcount & (bsize - 1)) == 0) {
+		/* Straight into the caller's pages */
+		(void) bioclone(bp, 0, bp->b_bcount, dmip->tdev,
+		    bp->b_lblkno, ver_read_done, dbp, KM_NOSLEEP);
+		dbp->b_lblkno = bp->b_lblkno;
+	} else {
+		vi->vi_bouncesz = (end - first) << v->v_bshift;
+		if ((vi->vi_bounce = kmem_alloc(vi->vi_bouncesz,
+		    KM_NOSLEEP)) == NULL) {
+			biofini(dbp);
+			kmem_free(vi, sizeof (*vi));
+			bioerror(bp, ENOMEM);
+			return (DM_MAPIO_KILL);
+		}
+		dbp->b_flags = B_BUSY | B_READ;
+		dbp->b_un.b_addr = vi->vi_bounce;
+		dbp->b_bcount = vi->vi_bouncesz;
+		dbp->b_lblkno = first << (v->v_bshift - DEV_BSHIFT);
+		dbp->b_blkno = (daddr_t)dbp->b_lblkno;
+		dbp->b_edev = dmip->tdev;
+		dbp->b_dev = cmpdev(dmip->tdev);
+		dbp->b_iodone = ver_read_done;
+	}
+	atomic_inc_64(&v->v_reads);
+
+	dm_split_issue(dbp, dmip->lh, &dmip->limits);
+
+	return (DM_MAPIO_SUBMITTED);
+}
+
+static int
+dm_verity_stats(dm_info_t *dmip, void *priv, nvlist_t *nvl)
+{
+	ver_t	*v = priv;
+
+	mutex_enter(&v->v_lock);
+	(void) nvlist_add_uint64(nvl, "block_size", 1ULL << v->v_bshift);
+	(void) nvlist_add_int32(nvl, "levels", v->v_nlevels);
+	(void) nvlist_add_uint64(nvl, "cache_blocks", v->v_ncache);
+	(void) nvlist_add_uint64(nvl, "reads", v->v_reads);
+	(void) nvlist_add_uint64(nvl, "hashed", v->v_hashed);
+	(void) nvlist_add_uint64(nvl, "cache_hits", v->v_hits);
+	(void) nvlist_add_uint64(nvl, "cache_misses", v->v_misses);
+	(void) nvlist_add_uint64(nvl, "corrupt", v->v_corrupt);
+	mutex_exit(&v->v_lock);
+
+	return (0);
+}
+
+
+dm_plugin_ops_t dm_ops = {
+	.dpo_rev	= DPO_REV,
+	.dpo_name	= "verity",
+	.dpo_init	= dm_verity_init,
+	.dpo_fini	= dm_verity_fini,
+	.dpo_create	= dm_verity_create,
+	.dpo_destroy	= dm_verity_destroy,
+	.dpo_mapio	= dm_verity_mapio,
+	.dpo_stats	= dm_verity_stats,
+};
+
+static struct modlmisc modlmisc = {
+	.misc_modops	= &mod_miscops,
+	.misc_linkinfo	= "Solaris Device Mapper verity plugin"
+};
+
+static struct modlinkage modlinkage = {
+	.ml_rev		= MODREV_1,
+	.ml_linkage	= {&modlmisc, NULL, NULL, NULL}
+};
+
+int
+_init(void)
+{
+	return (mod_install(&modlinkage));
+}
+
+int
+_info(struct modinfo *mip)
+{
+	return (mod_info(&modlinkage, mip));
+}
+
+int
+_fini(void)
+{
+	return (mod_remove(&modlinkage));
+}
@@ -0,0 +1,91 @@
+#!/bin/ksh
+#
+# CDDL HEADER START
+#
+# The contents of this file are subject to the terms of the
+# Common Development and Distribution License, Version 1.0 only
+# (the "License").  You may not use this file except in compliance
+# with the License.
+#
+# You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+# or http://www.opensolaris.org/os/licensing.
+# See the License for the specific language governing permissions
+# and limitations under the License.
+#
+# When distributing Covered Code, include this CDDL HEADER in each
+# file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+# If applicable, add the following below this CDDL HEADER, with the
+# fields enclosed by brackets "[]" replaced with your own identifying
+# information: Portions Copyright [yyyy] [name of copyright owner]
+#
+# CDDL HEADER END
+#
+#
+# Copyright 2011 Grigale Ltd. All rights reserved.
+# Use is subject to license terms.
+#
+
+#
+# Check that I/O to a mapping at an offset lands where it should on the
+# device: a linear mapping starting 'OFFSET' blocks into a lofi device is
+# written at its blocks 0 and 5 through both the raw and the block node
+# (the latter goes through the clone path), and the device is read back at
+# OFFSET and OFFSET + 5.  Block 0 of the device has to stay untouched.
+#
+# Run as root with the driver loaded: ./linear_offset.sh [dmadm]
+#
+
+DMADM=${1:-dmadm}
+NAME=dmtest$$
+OFFSET=2048
+TMP=/var/tmp/$NAME
+FILE=$TMP/backing
+
+fail()
+{
+	print -u2 "FAIL: $*"
+	exit 1
+}
+
+cleanup()
+{
+	$DMADM remove $NAME >/dev/null 2>&1
+	[[ -n "$LOFI" ]] && lofiadm -d $LOFI >/dev/null 2>&1
+	rm -rf $TMP
+}
+trap cleanup EXIT
+
+mkdir -p $TMP || fail "mkdir $TMP"
+mkfile 16m $FILE || fail "mkfile"
+LOFI=$(lofiadm -a $FILE) || fail "lofiadm -a"
+RLOFI=$(print $LOFI | sed 's,/dev/lofi/,/dev/rlofi/,')
+
+dd if=/dev/zero of=$RLOFI bs=512 count=1 2>/dev/null
+$DMADM create $NAME $LOFI target=linear offset=$OFFSET ||
+    fail "dmadm create"
+
+# Pattern blocks, distinct from each other and from zeroes
+print "raw-node-block-0" | dd of=$TMP/p0 bs=512 conv=sync 2>/dev/null
+print "blk-node-block-5" | dd of=$TMP/p5 bs=512 conv=sync 2>/dev/null
+
+dd if=$TMP/p0 of=/dev/dm/rdsk/$NAME bs=512 count=1 2>/dev/null ||
+    fail "write through the raw node"
+dd if=$TMP/p5 of=/dev/dm/dsk/$NAME bs=512 oseek=5 count=1 \
+    conv=notrunc 2>/dev/null || fail "write through the block node"
+sync
+
+dd if=$RLOFI of=$TMP/r0 bs=512 iseek=$OFFSET count=1 2>/dev/null
+dd if=$RLOFI of=$TMP/r5 bs=512 iseek=$((OFFSET + 5)) count=1 2>/dev/null
+dd if=$RLOFI of=$TMP/z bs=512 count=1 2>/dev/null
+dd if=/dev/zero of=$TMP/zero bs=512 count=1 2>/dev/null
+
+cmp -s $TMP/p0 $TMP/r0 || fail "block 0 not at LBA $OFFSET"
+cmp -s $TMP/p5 $TMP/r5 || fail "block 5 not at LBA $((OFFSET + 5))"
+cmp -s $TMP/zero $TMP/z || fail "LBA 0 of the device was written"
+
+# And back through the mapping
+dd if=/dev/dm/rdsk/$NAME of=$TMP/m5 bs=512 iseek=5 count=1 2>/dev/null
+cmp -s $TMP/p5 $TMP/m5 || fail "block 5 read back wrong"
+
+print "PASS"
+exit 0